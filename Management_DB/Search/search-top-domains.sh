@@ -2,17 +2,22 @@
 # ============================================================================
 # Show top N domains/patterns from each table
 # ============================================================================
-# Usage: ./search-top-domains.sh <database> [limit]
+# Usage: ./search-top-domains.sh <database> [limit] [stats-db]
+#
+# With a stats database (dnsmasq --sqlite-stats) the most hit entries are
+# listed as well.
 # ============================================================================
 
 DB_FILE="${1}"
 LIMIT="${2:-10}"
+STATS_DB="${3}"
 
 if [ -z "$DB_FILE" ]; then
-    echo "Usage: $0 <database> [limit]"
+    echo "Usage: $0 <database> [limit] [stats-db]"
     echo ""
     echo "Example:"
     echo "  $0 blocklist.db 20"
+    echo "  $0 blocklist.db 20 /var/lib/dnsmasq/stats.db"
     echo ""
     exit 1
 fi
@@ -68,4 +73,16 @@ else
 fi
 echo ""
 
+# entry_stats (hit counters written by dnsmasq --sqlite-stats)
+if [ -n "$STATS_DB" ]; then
+    echo "Top $LIMIT most hit entries (entry_stats):"
+    echo "----------------------------------------"
+    if [ -f "$STATS_DB" ]; then
+        sqlite3 "$STATS_DB" "SELECT printf('%-14s %-40s %10d  %s', TableName, Domain, Hits, datetime(LastHit, 'unixepoch')) FROM entry_stats ORDER BY Hits DESC LIMIT $LIMIT;" | sed 's/^/  /'
+    else
+        echo "  (stats database '$STATS_DB' not found)"
+    fi
+    echo ""
+fi
+
 echo "Done! 🚀"
@@ -16,6 +16,13 @@ echo "========================================"
 echo "Database: $DB_FILE"
 echo ""
 
+# Single-writer merge: tools/bulk-import parses all lists in threads and
+# writes the database once, instead of 400 writers fighting for the lock.
+# Enable with BULK_IMPORT=/path/to/bulk-import (see README.md).
+if [ -n "$BULK_IMPORT" ]; then
+    exec "$BULK_IMPORT" -d "$DB_FILE" -w "$SCRIPT_DIR" -a -v
+fi
+
 # Count companies
 total=0
 for dir in "$SCRIPT_DIR"/*/; do
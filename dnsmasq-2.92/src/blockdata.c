@@ -50,6 +50,13 @@ void blockdata_init(void)
     add_blocks(daemon->cachesize);
 }
 
+/* Preallocate n more blocks, eg for the queries stashed by frecs. */
+void blockdata_reserve(int n)
+{
+  if (n > 0)
+    add_blocks(n);
+}
+
 void blockdata_report(void)
 {
   my_syslog(LOG_INFO, _("pool memory in use %zu, max %zu, allocated %zu"), 
@@ -63,7 +70,10 @@ static struct blockdata *new_block(void)
   struct blockdata *block;
 
   if (!keyblock_free)
-    add_blocks(50);
+    {
+      daemon->metrics[METRIC_BLOCKDATA_MISSES]++;
+      add_blocks(50);
+    }
   
   if (keyblock_free)
     {
@@ -72,6 +82,8 @@ static struct blockdata *new_block(void)
       blockdata_count++;
       if (blockdata_hwm < blockdata_count)
 	blockdata_hwm = blockdata_count;
+      if (daemon->metrics[METRIC_BLOCKDATA_HWM] < blockdata_count)
+	daemon->metrics[METRIC_BLOCKDATA_HWM] = blockdata_count;
       block->next = NULL;
       return block;
     }
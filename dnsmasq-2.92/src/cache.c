@@ -22,8 +22,27 @@ static struct crec *dhcp_spare = NULL;
 #endif
 static struct crec *new_chain = NULL;
 static int insert_error;
-static union bigname *big_free = NULL;
-static int bignames_left, hash_size;
+static int snapshot_loading = 0;
+static int bignames_left, bignames_max, hash_size;
+
+/* crec->hits once the entry has been refreshed by --cache-prefetch */
+#define PREFETCH_DONE 0xffff
+
+/* EDNS client subnet of the query being answered or whose reply is being
+   cached, set by cache_ecs_set(); family 0 when there is none. */
+static struct {
+  unsigned char family, source, scope, addr[IN6ADDRSZ];
+} ecs_client;
+
+/* Names too long for the crec live in a name arena, carved from
+   NAME_ARENA_BLOCK sized blocks in NAME_GRANULE steps, with a free list
+   per size. A 60 character name takes 64 bytes rather than MAXDNAME. */
+#define NAME_GRANULE 32
+#define NAME_CLASSES ((MAXDNAME + NAME_GRANULE - 1) / NAME_GRANULE + 1)
+#define NAME_ARENA_BLOCK 65536
+static char *name_free[NAME_CLASSES];
+static char *name_arena = NULL;
+static size_t name_arena_left = 0;
 
 static void make_non_terminals(struct crec *source);
 static struct crec *really_insert(char *name, union all_addr *addr, unsigned short class,
@@ -141,6 +160,7 @@ static void cache_unlink(struct crec *crecp);
 static void cache_link(struct crec *crecp);
 static void rehash(int size);
 static void cache_hash(struct crec *crecp);
+static void name_release(char *name);
 
 unsigned short rrtype(char *in)
 {
@@ -174,7 +194,7 @@ void cache_init(void)
   struct crec *crecp;
   int i;
  
-  bignames_left = daemon->cachesize/10;
+  bignames_left = bignames_max = daemon->cachesize/10;
   
   if (daemon->cachesize > 0)
     {
@@ -201,8 +221,8 @@ static void rehash(int size)
   struct crec **new, **old, *p, *tmp;
   int i, new_size, old_size;
 
-  /* hash_size is a power of two. */
-  for (new_size = 64; new_size < size/10; new_size = new_size << 1);
+  /* hash_size is a power of two, keep chains short (2 entries on average). */
+  for (new_size = 64; new_size < size/2; new_size = new_size << 1);
   
   /* must succeed in getting first instance, failure later is non-fatal */
   if (!hash_table)
@@ -223,14 +243,20 @@ static void rehash(int size)
       for (i = 0; i < old_size; i++)
 	for (p = old[i]; p ; p = tmp)
 	  {
+	    struct crec **up = hash_table + (p->hash & (hash_size - 1));
+
+	    /* Chains don't mix in a bigger table, appending keeps their order. */
 	    tmp = p->hash_next;
-	    cache_hash(p);
+	    while (*up)
+	      up = &(*up)->hash_next;
+	    p->hash_next = NULL;
+	    *up = p;
 	  }
       free(old);
     }
 }
   
-static struct crec **hash_bucket(char *name)
+static unsigned int hash_name(char *name)
 {
   unsigned int c, val = 017465; /* Barker code - minimum self-correlation in cyclic shift */
   const unsigned char *mix_tab = (const unsigned char*)typestr; 
@@ -243,8 +269,15 @@ static struct crec **hash_bucket(char *name)
       val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + c) & 0x3F] ^ c);
     } 
   
+  return val ^ (val >> 16);
+}
+
+/* The full hash is kept in each crec: chain walks compare it before
+   touching the name. */
+static struct crec **hash_bucket(unsigned int hash)
+{
   /* hash_size is a power of two */
-  return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
+  return hash_table + (hash & (hash_size - 1));
 }
 
 static void cache_hash(struct crec *crecp)
@@ -255,7 +288,8 @@ static void cache_hash(struct crec *crecp)
      This allows reverse searches and garbage collection to be optimised */
 
   char *name = cache_get_name(crecp);
-  struct crec **up = hash_bucket(name);
+  unsigned int hash = crecp->hash = hash_name(name);
+  struct crec **up = hash_bucket(hash);
   unsigned int flags = crecp->flags & (F_IMMORTAL | F_REVERSE);
   
   if (!(flags & F_REVERSE))
@@ -271,6 +305,7 @@ static void cache_hash(struct crec *crecp)
   /* Preserve order when inserting the same name multiple times.
      Do not mess up the flag invariants. */
   while (*up &&
+	 (*up)->hash == hash &&
 	 hostname_isequal(cache_get_name(*up), name) &&
 	 flags == ((*up)->flags & (F_IMMORTAL | F_REVERSE)))
     up = &((*up)->hash_next);
@@ -294,6 +329,135 @@ static void cache_blockdata_free(struct crec *crecp)
     }
 }
 
+static char *name_alloc(size_t len)
+{
+  int class = (len + NAME_GRANULE - 1) / NAME_GRANULE;
+  size_t size = class * NAME_GRANULE;
+  char *ret;
+
+  if ((ret = name_free[class]))
+    {
+      name_free[class] = *(char **)ret;
+      return ret;
+    }
+
+  if (name_arena_left < size)
+    {
+      char *new = whine_malloc(NAME_ARENA_BLOCK);
+
+      if (!new)
+	return NULL;
+
+      /* Keep the end of the old block for shorter names. */
+      if (name_arena_left >= NAME_GRANULE)
+	{
+	  *(char **)name_arena = name_free[name_arena_left / NAME_GRANULE];
+	  name_free[name_arena_left / NAME_GRANULE] = name_arena;
+	}
+      
+      name_arena = new;
+      name_arena_left = NAME_ARENA_BLOCK;
+    }
+
+  ret = name_arena;
+  name_arena += size;
+  name_arena_left -= size;
+  
+  return ret;
+}
+
+static void name_release(char *name)
+{
+  int class = (strlen(name) + NAME_GRANULE) / NAME_GRANULE;
+
+  *(char **)name = name_free[class];
+  name_free[class] = name;
+}
+
+/* --add-subnet with per-client source prefixes (RFC 7871): a reply for
+   a query which carried the client's subnet is cached for the scope the
+   upstream returned, capped at our source prefix. Such an entry always
+   keeps its name in the arena, the rest of the name union holds family,
+   scope and address, so it costs no more than a long name. Scope 0
+   entries, and all others, are valid for every client.
+
+   Lookups see the scoped entries whose subnet holds the client; inserts
+   replace the entries whose subnet overlaps the new one, so a client
+   never sees two answers for a name. */
+void cache_ecs_set(union mysockaddr *client, int scope)
+{
+  struct mysubnet *subnet = NULL;
+  unsigned char *addr = NULL;
+  int len;
+  
+  ecs_client.family = 0;
+  
+  if (!client)
+    return;
+  
+  if (client->sa.sa_family == AF_INET && (subnet = daemon->add_subnet4))
+    addr = (unsigned char *)&client->in.sin_addr;
+  else if (client->sa.sa_family == AF_INET6 && (subnet = daemon->add_subnet6))
+    addr = (unsigned char *)&client->in6.sin6_addr;
+  
+  if (!addr || subnet->addr_used || subnet->mask == 0)
+    return;
+
+  ecs_client.family = client->sa.sa_family;
+  ecs_client.source = subnet->mask;
+  ecs_client.scope = (scope < 0 || scope > subnet->mask) ? subnet->mask : scope;
+  memset(ecs_client.addr, 0, IN6ADDRSZ);
+  len = ((subnet->mask - 1) >> 3) + 1;
+  memcpy(ecs_client.addr, addr, len);
+  if (subnet->mask & 7)
+    ecs_client.addr[len-1] &= 0xff << (8 - (subnet->mask & 7));
+}
+
+static int ecs_scoped(struct crec *crecp)
+{
+  return (crecp->flags & F_BIGNAME) && crecp->name.ecs.scope != 0;
+}
+
+/* bignames_left limits the long names in use, not those ever allocated:
+   each one freed gives its place back. Scoped entries never took one. */
+static void bigname_release(struct crec *crecp)
+{
+  if (!ecs_scoped(crecp) && bignames_left < bignames_max)
+    bignames_left++;
+  name_release(crecp->name.bname);
+}
+
+static int ecs_prefix_equal(unsigned char *a, unsigned char *b, int bits)
+{
+  if (memcmp(a, b, bits >> 3) != 0)
+    return 0;
+
+  return (bits & 7) == 0 || ((a[bits >> 3] ^ b[bits >> 3]) & (0xff << (8 - (bits & 7)))) == 0;
+}
+
+/* May the current client be answered from this entry? */
+static int ecs_visible(struct crec *crecp)
+{
+  return !ecs_scoped(crecp) ||
+    (crecp->name.ecs.family == ecs_client.family &&
+     ecs_prefix_equal(crecp->name.ecs.addr, ecs_client.addr, crecp->name.ecs.scope));
+}
+
+/* Does an entry for the same name conflict with the one being inserted? */
+static int ecs_overlaps(struct crec *crecp)
+{
+  int bits;
+  
+  if (!ecs_scoped(crecp) || ecs_client.family == 0 || ecs_client.scope == 0)
+    return 1;
+
+  if (crecp->name.ecs.family != ecs_client.family)
+    return 0;
+
+  bits = crecp->name.ecs.scope < ecs_client.scope ? crecp->name.ecs.scope : ecs_client.scope;
+  return ecs_prefix_equal(crecp->name.ecs.addr, ecs_client.addr, bits);
+}
+
 static void cache_free(struct crec *crecp)
 {
   crecp->flags &= ~F_FORWARD;
@@ -311,8 +475,7 @@ static void cache_free(struct crec *crecp)
   /* retrieve big name for further use. */
   if (crecp->flags & F_BIGNAME)
     {
-      crecp->name.bname->next = big_free;
-      big_free = crecp->name.bname;
+      bigname_release(crecp);
       crecp->flags &= ~F_BIGNAME;
     }
 
@@ -348,7 +511,7 @@ static void cache_unlink (struct crec *crecp)
 char *cache_get_name(struct crec *crecp)
 {
   if (crecp->flags & F_BIGNAME)
-    return crecp->name.bname->name;
+    return crecp->name.bname;
   else if (crecp->flags & F_NAMEP) 
     return crecp->name.namep;
   
@@ -476,9 +639,12 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
   
   if (flags & F_FORWARD)
     {
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = crecp->hash_next)
+      unsigned int hash = hash_name(name);
+      
+      for (up = hash_bucket(hash), crecp = *up; crecp; crecp = crecp->hash_next)
 	{
-	  if ((crecp->flags & F_FORWARD) && hostname_isequal(cache_get_name(crecp), name))
+	  if ((crecp->flags & F_FORWARD) && crecp->hash == hash &&
+	      hostname_isequal(cache_get_name(crecp), name) && ecs_overlaps(crecp))
 	    {
 	      int rrmatch = 0;
 	      if (addr && (crecp->flags & flags & F_RR))
@@ -631,8 +797,9 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
 				  time_t now,  unsigned long ttl, unsigned int flags)
 {
   struct crec *new, *target_crec = NULL;
-  union bigname *big_name = NULL;
+  char *big_name = NULL;
   int freed_all = (flags & F_REVERSE);
+  int scoped = ecs_client.family != 0 && ecs_client.scope != 0;
   struct crec *free_avail = NULL;
   unsigned int target_uid;
   
@@ -640,6 +807,10 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
   if (insert_error)
     return NULL;
 
+  /* A scoped reverse entry could not be told apart from others. */
+  if (scoped && (flags & F_REVERSE))
+    return NULL;
+  
   /* we don't cache zero-TTL records unless we're doing stale-caching. */
   if (daemon->cache_max_expiry == 0 && ttl == 0)
     {
@@ -648,8 +819,11 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
     }
   
   /* First remove any expired entries and entries for the name/address we
-     are currently inserting. */
-  if ((new = cache_scan_free(name, addr, class, now, flags, &target_crec, &target_uid)))
+     are currently inserting. A snapshot has no duplicates and its reverse
+     entries for local addresses were dropped (snap_local_find()), so
+     don't scan the whole cache for every reverse entry whilst loading one. */
+  if (!(snapshot_loading && (flags & F_REVERSE)) &&
+      (new = cache_scan_free(name, addr, class, now, flags, &target_crec, &target_uid)))
     {
       /* We're trying to insert a record over one from 
 	 /etc/hosts or DHCP, or other config. If the 
@@ -719,23 +893,18 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
     }
       
   /* Check if we need to and can allocate extra memory for a long name.
-     If that fails, give up now, always succeed for DNSSEC records. */
-  if (name && (strlen(name) > SMALLDNAME-1))
+     If that fails, give up now, always succeed for DNSSEC records.
+     Scoped entries always keep their name in the arena. */
+  if (name && (scoped || strlen(name) > SMALLDNAME-1))
     {
-      if (big_free)
-	{ 
-	  big_name = big_free;
-	  big_free = big_free->next;
-	}
-      else if ((bignames_left == 0 && !(flags & (F_DS | F_DNSKEY))) ||
-	       !(big_name = (union bigname *)whine_malloc(sizeof(union bigname))))
+      if ((bignames_left == 0 && !scoped && !(flags & (F_DS | F_DNSKEY))) ||
+	  !(big_name = name_alloc(strlen(name) + 1)))
 	{
 	  insert_error = 1;
 	  return NULL;
 	}
-      else if (bignames_left != 0)
+      else if (bignames_left != 0 && !scoped)
 	bignames_left--;
-      
     }
 
   /* If we freed a cache entry for our name which was a CNAME target, use that.
@@ -753,7 +922,15 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
   if (big_name)
     {
       new->name.bname = big_name;
+      new->name.ecs.scope = 0;
       new->flags |= F_BIGNAME;
+
+      if (scoped)
+	{
+	  new->name.ecs.family = ecs_client.family;
+	  new->name.ecs.scope = ecs_client.scope;
+	  memcpy(new->name.ecs.addr, ecs_client.addr, IN6ADDRSZ);
+	}
     }
 
   if (name)
@@ -770,6 +947,8 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
     new->addr = *addr;	
 
   new->ttd = now + (time_t)ttl;
+  new->hits = 0;
+  new->lifetime = ttl > 0xffff ? 0xffff : ttl;
   new->next = new_chain;
   new_chain = new;
   
@@ -1080,12 +1259,474 @@ int cache_recv_insert(time_t now, int fd)
   return 0;
 }
 	
+/* Cache snapshot (--cache-snapshot): the entries learned from upstream,
+   written on SIGTERM and every cache_snapshot_interval seconds by a
+   forked child, and read back at start with the time spent down taken
+   off their TTLs. Like the pipe from the TCP children, the layout is
+   native, so a snapshot only moves between identical builds.
+
+   header: magic, version, sizeof(union all_addr), wall-clock time
+   entry:  u16 namelen, name, u32 flags, u16 class, u32 ttl, addr, then
+           the CNAME target name (u16 len, name) or the blockdata.
+   A namelen of SNAP_END ends a group, which is inserted as one
+   transaction. All the entries for a name share a hash chain and so a
+   group. CNAMEs come last, one per group, after their targets. */
+#define SNAP_MAGIC       "DNSMSNAP"
+#define SNAP_VERSION     1
+#define SNAP_END         0xffff
+#define SNAP_CNAME_DEPTH 10
+
+static pid_t snapshot_pid = 0;
+static time_t snapshot_next = 0;
+
+static int snap_savable(struct crec *crecp, time_t now)
+{
+  return (crecp->flags & (F_FORWARD | F_REVERSE)) &&
+    !(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL)) &&
+    !ecs_scoped(crecp) &&
+    difftime(crecp->ttd, now) > 0 &&
+    !is_outdated_cname_pointer(crecp);
+}
+
+/* Length of the CNAME chain starting here, targets are saved first. */
+static int snap_cname_depth(struct crec *crecp)
+{
+  int depth = 1;
+
+  while (depth <= SNAP_CNAME_DEPTH &&
+	 !crecp->addr.cname.is_name_ptr &&
+	 (crecp = crecp->addr.cname.target.cache) &&
+	 (crecp->flags & F_CNAME))
+    depth++;
+
+  return depth;
+}
+
+static void snap_write(FILE *f, struct crec *crecp, time_t now)
+{
+  char *name = cache_get_name(crecp);
+  u16 len = strlen(name), class = C_IN;
+  u32 flags = crecp->flags, ttl = (u32)difftime(crecp->ttd, now);
+  struct blockdata *block = NULL;
+  size_t blen = 0;
+
+  if (flags & (F_DNSKEY | F_DS))
+    class = crecp->uid;
+  
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(name, len, 1, f);
+  fwrite(&flags, sizeof(flags), 1, f);
+  fwrite(&class, sizeof(class), 1, f);
+  fwrite(&ttl, sizeof(ttl), 1, f);
+  fwrite(&crecp->addr, sizeof(crecp->addr), 1, f);
+
+  if (flags & F_CNAME)
+    {
+      char *target = cache_get_cname_target(crecp);
+
+      len = strlen(target);
+      fwrite(&len, sizeof(len), 1, f);
+      fwrite(target, len, 1, f);
+    }
+  else if (flags & F_RR)
+    {
+      if (!(flags & F_NEG) && (flags & F_KEYTAG))
+	{
+	  block = crecp->addr.rrblock.rrdata;
+	  blen = crecp->addr.rrblock.datalen;
+	}
+    }
+#ifdef HAVE_DNSSEC
+  else if (flags & F_DNSKEY)
+    {
+      block = crecp->addr.key.keydata;
+      blen = crecp->addr.key.keylen;
+    }
+  else if ((flags & F_DS) && !(flags & F_NEG))
+    {
+      block = crecp->addr.ds.keydata;
+      blen = crecp->addr.ds.keylen;
+    }
+#endif
+
+  if (block)
+    fwrite(blockdata_retrieve(block, blen, NULL), blen, 1, f);
+}
+
+static int snapshot_write(time_t now, int *countp)
+{
+  char *tmp = daemon->workspacename;
+  u16 end = SNAP_END;
+  u32 version = SNAP_VERSION, addrsz = sizeof(union all_addr);
+  long long wall = (long long)time(NULL);
+  struct crec *crecp;
+  int i, depth, count = 0;
+  FILE *f;
+
+  snprintf(tmp, MAXDNAME, "%s.%d", daemon->cache_snapshot, (int)getpid());
+  
+  if (!(f = fopen(tmp, "w")))
+    {
+      my_syslog(LOG_ERR, _("cannot write cache snapshot %s: %s"), tmp, strerror(errno));
+      return 0;
+    }
+
+  fwrite(SNAP_MAGIC, 8, 1, f);
+  fwrite(&version, sizeof(version), 1, f);
+  fwrite(&addrsz, sizeof(addrsz), 1, f);
+  fwrite(&wall, sizeof(wall), 1, f);
+  
+  for (i = 0; i < hash_size; i++)
+    {
+      int any = 0;
+      
+      for (crecp = hash_table[i]; crecp; crecp = crecp->hash_next)
+	if (!(crecp->flags & F_CNAME) && snap_savable(crecp, now))
+	  {
+	    snap_write(f, crecp, now);
+	    any = 1;
+	    count++;
+	  }
+      
+      if (any)
+	fwrite(&end, sizeof(end), 1, f);
+    }
+
+  for (depth = 1; depth <= SNAP_CNAME_DEPTH; depth++)
+    for (i = 0; i < hash_size; i++)
+      for (crecp = hash_table[i]; crecp; crecp = crecp->hash_next)
+	if ((crecp->flags & F_CNAME) && snap_savable(crecp, now) &&
+	    snap_cname_depth(crecp) == depth)
+	  {
+	    snap_write(f, crecp, now);
+	    fwrite(&end, sizeof(end), 1, f);
+	    count++;
+	  }
+  
+  if (ferror(f) | fclose(f) || rename(tmp, daemon->cache_snapshot) == -1)
+    {
+      my_syslog(LOG_ERR, _("cannot write cache snapshot %s: %s"), daemon->cache_snapshot, strerror(errno));
+      unlink(tmp);
+      return 0;
+    }
+
+  if (countp)
+    *countp = count;
+  
+  return 1;
+}
+
+/* Any live forward entry for the name, as target of a restored CNAME. */
+static struct crec *snap_find_target(char *name, time_t now)
+{
+  unsigned int hash = hash_name(name);
+  struct crec *crecp;
+
+  for (crecp = *hash_bucket(hash); crecp; crecp = crecp->hash_next)
+    if (crecp->hash == hash &&
+	(crecp->flags & F_FORWARD) &&
+	!is_expired(now, crecp) &&
+	hostname_isequal(cache_get_name(crecp), name))
+      return crecp;
+
+  return NULL;
+}
+
+/* Addresses with a reverse entry from hosts, DHCP or config, sorted.
+   A cached PTR for one of them would be answered next to the local one. */
+struct snap_local {
+  unsigned int prot;
+  unsigned char addr[IN6ADDRSZ];
+};
+
+static int snap_local_cmp(const void *a, const void *b)
+{
+  const struct snap_local *x = a, *y = b;
+
+  if (x->prot != y->prot)
+    return x->prot < y->prot ? -1 : 1;
+  return memcmp(x->addr, y->addr, IN6ADDRSZ);
+}
+
+static struct snap_local *snap_local_collect(int *countp)
+{
+  struct snap_local *local = NULL;
+  struct crec *crecp;
+  int i, count = 0, size = 0;
+
+  /* reverse entries are at the start of each hash chain */
+  for (i = 0; i < hash_size; i++)
+    for (crecp = hash_table[i]; crecp && (crecp->flags & F_REVERSE); crecp = crecp->hash_next)
+      if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
+	{
+	  if (count == size)
+	    {
+	      struct snap_local *new = whine_realloc(local, (size = size ? 2 * size : 64) * sizeof(*local));
+
+	      if (!new)
+		break;
+	      local = new;
+	    }
+	  memset(&local[count], 0, sizeof(*local));
+	  local[count].prot = crecp->flags & (F_IPV4 | F_IPV6);
+	  memcpy(local[count].addr, &crecp->addr, (crecp->flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ);
+	  count++;
+	}
+
+  if (count != 0)
+    qsort(local, count, sizeof(*local), snap_local_cmp);
+  *countp = count;
+  return local;
+}
+
+static int snap_local_find(struct snap_local *local, int count, unsigned int flags, union all_addr *addr)
+{
+  struct snap_local key;
+
+  memset(&key, 0, sizeof(key));
+  key.prot = flags & (F_IPV4 | F_IPV6);
+  memcpy(key.addr, addr, (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ);
+  return count != 0 && bsearch(&key, local, count, sizeof(*local), snap_local_cmp) != NULL;
+}
+
+void cache_snapshot_load(time_t now)
+{
+  char magic[8], *name = daemon->namebuff, *target = daemon->workspacename;
+  unsigned char *buf = NULL;
+  u32 version, addrsz, flags, ttl;
+  u16 len, class;
+  long long wall, down;
+  union all_addr addr;
+  struct snap_local *local;
+  int count = 0, ok = 0, nlocal;
+  FILE *f;
+
+  if (!daemon->cache_snapshot || daemon->cachesize == 0)
+    return;
+
+  if (!(f = fopen(daemon->cache_snapshot, "r")))
+    {
+      if (errno != ENOENT)
+	my_syslog(LOG_WARNING, _("cannot read cache snapshot %s: %s"), daemon->cache_snapshot, strerror(errno));
+      return;
+    }
+  
+  if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, SNAP_MAGIC, sizeof(magic)) != 0 ||
+      fread(&version, sizeof(version), 1, f) != 1 || version != SNAP_VERSION ||
+      fread(&addrsz, sizeof(addrsz), 1, f) != 1 || addrsz != sizeof(union all_addr) ||
+      fread(&wall, sizeof(wall), 1, f) != 1 ||
+      !(buf = whine_malloc(65536)))
+    {
+      my_syslog(LOG_WARNING, _("ignoring cache snapshot %s: not written by this version"), daemon->cache_snapshot);
+      fclose(f);
+      free(buf);
+      return;
+    }
+
+  if ((down = (long long)time(NULL) - wall) < 0)
+    down = 0;
+  
+  local = snap_local_collect(&nlocal);
+  snapshot_loading = 1;
+  cache_start_insert();
+  
+  while (1)
+    {
+      struct blockdata *block = NULL;
+      size_t blen = 0;
+      struct crec *crecp;
+      
+      if (fread(&len, sizeof(len), 1, f) != 1)
+	{
+	  ok = feof(f);
+	  break;
+	}
+
+      if (len == SNAP_END)
+	{
+	  cache_end_insert();
+	  cache_start_insert();
+	  continue;
+	}
+      
+      if (len >= MAXDNAME ||
+	  (len != 0 && fread(name, len, 1, f) != 1) ||
+	  fread(&flags, sizeof(flags), 1, f) != 1 ||
+	  fread(&class, sizeof(class), 1, f) != 1 ||
+	  fread(&ttl, sizeof(ttl), 1, f) != 1 ||
+	  fread(&addr, sizeof(addr), 1, f) != 1)
+	break;
+      name[len] = 0;
+
+      if (flags & F_CNAME)
+	{
+	  if (fread(&len, sizeof(len), 1, f) != 1 || len >= MAXDNAME ||
+	      (len != 0 && fread(target, len, 1, f) != 1))
+	    break;
+	  target[len] = 0;
+	}
+      else if (flags & F_RR)
+	{
+	  if (!(flags & F_NEG) && (flags & F_KEYTAG))
+	    blen = addr.rrblock.datalen;
+	}
+#ifdef HAVE_DNSSEC
+      else if (flags & F_DNSKEY)
+	blen = addr.key.keylen;
+      else if ((flags & F_DS) && !(flags & F_NEG))
+	blen = addr.ds.keylen;
+#endif
+
+      if (blen != 0 && fread(buf, blen, 1, f) != 1)
+	break;
+      
+      /* expired whilst we were down, or the address is local now */
+      if (ttl <= down ||
+	  ((flags & F_REVERSE) && snap_local_find(local, nlocal, flags, &addr)))
+	continue;
+      ttl -= down;
+
+      if (flags & F_CNAME)
+	{
+	  struct crec *newc, *targetp = snap_find_target(target, now);
+
+	  if (targetp && (newc = really_insert(name, NULL, C_IN, now, ttl, flags)))
+	    {
+	      newc->addr.cname.is_name_ptr = 0;
+	      newc->addr.cname.target.cache = targetp;
+	      next_uid(targetp);
+	      newc->addr.cname.uid = targetp->uid;
+	      count++;
+	    }
+	  continue;
+	}
+      
+      if ((flags & (F_RR | F_DNSKEY | F_DS)) && blen != 0)
+	{
+	  if (!(block = blockdata_alloc((char *)buf, blen)))
+	    continue;
+	  if (flags & F_RR)
+	    addr.rrblock.rrdata = block;
+#ifdef HAVE_DNSSEC
+	  else if (flags & F_DNSKEY)
+	    addr.key.keydata = block;
+	  else
+	    addr.ds.keydata = block;
+#endif
+	}
+      
+      if ((crecp = really_insert(name, &addr, class, now, ttl, flags)))
+	count++;
+      else
+	blockdata_free(block);
+    }
+  
+  cache_end_insert();
+  snapshot_loading = 0;
+  fclose(f);
+  free(buf);
+  free(local);
+
+  if (!ok)
+    my_syslog(LOG_WARNING, _("cache snapshot %s is truncated"), daemon->cache_snapshot);
+  my_syslog(LOG_INFO, _("restored %d cache entries from %s, saved %llds ago"),
+	    count, daemon->cache_snapshot, down);
+}
+
+/* SIGTERM: write the snapshot in the foreground. */
+void cache_snapshot_save(time_t now)
+{
+  int count;
+  
+  if (!daemon->cache_snapshot || daemon->cachesize == 0)
+    return;
+
+  /* an older one must not replace ours when it finishes */
+  if (snapshot_pid != 0)
+    {
+      kill(snapshot_pid, SIGKILL);
+      while (waitpid(snapshot_pid, NULL, 0) == -1 && errno == EINTR);
+      snapshot_pid = 0;
+    }
+  
+  if (snapshot_write(now, &count))
+    my_syslog(LOG_INFO, _("saved %d cache entries to %s"), count, daemon->cache_snapshot);
+}
+
+/* Main loop: periodic snapshots are written by a child process from its
+   copy of the cache, the parent carries on answering. */
+void cache_snapshot_poll(time_t now)
+{
+  pid_t pid;
+  
+  if (!daemon->cache_snapshot || daemon->cache_snapshot_interval == 0 ||
+      daemon->cachesize == 0 || snapshot_pid != 0)
+    return;
+
+  if (snapshot_next == 0)
+    snapshot_next = now + daemon->cache_snapshot_interval;
+  
+  if (difftime(now, snapshot_next) < 0)
+    return;
+  
+  snapshot_next = now + daemon->cache_snapshot_interval;
+  
+  if ((pid = fork()) == -1)
+    {
+      my_syslog(LOG_WARNING, _("cannot fork to save cache snapshot: %s"), strerror(errno));
+      return;
+    }
+  
+  if (pid == 0)
+    _exit(snapshot_write(now, NULL) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  snapshot_pid = pid;
+}
+
+/* Called for every child reaped by the main loop */
+int cache_snapshot_reaped(pid_t pid, int status)
+{
+  if (snapshot_pid == 0 || pid != snapshot_pid)
+    return 0;
+
+  snapshot_pid = 0;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    my_syslog(LOG_WARNING, _("failed to save cache snapshot %s"), daemon->cache_snapshot);
+  
+  return 1;
+}
+
+/* --cache-prefetch: count answers given from an entry in the last
+   prefetch_percent of its lifetime. Returns 1 once, when the entry has
+   become popular enough to be refreshed before it expires; the reply to
+   the refresh query then replaces it. */
+int cache_prefetch_hit(struct crec *crecp, time_t now)
+{
+  long left;
+
+  if (daemon->prefetch_hits == 0 || crecp->hits == PREFETCH_DONE ||
+      (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL)))
+    return 0;
+
+  left = (long)difftime(crecp->ttd, now);
+  if (left <= 0 || left * 100 > (long)crecp->lifetime * daemon->prefetch_percent)
+    return 0;
+  
+  if (++crecp->hits < daemon->prefetch_hits)
+    return 0;
+
+  crecp->hits = PREFETCH_DONE;
+  return 1;
+}
+
 int cache_find_non_terminal(char *name, time_t now)
 {
   struct crec *crecp;
+  unsigned int hash = hash_name(name);
 
-  for (crecp = *hash_bucket(name); crecp; crecp = crecp->hash_next)
-    if (!is_outdated_cname_pointer(crecp) &&
+  for (crecp = *hash_bucket(hash); crecp; crecp = crecp->hash_next)
+    if (crecp->hash == hash &&
+	!is_outdated_cname_pointer(crecp) &&
 	!is_expired(now, crecp) &&
 	(crecp->flags & F_FORWARD) &&
 	!(crecp->flags & F_NXDOMAIN) && 
@@ -1109,9 +1750,9 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
       /* first search, look for relevant entries and push to top of list
 	 also free anything which has expired */
       struct crec *next, **up, **insert = NULL, **chainp = &ans;
-      unsigned int ins_flags = 0;
+      unsigned int ins_flags = 0, hash = hash_name(name);
       
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = next)
+      for (up = hash_bucket(hash), crecp = *up; crecp; crecp = next)
 	{
 	  next = crecp->hash_next;
 	  
@@ -1119,7 +1760,9 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	    {
 	      if ((crecp->flags & F_FORWARD) && 
 		  (crecp->flags & prot) &&
-		  hostname_isequal(cache_get_name(crecp), name))
+		  crecp->hash == hash &&
+		  hostname_isequal(cache_get_name(crecp), name) &&
+		  ecs_visible(crecp))
 		{
 		  if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
 		    {
@@ -1176,7 +1819,8 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
   if (ans && 
       (ans->flags & F_FORWARD) &&
       (ans->flags & prot) &&     
-      hostname_isequal(cache_get_name(ans), name))
+      hostname_isequal(cache_get_name(ans), name) &&
+      ecs_visible(ans))
     return ans;
   
   return NULL;
@@ -1478,6 +2122,10 @@ void cache_reload(void)
 
   daemon->metrics[METRIC_DNS_CACHE_INSERTED] = 0;
   daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED] = 0;
+
+#ifdef HAVE_DNSSEC
+  dnssec_nsec_flush();
+#endif
   
   for (i=0; i<hash_size; i++)
     for (cache = hash_table[i], up = &hash_table[i]; cache; cache = tmp)
@@ -1494,10 +2142,7 @@ void cache_reload(void)
 	  {
 	    *up = cache->hash_next;
 	    if (cache->flags & F_BIGNAME)
-	      {
-		cache->name.bname->next = big_free;
-		big_free = cache->name.bname;
-	      }
+	      bigname_release(cache);
 	    cache->flags = 0;
 	  }
 	else
@@ -1768,7 +2413,7 @@ static void make_non_terminals(struct crec *source)
      entry and vice-versa for HOSTS and CONFIG. This ensures that 
      non-terminals from DHCP go when we reload DHCP and 
      for HOSTS/CONFIG when we re-read. */
-  for (up = hash_bucket(name), crecp = *up; crecp; crecp = tmp)
+  for (up = hash_bucket(hash_name(name)), crecp = *up; crecp; crecp = tmp)
     {
       tmp = crecp->hash_next;
 
@@ -1798,9 +2443,12 @@ static void make_non_terminals(struct crec *source)
     {
       name++;
 
+      unsigned int hash = hash_name(name);
+
       /* Look for one existing, don't need another */
-      for (crecp = *hash_bucket(name); crecp; crecp = crecp->hash_next)
-	if (!is_outdated_cname_pointer(crecp) &&
+      for (crecp = *hash_bucket(hash); crecp; crecp = crecp->hash_next)
+	if (crecp->hash == hash &&
+	    !is_outdated_cname_pointer(crecp) &&
 	    (crecp->flags & F_FORWARD) &&
 	    (crecp->flags & type) &&
 	    hostname_isequal(name, cache_get_name(crecp)))
@@ -2071,6 +2719,10 @@ void dump_cache(time_t now)
 	    daemon->metrics[METRIC_DNS_QUERIES_FORWARDED], daemon->metrics[METRIC_DNS_LOCAL_ANSWERED]);
   if (daemon->cache_max_expiry != 0)
     my_syslog(LOG_INFO, _("queries answered from stale cache %u"), daemon->metrics[METRIC_DNS_STALE_ANSWERED]);
+  if (daemon->prefetch_hits != 0)
+    my_syslog(LOG_INFO, _("prefetch queries %u (%u%% of forwarded)"), daemon->metrics[METRIC_DNS_PREFETCHED],
+	      daemon->metrics[METRIC_DNS_QUERIES_FORWARDED] == 0 ? 0 :
+	      (unsigned int)(100ULL * daemon->metrics[METRIC_DNS_PREFETCHED] / daemon->metrics[METRIC_DNS_QUERIES_FORWARDED]));
 #ifdef HAVE_AUTH
   my_syslog(LOG_INFO, _("queries for authoritative zones %u"), daemon->metrics[METRIC_DNS_AUTH_ANSWERED]);
 #endif
@@ -2078,9 +2730,15 @@ void dump_cache(time_t now)
   my_syslog(LOG_INFO, _("DNSSEC per-query subqueries HWM %u"), daemon->metrics[METRIC_WORK_HWM]);
   my_syslog(LOG_INFO, _("DNSSEC per-query crypto work HWM %u"), daemon->metrics[METRIC_CRYPTO_HWM]);
   my_syslog(LOG_INFO, _("DNSSEC per-RRSet signature fails HWM %u"), daemon->metrics[METRIC_SIG_FAIL_HWM]);
+  if (daemon->nsec_cache_size != 0)
+    my_syslog(LOG_INFO, _("queries answered from NSEC/NSEC3 ranges %u"), daemon->metrics[METRIC_DNS_NSEC_ANSWERED]);
+  if (daemon->sig_cache_size != 0)
+    my_syslog(LOG_INFO, _("signature verification cache size %d, %u hits, %u misses"), daemon->sig_cache_size,
+	      daemon->metrics[METRIC_SIG_CACHE_HITS], daemon->metrics[METRIC_SIG_CACHE_MISSES]);
 #endif
 
   blockdata_report();
+  frec_report();
   my_syslog(LOG_INFO, _("child processes for TCP requests: in use %zu, highest since last SIGUSR1 %zu, max allowed %zu."),
 	    daemon->metrics[METRIC_TCP_CONNECTIONS],
 	    daemon->max_procs_used,
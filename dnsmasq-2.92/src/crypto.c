@@ -31,6 +31,7 @@
 				   (NETTLE_VERSION_MAJOR > (major)))
 
 #include <nettle/rsa.h>
+#include <nettle/sha2.h>
 #include <nettle/ecdsa.h>
 #include <nettle/ecc-curve.h>
 #if MIN_VERSION(3, 1)
@@ -400,19 +401,117 @@ static int (*verify_func(int algo))(struct blockdata *key_data, unsigned int key
   return NULL;
 }
 
+/* Cache of signature verification results, so that an RRset which arrives
+   again (in a different answer, or from another upstream) doesn't cost
+   another RSA/ECDSA/EdDSA operation. The key is a SHA-256 over everything the
+   crypto sees: algorithm, DNSKEY, signature and the digest of RRSIG rdata
+   plus canonical RRset, so a hit is as good as doing the work again.
+   Entries are kept until the signature expires. The table is a fixed
+   array of SIG_CACHE_WAYS-entry sets; in a full set the entry which
+   expires first is replaced. */
+#define SIG_CACHE_WAYS 4
+
+struct sig_cache {
+  unsigned char fp[SHA256_DIGEST_SIZE];
+  time_t ttd; /* zero if slot unused */
+  int secure;
+};
+
+static struct sig_cache *sig_cache = NULL;
+static unsigned int sig_cache_sets = 0;
+
+static void sig_fingerprint(unsigned char *fp, int is_null, unsigned char *key, unsigned int key_len,
+			    unsigned char *sig, size_t sig_len, unsigned char *digest, size_t digest_len, int algo)
+{
+  struct sha256_ctx ctx;
+  unsigned char hdr[13], *p = hdr;
+
+#if MIN_VERSION(3, 1)
+  /* For EdDSA, "digest" points at the whole message, see null_hash above. */
+  if (is_null)
+    {
+      digest_len = ((struct null_hash_digest *)digest)->len;
+      digest = ((struct null_hash_digest *)digest)->buff;
+    }
+#else
+  (void)is_null;
+#endif
+  
+  *p++ = algo;
+  PUTLONG(key_len, p);
+  PUTLONG(sig_len, p);
+  PUTLONG(digest_len, p);
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, sizeof(hdr), hdr);
+  sha256_update(&ctx, key_len, key);
+  sha256_update(&ctx, sig_len, sig);
+  sha256_update(&ctx, digest_len, digest);
+  sha256_digest(&ctx, SHA256_DIGEST_SIZE, fp);
+}
+
+/* ttd is when the signature stops being usable, and therefore when the cached result
+   can go. */
 int verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
-	   unsigned char *digest, size_t digest_len, int algo)
+	   unsigned char *digest, size_t digest_len, int algo, time_t ttd)
 {
 
   int (*func)(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
 	      unsigned char *digest, size_t digest_len, int algo);
+  unsigned char fp[SHA256_DIGEST_SIZE], *key;
+  struct sig_cache *set, *slot;
+  time_t now;
+  int i, secure;
   
   func = verify_func(algo);
   
   if (!func)
     return 0;
 
-  return (*func)(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+  if (daemon->sig_cache_size != 0 && !sig_cache)
+    {
+      sig_cache_sets = (daemon->sig_cache_size + SIG_CACHE_WAYS - 1) / SIG_CACHE_WAYS;
+      if (!(sig_cache = whine_malloc(sig_cache_sets * SIG_CACHE_WAYS * sizeof(struct sig_cache))))
+	daemon->sig_cache_size = 0;
+    }
+  
+  if (daemon->sig_cache_size == 0 || sig_cache_sets == 0 || !(key = blockdata_retrieve(key_data, key_len, NULL)))
+    return (*func)(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+
+#if MIN_VERSION(3, 1)
+  sig_fingerprint(fp, func == dnsmasq_eddsa_verify, key, key_len, sig, sig_len, digest, digest_len, algo);
+#else
+  sig_fingerprint(fp, 0, key, key_len, sig, sig_len, digest, digest_len, algo);
+#endif
+  
+  now = dnsmasq_time();
+  set = &sig_cache[(((u32)fp[0] << 24) | (fp[1] << 16) | (fp[2] << 8) | fp[3]) % sig_cache_sets * SIG_CACHE_WAYS];
+
+  for (slot = set, i = 0; i < SIG_CACHE_WAYS; i++)
+    {
+      if (set[i].ttd != 0 && difftime(set[i].ttd, now) > 0 &&
+	  memcmp(set[i].fp, fp, SHA256_DIGEST_SIZE) == 0)
+	{
+	  daemon->metrics[METRIC_SIG_CACHE_HITS]++;
+	  return set[i].secure;
+	}
+      
+      /* Prefer a free or expired slot, else the one expiring soonest. */
+      if (slot->ttd != 0 && (set[i].ttd == 0 || difftime(set[i].ttd, slot->ttd) < 0))
+	slot = &set[i];
+    }
+  
+  daemon->metrics[METRIC_SIG_CACHE_MISSES]++;
+  secure = (*func)(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+
+  if (difftime(ttd, now) > 0)
+    {
+      memcpy(slot->fp, fp, SHA256_DIGEST_SIZE);
+      slot->ttd = ttd;
+      slot->secure = secure;
+    }
+
+  return secure;
 }
 
 /* Note the ds_digest_name(), algo_digest_name() and nsec3_digest_name()
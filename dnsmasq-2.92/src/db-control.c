@@ -0,0 +1,282 @@
+/* DNSMASQ-SQLITE Control Socket
+ *
+ * Local UNIX stream socket (--sqlite-control=PATH[,persist]) for live
+ * changes without scripts or restarts. Changes go into the runtime overlay
+ * in db.c and take effect for the next query; with "persist" they are also
+ * written to the database by the background compaction in db-delta.c.
+ * Everything is serviced from the main poll loop with non-blocking sockets.
+ *
+ * Protocol: one command per line, answered by zero or more data lines and
+ * a final "OK" or "ERR <reason>" line.
+ *
+ *   block <name>               block exact hostname (block_hosts)
+ *   block-wildcard <domain>    block domain and subdomains (block_wildcard)
+ *   unblock <name>             hide <name> in block_hosts and block_wildcard
+ *   allow <name>               exception for exactly <name> (allow_exact)
+ *   allow-wildcard <domain>    exception for domain and subdomains (allow_wildcard)
+ *   unallow <name>             hide <name> in allow_exact and allow_wildcard
+ *   rewrite-add <ip|cidr> <ip> rewrite answers (block_ips)
+ *   rewrite-remove <ip|cidr>   hide a rewrite
+ *   lookup <name|ip>           explain the verdict / rewrite
+ *   policy <client-ip>         client policy: enabled categories and IP set
+ *   top <blocked|passed> [N]   most queried names of the current window
+ *   top-last <blocked|passed> [N]  the same for the previous window
+ *   stats                      overlay, delta and query counters
+ *   flush-verdict-cache        drop cached answers (rewritten under old rules)
+ *   persist                    write the overlay to the database now
+ *
+ * Example: printf 'block ads.example.com\n' | nc -U /run/dnsmasq/control
+ */
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_SQLITE
+#include <sys/un.h>
+
+#define CTL_MAX_CLIENTS 8
+#define CTL_LINE_MAX    512
+#define CTL_REPLY_MAX   8192
+
+struct ctl_client {
+  int fd;
+  size_t len;
+  char buf[CTL_LINE_MAX];
+};
+
+static char *ctl_path = NULL;
+static int ctl_persist = 0;
+static int ctl_fd = -1;
+static struct ctl_client ctl_clients[CTL_MAX_CLIENTS];
+
+void db_set_control(char *arg)
+{
+  char *comma = strchr(arg, ',');
+
+  if (comma) {
+    *comma = '\0';
+    ctl_persist = strcmp(comma + 1, "persist") == 0;
+  }
+  if (ctl_path) free(ctl_path);
+  ctl_path = strdup(arg);
+  if (!ctl_path)
+    my_syslog(LOG_ERR, "SQLite: Memory allocation failed for control socket path");
+}
+
+/* Called at startup, before privileges are dropped */
+void db_control_init(void)
+{
+  struct sockaddr_un sa;
+  mode_t old;
+
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++)
+    ctl_clients[i].fd = -1;
+
+  if (!ctl_path)
+    return;
+
+  if (strlen(ctl_path) >= sizeof(sa.sun_path))
+    die(_("control socket path too long: %s"), ctl_path, EC_BADCONF);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, ctl_path);
+  unlink(ctl_path);
+
+  /* owner and group only */
+  old = umask(0117);
+  if ((ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      bind(ctl_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+      listen(ctl_fd, CTL_MAX_CLIENTS) == -1 ||
+      !fix_fd(ctl_fd))
+    die(_("cannot create control socket %s: %s"), ctl_path, EC_BADNET);
+  umask(old);
+
+  my_syslog(LOG_INFO, "SQLite: Control socket %s%s", ctl_path,
+            ctl_persist ? " (changes persisted)" : "");
+}
+
+void db_control_set_listeners(void)
+{
+  if (ctl_fd == -1)
+    return;
+
+  poll_listen(ctl_fd, POLLIN);
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++)
+    if (ctl_clients[i].fd != -1)
+      poll_listen(ctl_clients[i].fd, POLLIN);
+}
+
+static void ctl_close(struct ctl_client *c)
+{
+  close(c->fd);
+  c->fd = -1;
+  c->len = 0;
+}
+
+/* ============================================================================
+ * Commands
+ * ============================================================================ */
+
+static const char *ctl_change(int table, int op, const char *key, const char *target, time_t now)
+{
+  if (!db_overlay_apply(table, op, key, target))
+    return "invalid argument";
+  if (ctl_persist)
+    db_delta_request_compact(now, 0);
+  return NULL;
+}
+
+static void ctl_command(char *line, char *reply, size_t len, time_t now)
+{
+  char *cmd, *arg1, *arg2, *save = NULL;
+  const char *err = NULL;
+  size_t n = 0;
+
+  cmd = strtok_r(line, " \t\r", &save);
+  arg1 = strtok_r(NULL, " \t\r", &save);
+  arg2 = strtok_r(NULL, " \t\r", &save);
+
+  if (!cmd)
+    err = "empty command";
+  else if (strcmp(cmd, "block") == 0)
+    err = arg1 ? ctl_change(DB_TABLE_HOSTS, DB_OVERLAY_ADD, arg1, NULL, now) : "missing name";
+  else if (strcmp(cmd, "block-wildcard") == 0)
+    err = arg1 ? ctl_change(DB_TABLE_WILDCARD, DB_OVERLAY_ADD, arg1, NULL, now) : "missing domain";
+  else if (strcmp(cmd, "unblock") == 0) {
+    if (!arg1)
+      err = "missing name";
+    else if (!(err = ctl_change(DB_TABLE_HOSTS, DB_OVERLAY_DEL, arg1, NULL, now)))
+      err = ctl_change(DB_TABLE_WILDCARD, DB_OVERLAY_DEL, arg1, NULL, now);
+  }
+  else if (strcmp(cmd, "allow") == 0)
+    err = arg1 ? ctl_change(DB_TABLE_ALLOW_EXACT, DB_OVERLAY_ADD, arg1, NULL, now) : "missing name";
+  else if (strcmp(cmd, "allow-wildcard") == 0)
+    err = arg1 ? ctl_change(DB_TABLE_ALLOW_WILDCARD, DB_OVERLAY_ADD, arg1, NULL, now) : "missing domain";
+  else if (strcmp(cmd, "unallow") == 0) {
+    if (!arg1)
+      err = "missing name";
+    else if (!(err = ctl_change(DB_TABLE_ALLOW_EXACT, DB_OVERLAY_DEL, arg1, NULL, now)))
+      err = ctl_change(DB_TABLE_ALLOW_WILDCARD, DB_OVERLAY_DEL, arg1, NULL, now);
+  }
+  else if (strcmp(cmd, "rewrite-add") == 0)
+    err = (arg1 && arg2) ? ctl_change(DB_TABLE_IPS, DB_OVERLAY_ADD, arg1, arg2, now)
+      : "usage: rewrite-add <ip|cidr> <ip>";
+  else if (strcmp(cmd, "rewrite-remove") == 0)
+    err = arg1 ? ctl_change(DB_TABLE_IPS, DB_OVERLAY_DEL, arg1, NULL, now) : "missing ip";
+  else if (strcmp(cmd, "lookup") == 0) {
+    if (!arg1)
+      err = "missing name or ip";
+    else
+      n = db_explain(arg1, reply, len);
+  }
+  else if (strcmp(cmd, "policy") == 0) {
+    union mysockaddr client;
+
+    memset(&client, 0, sizeof(client));
+    if (!arg1)
+      err = "missing client ip";
+    else if (inet_pton(AF_INET, arg1, &client.in.sin_addr) == 1)
+      client.sa.sa_family = AF_INET;
+    else if (inet_pton(AF_INET6, arg1, &client.in6.sin6_addr) == 1)
+      client.sa.sa_family = AF_INET6;
+    else
+      err = "invalid client ip";
+    if (!err)
+      n = db_policy_explain(&client, reply, len);
+  }
+  else if (strcmp(cmd, "top") == 0 || strcmp(cmd, "top-last") == 0) {
+    long count = 20;
+
+    if (arg2) {
+      char *end;
+      count = strtol(arg2, &end, 10);
+      if (*end != '\0' || count < 1)
+        err = "invalid count";
+    }
+    if (!arg1 || (strcmp(arg1, "blocked") != 0 && strcmp(arg1, "passed") != 0))
+      err = "usage: top <blocked|passed> [N]";
+    if (!err)
+      n = db_top_explain(strcmp(arg1, "blocked") == 0, cmd[3] == '-', count, reply, len);
+  }
+  else if (strcmp(cmd, "stats") == 0) {
+    n = snprintf(reply, len, "overlay_entries %d\ndelta_seq %u\n",
+                 db_overlay_size(), db_delta_seq());
+    for (int i = 0; i < __METRIC_MAX && n < len; i++)
+      n += snprintf(reply + n, len - n, "%s %u\n", get_metric_name(i), daemon->metrics[i]);
+  }
+  else if (strcmp(cmd, "flush-verdict-cache") == 0) {
+    if (daemon->port != 0)
+      cache_reload();
+  }
+  else if (strcmp(cmd, "persist") == 0)
+    db_delta_request_compact(now, 1);
+  else
+    err = "unknown command";
+
+  if (n >= len)
+    n = len - 1;
+  snprintf(reply + n, len - n, err ? "ERR %s\n" : "OK\n", err);
+}
+
+void db_control_check(time_t now)
+{
+  if (ctl_fd == -1)
+    return;
+
+  if (poll_check(ctl_fd, POLLIN)) {
+    int fd = accept(ctl_fd, NULL, NULL);
+    int i;
+
+    for (i = 0; fd != -1 && i < CTL_MAX_CLIENTS; i++)
+      if (ctl_clients[i].fd == -1)
+        break;
+
+    if (fd != -1 && (i == CTL_MAX_CLIENTS || !fix_fd(fd)))
+      close(fd);
+    else if (fd != -1) {
+      ctl_clients[i].fd = fd;
+      ctl_clients[i].len = 0;
+    }
+  }
+
+  for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+    struct ctl_client *c = &ctl_clients[i];
+    char *nl;
+    ssize_t r;
+
+    if (c->fd == -1 || !poll_check(c->fd, POLLIN))
+      continue;
+
+    r = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (r <= 0) {
+      if (r == 0 || (errno != EINTR && errno != EAGAIN))
+        ctl_close(c);
+      continue;
+    }
+    c->len += r;
+    c->buf[c->len] = '\0';
+
+    while (c->fd != -1 && (nl = strchr(c->buf, '\n'))) {
+      char reply[CTL_REPLY_MAX];
+      size_t rest;
+
+      *nl = '\0';
+      ctl_command(c->buf, reply, sizeof(reply), now);
+
+      /* replies are small; a client that cannot take one is dropped */
+      if (send(c->fd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)strlen(reply)) {
+        ctl_close(c);
+        break;
+      }
+
+      rest = c->len - (nl + 1 - c->buf);
+      memmove(c->buf, nl + 1, rest + 1);
+      c->len = rest;
+    }
+
+    if (c->fd != -1 && c->len == sizeof(c->buf) - 1)
+      ctl_close(c);
+  }
+}
+
+#endif /* HAVE_SQLITE */
@@ -0,0 +1,546 @@
+/* DNSMASQ-SQLITE Incremental Deltas
+ *
+ * Small daily changes are pushed as delta files and applied to the runtime
+ * overlay in db.c, so neither a rebuild of the base database nor a reload
+ * of dnsmasq is needed. A forked child later folds the overlay into a new
+ * base file and renames it over the old one (compaction); the main process
+ * then reopens the base and drops the folded overlay entries.
+ *
+ * Delta files live in --sqlite-delta-dir and are named <seq>.delta (decimal,
+ * no leading zeros). They are applied strictly in sequence: after the base
+ * (db_metadata key "delta_seq", 0 if absent) comes seq+1, then seq+2, ...
+ *
+ *   # comment lines and blank lines are ignored
+ *   seq 42
+ *   +wildcard example.com
+ *   -wildcard example.org
+ *   +hosts ads.example.net
+ *   -hosts tracker.example.net
+ *   +allow-wildcard cdn.example.com
+ *   +allow-exact login.example.net
+ *   +ips 192.0.2.1 10.0.0.1
+ *   +ips 198.51.100.0/24 10.0.0.1
+ *   -ips 192.0.2.1
+ *   hmac <64 hex digits>
+ *
+ * The last line is HMAC-SHA256 over every byte before it, keyed with the
+ * contents of --sqlite-delta-key, which --sqlite-delta-dir requires. A file
+ * without its last line is treated as still being written and retried; a
+ * file with a bad signature or a bad seq line is skipped until it changes.
+ * Files are checked completely before the first change is applied, so a
+ * rejected file leaves the overlay untouched.
+ *
+ * Compaction runs after DELTA_COMPACT_IDLE seconds without new deltas, or
+ * at once when the overlay holds DELTA_COMPACT_ENTRIES entries. It writes
+ * the whole overlay, so changes made through the control socket (see
+ * db-control.c) are persisted with it. The directory of the base file must
+ * be writable by the user dnsmasq runs as and have room for a second copy.
+ */
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_SQLITE
+#include <sys/stat.h>
+
+#define DELTA_MAX_SIZE        (64 * 1024 * 1024)
+#define DELTA_COMPACT_ENTRIES 100000
+#define DELTA_COMPACT_IDLE    30
+#define DELTA_COMPACT_RETRY   300
+
+static char *delta_dir = NULL;
+static unsigned char *delta_key = NULL;
+static size_t delta_key_len = 0;
+
+static int delta_started = 0;
+static unsigned int applied_seq = 0;
+static time_t last_scan = 0, last_apply = 0, next_compact = 0;
+
+/* Rejected file, skipped until its mtime changes */
+static unsigned int bad_seq = 0;
+static time_t bad_mtime = 0;
+
+/* Overlay generations: last change wanting a write, last one written */
+static unsigned int wanted_gen = 0, folded_gen = 0;
+static int compact_now = 0;
+
+static pid_t compact_pid = 0;
+static unsigned int compact_seq = 0, compact_gen = 0;
+static int compact_done = 0;    /* new base written, reopen on next poll */
+
+/* ============================================================================
+ * SHA-256 / HMAC (FIPS 180-4, RFC 2104)
+ * ============================================================================ */
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t len;
+  unsigned char buf[64];
+  size_t fill;
+} sha256_ctx;
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_ctx *c, const unsigned char *p)
+{
+  uint32_t w[64], a, b, d, e, f, g, h, cc;
+
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+  for (int i = 16; i < 64; i++)
+    w[i] = w[i-16] + (ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3)) +
+           w[i-7] + (ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10));
+
+  a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3];
+  e = c->h[4]; f = c->h[5]; g = c->h[6]; h = c->h[7];
+
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+    h = g; g = f; f = e; e = d + t1;
+    d = cc; cc = b; b = a; a = t1 + t2;
+  }
+
+  c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+  c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
+}
+
+static void sha256_init(sha256_ctx *c)
+{
+  static const uint32_t iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(c->h, iv, sizeof(iv));
+  c->len = 0;
+  c->fill = 0;
+}
+
+static void sha256_update(sha256_ctx *c, const unsigned char *p, size_t n)
+{
+  c->len += n;
+  while (n > 0) {
+    size_t take = 64 - c->fill;
+    if (take > n) take = n;
+    memcpy(c->buf + c->fill, p, take);
+    c->fill += take; p += take; n -= take;
+    if (c->fill == 64) {
+      sha256_block(c, c->buf);
+      c->fill = 0;
+    }
+  }
+}
+
+static void sha256_final(sha256_ctx *c, unsigned char out[32])
+{
+  uint64_t bits = c->len * 8;
+  unsigned char pad = 0x80, zero = 0, len[8];
+
+  sha256_update(c, &pad, 1);
+  while (c->fill != 56)
+    sha256_update(c, &zero, 1);
+  for (int i = 0; i < 8; i++)
+    len[i] = bits >> (56 - 8 * i);
+  sha256_update(c, len, 8);
+
+  for (int i = 0; i < 8; i++) {
+    out[4*i] = c->h[i] >> 24; out[4*i+1] = c->h[i] >> 16;
+    out[4*i+2] = c->h[i] >> 8; out[4*i+3] = c->h[i];
+  }
+}
+
+static void hmac_sha256(const unsigned char *key, size_t key_len,
+                        const unsigned char *msg, size_t msg_len, unsigned char out[32])
+{
+  unsigned char k[64], pad[64], inner[32];
+  sha256_ctx c;
+
+  memset(k, 0, sizeof(k));
+  if (key_len > 64) {
+    sha256_init(&c);
+    sha256_update(&c, key, key_len);
+    sha256_final(&c, k);
+  } else {
+    memcpy(k, key, key_len);
+  }
+
+  for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+  sha256_init(&c);
+  sha256_update(&c, pad, 64);
+  sha256_update(&c, msg, msg_len);
+  sha256_final(&c, inner);
+
+  for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+  sha256_init(&c);
+  sha256_update(&c, pad, 64);
+  sha256_update(&c, inner, 32);
+  sha256_final(&c, out);
+}
+
+/* ============================================================================
+ * Configuration
+ * ============================================================================ */
+
+void db_set_delta_dir(char *path)
+{
+  if (delta_dir) free(delta_dir);
+  delta_dir = path ? strdup(path) : NULL;
+  if (path && !delta_dir)
+    my_syslog(LOG_ERR, "SQLite: Memory allocation failed for delta_dir");
+}
+
+/* Read at option parsing time, before privileges are dropped */
+int db_set_delta_key(char *path)
+{
+  unsigned char buf[1024];
+  size_t len;
+  FILE *f;
+
+  if (!path || !(f = fopen(path, "r"))) return 0;
+  len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+
+  /* trailing newline from "echo secret > key" is not part of the key */
+  while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+    len--;
+  if (len == 0) return 0;
+
+  free(delta_key);
+  if (!(delta_key = malloc(len))) return 0;
+  memcpy(delta_key, buf, len);
+  delta_key_len = len;
+  return 1;
+}
+
+/* Deltas must be signed: a directory without a key is a configuration error */
+int db_delta_config_ok(void)
+{
+  return delta_dir == NULL || delta_key != NULL;
+}
+
+/* Main loop wakes every second while deltas are watched or a write is due */
+int db_delta_enabled(void)
+{
+  return delta_dir != NULL || wanted_gen > folded_gen || compact_done;
+}
+
+/* ============================================================================
+ * Delta Files
+ * ============================================================================ */
+
+static int hex_nibble(int c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  c = tolower(c);
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+/* Returns 1 applied, 0 incomplete (retry later), -1 rejected */
+static int delta_apply_file(const char *path, unsigned int seq, int *changes, int *invalid)
+{
+  struct delta_change {
+    char *key, *target;
+    int table, op;
+  } *chg = NULL;
+  struct stat st;
+  char *buf, *p, *end, *last;
+  size_t len, lines, nchg = 0;
+  FILE *f;
+  int ret = -1, have_seq = 0;
+
+  *changes = *invalid = 0;
+
+  if (!(f = fopen(path, "r"))) return 0;
+  if (fstat(fileno(f), &st) != 0 || st.st_size == 0) {
+    fclose(f);
+    return 0;
+  }
+  if (st.st_size > DELTA_MAX_SIZE) {
+    fclose(f);
+    my_syslog(LOG_ERR, "SQLite: Delta %s larger than %d bytes", path, DELTA_MAX_SIZE);
+    return -1;
+  }
+
+  len = st.st_size;
+  if (!(buf = malloc(len + 1))) {
+    fclose(f);
+    return 0;
+  }
+  if (fread(buf, 1, len, f) != len) {
+    free(buf);
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+  buf[len] = '\0';
+
+  /* Locate the terminating line; missing means the writer is not done */
+  end = buf + len;
+  while (end > buf && (end[-1] == '\n' || end[-1] == '\r'))
+    end--;
+  for (last = end; last > buf && last[-1] != '\n'; last--)
+    ;
+
+  if (strncmp(last, "hmac ", 5) == 0) {
+    unsigned char mac[32], want[32];
+    const char *hex = last + 5;
+    int i;
+
+    unsigned char diff = 0;
+
+    if (!delta_key || end - hex != 64) goto bad_sig;
+    for (i = 0; i < 32; i++) {
+      int hi = hex_nibble((unsigned char)hex[2*i]), lo = hex_nibble((unsigned char)hex[2*i+1]);
+      if (hi < 0 || lo < 0) goto bad_sig;
+      want[i] = (hi << 4) | lo;
+    }
+    hmac_sha256(delta_key, delta_key_len, (unsigned char *)buf, last - buf, mac);
+    for (i = 0; i < 32; i++)
+      diff |= mac[i] ^ want[i];
+    if (diff) goto bad_sig;
+  } else if (end - last == 3 && strncmp(last, "end", 3) == 0) {
+    my_syslog(LOG_ERR, "SQLite: Delta %s is not signed", path);
+    goto out;
+  } else {
+    ret = 0;
+    goto out;
+  }
+
+  *last = '\0';
+
+  /* Parse everything first; nothing reaches the overlay unless the whole
+   * file is good. */
+  for (lines = 1, p = buf; *p; p++)
+    if (*p == '\n') lines++;
+  if (!(chg = malloc(lines * sizeof(*chg)))) {
+    ret = 0;
+    goto out;
+  }
+
+  for (p = buf; *p; ) {
+    char *line = p, *nl = strchr(p, '\n');
+    char *tok[3] = { NULL, NULL, NULL };
+    int ntok = 0, table, op;
+
+    if (nl) { *nl = '\0'; p = nl + 1; } else p += strlen(p);
+
+    for (char *s = line; *s && ntok < 3; ) {
+      while (*s == ' ' || *s == '\t' || *s == '\r') *s++ = '\0';
+      if (!*s) break;
+      tok[ntok++] = s;
+      while (*s && *s != ' ' && *s != '\t' && *s != '\r') s++;
+    }
+
+    if (ntok == 0 || tok[0][0] == '#') continue;
+
+    if (strcmp(tok[0], "seq") == 0) {
+      if (!tok[1] || strtoul(tok[1], NULL, 10) != seq) {
+        my_syslog(LOG_ERR, "SQLite: Delta %s does not carry seq %u", path, seq);
+        goto out;
+      }
+      have_seq = 1;
+      continue;
+    }
+
+    /* seq must precede the changes so a renamed file is never applied */
+    if (!have_seq) {
+      my_syslog(LOG_ERR, "SQLite: Delta %s has no seq line", path);
+      goto out;
+    }
+
+    op = tok[0][0] == '+' ? DB_OVERLAY_ADD : tok[0][0] == '-' ? DB_OVERLAY_DEL : 0;
+    table = !op ? -1 :
+      strcmp(tok[0] + 1, "wildcard") == 0 ? DB_TABLE_WILDCARD :
+      strcmp(tok[0] + 1, "hosts") == 0 ? DB_TABLE_HOSTS :
+      strcmp(tok[0] + 1, "ips") == 0 ? DB_TABLE_IPS :
+      strcmp(tok[0] + 1, "allow-wildcard") == 0 ? DB_TABLE_ALLOW_WILDCARD :
+      strcmp(tok[0] + 1, "allow-exact") == 0 ? DB_TABLE_ALLOW_EXACT : -1;
+
+    if (table < 0 || !tok[1])
+      (*invalid)++;
+    else {
+      chg[nchg].table = table;
+      chg[nchg].op = op;
+      chg[nchg].key = tok[1];
+      chg[nchg++].target = tok[2];
+    }
+  }
+
+  if (!have_seq) {
+    my_syslog(LOG_ERR, "SQLite: Delta %s has no seq line", path);
+    goto out;
+  }
+
+  for (size_t i = 0; i < nchg; i++)
+    if (db_overlay_apply(chg[i].table, chg[i].op, chg[i].key, chg[i].target))
+      (*changes)++;
+    else
+      (*invalid)++;
+  ret = 1;
+  goto out;
+
+bad_sig:
+  my_syslog(LOG_ERR, "SQLite: Delta %s has an invalid signature", path);
+out:
+  free(chg);
+  free(buf);
+  return ret;
+}
+
+/* ============================================================================
+ * Compaction
+ * ============================================================================ */
+
+/* Ask for the overlay to be written to the base: after DELTA_COMPACT_IDLE
+ * quiet seconds, or on the next main loop pass when immediate is set. */
+void db_delta_request_compact(time_t now, int immediate)
+{
+  wanted_gen = db_overlay_generation();
+  last_apply = now;
+  if (immediate) {
+    compact_now = 1;
+    next_compact = 0;
+  }
+}
+
+static void delta_compact(time_t now)
+{
+  pid_t pid;
+
+  if (compact_pid != 0 || compact_done || wanted_gen <= folded_gen || now < next_compact)
+    return;
+  if (!compact_now && db_overlay_size() < DELTA_COMPACT_ENTRIES &&
+      difftime(now, last_apply) < DELTA_COMPACT_IDLE)
+    return;
+
+  /* the child must not inherit a read transaction of the lookup handle */
+  db_release();
+
+  if ((pid = fork()) == -1) {
+    my_syslog(LOG_WARNING, "SQLite: Cannot fork for delta compaction: %s", strerror(errno));
+    next_compact = now + DELTA_COMPACT_RETRY;
+    return;
+  }
+
+  if (pid == 0)
+    _exit(db_overlay_persist(applied_seq) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  compact_pid = pid;
+  compact_seq = applied_seq;
+  compact_gen = db_overlay_generation();
+  compact_now = 0;
+}
+
+/* Called for every child reaped by the main loop */
+int db_delta_reaped(pid_t pid, int status)
+{
+  if (compact_pid == 0 || pid != compact_pid)
+    return 0;
+
+  compact_pid = 0;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+    compact_done = 1;
+  else {
+    my_syslog(LOG_WARNING, "SQLite: Delta compaction failed, retrying in %d seconds", DELTA_COMPACT_RETRY);
+    next_compact = dnsmasq_time() + DELTA_COMPACT_RETRY;
+  }
+  return 1;
+}
+
+/* Switch to the new base, then drop what it now contains from the overlay.
+ * If it cannot be opened the overlay stays and compaction runs again. */
+static void delta_swap(time_t now)
+{
+  compact_done = 0;
+  if (!db_reopen()) {
+    my_syslog(LOG_WARNING, "SQLite: Cannot open compacted base, retrying in %d seconds", DELTA_COMPACT_RETRY);
+    next_compact = now + DELTA_COMPACT_RETRY;
+    return;
+  }
+
+  db_overlay_fold(compact_gen);
+  folded_gen = compact_gen;
+  my_syslog(LOG_INFO, "SQLite: Compacted overlay into base, delta seq %u (%d overlay entries left)",
+            compact_seq, db_overlay_size());
+}
+
+unsigned int db_delta_seq(void)
+{
+  return applied_seq;
+}
+
+/* ============================================================================
+ * Main Loop Hook
+ * ============================================================================ */
+
+static void delta_scan(time_t now)
+{
+  char path[PATH_MAX];
+  struct stat st;
+
+  if (!delta_started) {
+    char val[32];
+
+    db_init();
+    delta_started = 1;
+    if (db_get_meta("delta_seq", val, sizeof(val)))
+      applied_seq = strtoul(val, NULL, 10);
+    my_syslog(LOG_INFO, "SQLite: Watching %s for deltas after seq %u", delta_dir, applied_seq);
+  }
+
+  for (;;) {
+    struct timespec t0, t1;
+    int changes, invalid, ret;
+    unsigned int seq = applied_seq + 1;
+
+    snprintf(path, sizeof(path), "%s/%u.delta", delta_dir, seq);
+    if (stat(path, &st) != 0)
+      break;
+    if (seq == bad_seq && st.st_mtime == bad_mtime)
+      break;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret = delta_apply_file(path, seq, &changes, &invalid);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (ret == 0)
+      break;
+    if (ret < 0) {
+      bad_seq = seq;
+      bad_mtime = st.st_mtime;
+      break;
+    }
+
+    applied_seq = seq;
+    db_delta_request_compact(now, 0);
+    my_syslog(LOG_INFO, "SQLite: Applied delta %u: %d changes, %d invalid in %.1f ms, overlay %d entries",
+              seq, changes, invalid,
+              (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+              db_overlay_size());
+  }
+}
+
+void db_delta_poll(time_t now)
+{
+  if (compact_done)
+    delta_swap(now);
+
+  if (delta_dir && now != last_scan) {
+    last_scan = now;
+    delta_scan(now);
+  }
+
+  delta_compact(now);
+}
+
+#endif /* HAVE_SQLITE */
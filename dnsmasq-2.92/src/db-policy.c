@@ -0,0 +1,248 @@
+/* DNSMASQ-SQLITE Client Policies
+ *
+ * Multi-tenant filtering on one database: block entries carry a Category
+ * (0-63, see db.c) and each client group enables a set of categories and
+ * picks the answer addresses from ip_sets.
+ *
+ *   sqlite-policy=<client>,<categories>[,<ip-set>]
+ *
+ *   client      192.168.10.0/24, 2001:db8:1::/48 or a single address
+ *               mac=00:11:22:*:*:*   client MAC (ARP/neighbour table), * = any
+ *               listen=192.168.1.1   local address the query arrived on
+ *   categories  all | none | 1:4:17
+ *   ip-set      ID in ip_sets for entries without their own IPSet,
+ *               0 or missing = sqlite-block-ipv4/6
+ *
+ * Policies are tried in configuration order and the first match applies;
+ * clients that match none get all categories and the global addresses.
+ * Blocks added at runtime (control socket, delta files) have no category
+ * and count in every one, so they reach each policy that blocks anything.
+ * Resolving the policy is a short list walk, the verdict itself is one AND
+ * of the entry's category bit with the policy mask in db_check_block_mask().
+ */
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_SQLITE
+
+#define POLICY_SUBNET 1
+#define POLICY_MAC    2
+#define POLICY_LISTEN 3
+
+struct db_policy {
+  struct db_policy *next;
+  int type;
+  int family, prefix;
+  union all_addr addr;
+  unsigned char mac[ETHER_ADDR_LEN], mac_mask[ETHER_ADDR_LEN];
+  uint64_t categories;
+  int ip_set;
+  char *text;
+};
+
+static struct db_policy *policies = NULL, **policies_tail = &policies;
+static int policy_mac = 0;
+
+static int parse_categories(char *s, uint64_t *mask)
+{
+  char *tok, *save = NULL;
+
+  if (strcmp(s, "all") == 0) {
+    *mask = DB_CATEGORY_ALL;
+    return 1;
+  }
+  *mask = 0;
+  if (strcmp(s, "none") == 0)
+    return 1;
+
+  for (tok = strtok_r(s, ":", &save); tok; tok = strtok_r(NULL, ":", &save)) {
+    char *end;
+    long cat = strtol(tok, &end, 10);
+    if (*tok == '\0' || *end != '\0' || cat < 0 || cat >= DB_CATEGORIES)
+      return 0;
+    *mask |= 1ULL << cat;
+  }
+  return *mask != 0;
+}
+
+/* aa:bb:cc:*:*:* - each octet hex or a wildcard */
+static int parse_mac(char *s, unsigned char *mac, unsigned char *mask)
+{
+  char *tok, *save = NULL;
+  int i = 0;
+
+  for (tok = strtok_r(s, ":-", &save); tok; tok = strtok_r(NULL, ":-", &save), i++) {
+    char *end;
+    unsigned long v;
+
+    if (i == ETHER_ADDR_LEN)
+      return 0;
+    if (strcmp(tok, "*") == 0) {
+      mac[i] = mask[i] = 0;
+      continue;
+    }
+    v = strtoul(tok, &end, 16);
+    if (*tok == '\0' || *end != '\0' || v > 0xff)
+      return 0;
+    mac[i] = v;
+    mask[i] = 0xff;
+  }
+  return i == ETHER_ADDR_LEN;
+}
+
+static int parse_subnet(char *s, struct db_policy *p)
+{
+  char *slash = strchr(s, '/');
+  int max;
+
+  if (slash)
+    *slash = '\0';
+  if (inet_pton(AF_INET, s, &p->addr.addr4) == 1)
+    p->family = AF_INET, max = 32;
+  else if (inet_pton(AF_INET6, s, &p->addr.addr6) == 1)
+    p->family = AF_INET6, max = 128;
+  else
+    return 0;
+
+  p->prefix = max;
+  if (slash) {
+    char *end;
+    long len = strtol(slash + 1, &end, 10);
+    if (slash[1] == '\0' || *end != '\0' || len < 0 || len > max)
+      return 0;
+    p->prefix = len;
+  }
+  return 1;
+}
+
+int db_add_policy(char *arg)
+{
+  struct db_policy *p;
+  char *cats, *set;
+
+  if (!arg || !(cats = strchr(arg, ',')))
+    return 0;
+  *cats++ = '\0';
+  if ((set = strchr(cats, ',')))
+    *set++ = '\0';
+
+  if (!(p = calloc(1, sizeof(struct db_policy))) || !(p->text = strdup(arg))) {
+    free(p);
+    return 0;
+  }
+
+  if (strncmp(arg, "mac=", 4) == 0) {
+    p->type = POLICY_MAC;
+    if (!parse_mac(arg + 4, p->mac, p->mac_mask))
+      goto bad;
+  }
+  else if (strncmp(arg, "listen=", 7) == 0) {
+    p->type = POLICY_LISTEN;
+    p->family = AF_INET;
+    if (inet_pton(AF_INET, arg + 7, &p->addr.addr4) != 1)
+      goto bad;
+  }
+  else {
+    p->type = POLICY_SUBNET;
+    if (!parse_subnet(arg, p))
+      goto bad;
+  }
+
+  if (!parse_categories(cats, &p->categories))
+    goto bad;
+  if (set) {
+    char *end;
+    long id = strtol(set, &end, 10);
+    if (*set == '\0' || *end != '\0' || id < 0)
+      goto bad;
+    p->ip_set = id;
+  }
+
+  if (p->type == POLICY_MAC)
+    policy_mac = 1;
+  *policies_tail = p;
+  policies_tail = &p->next;
+  return 1;
+
+bad:
+  free(p->text);
+  free(p);
+  return 0;
+}
+
+/* Any MAC policy? edns0_needs_mac() then primes the ARP cache for TCP children */
+int db_policy_uses_mac(void)
+{
+  return policy_mac;
+}
+
+static struct db_policy *policy_find(union mysockaddr *client, struct in_addr local, time_t now)
+{
+  unsigned char mac[ETHER_ADDR_LEN];
+  int have_mac = -1;
+
+  for (struct db_policy *p = policies; p; p = p->next)
+    switch (p->type) {
+    case POLICY_SUBNET:
+      if (!client || client->sa.sa_family != p->family)
+        break;
+      if (p->family == AF_INET) {
+        struct in_addr mask;
+        mask.s_addr = p->prefix ? htonl(~0U << (32 - p->prefix)) : 0;
+        if (is_same_net(client->in.sin_addr, p->addr.addr4, mask))
+          return p;
+      }
+      else if (is_same_net6(&client->in6.sin6_addr, &p->addr.addr6, p->prefix))
+        return p;
+      break;
+
+    case POLICY_LISTEN:
+      if (local.s_addr == p->addr.addr4.s_addr)
+        return p;
+      break;
+
+    case POLICY_MAC:
+      /* one ARP cache lookup per query, and only if a MAC policy is reached */
+      if (have_mac == -1)
+        have_mac = client && find_mac(client, mac, 1, now) == ETHER_ADDR_LEN;
+      if (have_mac) {
+        int i;
+        for (i = 0; i < ETHER_ADDR_LEN; i++)
+          if ((mac[i] & p->mac_mask[i]) != p->mac[i])
+            break;
+        if (i == ETHER_ADDR_LEN)
+          return p;
+      }
+      break;
+    }
+
+  return NULL;
+}
+
+/* db_get_block_addrs() with the categories and IP set of this client */
+int db_policy_block_addrs(const char *name, union mysockaddr *client, struct in_addr local,
+                          time_t now, struct in_addr **ipv4, struct in6_addr **ipv6)
+{
+  struct db_policy *p;
+
+  if (!policies || !(p = policy_find(client, local, now)))
+    return db_get_block_addrs(name, DB_CATEGORY_ALL, 0, ipv4, ipv6);
+  return db_get_block_addrs(name, p->categories, p->ip_set, ipv4, ipv6);
+}
+
+/* Control socket: which policy a client address gets (listener policies never match) */
+int db_policy_explain(union mysockaddr *client, char *buf, size_t len)
+{
+  struct in_addr none;
+  struct db_policy *p;
+
+  none.s_addr = 0;
+  if (!(p = policy_find(client, none, dnsmasq_time())))
+    return snprintf(buf, len, "policy default categories all ip-set 0\n");
+  if (p->categories == DB_CATEGORY_ALL)
+    return snprintf(buf, len, "policy %s categories all ip-set %d\n", p->text, p->ip_set);
+  return snprintf(buf, len, "policy %s categories 0x%016llx ip-set %d\n",
+                  p->text, (unsigned long long)p->categories, p->ip_set);
+}
+
+#endif /* HAVE_SQLITE */
@@ -0,0 +1,293 @@
+/* DNSMASQ-SQLITE Asynchronous Query Log
+ *
+ * --sqlite-query-log=<file|unix:/path>[,<records>] records every query the
+ * SQLite check sees (timestamp, client, name, type, verdict, table) without
+ * formatting or I/O in the answer path. The main process is the only
+ * producer: it copies a fixed-size binary record into a preallocated ring
+ * and publishes it with one release store. A writer thread drains the ring,
+ * formats the records and appends them to the file (or sends one datagram
+ * per line to the UNIX socket).
+ *
+ * A full ring drops the record (metric sqlite_qlog_dropped) instead of
+ * blocking; records the writer cannot write count as sqlite_qlog_lost.
+ * TCP children have no writer and write their own lines directly, they are
+ * outside the main loop. The file is reopened on SIGUSR2 like log-facility.
+ *
+ * Line format:
+ *   1760000000.123456 192.168.1.10 ads.example.com A block wildcard
+ */
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_SQLITE
+#include <pthread.h>
+#include <sys/un.h>
+
+#define QLOG_DEFAULT_RECORDS 16384
+#define QLOG_MAX_RECORDS     (1 << 22)
+#define QLOG_NAME_MAX        256         /* longer names are truncated */
+#define QLOG_LINE_MAX        (QLOG_NAME_MAX + 128)
+#define QLOG_BATCH           65536
+#define QLOG_IDLE_NS         10000000    /* writer poll interval when idle */
+
+struct qlog_rec {
+  uint32_t sec, usec;
+  uint16_t qtype, port;
+  uint8_t family, verdict, table, namelen;
+  uint8_t addr[16];
+  char name[QLOG_NAME_MAX];
+};
+
+static char *qlog_path = NULL;
+static unsigned int qlog_size = QLOG_DEFAULT_RECORDS;
+static int qlog_fd = -1, qlog_sock = 0;
+static struct sockaddr_un qlog_sa;
+static struct qlog_rec *qlog_ring = NULL;
+static unsigned int qlog_mask;
+static pthread_t qlog_thread;
+static int qlog_running = 0, qlog_stop = 0;
+
+/* producer and consumer indices on separate cache lines */
+static struct { unsigned int v; char pad[60]; } qlog_head, qlog_tail;
+static unsigned int qlog_lost = 0;
+
+int db_set_query_log(char *arg)
+{
+  char *comma = strchr(arg, ',');
+
+  if (comma) {
+    char *end;
+    long n = strtol(comma + 1, &end, 10);
+    if (*end != '\0' || n < 16 || n > QLOG_MAX_RECORDS)
+      return 0;
+    *comma = '\0';
+    qlog_size = n;
+  }
+  /* power of two, so the index wraps with a mask */
+  while (qlog_size & (qlog_size - 1))
+    qlog_size &= qlog_size - 1;
+
+  free(qlog_path);
+  return (qlog_path = strdup(arg)) != NULL;
+}
+
+static int qlog_open(void)
+{
+  if (strncmp(qlog_path, "unix:", 5) == 0) {
+    memset(&qlog_sa, 0, sizeof(qlog_sa));
+    qlog_sa.sun_family = AF_UNIX;
+    if (strlen(qlog_path + 5) >= sizeof(qlog_sa.sun_path))
+      return -1;
+    strcpy(qlog_sa.sun_path, qlog_path + 5);
+    qlog_sock = 1;
+    /* not connected: the reader may start (or restart) later */
+    return socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  }
+
+  return open(qlog_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+}
+
+/* Called at startup, before privileges are dropped */
+void db_qlog_init(void)
+{
+  if (!qlog_path)
+    return;
+
+  if ((qlog_fd = qlog_open()) == -1)
+    die(_("cannot open query log %s: %s"), qlog_path, EC_FILE);
+  qlog_ring = safe_malloc(qlog_size * sizeof(struct qlog_rec));
+  qlog_mask = qlog_size - 1;
+}
+
+static const char *qlog_type(unsigned int t, char *buf)
+{
+  switch (t) {
+  case T_A: return "A";
+  case T_NS: return "NS";
+  case T_CNAME: return "CNAME";
+  case T_SOA: return "SOA";
+  case T_PTR: return "PTR";
+  case T_MX: return "MX";
+  case T_TXT: return "TXT";
+  case T_AAAA: return "AAAA";
+  case T_SRV: return "SRV";
+  case T_NAPTR: return "NAPTR";
+  case T_DS: return "DS";
+  case T_DNSKEY: return "DNSKEY";
+  case T_SVCB: return "SVCB";
+  case T_HTTPS: return "HTTPS";
+  case T_CAA: return "CAA";
+  case T_ANY: return "ANY";
+  }
+  sprintf(buf, "TYPE%u", t);
+  return buf;
+}
+
+static int qlog_format(const struct qlog_rec *r, char *buf)
+{
+  static const char *tables[] = { "-", "hosts", "wildcard" };
+  char addr[INET6_ADDRSTRLEN], type[16];
+
+  if (!r->family || !inet_ntop(r->family, r->addr, addr, sizeof(addr)))
+    strcpy(addr, "-");
+  return sprintf(buf, "%u.%06u %s %.*s %s %s %s\n", r->sec, r->usec, addr,
+                 r->namelen, r->name, qlog_type(r->qtype, type),
+                 r->verdict ? "block" : "pass", tables[r->table < 3 ? r->table : 0]);
+}
+
+static void qlog_send(const char *line, size_t len)
+{
+  if (sendto(qlog_fd, line, len, MSG_DONTWAIT, (struct sockaddr *)&qlog_sa, sizeof(qlog_sa)) != (ssize_t)len)
+    __atomic_add_fetch(&qlog_lost, 1, __ATOMIC_RELAXED);
+}
+
+static void qlog_write(const char *buf, size_t len)
+{
+  while (len) {
+    ssize_t n = write(qlog_fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      __atomic_add_fetch(&qlog_lost, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+static void *qlog_writer(void *arg)
+{
+  static char buf[QLOG_BATCH];
+  struct timespec idle = { 0, QLOG_IDLE_NS };
+
+  (void)arg;
+  for (;;) {
+    unsigned int t = qlog_tail.v;
+    unsigned int h = __atomic_load_n(&qlog_head.v, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    if (t == h) {
+      if (__atomic_load_n(&qlog_stop, __ATOMIC_ACQUIRE))
+        break;
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    for (; t != h && n < sizeof(buf) - QLOG_LINE_MAX; t++) {
+      int len = qlog_format(&qlog_ring[t & qlog_mask], buf + n);
+      /* one datagram per line */
+      if (qlog_sock)
+        qlog_send(buf + n, len);
+      else
+        n += len;
+    }
+    /* the records are copied out, hand the slots back before the I/O */
+    __atomic_store_n(&qlog_tail.v, t, __ATOMIC_RELEASE);
+    if (n)
+      qlog_write(buf, n);
+  }
+
+  return NULL;
+}
+
+/* Called once the daemon has forked and dropped privileges */
+void db_qlog_start(void)
+{
+  int err;
+
+  if (!qlog_ring || qlog_running)
+    return;
+  if ((err = pthread_create(&qlog_thread, NULL, qlog_writer, NULL)) != 0) {
+    my_syslog(LOG_ERR, "SQLite: Cannot start query log writer: %s", strerror(err));
+    return;
+  }
+  qlog_running = 1;
+  my_syslog(LOG_INFO, "SQLite: Query log %s (%u records)", qlog_path, qlog_size);
+}
+
+/* Flush what is queued and stop the writer (SIGTERM) */
+void db_qlog_stop(void)
+{
+  if (!qlog_running)
+    return;
+  __atomic_store_n(&qlog_stop, 1, __ATOMIC_RELEASE);
+  pthread_join(qlog_thread, NULL);
+  qlog_running = 0;
+}
+
+void db_qlog_reopen(void)
+{
+  int fd;
+
+  if (qlog_fd == -1 || qlog_sock)
+    return;
+  /* dup2() swaps the file under the writer atomically */
+  if ((fd = qlog_open()) == -1)
+    my_syslog(LOG_ERR, "SQLite: Cannot reopen query log %s: %s", qlog_path, strerror(errno));
+  else {
+    dup2(fd, qlog_fd);
+    fcntl(qlog_fd, F_SETFD, FD_CLOEXEC);
+    close(fd);
+  }
+}
+
+/* Hot path: fill the next slot and publish it, nothing else */
+void db_qlog_record(const char *name, int qtype, union mysockaddr *client, int verdict)
+{
+  struct qlog_rec *r, local;
+  struct timeval tv;
+  unsigned int h = 0;
+  size_t len;
+
+  if (!qlog_ring)
+    return;
+
+  if (daemon->pipe_to_parent != -1)
+    r = &local;
+  else {
+    h = qlog_head.v;
+    if (h - __atomic_load_n(&qlog_tail.v, __ATOMIC_ACQUIRE) > qlog_mask) {
+      daemon->metrics[METRIC_SQLITE_QLOG_DROPPED]++;
+      return;
+    }
+    r = &qlog_ring[h & qlog_mask];
+  }
+
+  gettimeofday(&tv, NULL);
+  r->sec = tv.tv_sec;
+  r->usec = tv.tv_usec;
+  r->qtype = qtype;
+  r->verdict = verdict != 0;
+  r->table = verdict;
+  r->family = 0;
+  if (client && client->sa.sa_family == AF_INET) {
+    r->family = AF_INET;
+    r->port = ntohs(client->in.sin_port);
+    memcpy(r->addr, &client->in.sin_addr, INADDRSZ);
+  }
+  else if (client && client->sa.sa_family == AF_INET6) {
+    r->family = AF_INET6;
+    r->port = ntohs(client->in6.sin6_port);
+    memcpy(r->addr, &client->in6.sin6_addr, IN6ADDRSZ);
+  }
+  len = strnlen(name, QLOG_NAME_MAX - 1);
+  r->namelen = len;
+  memcpy(r->name, name, len);
+
+  if (r == &local) {
+    /* TCP child: no writer thread here, write the line ourselves */
+    char line[QLOG_LINE_MAX];
+    int n = qlog_format(r, line);
+    if (qlog_sock)
+      qlog_send(line, n);
+    else
+      qlog_write(line, n);
+    return;
+  }
+
+  __atomic_store_n(&qlog_head.v, h + 1, __ATOMIC_RELEASE);
+  daemon->metrics[METRIC_SQLITE_QLOG_LOST] = __atomic_load_n(&qlog_lost, __ATOMIC_RELAXED);
+}
+
+#endif /* HAVE_SQLITE */
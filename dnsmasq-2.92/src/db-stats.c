@@ -0,0 +1,281 @@
+/* DNSMASQ-SQLITE Entry Hit Statistics
+ *
+ * --sqlite-stats=<file>[,<seconds>] counts how often each block_hosts and
+ * block_wildcard entry actually blocked, keyed by the matched entry (the
+ * hostname, or the base domain for wildcard entries). The base database
+ * stays read-only: counters live in RAM and every <seconds> (default 60)
+ * a forked child adds them to a separate SQLite file in one transaction of
+ * upserts:
+ *
+ *   entry_stats(TableName, Domain, Hits, FirstHit, LastHit)
+ *
+ * The main process counts without locks. At flush time it forks, the child
+ * writes its copy of the counters and exits, and the parent clears them
+ * and counts on. SQLite never runs on a thread of this forking process. A
+ * table that fills up early is flushed at once; hits that find no free
+ * slot while a writer still runs count as sqlite_stats_dropped, a writer
+ * that fails as sqlite_stats_errors. TCP children are not counted.
+ *
+ * Dead entries: ATTACH the stats file and select the base rows without a
+ * matching entry_stats row (see light/README.md).
+ */
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+
+#define STATS_SLOTS            65536         /* distinct entries, power of two */
+#define STATS_ARENA            (4 << 20)     /* key bytes */
+#define STATS_FLUSH_LOAD       (STATS_SLOTS / 2)
+#define STATS_DEFAULT_INTERVAL 60
+
+#define STATS_SCHEMA_SQL \
+  "CREATE TABLE IF NOT EXISTS entry_stats (" \
+  "TableName TEXT NOT NULL, Domain TEXT NOT NULL, Hits INTEGER NOT NULL DEFAULT 0, " \
+  "FirstHit INTEGER, LastHit INTEGER, PRIMARY KEY (TableName, Domain)) WITHOUT ROWID"
+
+#define STATS_UPSERT_SQL \
+  "INSERT INTO entry_stats (TableName, Domain, Hits, FirstHit, LastHit) VALUES (?, ?, ?, ?, ?) " \
+  "ON CONFLICT (TableName, Domain) DO UPDATE SET Hits = Hits + excluded.Hits, " \
+  "LastHit = max(LastHit, excluded.LastHit)"
+
+struct stats_slot {
+  uint32_t hash;
+  uint32_t key;          /* arena offset + 1, 0 = free */
+  uint32_t hits;
+  uint32_t first, last;
+  uint32_t table;
+};
+
+struct stats_table {
+  struct stats_slot *slots;
+  char *arena;
+  size_t arena_used;
+  unsigned int used;
+};
+
+static char *stats_path = NULL;
+static unsigned int stats_interval = STATS_DEFAULT_INTERVAL;
+static struct stats_table stats_table, *stats_active = NULL;
+static time_t stats_now = 0, stats_next_flush = 0;
+static pid_t stats_pid = 0;
+
+int db_set_stats(char *arg)
+{
+  char *comma = strchr(arg, ',');
+
+  if (comma) {
+    char *end;
+    long n = strtol(comma + 1, &end, 10);
+    if (comma[1] == '\0' || *end != '\0' || n < 1 || n > 86400)
+      return 0;
+    *comma = '\0';
+    stats_interval = n;
+  }
+  if (!*arg)
+    return 0;
+
+  free(stats_path);
+  return (stats_path = strdup(arg)) != NULL;
+}
+
+static const char *stats_table_name(int table)
+{
+  return table == DB_TABLE_HOSTS ? "block_hosts" : "block_wildcard";
+}
+
+static sqlite3 *stats_open(void)
+{
+  sqlite3 *db = NULL;
+
+  if (sqlite3_open_v2(stats_path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK ||
+      sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_exec(db, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_exec(db, STATS_SCHEMA_SQL, NULL, NULL, NULL) != SQLITE_OK) {
+    my_syslog(LOG_ERR, "SQLite: Cannot open stats database %s: %s", stats_path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_busy_timeout(db, 5000);
+  return db;
+}
+
+/* Add the counters to the stats file. Runs in the writer child, and in
+   the main process only on the way out. */
+static int stats_write(struct stats_table *t)
+{
+  sqlite3 *db;
+  sqlite3_stmt *upsert = NULL;
+  int ok;
+
+  if (!(db = stats_open()))
+    return 0;
+
+  ok = sqlite3_prepare_v2(db, STATS_UPSERT_SQL, -1, &upsert, NULL) == SQLITE_OK &&
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK;
+
+  for (unsigned int i = 0; ok && i < STATS_SLOTS; i++) {
+    struct stats_slot *s = &t->slots[i];
+
+    if (!s->key)
+      continue;
+    sqlite3_bind_text(upsert, 1, stats_table_name(s->table), -1, SQLITE_STATIC);
+    sqlite3_bind_text(upsert, 2, t->arena + s->key - 1, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(upsert, 3, s->hits);
+    sqlite3_bind_int64(upsert, 4, s->first);
+    sqlite3_bind_int64(upsert, 5, s->last);
+    ok = sqlite3_step(upsert) == SQLITE_DONE;
+    sqlite3_reset(upsert);
+  }
+
+  if (ok)
+    ok = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
+  if (!ok) {
+    my_syslog(LOG_ERR, "SQLite: Cannot write stats to %s: %s", stats_path, sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+  }
+
+  sqlite3_finalize(upsert);
+  sqlite3_close(db);
+  return ok;
+}
+
+static void stats_clear(struct stats_table *t)
+{
+  memset(t->slots, 0, STATS_SLOTS * sizeof(struct stats_slot));
+  t->arena_used = 0;
+  t->used = 0;
+}
+
+/* Called once the daemon has forked and dropped privileges, so the stats
+   file and its journal belong to the user dnsmasq runs as */
+void db_stats_start(void)
+{
+  sqlite3 *db;
+
+  if (!stats_path || stats_active)
+    return;
+
+  /* create the schema now so a bad path shows at startup */
+  if (!(db = stats_open()))
+    return;
+  sqlite3_close(db);
+
+  stats_table.slots = safe_malloc(STATS_SLOTS * sizeof(struct stats_slot));
+  stats_table.arena = safe_malloc(STATS_ARENA);
+  stats_clear(&stats_table);
+
+  stats_now = time(NULL);
+  stats_next_flush = stats_now + stats_interval;
+  stats_active = &stats_table;
+  my_syslog(LOG_INFO, "SQLite: Entry hit statistics in %s (every %u s)", stats_path, stats_interval);
+}
+
+/* Write what is counted (SIGTERM). A writer still running finishes first
+   so its rows are not counted twice or lost. */
+void db_stats_stop(void)
+{
+  if (!stats_active)
+    return;
+
+  if (stats_pid != 0) {
+    int status;
+    while (waitpid(stats_pid, &status, 0) == -1 && errno == EINTR)
+      ;
+    stats_pid = 0;
+  }
+  if (stats_active->used)
+    stats_write(stats_active);
+  stats_active = NULL;
+}
+
+/* Anything counted that is not written yet? The main loop then wakes up
+   once a second so an idle daemon still flushes. */
+int db_stats_pending(void)
+{
+  return stats_active && stats_active->used;
+}
+
+/* Main loop: fork a writer for the counters when they are due */
+void db_stats_poll(void)
+{
+  pid_t pid;
+
+  if (!stats_active)
+    return;
+
+  /* wall clock for FirstHit/LastHit, read once per loop instead of per hit */
+  stats_now = time(NULL);
+
+  if (!stats_active->used || stats_pid != 0 ||
+      (stats_now < stats_next_flush && stats_active->used < STATS_FLUSH_LOAD &&
+       stats_active->arena_used < STATS_ARENA / 2))
+    return;
+
+  if ((pid = fork()) == -1) {
+    my_syslog(LOG_WARNING, "SQLite: Cannot fork stats writer: %s", strerror(errno));
+    stats_next_flush = stats_now + stats_interval;
+    return;
+  }
+
+  if (pid == 0)
+    _exit(stats_write(stats_active) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  /* the child has its own copy; whatever it fails to write is lost */
+  stats_pid = pid;
+  stats_clear(stats_active);
+  stats_next_flush = stats_now + stats_interval;
+}
+
+/* Called for every child reaped by the main loop */
+int db_stats_reaped(pid_t pid, int status)
+{
+  if (stats_pid == 0 || pid != stats_pid)
+    return 0;
+
+  stats_pid = 0;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    daemon->metrics[METRIC_SQLITE_STATS_ERRORS]++;
+  return 1;
+}
+
+/* Hot path, from block_lookup(): one hash probe, no I/O */
+void db_stats_hit(int table, const char *key)
+{
+  struct stats_table *t = stats_active;
+  uint32_t h = 2166136261u ^ table;
+  size_t len;
+  unsigned int i;
+
+  if (!t || daemon->pipe_to_parent != -1)
+    return;
+
+  for (len = 0; key[len]; len++)
+    h = (h ^ (unsigned char)key[len]) * 16777619u;
+
+  for (i = h & (STATS_SLOTS - 1); t->slots[i].key; i = (i + 1) & (STATS_SLOTS - 1)) {
+    struct stats_slot *s = &t->slots[i];
+    if (s->hash == h && s->table == (uint32_t)table && strcmp(t->arena + s->key - 1, key) == 0) {
+      s->hits++;
+      s->last = stats_now;
+      return;
+    }
+  }
+
+  /* new entry; the table is swapped out long before the probe chains get long */
+  if (t->used >= STATS_SLOTS - STATS_SLOTS / 8 || t->arena_used + len + 1 > STATS_ARENA) {
+    daemon->metrics[METRIC_SQLITE_STATS_DROPPED]++;
+    return;
+  }
+  memcpy(t->arena + t->arena_used, key, len + 1);
+  t->slots[i].key = t->arena_used + 1;
+  t->slots[i].hash = h;
+  t->slots[i].table = table;
+  t->slots[i].hits = 1;
+  t->slots[i].first = t->slots[i].last = stats_now;
+  t->arena_used += len + 1;
+  t->used++;
+}
+
+#endif /* HAVE_SQLITE */
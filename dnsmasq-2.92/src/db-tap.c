@@ -0,0 +1,391 @@
+/* DNSMASQ-SQLITE Binary Query/Response Log
+ *
+ * --sqlite-tap=<file>[,size=<MB>][,interval=<seconds>][,buffer=<KB>] writes
+ * every client query and response, every upstream exchange and every block
+ * verdict as a binary frame carrying the DNS message as it went over the
+ * wire. The packets are taken from the hooks of dump.c (dump_packet_udp()
+ * is called at each of them whether or not --dumpfile is set) plus the TCP
+ * client path in tcp_request(); verdicts come from answer_request().
+ *
+ * The main process copies the frame into a preallocated byte ring and
+ * publishes it with one release store. A writer thread hands whatever is
+ * queued to writev() straight from the ring (whole frames, at most two
+ * segments at the wrap point) and rotates the file when it exceeds <size>
+ * or is older than <interval>: <file> is renamed to <file>.YYYYMMDD-HHMMSS
+ * (UTC) and a new <file> is started. SIGUSR2 forces a rotation. A full ring
+ * drops the frame (metric sqlite_tap_dropped); write and rotation failures
+ * count as sqlite_tap_errors. TCP children append their frames themselves
+ * with one writev() each, O_APPEND keeps them whole.
+ *
+ * File layout, all integers big-endian. A file starts with a 16 byte header:
+ *
+ *   0  magic    "DSQLTAP1"
+ *   8  u32      version (1)
+ *  12  u32      creation time, seconds since the epoch
+ *
+ * followed by frames with a 36 byte header:
+ *
+ *   0  u32      frame length, excluding this field
+ *   4  u8       type: 1 client query, 2 client response, 3 upstream query,
+ *               4 upstream response, 5 block verdict
+ *   5  u8       peer family: 4, 6 or 0 (unknown)
+ *   6  u8       transport: 17 UDP, 6 TCP
+ *   7  u8       verdict table: 1 block_hosts, 2 block_wildcard (type 5)
+ *   8  u32      seconds   12  u32  microseconds
+ *  16  u16      peer port (client or upstream server)
+ *  18  u16      query type (type 5, otherwise 0)
+ *  20  u8[16]   peer address, IPv4 in the first 4 bytes
+ *  36  payload  DNS message; the query name in text form for type 5
+ *
+ * tools/tap-decode prints the frames.
+ */
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_SQLITE
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define TAP_MAGIC          "DSQLTAP1"
+#define TAP_VERSION        1
+#define TAP_FILE_HDR       16
+#define TAP_FRAME_HDR      36
+#define TAP_DEFAULT_BUFFER (4 << 20)
+#define TAP_MIN_BUFFER     (128 << 10)
+#define TAP_MAX_BUFFER     (1 << 30)
+#define TAP_IDLE_NS        10000000      /* writer poll interval when idle */
+#define TAP_RETRY          60            /* seconds after a failed rotation */
+
+#define TAP_CLIENT_QUERY    1
+#define TAP_CLIENT_RESPONSE 2
+#define TAP_UPSTREAM_QUERY  3
+#define TAP_UPSTREAM_REPLY  4
+#define TAP_VERDICT         5
+
+static char *tap_path = NULL;
+static unsigned long long tap_max_size = 0;
+static unsigned int tap_interval = 0;
+static unsigned int tap_size = TAP_DEFAULT_BUFFER;
+static int tap_fd = -1;
+static unsigned char *tap_ring = NULL;
+static unsigned int tap_mask;
+static pthread_t tap_thread;
+static int tap_running = 0, tap_stop = 0, tap_force = 0;
+
+/* producer and consumer byte offsets on separate cache lines */
+static struct { unsigned int v; char pad[60]; } tap_head, tap_tail;
+static unsigned int tap_errors = 0;
+
+/* owned by the writer thread once it runs */
+static unsigned long long tap_bytes;
+static time_t tap_opened, tap_retry;
+
+int db_set_tap(char *arg)
+{
+  char *opt, *save = NULL;
+  char *path = strtok_r(arg, ",", &save);
+
+  if (!path || !*path)
+    return 0;
+
+  while ((opt = strtok_r(NULL, ",", &save))) {
+    char *end, *val = strchr(opt, '=');
+    unsigned long n;
+
+    if (!val || !val[1])
+      return 0;
+    *val++ = '\0';
+    n = strtoul(val, &end, 10);
+    if (*end != '\0')
+      return 0;
+
+    if (strcmp(opt, "size") == 0 && n > 0)
+      tap_max_size = (unsigned long long)n << 20;
+    else if (strcmp(opt, "interval") == 0 && n > 0)
+      tap_interval = n;
+    else if (strcmp(opt, "buffer") == 0 && n >= (TAP_MIN_BUFFER >> 10) && n <= (TAP_MAX_BUFFER >> 10))
+      tap_size = n << 10;
+    else
+      return 0;
+  }
+  /* power of two, so offsets wrap with a mask */
+  while (tap_size & (tap_size - 1))
+    tap_size &= tap_size - 1;
+
+  free(tap_path);
+  return (tap_path = strdup(path)) != NULL;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+  p[0] = v >> 8; p[1] = v;
+}
+
+/* Open <file> and write the file header if it is new */
+static int tap_open(time_t now)
+{
+  unsigned char hdr[TAP_FILE_HDR];
+  struct stat st;
+  int fd = open(tap_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+
+  tap_bytes = st.st_size;
+  tap_opened = now;
+  if (st.st_size == 0) {
+    memcpy(hdr, TAP_MAGIC, 8);
+    put32(hdr + 8, TAP_VERSION);
+    put32(hdr + 12, now);
+    if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+      close(fd);
+      return -1;
+    }
+    tap_bytes = sizeof(hdr);
+  }
+  return fd;
+}
+
+/* Called at startup, before privileges are dropped */
+void db_tap_init(void)
+{
+  if (!tap_path)
+    return;
+
+  if ((tap_fd = tap_open(time(NULL))) == -1)
+    die(_("cannot open binary log %s: %s"), tap_path, EC_FILE);
+  tap_ring = safe_malloc(tap_size);
+  tap_mask = tap_size - 1;
+}
+
+/* Writer thread: move <file> aside and continue in a new one. The fd number
+   stays the same (dup2), so TCP children forked later get the new file. */
+static void tap_rotate(time_t now)
+{
+  char name[PATH_MAX];
+  struct tm tm;
+  size_t n;
+  int fd;
+
+  gmtime_r(&now, &tm);
+  n = snprintf(name, sizeof(name), "%s.", tap_path);
+  if (n >= sizeof(name) - 32 || strftime(name + n, sizeof(name) - n, "%Y%m%d-%H%M%S", &tm) == 0) {
+    __atomic_add_fetch(&tap_errors, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  /* several rotations within one second */
+  n = strlen(name);
+  for (int i = 1; access(name, F_OK) == 0 && i < 1000; i++)
+    snprintf(name + n, sizeof(name) - n, "-%d", i);
+
+  /* the directory must be writable by the user dnsmasq runs as */
+  if (rename(tap_path, name) == -1 || (fd = tap_open(now)) == -1) {
+    __atomic_add_fetch(&tap_errors, 1, __ATOMIC_RELAXED);
+    tap_retry = now + TAP_RETRY;   /* keep appending, do not retry every batch */
+    return;
+  }
+  dup2(fd, tap_fd);
+  fcntl(tap_fd, F_SETFD, FD_CLOEXEC);
+  close(fd);
+}
+
+static void tap_writev(struct iovec *iov, int cnt)
+{
+  while (cnt) {
+    ssize_t n = writev(tap_fd, iov, cnt);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      __atomic_add_fetch(&tap_errors, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    tap_bytes += n;
+    for (; cnt && (size_t)n >= iov->iov_len; iov++, cnt--)
+      n -= iov->iov_len;
+    if (cnt) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+static void *tap_writer(void *arg)
+{
+  struct timespec idle = { 0, TAP_IDLE_NS };
+
+  (void)arg;
+  for (;;) {
+    unsigned int t = tap_tail.v;
+    unsigned int h = __atomic_load_n(&tap_head.v, __ATOMIC_ACQUIRE);
+    time_t now = time(NULL);
+
+    /* a file holding only its header is not worth a rotation */
+    if (__atomic_exchange_n(&tap_force, 0, __ATOMIC_ACQ_REL) ||
+        (now >= tap_retry &&
+         ((tap_max_size && tap_bytes >= tap_max_size) ||
+          (tap_interval && tap_bytes > TAP_FILE_HDR && now - tap_opened >= (time_t)tap_interval))))
+      tap_rotate(now);
+
+    if (t == h) {
+      if (__atomic_load_n(&tap_stop, __ATOMIC_ACQUIRE))
+        break;
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    /* everything queued in one call, from the ring itself */
+    {
+      unsigned int len = h - t, off = t & tap_mask;
+      unsigned int first = len < tap_size - off ? len : tap_size - off;
+      struct iovec iov[2];
+
+      iov[0].iov_base = tap_ring + off;
+      iov[0].iov_len = first;
+      iov[1].iov_base = tap_ring;
+      iov[1].iov_len = len - first;
+      tap_writev(iov, len > first ? 2 : 1);
+    }
+    __atomic_store_n(&tap_tail.v, h, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+/* Called once the daemon has forked and dropped privileges */
+void db_tap_start(void)
+{
+  int err;
+
+  if (!tap_ring || tap_running)
+    return;
+  if ((err = pthread_create(&tap_thread, NULL, tap_writer, NULL)) != 0) {
+    my_syslog(LOG_ERR, "SQLite: Cannot start binary log writer: %s", strerror(err));
+    return;
+  }
+  tap_running = 1;
+  my_syslog(LOG_INFO, "SQLite: Binary log %s (%u KB buffer, rotate at %llu MB / %u s)",
+            tap_path, tap_size >> 10, tap_max_size >> 20, tap_interval);
+}
+
+/* Flush what is queued and stop the writer (SIGTERM) */
+void db_tap_stop(void)
+{
+  if (!tap_running)
+    return;
+  __atomic_store_n(&tap_stop, 1, __ATOMIC_RELEASE);
+  pthread_join(tap_thread, NULL);
+  tap_running = 0;
+}
+
+/* SIGUSR2: start a new file */
+void db_tap_rotate(void)
+{
+  if (tap_running)
+    __atomic_store_n(&tap_force, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_put(unsigned int off, const void *data, size_t len)
+{
+  unsigned int o = off & tap_mask;
+  size_t first = len < tap_size - o ? len : tap_size - o;
+
+  memcpy(tap_ring + o, data, first);
+  memcpy(tap_ring, (const unsigned char *)data + first, len - first);
+}
+
+/* Hot path: frame header plus payload into the ring, then publish */
+static void tap_frame(int type, int tcp, int table, int qtype, union mysockaddr *peer,
+                      const void *payload, size_t len)
+{
+  unsigned char hdr[TAP_FRAME_HDR];
+  struct timeval tv;
+  unsigned int h;
+
+  if (len > 65535)
+    len = 65535;
+
+  memset(hdr, 0, sizeof(hdr));
+  gettimeofday(&tv, NULL);
+  put32(hdr, TAP_FRAME_HDR - 4 + len);
+  hdr[4] = type;
+  hdr[6] = tcp ? IPPROTO_TCP : IPPROTO_UDP;
+  hdr[7] = table;
+  put32(hdr + 8, tv.tv_sec);
+  put32(hdr + 12, tv.tv_usec);
+  put16(hdr + 18, qtype);
+  if (peer && peer->sa.sa_family == AF_INET) {
+    hdr[5] = 4;
+    put16(hdr + 16, ntohs(peer->in.sin_port));
+    memcpy(hdr + 20, &peer->in.sin_addr, INADDRSZ);
+  }
+  else if (peer && peer->sa.sa_family == AF_INET6) {
+    hdr[5] = 6;
+    put16(hdr + 16, ntohs(peer->in6.sin6_port));
+    memcpy(hdr + 20, &peer->in6.sin6_addr, IN6ADDRSZ);
+  }
+
+  if (daemon->pipe_to_parent != -1) {
+    /* TCP child: no writer thread here, append the frame ourselves */
+    struct iovec iov[2];
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    if (writev(tap_fd, iov, 2) != (ssize_t)(sizeof(hdr) + len))
+      __atomic_add_fetch(&tap_errors, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  h = tap_head.v;
+  if (tap_size - (h - __atomic_load_n(&tap_tail.v, __ATOMIC_ACQUIRE)) < sizeof(hdr) + len) {
+    daemon->metrics[METRIC_SQLITE_TAP_DROPPED]++;
+    return;
+  }
+  ring_put(h, hdr, sizeof(hdr));
+  ring_put(h + sizeof(hdr), payload, len);
+  __atomic_store_n(&tap_head.v, h + sizeof(hdr) + len, __ATOMIC_RELEASE);
+  daemon->metrics[METRIC_SQLITE_TAP_ERRORS] = __atomic_load_n(&tap_errors, __ATOMIC_RELAXED);
+}
+
+/* From dump_packet_udp() and tcp_request(); mask is a DUMP_* value. The
+   peer is the side that is not us: the source of what we receive, the
+   destination of what we send. */
+void db_tap_packet(int mask, void *packet, size_t len,
+                   union mysockaddr *src, union mysockaddr *dst, int tcp)
+{
+  int type;
+
+  if (tap_fd == -1)
+    return;
+
+  if (mask & DUMP_QUERY)
+    type = TAP_CLIENT_QUERY;
+  else if (mask & DUMP_REPLY)
+    type = TAP_CLIENT_RESPONSE;
+  else if (mask & (DUMP_UP_QUERY | DUMP_SEC_QUERY))
+    type = TAP_UPSTREAM_QUERY;
+  else if (mask & (DUMP_UP_REPLY | DUMP_SEC_REPLY))
+    type = TAP_UPSTREAM_REPLY;
+  else
+    return;   /* DUMP_BOGUS: the reply was already logged on arrival */
+
+  tap_frame(type, tcp, 0, 0, src ? src : dst, packet, len);
+}
+
+void db_tap_verdict(const char *name, int qtype, union mysockaddr *client, int verdict)
+{
+  if (tap_fd == -1 || !verdict)
+    return;
+  tap_frame(TAP_VERDICT, daemon->pipe_to_parent != -1, verdict, qtype, client, name, strlen(name));
+}
+
+#endif /* HAVE_SQLITE */
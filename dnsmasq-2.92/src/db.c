@@ -6,12 +6,20 @@
  *   block_hosts    - Exact hostname match only
  *   block_ips      - IP address rewriting (Source_IP → Target_IP)
  *                    Supports CIDR notation (192.168.0.0/16 → Target_IP)
+ *   allow_exact    - Exception for exactly this hostname (optional)
+ *   allow_wildcard - Exception for a domain and its subdomains (optional)
+ *   ip_sets        - Answer addresses by ID (optional)
+ *
+ * block_hosts / block_wildcard may carry a Category (0-63) and an IPSet
+ * (ip_sets ID) column; client policies (db-policy.c) enable categories per
+ * subnet, MAC or listener.
  *
  * Performance Features:
- *   - CIDR rules loaded into RAM at startup
- *   - 2nd-level TLD aware (co.uk, com.au handled correctly)
+ *   - CIDR rules and allowlist loaded into RAM at startup
+ *   - Public Suffix List aware (co.uk, *.ck, !www.ck, any depth)
  *   - IPv6 normalization (compressed ↔ expanded matching)
  *   - Aggressive SQLite settings for 128GB RAM
+ *   - Runtime overlay consulted before the base tables (see db-delta.c)
  */
 
 #include "dnsmasq.h"
@@ -38,11 +46,19 @@ static char *block_txt = NULL;
 static char *block_mx = NULL;
 static int block_mx_prio = 10;
 
+/* Exception tables are optional; created when the overlay writes to them */
+#define ALLOW_SCHEMA_SQL \
+  "CREATE TABLE IF NOT EXISTS allow_wildcard (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID;" \
+  "CREATE TABLE IF NOT EXISTS allow_exact (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID;"
+
 /* Prepared statements */
 static sqlite3_stmt *stmt_block_hosts = NULL;
 static sqlite3_stmt *stmt_block_wildcard = NULL;
 static sqlite3_stmt *stmt_block_ips = NULL;
 
+/* Set while db_warm_block() looks up a name: no metrics, no hit stats */
+static int lookup_quiet = 0;
+
 /* ============================================================================
  * CIDR Rules in RAM (loaded at startup, no DB queries needed)
  * ============================================================================ */
@@ -102,6 +118,27 @@ static int parse_cidr(const char *cidr, struct in_addr *addr4, struct in6_addr *
   return prefix_len;
 }
 
+/* Add one CIDR rule in front of the list (newest rule wins) */
+static int cidr_add(const char *cidr, const char *target)
+{
+  cidr_rule_t *rule = malloc(sizeof(cidr_rule_t));
+  if (!rule) return 0;
+
+  rule->prefix_len = parse_cidr(cidr, &rule->net4, &rule->net6, &rule->is_ipv6);
+  if (rule->prefix_len < 0) {
+    free(rule);
+    return 0;
+  }
+
+  strncpy(rule->target, target, sizeof(rule->target) - 1);
+  rule->target[sizeof(rule->target) - 1] = '\0';
+
+  rule->next = cidr_rules;
+  cidr_rules = rule;
+  cidr_count++;
+  return 1;
+}
+
 /* Load all CIDR rules into RAM */
 static void cidr_load(void)
 {
@@ -119,22 +156,7 @@ static void cidr_load(void)
     const char *target = (const char *)sqlite3_column_text(stmt, 1);
 
     if (!cidr || !target) continue;
-
-    cidr_rule_t *rule = malloc(sizeof(cidr_rule_t));
-    if (!rule) continue;
-
-    rule->prefix_len = parse_cidr(cidr, &rule->net4, &rule->net6, &rule->is_ipv6);
-    if (rule->prefix_len < 0) {
-      free(rule);
-      continue;
-    }
-
-    strncpy(rule->target, target, sizeof(rule->target) - 1);
-    rule->target[sizeof(rule->target) - 1] = '\0';
-
-    rule->next = cidr_rules;
-    cidr_rules = rule;
-    cidr_count++;
+    cidr_add(cidr, target);
   }
 
   sqlite3_finalize(stmt);
@@ -182,7 +204,7 @@ static inline int ipv6_in_cidr(const struct in6_addr *addr, const struct in6_add
 }
 
 /* Find matching CIDR rule in RAM */
-static const char *cidr_find_match(const struct in_addr *addr4, const struct in6_addr *addr6, int is_ipv6)
+static cidr_rule_t *cidr_find_rule(const struct in_addr *addr4, const struct in6_addr *addr6, int is_ipv6)
 {
   for (cidr_rule_t *r = cidr_rules; r; r = r->next) {
     if (r->is_ipv6 != is_ipv6) continue;
@@ -192,149 +214,794 @@ static const char *cidr_find_match(const struct in_addr *addr4, const struct in6
       ipv4_in_cidr(addr4, &r->net4, r->prefix_len);
 
     if (match)
-      return r->target;
+      return r;
   }
   return NULL;
 }
 
+static const char *cidr_find_match(const struct in_addr *addr4, const struct in6_addr *addr6, int is_ipv6)
+{
+  cidr_rule_t *r = cidr_find_rule(addr4, addr6, is_ipv6);
+  return r ? r->target : NULL;
+}
+
+/* Remove every rule for the same network/prefix */
+static void cidr_remove(const char *cidr)
+{
+  struct in_addr net4;
+  struct in6_addr net6;
+  int is_ipv6;
+  int prefix_len = parse_cidr(cidr, &net4, &net6, &is_ipv6);
+
+  if (prefix_len < 0) return;
+
+  for (cidr_rule_t **up = &cidr_rules, *r = *up; r; r = *up) {
+    if (r->is_ipv6 == is_ipv6 && r->prefix_len == prefix_len &&
+        (is_ipv6 ? ipv6_in_cidr(&r->net6, &net6, prefix_len)
+                 : ipv4_in_cidr(&r->net4, &net4, prefix_len))) {
+      *up = r->next;
+      free(r);
+      cidr_count--;
+    } else {
+      up = &r->next;
+    }
+  }
+}
+
 /* ============================================================================
- * 2nd-Level TLD Hash Set
+ * Domain Helpers
  * ============================================================================ */
 
-#define TLD2_HASH_SIZE 16384
-
-typedef struct tld2_entry {
-  char *tld;
-  struct tld2_entry *next;
-} tld2_entry_t;
+static inline void str_tolower(char *s)
+{
+  for (; *s; s++) *s = tolower((unsigned char)*s);
+}
 
-static tld2_entry_t *tld2_hash[TLD2_HASH_SIZE];
-static int tld2_loaded = 0;
+/* ============================================================================
+ * Public Suffix List (reversed-label trie, built once at load)
+ * ============================================================================
+ * Reads publicsuffix.org's public_suffix_list.dat as well as the plain
+ * 2ndlevel.txt (one suffix per line): "co.uk", wildcards "*.ck", exceptions
+ * "!www.ck", any depth, "//" and "#" comments. Each node of the trie is one
+ * label of a rule, counted from the right (uk -> co). Nodes live in one
+ * array with a shared label pool; the edges parent -> child are kept in a
+ * single open-addressing table keyed by (parent, label), so a lookup is one
+ * right-to-left scan over the name with one probe per label.
+ */
 
-static unsigned int tld2_hash_func(const char *s)
+#define PSL_RULE   1            /* the suffix itself is a rule */
+#define PSL_WILD   2            /* "*.<suffix>" */
+#define PSL_EXCEPT 4            /* "!<suffix>" */
+
+typedef struct {
+  uint32_t label;               /* offset into psl_labels */
+  uint8_t len;
+  uint8_t flags;
+} psl_node_t;
+
+typedef struct {
+  uint32_t hash;                /* psl_edge_hash(), for cheap mismatches */
+  uint32_t parent;
+  uint32_t child;               /* 0 = empty slot (the root is no child) */
+} psl_edge_t;
+
+static psl_node_t *psl_nodes = NULL;    /* [0] is the root */
+static psl_edge_t *psl_edges = NULL;
+static char *psl_labels = NULL;
+static uint32_t psl_edge_mask = 0;
+static int psl_node_count = 0;
+static int psl_loaded = 0;
+
+static inline uint32_t psl_edge_hash(uint32_t parent, const char *s, size_t len)
 {
-  unsigned int hash = 5381;
-  while (*s)
-    hash = ((hash << 5) + hash) ^ (unsigned char)(*s++);
-  return hash & (TLD2_HASH_SIZE - 1);
+  uint32_t h = 2166136261u ^ (parent * 0x9e3779b1u);
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
 }
 
-static int tld2_is_2nd_level(const char *tld)
+static inline uint32_t psl_child(uint32_t parent, const char *s, size_t len)
 {
-  if (!tld2_loaded) return 0;
-  unsigned int h = tld2_hash_func(tld);
-  for (tld2_entry_t *e = tld2_hash[h]; e; e = e->next)
-    if (strcmp(e->tld, tld) == 0) return 1;
+  uint32_t h = psl_edge_hash(parent, s, len);
+
+  for (uint32_t i = h & psl_edge_mask; psl_edges[i].child; i = (i + 1) & psl_edge_mask) {
+    const psl_edge_t *e = &psl_edges[i];
+    const psl_node_t *c = &psl_nodes[e->child];
+    if (e->hash == h && e->parent == parent && c->len == len &&
+        memcmp(psl_labels + c->label, s, len) == 0)
+      return e->child;
+  }
   return 0;
 }
 
-static void tld2_add(const char *tld)
+/* One rule line -> flags; the rule (without "!" / "*.") is left in line */
+static int psl_parse_rule(char *line, char **rule, size_t *len)
 {
-  unsigned int h = tld2_hash_func(tld);
-  for (tld2_entry_t *e = tld2_hash[h]; e; e = e->next)
-    if (strcmp(e->tld, tld) == 0) return;
+  int flags = PSL_RULE;
+  char *p = line, *end;
+
+  while (*p == ' ' || *p == '\t') p++;
+  for (end = p; *end && !isspace((unsigned char)*end); end++);
+  *end = '\0';
+  if (*p == '\0' || *p == '#' || (p[0] == '/' && p[1] == '/')) return 0;
+
+  if (*p == '!') { flags = PSL_EXCEPT; p++; }
+  else if (p[0] == '*' && p[1] == '.') { flags = PSL_WILD; p += 2; }
+  *len = strlen(p);
+  if (*len > 0 && p[*len - 1] == '.') p[--(*len)] = '\0';
+  if (*len == 0 || *len > MAXDNAME || strchr(p, '*')) return 0;
+  str_tolower(p);
+  *rule = p;
+  return flags;
+}
 
-  tld2_entry_t *e = malloc(sizeof(tld2_entry_t));
-  if (!e) return;
-  e->tld = strdup(tld);
-  if (!e->tld) { free(e); return; }
-  e->next = tld2_hash[h];
-  tld2_hash[h] = e;
+/* Add one rule, creating the missing nodes from the right; 0 if full */
+static int psl_insert(const char *rule, size_t len, int flags, int max_nodes, uint32_t *pool)
+{
+  uint32_t node = 0;
+  const char *end = rule + len;
+
+  while (end > rule) {
+    const char *s = end;
+    while (s > rule && s[-1] != '.') s--;
+    size_t l = end - s;
+    if (l == 0 || l > 63) return 1;
+
+    uint32_t c = psl_child(node, s, l);
+    if (!c) {
+      uint32_t h = psl_edge_hash(node, s, l), i;
+      if (psl_node_count >= max_nodes) return 0;
+      c = psl_node_count++;
+      psl_nodes[c].label = *pool;
+      psl_nodes[c].len = l;
+      memcpy(psl_labels + *pool, s, l);
+      *pool += l;
+      for (i = h & psl_edge_mask; psl_edges[i].child; i = (i + 1) & psl_edge_mask);
+      psl_edges[i].hash = h;
+      psl_edges[i].parent = node;
+      psl_edges[i].child = c;
+    }
+    node = c;
+    end = s > rule ? s - 1 : rule;
+  }
+  psl_nodes[node].flags |= flags;
+  return 1;
 }
 
-static void tld2_load(const char *path)
+static void psl_cleanup(void)
+{
+  free(psl_nodes);
+  free(psl_edges);
+  free(psl_labels);
+  psl_nodes = NULL;
+  psl_edges = NULL;
+  psl_labels = NULL;
+  psl_node_count = 0;
+  psl_loaded = 0;
+}
+
+static void psl_load(const char *path)
 {
   FILE *f = fopen(path, "r");
   if (!f) {
-    my_syslog(LOG_WARNING, "SQLite: Cannot open TLD2 list: %s", path);
+    my_syslog(LOG_WARNING, "SQLite: Cannot open public suffix list: %s", path);
     return;
   }
 
-  char line[256];
-  int count = 0;
+  /* size everything from the file: at most one node per label */
+  char line[512], *rule;
+  size_t len, labels = 0, bytes = 0;
+  int count = 0, flags;
 
-  while (fgets(line, sizeof(line), f)) {
-    char *p = line;
-    while (*p && *p != '\n' && *p != '\r' && *p != ' ' && *p != '\t') p++;
-    *p = '\0';
-    if (line[0] == '\0' || line[0] == '#') continue;
-    for (p = line; *p; p++) *p = tolower((unsigned char)*p);
-    tld2_add(line);
-    count++;
+  while (fgets(line, sizeof(line), f))
+    if (psl_parse_rule(line, &rule, &len)) {
+      bytes += len;
+      for (labels++; *rule; rule++)
+        if (*rule == '.') labels++;
+    }
+
+  uint32_t slots = 64;
+  while (slots < 2 * labels) slots <<= 1;
+  psl_edge_mask = slots - 1;
+  psl_nodes = calloc(labels + 1, sizeof(psl_node_t));
+  psl_edges = calloc(slots, sizeof(psl_edge_t));
+  psl_labels = malloc(bytes + 1);
+  psl_node_count = 1;
+  if (!psl_nodes || !psl_edges || !psl_labels) {
+    my_syslog(LOG_ERR, "SQLite: Memory allocation failed for public suffix list");
+    fclose(f);
+    psl_cleanup();
+    return;
   }
 
+  uint32_t pool = 0;
+  rewind(f);
+  while (fgets(line, sizeof(line), f))
+    if ((flags = psl_parse_rule(line, &rule, &len)) &&
+        psl_insert(rule, len, flags, labels + 1, &pool))
+      count++;
   fclose(f);
-  tld2_loaded = 1;
-  my_syslog(LOG_INFO, "SQLite: Loaded %d 2nd-level TLDs", count);
+
+  psl_loaded = 1;
+  my_syslog(LOG_INFO, "SQLite: Loaded %d public suffix rules (%d trie nodes)", count, psl_node_count - 1);
 }
 
-static void tld2_cleanup(void)
+/* Registrable domain (public suffix plus one label) of a lowercase name;
+ * the name itself if it is a public suffix. Without a list every TLD is a
+ * public suffix (the implicit "*" rule). */
+static const char *get_base_domain(const char *name)
 {
-  for (int i = 0; i < TLD2_HASH_SIZE; i++) {
-    tld2_entry_t *e = tld2_hash[i];
-    while (e) {
-      tld2_entry_t *next = e->next;
-      free(e->tld);
-      free(e);
-      e = next;
+  const char *suffix = NULL;
+  const char *end = name + strlen(name);
+  uint32_t node = 0;
+
+  while (end > name) {
+    const char *s = end;
+    while (s > name && s[-1] != '.') s--;
+
+    uint32_t child = psl_loaded ? psl_child(node, s, end - s) : 0;
+    int flags = child ? psl_nodes[child].flags : 0;
+    if ((flags & PSL_EXCEPT) && suffix) {
+      /* "!city.kawasaki.jp": the public suffix is kawasaki.jp */
+      suffix = end + 1;
+      break;
     }
-    tld2_hash[i] = NULL;
+    if (!suffix || (psl_nodes[node].flags & PSL_WILD) || (flags & PSL_RULE))
+      suffix = s;
+    if (!child || s == name)
+      break;
+    node = child;
+    end = s - 1;
   }
-  tld2_loaded = 0;
+
+  if (!suffix || suffix == name) return name;
+  for (suffix--; suffix > name && suffix[-1] != '.'; suffix--);
+  return suffix;
 }
 
 /* ============================================================================
- * Domain Helpers
+ * IPv6 Normalization
  * ============================================================================ */
 
-static inline void str_tolower(char *s)
+static void ipv6_normalize(const char *input, char *output, size_t outlen)
 {
-  for (; *s; s++) *s = tolower((unsigned char)*s);
+  struct in6_addr addr;
+  if (inet_pton(AF_INET6, input, &addr) != 1) {
+    strncpy(output, input, outlen - 1);
+    output[outlen - 1] = '\0';
+    return;
+  }
+  snprintf(output, outlen,
+           "%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x",
+           addr.s6_addr[0], addr.s6_addr[1], addr.s6_addr[2], addr.s6_addr[3],
+           addr.s6_addr[4], addr.s6_addr[5], addr.s6_addr[6], addr.s6_addr[7],
+           addr.s6_addr[8], addr.s6_addr[9], addr.s6_addr[10], addr.s6_addr[11],
+           addr.s6_addr[12], addr.s6_addr[13], addr.s6_addr[14], addr.s6_addr[15]);
 }
 
-static const char *get_base_domain(const char *name)
+/* ============================================================================
+ * Runtime Overlay (changes applied without touching the base DB)
+ * ============================================================================
+ * Entries shadow the base tables: ADD blocks/rewrites, DEL hides a base row.
+ * They are consulted before SQLite; an empty overlay costs one branch per
+ * lookup. Every change gets a new generation number; entries are written to
+ * the base by db_overlay_persist() and then dropped with db_overlay_fold()
+ * up to the generation that was current when the write started. CIDR entries are also applied to the RAM
+ * CIDR list directly, since that list is never reread from the base.
+ */
+
+#define OVERLAY_HASH_SIZE 65536
+
+typedef struct overlay_entry {
+  struct overlay_entry *next;
+  unsigned int gen;
+  unsigned char table;
+  unsigned char op;
+  char *target;                 /* DB_TABLE_IPS only, points into key[] */
+  char key[];
+} overlay_entry_t;
+
+static void allow_add(int table, const char *name);
+static void allow_remove(int table, const char *name);
+
+static overlay_entry_t **overlay_hash = NULL;
+static int overlay_count = 0;
+static unsigned int overlay_gen = 0;
+
+static unsigned int overlay_hash_func(int table, const char *s)
 {
-  const char *dots[4] = {NULL, NULL, NULL, NULL};
-  int dot_count = 0;
+  unsigned int hash = 5381 + table;
+  while (*s)
+    hash = ((hash << 5) + hash) ^ (unsigned char)(*s++);
+  return hash & (OVERLAY_HASH_SIZE - 1);
+}
+
+static overlay_entry_t *overlay_find(int table, const char *key)
+{
+  unsigned int h = overlay_hash_func(table, key);
+  for (overlay_entry_t *e = overlay_hash[h]; e; e = e->next)
+    if (e->table == table && strcmp(e->key, key) == 0) return e;
+  return NULL;
+}
 
-  for (const char *p = name; *p; p++) {
-    if (*p == '.') {
-      dots[3] = dots[2]; dots[2] = dots[1]; dots[1] = dots[0]; dots[0] = p;
-      dot_count++;
+static void overlay_unlink(int table, const char *key)
+{
+  unsigned int h = overlay_hash_func(table, key);
+  for (overlay_entry_t **up = &overlay_hash[h], *e = *up; e; up = &e->next, e = *up)
+    if (e->table == table && strcmp(e->key, key) == 0) {
+      *up = e->next;
+      free(e);
+      overlay_count--;
+      return;
     }
+}
+
+/* Lowercase, drop a trailing dot; plain IPs are stored in inet_ntop() form,
+ * which is what db_rewrite_ipv4/6() look up. */
+static int overlay_key(int table, const char *in, char *out, size_t outlen)
+{
+  size_t len = strlen(in);
+
+  if (len == 0 || len >= outlen) return 0;
+  memcpy(out, in, len + 1);
+  str_tolower(out);
+  if (table != DB_TABLE_IPS) {
+    if (out[len - 1] == '.') out[--len] = '\0';
+    if (len == 0 || strpbrk(out, " \t/")) return 0;
+    return 1;
   }
 
-  if (dot_count <= 1) return name;
+  if (strchr(out, '/')) {
+    struct in_addr a4;
+    struct in6_addr a6;
+    int is_ipv6;
+    return parse_cidr(out, &a4, &a6, &is_ipv6) >= 0;
+  } else {
+    unsigned char addr[sizeof(struct in6_addr)];
+    int af = strchr(out, ':') ? AF_INET6 : AF_INET;
+    return inet_pton(af, out, addr) == 1 && inet_ntop(af, addr, out, outlen) != NULL;
+  }
+}
+
+int db_overlay_apply(int table, int op, const char *key, const char *target)
+{
+  char norm[256];
+  unsigned char addr[sizeof(struct in6_addr)];
+
+  if (table < DB_TABLE_WILDCARD || table > DB_TABLE_ALLOW_EXACT) return 0;
+  if (op != DB_OVERLAY_ADD && op != DB_OVERLAY_DEL) return 0;
+  if (!key || !overlay_key(table, key, norm, sizeof(norm))) return 0;
+  if (table == DB_TABLE_IPS && op == DB_OVERLAY_ADD &&
+      (!target || (inet_pton(AF_INET, target, addr) != 1 && inet_pton(AF_INET6, target, addr) != 1)))
+    return 0;
+
+  if (!overlay_hash) {
+    overlay_hash = calloc(OVERLAY_HASH_SIZE, sizeof(overlay_entry_t *));
+    if (!overlay_hash) {
+      my_syslog(LOG_ERR, "SQLite: Memory allocation failed for overlay");
+      return 0;
+    }
+  }
+
+  size_t klen = strlen(norm) + 1;
+  size_t tlen = (table == DB_TABLE_IPS && op == DB_OVERLAY_ADD) ? strlen(target) + 1 : 0;
+  overlay_entry_t *e = malloc(sizeof(overlay_entry_t) + klen + tlen);
+  if (!e) return 0;
+
+  overlay_unlink(table, norm);
+
+  memcpy(e->key, norm, klen);
+  e->target = tlen ? e->key + klen : NULL;
+  if (tlen) memcpy(e->target, target, tlen);
+  e->gen = ++overlay_gen;
+  e->table = table;
+  e->op = op;
+
+  unsigned int h = overlay_hash_func(table, norm);
+  e->next = overlay_hash[h];
+  overlay_hash[h] = e;
+  overlay_count++;
+
+  if (table == DB_TABLE_IPS && strchr(norm, '/')) {
+    cidr_remove(norm);
+    if (op == DB_OVERLAY_ADD) cidr_add(norm, target);
+  }
+
+  return 1;
+}
+
+/* Drop entries that are now part of the base (generation <= gen). The
+ * allowlist is only read at startup, so folded allow entries move into it. */
+void db_overlay_fold(unsigned int gen)
+{
+  if (!overlay_hash) return;
+
+  for (int i = 0; i < OVERLAY_HASH_SIZE; i++)
+    for (overlay_entry_t **up = &overlay_hash[i], *e = *up; e; e = *up)
+      if (e->gen <= gen) {
+        if (e->table == DB_TABLE_ALLOW_WILDCARD || e->table == DB_TABLE_ALLOW_EXACT) {
+          if (e->op == DB_OVERLAY_ADD) allow_add(e->table, e->key);
+          else allow_remove(e->table, e->key);
+        }
+        *up = e->next;
+        free(e);
+        overlay_count--;
+      } else {
+        up = &e->next;
+      }
+}
+
+int db_overlay_size(void)
+{
+  return overlay_count;
+}
+
+unsigned int db_overlay_generation(void)
+{
+  return overlay_gen;
+}
+
+static void overlay_cleanup(void)
+{
+  db_overlay_fold(~0u);
+  free(overlay_hash);
+  overlay_hash = NULL;
+}
+
+/* Version of the base as seen by a fresh read on conn; changes whenever
+ * another connection or process commits to it. */
+static int data_version(sqlite3 *conn)
+{
+  sqlite3_stmt *stmt;
+  int v = -1;
+
+  if (sqlite3_prepare_v2(conn, "PRAGMA data_version", -1, &stmt, NULL) != SQLITE_OK)
+    return -1;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    v = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return v;
+}
+
+static void unlink_db(const char *path)
+{
+  static const char *sfx[] = { "", "-journal", "-wal", "-shm" };
+  char name[PATH_MAX];
+
+  for (int i = 0; i < 4; i++)
+    if (snprintf(name, sizeof(name), "%s%s", path, sfx[i]) < (int)sizeof(name))
+      unlink(name);
+}
+
+/* Fold the overlay into a new base: copy the served file to
+ * <db_file>.compact with the backup API, write all overlay entries and
+ * delta_seq (when non-zero) into the copy in one transaction, then rename
+ * it over db_file. The served file is never written, so lookups in the
+ * parent do not see a locked database; they switch to the new file with
+ * db_reopen() once this child has exited. If something else commits to
+ * the base in the meantime the copy is dropped and compaction retried.
+ * Called from a forked child. Returns 1 on success. */
+int db_overlay_persist(unsigned int delta_seq)
+{
+  static const char *sql[5][2] = {
+    { "INSERT OR IGNORE INTO block_wildcard (Domain) VALUES (?)",
+      "DELETE FROM block_wildcard WHERE Domain = ?" },
+    { "INSERT OR IGNORE INTO block_hosts (Domain) VALUES (?)",
+      "DELETE FROM block_hosts WHERE Domain = ?" },
+    { "INSERT OR REPLACE INTO block_ips (Source_IP, Target_IP) VALUES (?, ?)",
+      "DELETE FROM block_ips WHERE Source_IP = ?" },
+    { "INSERT OR IGNORE INTO allow_wildcard (Domain) VALUES (?)",
+      "DELETE FROM allow_wildcard WHERE Domain = ?" },
+    { "INSERT OR IGNORE INTO allow_exact (Domain) VALUES (?)",
+      "DELETE FROM allow_exact WHERE Domain = ?" }
+  };
+  sqlite3_stmt *stmt[5][2] = { { NULL } };
+  sqlite3 *src = NULL, *rw = NULL;
+  sqlite3_backup *backup;
+  char tmp[PATH_MAX], name[PATH_MAX];
+  struct stat st;
+  int ok = 0, rows = 0, version;
+
+  if (!db_file || stat(db_file, &st) != 0) return 0;
+  if (snprintf(tmp, sizeof(tmp), "%s.compact", db_file) >= (int)sizeof(tmp)) return 0;
+  unlink_db(tmp);
+
+  if (sqlite3_open_v2(db_file, &src, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+      sqlite3_open_v2(tmp, &rw, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+    my_syslog(LOG_ERR, "SQLite: Cannot open %s for compaction: %s", tmp,
+              sqlite3_errmsg(rw ? rw : src));
+    goto out;
+  }
+  sqlite3_busy_timeout(src, 10000);
+  version = data_version(src);
+
+  if (!(backup = sqlite3_backup_init(rw, "main", src, "main"))) {
+    my_syslog(LOG_ERR, "SQLite: Cannot copy %s: %s", db_file, sqlite3_errmsg(rw));
+    goto out;
+  }
+  sqlite3_backup_step(backup, -1);
+  if (sqlite3_backup_finish(backup) != SQLITE_OK) {
+    my_syslog(LOG_ERR, "SQLite: Copying %s failed: %s", db_file, sqlite3_errmsg(rw));
+    goto out;
+  }
 
-  if (dots[1]) {
-    const char *last2 = dots[1] + 1;
-    if (tld2_is_2nd_level(last2)) {
-      if (dots[2]) return dots[2] + 1;
-      return name;
+  if (sqlite3_exec(rw, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK)
+    goto fail;
+
+  /* the allow tables are optional in older databases */
+  if (sqlite3_exec(rw, ALLOW_SCHEMA_SQL, NULL, NULL, NULL) != SQLITE_OK)
+    goto fail;
+
+  for (int t = 0; t < 5; t++)
+    for (int o = 0; o < 2; o++)
+      if (sqlite3_prepare_v2(rw, sql[t][o], -1, &stmt[t][o], NULL) != SQLITE_OK)
+        goto fail;
+
+  for (int i = 0; overlay_hash && i < OVERLAY_HASH_SIZE; i++)
+    for (overlay_entry_t *e = overlay_hash[i]; e; e = e->next) {
+      sqlite3_stmt *st = stmt[e->table][e->op == DB_OVERLAY_DEL];
+      sqlite3_reset(st);
+      sqlite3_bind_text(st, 1, e->key, -1, SQLITE_STATIC);
+      if (e->target) sqlite3_bind_text(st, 2, e->target, -1, SQLITE_STATIC);
+      if (sqlite3_step(st) != SQLITE_DONE) goto fail;
+
+      /* base rows may hold the expanded IPv6 form, see ipv6_normalize() */
+      if (e->table == DB_TABLE_IPS && e->op == DB_OVERLAY_DEL && strchr(e->key, ':') && !strchr(e->key, '/')) {
+        char expanded[48];
+        ipv6_normalize(e->key, expanded, sizeof(expanded));
+        sqlite3_reset(st);
+        sqlite3_bind_text(st, 1, expanded, -1, SQLITE_STATIC);
+        if (sqlite3_step(st) != SQLITE_DONE) goto fail;
+      }
+      rows++;
     }
+
+  if (delta_seq != 0) {
+    char sql_meta[256];
+    snprintf(sql_meta, sizeof(sql_meta),
+             "CREATE TABLE IF NOT EXISTS db_metadata (key TEXT PRIMARY KEY, value TEXT) WITHOUT ROWID;"
+             "INSERT OR REPLACE INTO db_metadata (key, value) VALUES ('delta_seq', '%u')", delta_seq);
+    if (sqlite3_exec(rw, sql_meta, NULL, NULL, NULL) != SQLITE_OK) goto fail;
+  }
+
+  if (sqlite3_exec(rw, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    goto fail;
+
+  for (int t = 0; t < 5; t++)
+    for (int o = 0; o < 2; o++)
+      if (stmt[t][o]) { sqlite3_finalize(stmt[t][o]); stmt[t][o] = NULL; }
+
+  /* closing the last connection checkpoints and removes the copy's WAL */
+  if (sqlite3_close(rw) != SQLITE_OK)
+    goto fail;
+  rw = NULL;
+
+  if (data_version(src) != version) {
+    my_syslog(LOG_WARNING, "SQLite: %s changed during compaction, not replacing it", db_file);
+    goto out;
   }
 
-  return dots[1] ? dots[1] + 1 : name;
+  chmod(tmp, st.st_mode & 07777);
+  if (rename(tmp, db_file) != 0) {
+    my_syslog(LOG_ERR, "SQLite: Cannot rename %s to %s: %s", tmp, db_file, strerror(errno));
+    goto out;
+  }
+
+  /* The served file's WAL and shm belong to the old inode. Open handles keep
+   * using them, but a new connection must not find them next to the new base. */
+  snprintf(name, sizeof(name), "%s-wal", db_file);
+  unlink(name);
+  snprintf(name, sizeof(name), "%s-shm", db_file);
+  unlink(name);
+  ok = 1;
+  goto out;
+
+fail:
+  my_syslog(LOG_ERR, "SQLite: Writing overlay to %s failed: %s", tmp, sqlite3_errmsg(rw));
+  sqlite3_exec(rw, "ROLLBACK", NULL, NULL, NULL);
+out:
+  for (int t = 0; t < 5; t++)
+    for (int o = 0; o < 2; o++)
+      if (stmt[t][o]) sqlite3_finalize(stmt[t][o]);
+  sqlite3_close(rw);
+  sqlite3_close(src);
+  if (!ok)
+    unlink_db(tmp);
+  else
+    my_syslog(LOG_INFO, "SQLite: Wrote %d overlay entries into a new %s", rows, db_file);
+  return ok;
 }
 
 /* ============================================================================
- * IPv6 Normalization
- * ============================================================================ */
+ * Allowlist in RAM (loaded at startup, no DB queries needed)
+ * ============================================================================
+ * allow_exact / allow_wildcard hold exceptions that override the block
+ * tables at query time, so a whitelist no longer has to delete rows from
+ * them. Whitelists are small, so both tables are kept in one hash set and
+ * only consulted once a block table has matched.
+ */
 
-static void ipv6_normalize(const char *input, char *output, size_t outlen)
+#define ALLOW_HASH_SIZE 16384
+
+typedef struct allow_entry {
+  struct allow_entry *next;
+  unsigned char table;
+  char name[];
+} allow_entry_t;
+
+static allow_entry_t *allow_hash[ALLOW_HASH_SIZE];
+static int allow_count = 0;
+
+static unsigned int allow_hash_func(int table, const char *s)
 {
-  struct in6_addr addr;
-  if (inet_pton(AF_INET6, input, &addr) != 1) {
-    strncpy(output, input, outlen - 1);
-    output[outlen - 1] = '\0';
+  unsigned int hash = 5381 + table;
+  while (*s)
+    hash = ((hash << 5) + hash) ^ (unsigned char)(*s++);
+  return hash & (ALLOW_HASH_SIZE - 1);
+}
+
+static void allow_add(int table, const char *name)
+{
+  char norm[256];
+  size_t len = strlen(name);
+
+  if (len == 0 || len >= sizeof(norm)) return;
+  memcpy(norm, name, len + 1);
+  str_tolower(norm);
+  if (len > 1 && norm[len - 1] == '.') norm[--len] = '\0';
+
+  unsigned int h = allow_hash_func(table, norm);
+  for (allow_entry_t *e = allow_hash[h]; e; e = e->next)
+    if (e->table == table && strcmp(e->name, norm) == 0) return;
+
+  allow_entry_t *e = malloc(sizeof(allow_entry_t) + len + 1);
+  if (!e) return;
+  e->table = table;
+  memcpy(e->name, norm, len + 1);
+  e->next = allow_hash[h];
+  allow_hash[h] = e;
+  allow_count++;
+}
+
+static void allow_remove(int table, const char *name)
+{
+  unsigned int h = allow_hash_func(table, name);
+  for (allow_entry_t **up = &allow_hash[h], *e = *up; e; up = &e->next, e = *up)
+    if (e->table == table && strcmp(e->name, name) == 0) {
+      *up = e->next;
+      free(e);
+      allow_count--;
+      return;
+    }
+}
+
+/* Overlay entries shadow the loaded rows, as for the block tables */
+static int allow_hit(int table, const char *name)
+{
+  overlay_entry_t *o;
+
+  if (overlay_count && (o = overlay_find(table, name)))
+    return o->op == DB_OVERLAY_ADD;
+  for (allow_entry_t *e = allow_hash[allow_hash_func(table, name)]; e; e = e->next)
+    if (e->table == table && strcmp(e->name, name) == 0) return 1;
+  return 0;
+}
+
+static void allow_load(void)
+{
+  static const char *sql[2] = { "SELECT Domain FROM allow_wildcard", "SELECT Domain FROM allow_exact" };
+  sqlite3_stmt *stmt;
+
+  for (int t = 0; t < 2; t++) {
+    /* optional tables; missing in databases created before they existed */
+    if (sqlite3_prepare_v2(db, sql[t], -1, &stmt, NULL) != SQLITE_OK) continue;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      const char *name = (const char *)sqlite3_column_text(stmt, 0);
+      if (name && *name) allow_add(DB_TABLE_ALLOW_WILDCARD + t, name);
+    }
+    sqlite3_finalize(stmt);
+  }
+}
+
+static void allow_cleanup(void)
+{
+  for (int i = 0; i < ALLOW_HASH_SIZE; i++) {
+    allow_entry_t *e = allow_hash[i];
+    while (e) {
+      allow_entry_t *next = e->next;
+      free(e);
+      e = next;
+    }
+    allow_hash[i] = NULL;
+  }
+  allow_count = 0;
+}
+
+/* Is a match in the block tables overridden by a more specific (or equally
+ * specific) exception? Walks the labels from the full name up to the level
+ * of the matching block entry; at each level an exception beats the block. */
+static int allow_overrides(const char *name, const char *matched)
+{
+  if (!allow_count && !overlay_count) return 0;
+
+  if (allow_hit(DB_TABLE_ALLOW_EXACT, name)) return 1;
+  for (const char *s = name; s; s = strchr(s, '.') ? strchr(s, '.') + 1 : NULL) {
+    if (allow_hit(DB_TABLE_ALLOW_WILDCARD, s)) return 1;
+    if (s == matched) break;
+  }
+  return 0;
+}
+
+/* ============================================================================
+ * IP Sets in RAM (loaded at startup, no DB queries needed)
+ * ============================================================================
+ * ip_sets (ID, IPv4, IPv6) holds the answer addresses for blocked names.
+ * Block entries (IPSet column) and client policies refer to a set by ID, so
+ * the rows carry a small integer instead of repeating address strings. IDs
+ * are small and dense: the sets live pre-parsed in an array indexed by ID,
+ * next to the global sqlite-block-ipv4/6 pair.
+ */
+
+#define IP_SET_MAX_ID 65535
+#define IP_SET_V4     1
+#define IP_SET_V6     2
+
+typedef struct ip_set {
+  struct in_addr ipv4;
+  struct in6_addr ipv6;
+  unsigned char flags;
+} ip_set_t;
+
+static ip_set_t ip_set_global;
+static ip_set_t *ip_sets = NULL;
+static int ip_set_size = 0;
+static int ip_set_count = 0;
+
+static void ip_set_parse(ip_set_t *set, const char *v4, const char *v6)
+{
+  set->flags = 0;
+  if (v4 && inet_pton(AF_INET, v4, &set->ipv4) == 1) set->flags |= IP_SET_V4;
+  if (v6 && inet_pton(AF_INET6, v6, &set->ipv6) == 1) set->flags |= IP_SET_V6;
+}
+
+static void ip_set_load(void)
+{
+  sqlite3_stmt *stmt;
+
+  ip_set_parse(&ip_set_global, block_ipv4, block_ipv6);
+
+  /* optional table, as for the allowlist */
+  if (sqlite3_prepare_v2(db, "SELECT ID, IPv4, IPv6 FROM ip_sets ORDER BY ID DESC",
+                         -1, &stmt, NULL) != SQLITE_OK)
     return;
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    int id = sqlite3_column_int(stmt, 0);
+
+    if (id <= 0 || id > IP_SET_MAX_ID) continue;
+    /* highest ID first, so one allocation covers them all */
+    if (!ip_sets) {
+      if (!(ip_sets = calloc(id + 1, sizeof(ip_set_t)))) break;
+      ip_set_size = id + 1;
+    }
+    ip_set_parse(&ip_sets[id], (const char *)sqlite3_column_text(stmt, 1),
+                 (const char *)sqlite3_column_text(stmt, 2));
+    if (ip_sets[id].flags) ip_set_count++;
   }
-  snprintf(output, outlen,
-           "%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x",
-           addr.s6_addr[0], addr.s6_addr[1], addr.s6_addr[2], addr.s6_addr[3],
-           addr.s6_addr[4], addr.s6_addr[5], addr.s6_addr[6], addr.s6_addr[7],
-           addr.s6_addr[8], addr.s6_addr[9], addr.s6_addr[10], addr.s6_addr[11],
-           addr.s6_addr[12], addr.s6_addr[13], addr.s6_addr[14], addr.s6_addr[15]);
+  sqlite3_finalize(stmt);
+}
+
+static void ip_set_cleanup(void)
+{
+  free(ip_sets);
+  ip_sets = NULL;
+  ip_set_size = ip_set_count = 0;
+  memset(&ip_set_global, 0, sizeof(ip_set_global));
+}
+
+static inline const ip_set_t *ip_set_get(int id)
+{
+  return (id > 0 && id < ip_set_size && ip_sets[id].flags) ? &ip_sets[id] : NULL;
 }
 
 /* ============================================================================
@@ -430,34 +1097,55 @@ void db_set_block_mx(char *mx)
 char *db_get_block_txt(void) { return block_txt; }
 char *db_get_block_mx(void) { return block_mx; }
 int db_get_block_mx_prio(void) { return block_mx_prio; }
+char *db_get_file(void) { return db_file; }
 
-void db_init(void)
+/* Read a value from db_metadata (written by the importers); 0 if absent */
+int db_get_meta(const char *key, char *buf, size_t len)
 {
-  if (db) return;
-  if (db_init_attempted) return;
-  db_init_attempted = 1;
+  sqlite3_stmt *stmt;
+  int found = 0;
 
-  if (!db_file) {
-    char *env = getenv("DNSMASQ_SQLITE_DB");
-    if (env && *env) {
-      db_file = strdup(env);
-      if (!db_file) {
-        my_syslog(LOG_ERR, "SQLite: Memory allocation failed for db_file from environment");
-        return;
-      }
-    }
-    else return;
+  if (!db || len == 0) return 0;
+  if (sqlite3_prepare_v2(db, "SELECT value FROM db_metadata WHERE key = ?", -1, &stmt, NULL) != SQLITE_OK)
+    return 0;
+  sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+    strncpy(buf, (const char *)sqlite3_column_text(stmt, 0), len - 1);
+    buf[len - 1] = '\0';
+    found = 1;
   }
+  sqlite3_finalize(stmt);
+  return found;
+}
 
-  my_syslog(LOG_INFO, "SQLite: Opening %s", db_file);
+/* Category and IPSet columns are optional; a missing one reads as 0 */
+static sqlite3_stmt *prepare_block_stmt(const char *table)
+{
+  static const char *cols[] = { "Category, IPSet", "Category, 0", "0, IPSet", "0, 0" };
+  sqlite3_stmt *stmt;
+  char sql[128];
+
+  for (int i = 0; i < 4; i++) {
+    snprintf(sql, sizeof(sql), "SELECT %s FROM %s WHERE Domain = ? LIMIT 1", cols[i], table);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) return stmt;
+  }
+  my_syslog(LOG_WARNING, "SQLite: Failed to prepare %s statement: %s", table, sqlite3_errmsg(db));
+  return NULL;
+}
 
+/* Open db_file read-only and prepare the lookup statements */
+static int db_open(void)
+{
   if (sqlite3_open_v2(db_file, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
     my_syslog(LOG_ERR, "SQLite: Cannot open database: %s", sqlite3_errmsg(db));
     sqlite3_close(db);
     db = NULL;
-    return;
+    return 0;
   }
 
+  /* Never checkpoint on close: a replaced base may still have its WAL open */
+  sqlite3_db_config(db, SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE, 1, NULL);
+
   /* Performance settings - aggressive for 128GB RAM / 7GB+ DB */
   sqlite3_exec(db, "PRAGMA cache_size = -20971520", NULL, NULL, NULL);  /* 20GB cache */
   sqlite3_exec(db, "PRAGMA mmap_size = 21474836480", NULL, NULL, NULL); /* 20GB mmap */
@@ -465,27 +1153,90 @@ void db_init(void)
   sqlite3_exec(db, "PRAGMA query_only = ON", NULL, NULL, NULL);
 
   /* Prepare statements (with error handling) */
-  if (sqlite3_prepare_v2(db, "SELECT 1 FROM block_hosts WHERE Domain = ? LIMIT 1",
-                         -1, &stmt_block_hosts, NULL) != SQLITE_OK) {
-    my_syslog(LOG_WARNING, "SQLite: Failed to prepare block_hosts statement: %s", sqlite3_errmsg(db));
-    stmt_block_hosts = NULL;
-  }
-  if (sqlite3_prepare_v2(db, "SELECT 1 FROM block_wildcard WHERE Domain = ? LIMIT 1",
-                         -1, &stmt_block_wildcard, NULL) != SQLITE_OK) {
-    my_syslog(LOG_WARNING, "SQLite: Failed to prepare block_wildcard statement: %s", sqlite3_errmsg(db));
-    stmt_block_wildcard = NULL;
-  }
+  stmt_block_hosts = prepare_block_stmt("block_hosts");
+  stmt_block_wildcard = prepare_block_stmt("block_wildcard");
   if (sqlite3_prepare_v2(db, "SELECT Target_IP FROM block_ips WHERE Source_IP = ? LIMIT 1",
                          -1, &stmt_block_ips, NULL) != SQLITE_OK) {
     my_syslog(LOG_WARNING, "SQLite: Failed to prepare block_ips statement: %s", sqlite3_errmsg(db));
     stmt_block_ips = NULL;
   }
+  return 1;
+}
+
+static void db_close(void)
+{
+  if (stmt_block_hosts) { sqlite3_finalize(stmt_block_hosts); stmt_block_hosts = NULL; }
+  if (stmt_block_wildcard) { sqlite3_finalize(stmt_block_wildcard); stmt_block_wildcard = NULL; }
+  if (stmt_block_ips) { sqlite3_finalize(stmt_block_ips); stmt_block_ips = NULL; }
+  if (db) { sqlite3_close(db); db = NULL; }
+}
+
+/* Switch lookups to the file now at db_file, after compaction renamed a
+ * new base over it. The RAM tables (CIDR, allowlist, IP sets) already hold
+ * the folded state and are kept. On failure the old handle stays in use. */
+int db_reopen(void)
+{
+  sqlite3 *old_db = db;
+  sqlite3_stmt *old_hosts = stmt_block_hosts, *old_wildcard = stmt_block_wildcard, *old_ips = stmt_block_ips;
+
+  if (!old_db) return 0;
+
+  db = NULL;
+  if (!db_open()) {
+    db = old_db;
+    stmt_block_hosts = old_hosts;
+    stmt_block_wildcard = old_wildcard;
+    stmt_block_ips = old_ips;
+    return 0;
+  }
+
+  if (old_hosts) sqlite3_finalize(old_hosts);
+  if (old_wildcard) sqlite3_finalize(old_wildcard);
+  if (old_ips) sqlite3_finalize(old_ips);
+  sqlite3_close(old_db);
+  my_syslog(LOG_INFO, "SQLite: Reopened %s", db_file);
+  return 1;
+}
 
-  /* Load 2nd-level TLDs */
-  if (tld2_file) tld2_load(tld2_file);
+/* End the read transaction a lookup statement may still hold, so a forked
+ * child inherits no SQLite locks. */
+void db_release(void)
+{
+  if (stmt_block_hosts) sqlite3_reset(stmt_block_hosts);
+  if (stmt_block_wildcard) sqlite3_reset(stmt_block_wildcard);
+  if (stmt_block_ips) sqlite3_reset(stmt_block_ips);
+}
 
-  /* Load CIDR rules into RAM */
+void db_init(void)
+{
+  if (db) return;
+  if (db_init_attempted) return;
+  db_init_attempted = 1;
+
+  if (!db_file) {
+    char *env = getenv("DNSMASQ_SQLITE_DB");
+    if (env && *env) {
+      db_file = strdup(env);
+      if (!db_file) {
+        my_syslog(LOG_ERR, "SQLite: Memory allocation failed for db_file from environment");
+        return;
+      }
+    }
+    else return;
+  }
+
+  my_syslog(LOG_INFO, "SQLite: Opening %s", db_file);
+
+  if (!db_open())
+    return;
+
+  /* Load the public suffix list (sqlite-tld2-list) */
+  if (tld2_file) psl_load(tld2_file);
+
+  /* Load CIDR rules, allowlist and IP sets into RAM */
   cidr_load();
+  allow_load();
+  ip_set_load();
 
   /* Count entries */
   sqlite3_stmt *count_stmt;
@@ -504,17 +1255,13 @@ void db_init(void)
     sqlite3_finalize(count_stmt);
   }
 
-  my_syslog(LOG_INFO, "SQLite: Ready - hosts=%d, wildcard=%d, ips=%d, cidr=%d",
-            hosts_count, wildcard_count, ips_count, cidr_count);
+  my_syslog(LOG_INFO, "SQLite: Ready - hosts=%d, wildcard=%d, ips=%d, cidr=%d, allow=%d, ip_sets=%d",
+            hosts_count, wildcard_count, ips_count, cidr_count, allow_count, ip_set_count);
 }
 
 void db_cleanup(void)
 {
-  if (stmt_block_hosts) { sqlite3_finalize(stmt_block_hosts); stmt_block_hosts = NULL; }
-  if (stmt_block_wildcard) { sqlite3_finalize(stmt_block_wildcard); stmt_block_wildcard = NULL; }
-  if (stmt_block_ips) { sqlite3_finalize(stmt_block_ips); stmt_block_ips = NULL; }
-
-  if (db) { sqlite3_close(db); db = NULL; }
+  db_close();
   if (db_file) { free(db_file); db_file = NULL; }
   if (tld2_file) { free(tld2_file); tld2_file = NULL; }
   if (block_ipv4) { free(block_ipv4); block_ipv4 = NULL; }
@@ -523,7 +1270,10 @@ void db_cleanup(void)
   if (block_mx) { free(block_mx); block_mx = NULL; }
 
   cidr_cleanup();
-  tld2_cleanup();
+  overlay_cleanup();
+  allow_cleanup();
+  ip_set_cleanup();
+  psl_cleanup();
 
   my_syslog(LOG_INFO, "SQLite: Cleanup complete");
 }
@@ -532,7 +1282,43 @@ void db_cleanup(void)
  * Blocking Functions
  * ============================================================================ */
 
-int db_check_block(const char *name)
+/* One step of a lookup statement: 1 for a row, 0 for none. Anything else
+ * (SQLITE_BUSY, I/O errors) returns -1 and must not be taken as a miss,
+ * or a blocked name would resolve. Logged at most once a minute. */
+static int lookup_step(sqlite3_stmt *stmt)
+{
+  static time_t last_log = 0;
+  time_t now;
+  int rc = sqlite3_step(stmt);
+
+  if (rc == SQLITE_ROW) return 1;
+  if (rc == SQLITE_DONE) return 0;
+
+  daemon->metrics[METRIC_SQLITE_ERRORS]++;
+  now = time(NULL);
+  if (now - last_log >= 60) {
+    last_log = now;
+    my_syslog(LOG_ERR, "SQLite: Lookup failed: %s", sqlite3_errstr(rc));
+  }
+  sqlite3_reset(stmt);
+  return -1;
+}
+
+/* Category of the row the statement just stepped to: bit 0-63 of the
+ * verdict mask. NULL and out-of-range values fall into category 0. */
+static inline uint64_t row_category(sqlite3_stmt *stmt)
+{
+  sqlite3_int64 cat = sqlite3_column_int64(stmt, 0);
+  return 1ULL << ((cat >= 0 && cat < DB_CATEGORIES) ? cat : 0);
+}
+
+/* Block check restricted to the categories in enabled: an entry only
+ * blocks if its category bit is set, so per-client policy is one AND on
+ * the same lookups the global check does. Overlay blocks (control socket,
+ * deltas) carry no category and block in every one, without an IP set.
+ * *set gets the IPSet of the blocking entry.
+ * Returns 1 (hosts), 2 (wildcard), 0 or -1 if the base could not be read. */
+static int block_lookup(const char *name, uint64_t enabled, int *set)
 {
   if (!name || !*name) return 0;
 
@@ -545,34 +1331,120 @@ int db_check_block(const char *name)
   name_lower[sizeof(name_lower) - 1] = '\0';
   str_tolower(name_lower);
 
-  /* Check 1: Exact match in block_hosts */
-  if (stmt_block_hosts) {
+  /* Check 1: Exact match in block_hosts (overlay shadows the base) */
+  overlay_entry_t *e;
+  uint64_t hit = 0;
+  int rc;
+  *set = 0;
+  if (overlay_count && (e = overlay_find(DB_TABLE_HOSTS, name_lower))) {
+    if (!lookup_quiet)
+      daemon->metrics[METRIC_SQLITE_OVERLAY_HITS]++;
+    hit = e->op == DB_OVERLAY_ADD ? DB_CATEGORY_ALL : 0;
+  } else if (stmt_block_hosts) {
     sqlite3_reset(stmt_block_hosts);
     sqlite3_bind_text(stmt_block_hosts, 1, name_lower, -1, SQLITE_STATIC);
-    if (sqlite3_step(stmt_block_hosts) == SQLITE_ROW)
-      return 1;
+    if ((rc = lookup_step(stmt_block_hosts)) < 0)
+      return -1;
+    if (rc) {
+      hit = row_category(stmt_block_hosts);
+      *set = sqlite3_column_int(stmt_block_hosts, 1);
+    }
+  }
+  if (hit & enabled) {
+    if (allow_overrides(name_lower, name_lower)) goto allowed;
+    if (!lookup_quiet) {
+      daemon->metrics[METRIC_SQLITE_BLOCKED_HOSTS]++;
+      db_stats_hit(DB_TABLE_HOSTS, name_lower);
+    }
+    return 1;
   }
 
   /* Check 2: Base domain in block_wildcard */
-  if (stmt_block_wildcard) {
-    const char *base = get_base_domain(name_lower);
+  const char *base = get_base_domain(name_lower);
+  hit = 0;
+  *set = 0;
+  if (overlay_count && (e = overlay_find(DB_TABLE_WILDCARD, base))) {
+    if (!lookup_quiet)
+      daemon->metrics[METRIC_SQLITE_OVERLAY_HITS]++;
+    hit = e->op == DB_OVERLAY_ADD ? DB_CATEGORY_ALL : 0;
+  } else if (stmt_block_wildcard) {
     sqlite3_reset(stmt_block_wildcard);
     sqlite3_bind_text(stmt_block_wildcard, 1, base, -1, SQLITE_STATIC);
-    if (sqlite3_step(stmt_block_wildcard) == SQLITE_ROW)
-      return 2;
+    if ((rc = lookup_step(stmt_block_wildcard)) < 0)
+      return -1;
+    if (rc) {
+      hit = row_category(stmt_block_wildcard);
+      *set = sqlite3_column_int(stmt_block_wildcard, 1);
+    }
+  }
+  if (hit & enabled) {
+    if (allow_overrides(name_lower, base)) goto allowed;
+    if (!lookup_quiet) {
+      daemon->metrics[METRIC_SQLITE_BLOCKED_WILDCARD]++;
+      db_stats_hit(DB_TABLE_WILDCARD, base);
+    }
+    return 2;
   }
 
   return 0;
+
+allowed:
+  if (!lookup_quiet)
+    daemon->metrics[METRIC_SQLITE_ALLOWED]++;
+  return 0;
+}
+
+/* Cache warm-up (forward.c): the global verdict for a name, without
+ * counting it. The lookup also pulls the index pages for the name into
+ * SQLite's page cache, so the first real query does not go to disk. */
+int db_warm_block(const char *name)
+{
+  int set, how;
+
+  lookup_quiet = 1;
+  how = block_lookup(name, DB_CATEGORY_ALL, &set);
+  lookup_quiet = 0;
+  return how;
+}
+
+int db_check_block_mask(const char *name, uint64_t enabled)
+{
+  int set;
+  return block_lookup(name, enabled, &set);
+}
+
+int db_check_block(const char *name)
+{
+  return db_check_block_mask(name, DB_CATEGORY_ALL);
 }
 
-int db_get_block_ips(const char *name, char **ipv4_out, char **ipv6_out)
+/* Answer addresses for a blocked name, per family: the IP set of the
+ * matching entry, else the policy's set (0 = none), else the global
+ * sqlite-block-ipv4/6. The pointers refer to the preloaded sets and stay
+ * valid until db_cleanup(); NULL if no address of that family is set.
+ * Returns the table that blocked (1 = hosts, 2 = wildcard), 0, or -1 if
+ * the base could not be read. */
+int db_get_block_addrs(const char *name, uint64_t enabled, int policy_set,
+                       struct in_addr **ipv4_out, struct in6_addr **ipv6_out)
 {
+  const ip_set_t *sets[3];
+  int entry_set, how;
+
   if (ipv4_out) *ipv4_out = NULL;
   if (ipv6_out) *ipv6_out = NULL;
-  if (!db_check_block(name)) return 0;
-  if (ipv4_out) *ipv4_out = block_ipv4;
-  if (ipv6_out) *ipv6_out = block_ipv6;
-  return 1;
+  if ((how = block_lookup(name, enabled, &entry_set)) <= 0) return how;
+
+  sets[0] = ip_set_get(entry_set);
+  sets[1] = ip_set_get(policy_set);
+  sets[2] = &ip_set_global;
+  for (int i = 0; i < 3; i++)
+    if (sets[i]) {
+      if (ipv4_out && !*ipv4_out && (sets[i]->flags & IP_SET_V4))
+        *ipv4_out = (struct in_addr *)&sets[i]->ipv4;
+      if (ipv6_out && !*ipv6_out && (sets[i]->flags & IP_SET_V6))
+        *ipv6_out = (struct in6_addr *)&sets[i]->ipv6;
+    }
+  return how;
 }
 
 /* ============================================================================
@@ -583,19 +1455,41 @@ int db_get_block_ips(const char *name, char **ipv4_out, char **ipv6_out)
  * call db_rewrite_ipv4/ipv6 concurrently. Each thread gets its own buffer. */
 static __thread char ip_rewrite_buffer[INET6_ADDRSTRLEN + 1];
 
-static char *db_get_rewrite_ip_internal(const char *source_ip, int is_ipv6)
+/* *error is set if the base could not be read; NULL then is not a miss */
+static char *db_get_rewrite_ip_internal(const char *source_ip, int is_ipv6, int *error)
 {
+  *error = 0;
   if (!source_ip || !db) return NULL;
 
   /* For IPv6, try normalized form too */
   char normalized_ip[48];
   if (is_ipv6) ipv6_normalize(source_ip, normalized_ip, sizeof(normalized_ip));
 
+  /* Overlay first: ADD rewrites, DEL hides the exact base row */
+  int hidden = 0;
+  if (overlay_count) {
+    overlay_entry_t *e = overlay_find(DB_TABLE_IPS, source_ip);
+    if (e)
+      daemon->metrics[METRIC_SQLITE_OVERLAY_HITS]++;
+    if (e && e->op == DB_OVERLAY_ADD) {
+      strncpy(ip_rewrite_buffer, e->target, sizeof(ip_rewrite_buffer) - 1);
+      ip_rewrite_buffer[sizeof(ip_rewrite_buffer) - 1] = '\0';
+      return ip_rewrite_buffer;
+    }
+    hidden = e != NULL;
+  }
+
   /* Try exact match first */
-  if (stmt_block_ips) {
+  if (stmt_block_ips && !hidden) {
+    int rc;
+
     sqlite3_reset(stmt_block_ips);
     sqlite3_bind_text(stmt_block_ips, 1, source_ip, -1, SQLITE_STATIC);
-    if (sqlite3_step(stmt_block_ips) == SQLITE_ROW) {
+    if ((rc = lookup_step(stmt_block_ips)) < 0) {
+      *error = 1;
+      return NULL;
+    }
+    if (rc) {
       const char *target = (const char *)sqlite3_column_text(stmt_block_ips, 0);
       if (target) {
         strncpy(ip_rewrite_buffer, target, sizeof(ip_rewrite_buffer) - 1);
@@ -608,7 +1502,11 @@ static char *db_get_rewrite_ip_internal(const char *source_ip, int is_ipv6)
     if (is_ipv6 && strcmp(source_ip, normalized_ip) != 0) {
       sqlite3_reset(stmt_block_ips);
       sqlite3_bind_text(stmt_block_ips, 1, normalized_ip, -1, SQLITE_STATIC);
-      if (sqlite3_step(stmt_block_ips) == SQLITE_ROW) {
+      if ((rc = lookup_step(stmt_block_ips)) < 0) {
+        *error = 1;
+        return NULL;
+      }
+      if (rc) {
         const char *target = (const char *)sqlite3_column_text(stmt_block_ips, 0);
         if (target) {
           strncpy(ip_rewrite_buffer, target, sizeof(ip_rewrite_buffer) - 1);
@@ -641,21 +1539,25 @@ static char *db_get_rewrite_ip_internal(const char *source_ip, int is_ipv6)
 
 char *db_get_rewrite_ip(const char *source_ip)
 {
+  int error;
   if (!source_ip) return NULL;
-  return db_get_rewrite_ip_internal(source_ip, strchr(source_ip, ':') != NULL);
+  return db_get_rewrite_ip_internal(source_ip, strchr(source_ip, ':') != NULL, &error);
 }
 
 int db_rewrite_ipv4(struct in_addr *addr)
 {
   if (!addr || !db) return 0;
   char ip_str[INET_ADDRSTRLEN];
+  int error;
   if (!inet_ntop(AF_INET, addr, ip_str, sizeof(ip_str))) return 0;
 
-  char *target = db_get_rewrite_ip_internal(ip_str, 0);
+  char *target = db_get_rewrite_ip_internal(ip_str, 0, &error);
+  if (error) return -1;
   if (target) {
     struct in_addr new_addr;
     if (inet_pton(AF_INET, target, &new_addr) == 1) {
       *addr = new_addr;
+      daemon->metrics[METRIC_SQLITE_REWRITTEN]++;
       return 1;
     }
   }
@@ -666,19 +1568,186 @@ int db_rewrite_ipv6(struct in6_addr *addr)
 {
   if (!addr || !db) return 0;
   char ip_str[INET6_ADDRSTRLEN];
+  int error;
   if (!inet_ntop(AF_INET6, addr, ip_str, sizeof(ip_str))) return 0;
 
-  char *target = db_get_rewrite_ip_internal(ip_str, 1);
+  char *target = db_get_rewrite_ip_internal(ip_str, 1, &error);
+  if (error) return -1;
   if (target) {
     struct in6_addr new_addr;
     if (inet_pton(AF_INET6, target, &new_addr) == 1) {
       *addr = new_addr;
+      daemon->metrics[METRIC_SQLITE_REWRITTEN]++;
       return 1;
     }
   }
   return 0;
 }
 
+/* ============================================================================
+ * Lookup Explanation (control socket "lookup")
+ * ============================================================================ */
+
+static const char *explain_table(int table, const char *key, sqlite3_stmt *stmt,
+                                 int *category, int *set)
+{
+  overlay_entry_t *e = overlay_count ? overlay_find(table, key) : NULL;
+  const char *how = "base-miss";
+  int rc;
+
+  *category = *set = 0;
+  if (e) {
+    /* overlay blocks apply in every category, see block_lookup() */
+    if (e->op == DB_OVERLAY_ADD)
+      *category = -1;
+    return e->op == DB_OVERLAY_ADD ? "overlay-add" : "overlay-del";
+  }
+  if (!stmt) return "unavailable";
+  sqlite3_reset(stmt);
+  sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+  if ((rc = lookup_step(stmt)) < 0)
+    return "error";
+  if (rc) {
+    how = "base-hit";
+    *category = __builtin_ctzll(row_category(stmt));
+    *set = sqlite3_column_int(stmt, 1);
+  }
+  sqlite3_reset(stmt);
+  return how;
+}
+
+static size_t explain_add(char *buf, size_t len, size_t n, const char *fmt, ...)
+{
+  va_list ap;
+  int r;
+
+  va_start(ap, fmt);
+  r = vsnprintf(buf + n, len - n, fmt, ap);
+  va_end(ap);
+  if (r < 0) return n;
+  return ((size_t)r < len - n) ? n + r : len - 1;
+}
+
+static int is_hit(const char *how)
+{
+  return strcmp(how, "overlay-add") == 0 || strcmp(how, "base-hit") == 0;
+}
+
+/* Describe how a name (block verdict) or an IP (rewrite) is decided, one
+ * "field value" pair per line. Returns the number of bytes written. */
+int db_explain(const char *query, char *buf, size_t len)
+{
+  unsigned char addr[sizeof(struct in6_addr)];
+  size_t n = 0;
+
+  if (len == 0) return 0;
+  buf[0] = '\0';
+
+  db_init();
+  if (!db) {
+    n = explain_add(buf, len, n, "error database not open\n");
+    return n;
+  }
+
+  int is_ipv6 = inet_pton(AF_INET6, query, addr) == 1;
+  if (is_ipv6 || inet_pton(AF_INET, query, addr) == 1) {
+    char ip[INET6_ADDRSTRLEN], expanded[48];
+    overlay_entry_t *e;
+    cidr_rule_t *r;
+
+    inet_ntop(is_ipv6 ? AF_INET6 : AF_INET, addr, ip, sizeof(ip));
+    n = explain_add(buf, len, n, "ip %s\n", ip);
+
+    e = overlay_count ? overlay_find(DB_TABLE_IPS, ip) : NULL;
+    if (e && e->op == DB_OVERLAY_ADD)
+      n = explain_add(buf, len, n, "overlay add %s\n", e->target);
+    else
+      n = explain_add(buf, len, n, "overlay %s\n", e ? "del" : "none");
+
+    if (e)
+      n = explain_add(buf, len, n, "exact skipped\n");
+    else if (stmt_block_ips) {
+      const char *found = NULL;
+      int rc;
+
+      sqlite3_reset(stmt_block_ips);
+      sqlite3_bind_text(stmt_block_ips, 1, ip, -1, SQLITE_STATIC);
+      if ((rc = lookup_step(stmt_block_ips)) > 0)
+        found = (const char *)sqlite3_column_text(stmt_block_ips, 0);
+      else if (rc == 0 && is_ipv6) {
+        ipv6_normalize(ip, expanded, sizeof(expanded));
+        sqlite3_reset(stmt_block_ips);
+        sqlite3_bind_text(stmt_block_ips, 1, expanded, -1, SQLITE_STATIC);
+        if ((rc = lookup_step(stmt_block_ips)) > 0)
+          found = (const char *)sqlite3_column_text(stmt_block_ips, 0);
+      }
+      n = explain_add(buf, len, n, "exact %s\n", found ? found : rc < 0 ? "error" : "miss");
+      sqlite3_reset(stmt_block_ips);
+    }
+
+    r = cidr_find_rule((struct in_addr *)addr, (struct in6_addr *)addr, is_ipv6);
+    if (r) {
+      char net[INET6_ADDRSTRLEN];
+      inet_ntop(is_ipv6 ? AF_INET6 : AF_INET, is_ipv6 ? (void *)&r->net6 : (void *)&r->net4, net, sizeof(net));
+      n = explain_add(buf, len, n, "cidr %s/%d %s\n", net, r->prefix_len, r->target);
+    } else {
+      n = explain_add(buf, len, n, "cidr miss\n");
+    }
+
+    int error;
+    char *target = db_get_rewrite_ip_internal(ip, is_ipv6, &error);
+    n = explain_add(buf, len, n, "rewrite %s\n", target ? target : error ? "error" : "none");
+    return n;
+  }
+
+  char name[256];
+  strncpy(name, query, sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  str_tolower(name);
+  size_t l = strlen(name);
+  if (l > 1 && name[l - 1] == '.') name[l - 1] = '\0';
+
+  const char *base = get_base_domain(name);
+  int hosts_cat, hosts_set, wildcard_cat, wildcard_set;
+  const char *hosts = explain_table(DB_TABLE_HOSTS, name, stmt_block_hosts, &hosts_cat, &hosts_set);
+  const char *wildcard = explain_table(DB_TABLE_WILDCARD, base, stmt_block_wildcard,
+                                       &wildcard_cat, &wildcard_set);
+
+  n = explain_add(buf, len, n, "name %s\n", name);
+  n = explain_add(buf, len, n, "base %s\n", base);
+  char hosts_cs[8], wildcard_cs[8];
+  snprintf(hosts_cs, sizeof(hosts_cs), "%d", hosts_cat);
+  snprintf(wildcard_cs, sizeof(wildcard_cs), "%d", wildcard_cat);
+  n = explain_add(buf, len, n, "hosts %s category %s ip-set %d\n", hosts,
+                  hosts_cat < 0 ? "all" : hosts_cs, hosts_set);
+  n = explain_add(buf, len, n, "wildcard %s category %s ip-set %d\n", wildcard,
+                  wildcard_cat < 0 ? "all" : wildcard_cs, wildcard_set);
+
+  const char *allow = NULL;
+  if (allow_hit(DB_TABLE_ALLOW_EXACT, name))
+    n = explain_add(buf, len, n, "allow exact %s\n", allow = name);
+  for (const char *s = name; s; s = strchr(s, '.') ? strchr(s, '.') + 1 : NULL)
+    if (allow_hit(DB_TABLE_ALLOW_WILDCARD, s)) {
+      n = explain_add(buf, len, n, "allow wildcard %s\n", s);
+      if (!allow) allow = s;
+    }
+
+  if (strcmp(hosts, "error") == 0 || (!is_hit(hosts) && strcmp(wildcard, "error") == 0))
+    n = explain_add(buf, len, n, "verdict error (SERVFAIL)\n");
+  else if (is_hit(hosts) && allow_overrides(name, name))
+    n = explain_add(buf, len, n, "verdict allowed by exception %s\n", allow);
+  else if (is_hit(hosts))
+    n = explain_add(buf, len, n, "verdict blocked hosts\n");
+  else if (is_hit(wildcard) && allow_overrides(name, base))
+    n = explain_add(buf, len, n, "verdict allowed by exception %s\n", allow);
+  else if (is_hit(wildcard))
+    n = explain_add(buf, len, n, "verdict blocked wildcard %s\n", base);
+  else
+    n = explain_add(buf, len, n, "verdict allowed\n");
+
+  return n;
+}
+
 /* Legacy compatibility functions.
  * Note: These return pointers to thread-local static variables.
  * The caller must use the result immediately before calling again.
@@ -421,6 +421,8 @@ int main (int argc, char **argv)
     {
       cache_init();
       blockdata_init();
+      frec_init();
+      warmup_init();
 
       /* Scale random socket pool by ftabsize, but
 	 limit it based on available fds. */
@@ -453,6 +455,14 @@ int main (int argc, char **argv)
 #else
   die(_("Packet dumps not available: set HAVE_DUMP in src/config.h"), NULL, EC_BADCONF);
 #endif
+
+#ifdef HAVE_SQLITE
+  if (!db_delta_config_ok())
+    die(_("--sqlite-delta-dir requires --sqlite-delta-key"), NULL, EC_BADCONF);
+  db_control_init();
+  db_qlog_init();
+  db_tap_init();
+#endif
   
   if (option_bool(OPT_DBUS))
 #ifdef HAVE_DBUS
@@ -885,6 +895,13 @@ int main (int argc, char **argv)
   
   my_syslog(LOG_INFO, _("compile time options: %s"), compile_opts);
 
+#ifdef HAVE_SQLITE
+  /* after the fork into the background, threads do not survive fork() */
+  db_qlog_start();
+  db_tap_start();
+  db_stats_start();
+#endif
+
   if (chown_warn != 0)
     {
 #if defined(HAVE_LINUX_NETWORK)
@@ -1101,6 +1118,21 @@ int main (int argc, char **argv)
       else if (is_dad_listeners() &&
 	       (timeout == -1 || timeout > 1000))
 	timeout = 1000;
+
+      /* Wake every quarter second whilst warming up the cache */
+      if (warmup_pending() && (timeout == -1 || timeout > 250))
+	timeout = 250;
+
+      /* Wake every second when the cache snapshot is saved periodically */
+      if (daemon->cache_snapshot_interval != 0 && (timeout == -1 || timeout > 1000))
+	timeout = 1000;
+
+#ifdef HAVE_SQLITE
+      /* Wake every second to pick up blocklist delta files and
+	 to write out entry hit counters */
+      if ((db_delta_enabled() || db_stats_pending()) && (timeout == -1 || timeout > 1000))
+	timeout = 1000;
+#endif
       
       if (daemon->port != 0)
 	set_dns_listeners();
@@ -1152,6 +1184,10 @@ int main (int argc, char **argv)
 	poll_listen(daemon->inotifyfd, POLLIN);
 #endif
 
+#ifdef HAVE_SQLITE
+      db_control_set_listeners();
+#endif
+
 #if defined(HAVE_LINUX_NETWORK)
       poll_listen(daemon->netlinkfd, POLLIN);
 #elif defined(HAVE_BSD_NETWORK)
@@ -1206,6 +1242,15 @@ int main (int argc, char **argv)
 
       check_log_writer(0);
 
+      cache_snapshot_poll(now);
+      warmup_poll(now);
+
+#ifdef HAVE_SQLITE
+      db_control_check(now);
+      db_delta_poll(now);
+      db_stats_poll();
+#endif
+
       /* prime. */
       enumerate_interfaces(1);
 
@@ -1508,6 +1553,12 @@ static void async_event(int pipe, time_t now)
 	
       case EVENT_INIT:
 	clear_cache_and_reload(now);
+
+	if (ev.event == EVENT_INIT)
+	  {
+	    cache_snapshot_load(now);
+	    warmup_start(now);
+	  }
 	
 	if (daemon->port != 0)
 	  {
@@ -1561,6 +1612,14 @@ static void async_event(int pipe, time_t now)
 	      if (errno != EINTR)
 		break;
 	    }      
+	  else if (cache_snapshot_reaped(p, wstatus))
+	    continue;
+#ifdef HAVE_SQLITE
+	  else if (db_delta_reaped(p, wstatus))
+	    continue;
+	  else if (db_stats_reaped(p, wstatus))
+	    continue;
+#endif
 	  else if (daemon->port != 0)
 	    for (i = 0 ; i < daemon->max_procs; i++)
 	      if (daemon->tcp_pids[i] == p)
@@ -1620,6 +1679,10 @@ static void async_event(int pipe, time_t now)
 	   we leave them logging to the old file. */
 	if (daemon->log_file != NULL)
 	  log_reopen(daemon->log_file);
+#ifdef HAVE_SQLITE
+	db_qlog_reopen();
+	db_tap_rotate();
+#endif
 	break;
 
       case EVENT_NEWADDR:
@@ -1684,6 +1747,13 @@ static void async_event(int pipe, time_t now)
 	  close(daemon->dumpfd);
 #endif
 	
+	cache_snapshot_save(now);
+	
+#ifdef HAVE_SQLITE
+	db_qlog_stop();
+	db_tap_stop();
+	db_stats_stop();
+#endif
 	my_syslog(LOG_INFO, _("exiting on receipt of SIGTERM"));
 	flush_log();
 	exit(EC_GOOD);
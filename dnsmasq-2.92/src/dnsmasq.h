@@ -478,11 +478,6 @@ struct interface_name {
   struct interface_name *next;
 };
 
-union bigname {
-  char name[MAXDNAME];
-  union bigname *next; /* freelist */
-};
-
 struct blockdata {
   struct blockdata *next;
   unsigned char key[KEYBLOCK_LEN];
@@ -495,10 +490,16 @@ struct crec {
   /* used as class if DNSKEY/DS, index to source for F_HOSTS */
   unsigned int uid; 
   unsigned int flags;
+  unsigned int hash; /* of the name, set by cache_hash() */
+  unsigned short hits, lifetime; /* for --cache-prefetch, lifetime capped at 65535s */
   union {
     char sname[SMALLDNAME];
-    union bigname *bname;
+    char *bname; /* F_BIGNAME, from the name arena */
     char *namep;
+    struct {     /* F_BIGNAME, answer for the clients in addr/scope only */
+      char *bname;
+      unsigned char family, scope, addr[IN6ADDRSZ];
+    } ecs;
   } name;
 };
 
@@ -619,6 +620,7 @@ struct server {
   unsigned int query_latency, mma_latency;
   time_t forwardtime;
   int forwardcount;
+  int frec_count; /* frecs sent here and younger than TIMEOUT */
 #ifdef HAVE_LOOP
   u32 uid;
 #endif
@@ -790,6 +792,7 @@ struct dyndir {
 #define FREC_HAS_PHEADER      128
 #define FREC_GONE_TO_TCP      256
 #define FREC_ANSWER           512
+#define FREC_ECS             1024
 
 struct frec {
   struct frec_src {
@@ -801,6 +804,7 @@ struct frec {
     struct frec_src *next;
   } frec_src;
   struct server *sentto; /* NULL means free */
+  struct server *counted; /* sentto while counted in its frec_count */
   struct randfd_list *rfds;
   unsigned short new_id;
   int forwardall, flags;
@@ -815,6 +819,11 @@ struct frec {
   struct frec *next_dependent; /* list of above. */
   struct frec *blocking_query; /* Query which is blocking us. */
 #endif
+  unsigned long long timer_due; /* tick of the retry/expiry timer */
+  struct frec *timer_next, **timer_pprev; /* timer wheel slot, timer_pprev NULL when idle */
+  int timer_slot, on_free_list;
+  struct frec *stale_next, **stale_pprev; /* past TIMEOUT, oldest first; may be recycled */
+  struct frec *next_free;
   struct frec *next;
 };
 
@@ -1254,6 +1263,11 @@ extern struct daemon {
   u32 metrics[__METRIC_MAX];
   int fast_retry_time, fast_retry_timeout;
   int cache_max_expiry;
+  char *cache_snapshot;
+  int cache_snapshot_interval;
+  int prefetch_hits, prefetch_percent;
+  char *warmup_file;
+  int warmup_qps;
 #ifdef HAVE_DNSSEC
   struct ds_config *ds;
   char *timestamp_file;
@@ -1271,8 +1285,10 @@ extern struct daemon {
   int dnssec_no_time_check;
   int back_to_the_future;
   int limit[LIMIT_MAX];
+  int nsec_cache_size; /* --dnssec-aggressive-nsec, zero if off */
+  int sig_cache_size; /* --dnssec-sig-cache, zero if off */
 #endif
-  struct frec *frec_list;
+  struct frec *frec_list, *free_frec_list;
   struct frec_src *free_frec_src;
   int frec_src_count;
   struct serverfd *sfds;
@@ -1370,6 +1386,12 @@ void cache_end_insert(void);
 void cache_start_insert(void);
 unsigned int cache_remove_uid(const unsigned int uid);
 int cache_recv_insert(time_t now, int fd);
+void cache_snapshot_save(time_t now);
+void cache_snapshot_load(time_t now);
+void cache_snapshot_poll(time_t now);
+int cache_snapshot_reaped(pid_t pid, int status);
+int cache_prefetch_hit(struct crec *crecp, time_t now);
+void cache_ecs_set(union mysockaddr *client, int scope);
 #ifdef HAVE_DNSSEC
 void cache_update_hwm(void);
 #endif
@@ -1395,6 +1417,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size,
 
 /* blockdata.c */
 void blockdata_init(void);
+void blockdata_reserve(int n);
 void blockdata_report(void);
 struct blockdata *blockdata_alloc(char *data, size_t len);
 int blockdata_expand(struct blockdata *block, size_t oldlen,
@@ -1428,7 +1451,8 @@ void report_addresses(struct dns_header *header, size_t len, u32 mark);
 #endif
 size_t answer_request(struct dns_header *header, char *limit, size_t qlen,  
 		      struct in_addr local_addr, struct in_addr local_netmask, 
-		      time_t now, int ad_reqd, int do_bit, int no_cache, int *stale, int *filtered);
+		      time_t now, int ad_reqd, int do_bit, int no_cache, int *stale, int *prefetch,
+		      int *filtered);
 int check_for_bogus_wildcard(struct dns_header *header, size_t qlen, char *name, 
 			     time_t now);
 int check_for_ignored_address(struct dns_header *header, size_t qlen);
@@ -1467,13 +1491,15 @@ int dnskey_keytag(int alg, int flags, unsigned char *key, int keylen);
 size_t filter_rrsigs(struct dns_header *header, size_t plen);
 int setup_timestamp(void);
 int errflags_to_ede(int status);
+int dnssec_nsec_answer(char *name, int qtype, time_t now, char **zonep);
+void dnssec_nsec_flush(void);
 #endif
 
 /* crypto.c */
 const struct nettle_hash *hash_find(char *name);
 int hash_init(const struct nettle_hash *hash, void **ctxp, unsigned char **digestp);
 int verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
-	   unsigned char *digest, size_t digest_len, int algo);
+	   unsigned char *digest, size_t digest_len, int algo, time_t ttd);
 char *ds_digest_name(int digest);
 char *algo_digest_name(int algo);
 char *nsec3_digest_name(int digest);
@@ -1568,6 +1594,12 @@ void resend_query(void);
 int allocate_rfd(struct randfd_list **fdlp, struct server *serv);
 void free_rfds(struct randfd_list **fdlp);
 int fast_retry(time_t now);
+void frec_init(void);
+void frec_report(void);
+void warmup_init(void);
+int warmup_pending(void);
+void warmup_start(time_t now);
+void warmup_poll(time_t now);
 
 /* network.c */
 int indextoname(int fd, int index, char *name);
@@ -1919,8 +1951,9 @@ size_t add_pseudoheader(struct dns_header *header, size_t plen, unsigned char *l
 			int optno, unsigned char *opt, size_t optlen, int set_do, int replace);
 size_t add_do_bit(struct dns_header *header, size_t plen, unsigned char *limit);
 void edns0_needs_mac(union mysockaddr *addr, time_t now);
+int get_ecs_scope(struct dns_header *header, size_t plen);
 size_t add_edns0_config(struct dns_header *header, size_t plen, unsigned char *limit, 
-			union mysockaddr *source, time_t now, int *cacheable);
+			union mysockaddr *source, time_t now, int *cacheable, int *ecs);
 int check_source(struct dns_header *header, size_t plen, unsigned char *pseudoheader, union mysockaddr *peer);
 
 /* arp.c */
@@ -1966,6 +1999,14 @@ void db_set_block_ipv4(char *ip);       /* sqlite-block-ipv4=0.0.0.0 */
 void db_set_block_ipv6(char *ip);       /* sqlite-block-ipv6=:: */
 void db_set_block_txt(char *txt);       /* sqlite-block-txt=Privacy Protection Active. */
 void db_set_block_mx(char *mx);         /* sqlite-block-mx=10 mx.example.com. */
+void db_set_delta_dir(char *path);      /* sqlite-delta-dir=/path/to/deltas */
+int db_set_delta_key(char *path);       /* sqlite-delta-key=/path/to/hmac.key */
+void db_set_control(char *arg);         /* sqlite-control=/path/to/socket[,persist] */
+int db_add_policy(char *arg);           /* sqlite-policy=<client>,<categories>[,<ip-set>] */
+int db_set_query_log(char *arg);        /* sqlite-query-log=<file|unix:/path>[,<records>] */
+int db_set_tap(char *arg);              /* sqlite-tap=<file>[,size=<MB>][,interval=<s>][,buffer=<KB>] */
+int db_set_stats(char *arg);            /* sqlite-stats=<file>[,<seconds>] */
+int db_set_top(char *arg);              /* sqlite-top=<K>[,<seconds>] */
 
 /* Block response getters */
 char *db_get_block_txt(void);
@@ -1973,8 +2014,82 @@ char *db_get_block_mx(void);
 int db_get_block_mx_prio(void);
 
 /* Core blocking functions */
-int db_rewrite_ipv4(struct in_addr *addr);    /* Returns 1 if IP was rewritten */
-int db_rewrite_ipv6(struct in6_addr *addr);   /* Returns 1 if IP was rewritten */
-int db_get_block_ips(const char *domain, char **ipv4, char **ipv6);  /* Returns 1 if domain blocked */
+void db_init(void);                           /* Lazy, first lookup calls it */
+int db_rewrite_ipv4(struct in_addr *addr);    /* Returns 1 if IP was rewritten, -1 on error */
+int db_rewrite_ipv6(struct in6_addr *addr);   /* Returns 1 if IP was rewritten, -1 on error */
+
+/* Categories: entry Category 0-63 is bit 0-63 of a verdict mask */
+#define DB_CATEGORIES     64
+#define DB_CATEGORY_ALL   (~(uint64_t)0)
+int db_check_block_mask(const char *domain, uint64_t enabled);
+int db_warm_block(const char *domain);   /* verdict without metrics, for cache-warmup */
+int db_get_block_addrs(const char *domain, uint64_t enabled, int policy_set,
+                       struct in_addr **ipv4, struct in6_addr **ipv6);  /* 1 hosts, 2 wildcard, 0 not blocked, -1 error */
+
+/* Runtime overlay, consulted before the base tables */
+#define DB_TABLE_WILDCARD 0
+#define DB_TABLE_HOSTS    1
+#define DB_TABLE_IPS      2
+#define DB_TABLE_ALLOW_WILDCARD 3
+#define DB_TABLE_ALLOW_EXACT    4
+#define DB_OVERLAY_ADD    1
+#define DB_OVERLAY_DEL    2
+int db_overlay_apply(int table, int op, const char *key, const char *target);
+void db_overlay_fold(unsigned int gen);
+int db_overlay_persist(unsigned int delta_seq);
+int db_reopen(void);
+void db_release(void);
+int db_overlay_size(void);
+unsigned int db_overlay_generation(void);
+char *db_get_file(void);
+int db_get_meta(const char *key, char *buf, size_t len);
+int db_explain(const char *query, char *buf, size_t len);
+
+/* db-delta.c - sequenced delta files and background compaction */
+int db_delta_config_ok(void);
+int db_delta_enabled(void);
+void db_delta_poll(time_t now);
+int db_delta_reaped(pid_t pid, int status);
+void db_delta_request_compact(time_t now, int immediate);
+unsigned int db_delta_seq(void);
+
+/* db-control.c - UNIX control socket serviced from the main loop */
+void db_control_init(void);
+void db_control_set_listeners(void);
+void db_control_check(time_t now);
+
+/* db-policy.c - per-client categories and IP sets */
+int db_policy_block_addrs(const char *domain, union mysockaddr *client, struct in_addr local,
+                          time_t now, struct in_addr **ipv4, struct in6_addr **ipv6);
+int db_policy_explain(union mysockaddr *client, char *buf, size_t len);
+int db_policy_uses_mac(void);
+
+/* db-qlog.c - ring-buffered query log drained by a writer thread */
+void db_qlog_init(void);
+void db_qlog_start(void);
+void db_qlog_stop(void);
+void db_qlog_reopen(void);
+void db_qlog_record(const char *domain, int qtype, union mysockaddr *client, int verdict);
+
+/* db-tap.c - binary query/response log with rotation */
+void db_tap_init(void);
+void db_tap_start(void);
+void db_tap_stop(void);
+void db_tap_rotate(void);
+void db_tap_packet(int mask, void *packet, size_t len,
+                   union mysockaddr *src, union mysockaddr *dst, int tcp);
+void db_tap_verdict(const char *domain, int qtype, union mysockaddr *client, int verdict);
+
+/* db-stats.c - per-entry hit counters flushed to a stats database */
+void db_stats_start(void);
+void db_stats_stop(void);
+int db_stats_pending(void);
+void db_stats_poll(void);
+int db_stats_reaped(pid_t pid, int status);
+void db_stats_hit(int table, const char *key);
+
+/* db-top.c - heavy hitters: count-min sketch and top-K heap per window */
+void db_top_record(const char *domain, int blocked, time_t now);
+size_t db_top_explain(int blocked, int last, int n, char *buf, size_t len);
 
 #endif 
@@ -487,6 +487,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
       void *ctx;
       char *name_start;
       u32 nsigttl, ttl, orig_ttl;
+      time_t sig_ttd;
 
       failflags &= ~DNSSEC_FAIL_NOSIG;
       
@@ -522,6 +523,10 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	    failflags &= ~DNSSEC_FAIL_EXP;
 	}
 
+      /* How long a cached verification result for this signature may be used.
+	 Without time checks, the sig never expires, so pick an arbitrary hour. */
+      sig_ttd = now + (time_check ? (time_t)(sig_expiration - (u32)curtime) : 3600);
+
       if (!(hash = hash_find(algo_digest_name(algo))))
 	continue;
       else
@@ -671,7 +676,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	      if (dec_counter(validate_counter, NULL))
 		return STAT_ABANDONED;
 	     	      
-	      if (verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo))
+	      if (verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo, sig_ttd))
 		return STAT_SECURE;
 	    }
 	}
@@ -686,7 +691,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 		if (dec_counter(validate_counter, NULL))
 		  return STAT_ABANDONED;
 		
-		if (verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo))
+		if (verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo, sig_ttd))
 		  return (labels < name_labels) ? STAT_SECURE_WILDCARD : STAT_SECURE;
 		
 		/* An attacker can waste a lot of our CPU by setting up a giant DNSKEY RRSET full of failing
@@ -1948,6 +1953,600 @@ static int zone_status(char *name, int class, char *keyname, time_t now)
   return STAT_SECURE;
 }
        
+/* Aggressive use of the DNSSEC-validated cache, RFC 8198.
+   The validated NSEC and NSEC3 RRs in the authority section of a secure
+   reply are kept as ranges per signing zone, sorted by owner name (NSEC)
+   or owner hash (NSEC3). A query for a name covered by a live range is
+   answered NXDOMAIN or NODATA from here, without going upstream. The
+   total number of ranges is bounded by --dnssec-aggressive-nsec. */
+struct nsec_range {
+  time_t ttd;
+  unsigned char *owner, *next, *types; /* names for NSEC, hashes for NSEC3 */
+  int types_len, optout;
+};
+
+struct nsec_zone {
+  struct nsec_zone *next;
+  char *name;
+  int type, algo, iterations, salt_len, hash_len;
+  unsigned char salt[255];
+  int count, size; /* ranges sorted by owner */
+  struct nsec_range **ranges;
+};
+
+static struct nsec_zone *nsec_zones = NULL;
+static int nsec_total = 0;
+
+/* Is name equal to or below zone? hostname_issubdomain() doesn't do the root. */
+static int nsec_in_zone(char *name, char *zone)
+{
+  return *zone == 0 || hostname_issubdomain(zone, name) != 0;
+}
+
+static int nsec_cmp(struct nsec_zone *zone, unsigned char *a, unsigned char *b)
+{
+  if (zone->type == T_NSEC)
+    return hostname_cmp((char *)a, (char *)b);
+
+  return memcmp(a, b, zone->hash_len);
+}
+
+/* Index of the range whose owner is key or precedes it, wrapping round
+   to the last range, -1 if the zone is empty. */
+static int nsec_find(struct nsec_zone *zone, unsigned char *key, int *exact)
+{
+  int lo = 0, hi = zone->count - 1, mid, rc;
+
+  *exact = 0;
+  
+  while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+
+      if ((rc = nsec_cmp(zone, zone->ranges[mid]->owner, key)) == 0)
+	{
+	  *exact = 1;
+	  return mid;
+	}
+      
+      if (rc < 0)
+	lo = mid + 1;
+      else
+	hi = mid - 1;
+    }
+
+  return hi < 0 ? zone->count - 1 : hi;
+}
+
+static int nsec_live(struct nsec_zone *zone, int i, time_t now)
+{
+  return i >= 0 && difftime(zone->ranges[i]->ttd, now) > 0;
+}
+
+/* Does the range prove that key, which isn't its owner, doesn't exist? */
+static int nsec_covers(struct nsec_zone *zone, struct nsec_range *r, unsigned char *key)
+{
+  if (nsec_cmp(zone, r->owner, r->next) < 0)
+    return nsec_cmp(zone, r->owner, key) < 0 && nsec_cmp(zone, key, r->next) < 0;
+
+  /* Last range in the chain, next is the first. */
+  return nsec_cmp(zone, r->owner, key) < 0 || nsec_cmp(zone, key, r->next) < 0;
+}
+
+static int nsec_has_type(struct nsec_range *r, int type)
+{
+  unsigned char *p = r->types;
+  int len = r->types_len, offset = (type & 0xff) >> 3;
+
+  while (len >= 2 && len >= p[1] + 2)
+    {
+      if (p[0] == type >> 8)
+	return offset < p[1] && (p[offset + 2] & (0x80 >> (type & 0x07))) != 0;
+      
+      len -= p[1] + 2;
+      p += p[1] + 2;
+    }
+
+  return 0;
+}
+
+/* Delegation or DNAME: says nothing about the names below it. */
+static int nsec_cut(struct nsec_range *r)
+{
+  return (nsec_has_type(r, T_NS) && !nsec_has_type(r, T_SOA)) || nsec_has_type(r, T_DNAME);
+}
+
+/* Range owned by name itself: NODATA if the type map rules out qtype. 
+   As in prove_non_existence_nsec(), the parent side of a zone cut can only
+   deny the DS, and the child apex can't. */
+static int nsec_nodata(struct nsec_range *r, char *name, int qtype)
+{
+  if (qtype == T_ANY || nsec_has_type(r, qtype) || nsec_has_type(r, T_CNAME))
+    return 0;
+
+  if (qtype == T_DS)
+    {
+      if (*name != 0 && nsec_has_type(r, T_SOA))
+	return 0;
+    }
+  else if (nsec_has_type(r, T_NS) && !nsec_has_type(r, T_SOA))
+    return 0;
+
+  return F_NEG;
+}
+
+static void nsec_remove(struct nsec_zone *zone, int i)
+{
+  free(zone->ranges[i]);
+  memmove(&zone->ranges[i], &zone->ranges[i+1], (zone->count - i - 1) * sizeof(struct nsec_range *));
+  zone->count--;
+  nsec_total--;
+}
+
+/* Drop expired ranges and empty zones. If that doesn't make room, drop
+   the range closest to expiry. */
+static void nsec_make_room(time_t now)
+{
+  struct nsec_zone *zone, *tmp, **up, *oldest = NULL;
+  int i, oldest_i = 0;
+
+  for (up = &nsec_zones, zone = nsec_zones; zone; zone = tmp)
+    {
+      tmp = zone->next;
+
+      for (i = 0; i < zone->count; )
+	if (!nsec_live(zone, i, now))
+	  nsec_remove(zone, i);
+	else
+	  {
+	    if (!oldest || difftime(zone->ranges[i]->ttd, oldest->ranges[oldest_i]->ttd) < 0)
+	      {
+		oldest = zone;
+		oldest_i = i;
+	      }
+	    i++;
+	  }
+
+      if (zone->count == 0)
+	{
+	  *up = tmp;
+	  free(zone->ranges);
+	  free(zone);
+	}
+      else
+	up = &zone->next;
+    }
+
+  if (nsec_total >= daemon->nsec_cache_size && oldest)
+    nsec_remove(oldest, oldest_i);
+}
+
+/* rdata is the NSEC3 RDATA, NULL for NSEC. */
+static void nsec_store(time_t now, unsigned long ttl, char *zonename, int type, unsigned char *rdata,
+		       unsigned char *owner, int owner_len, unsigned char *next, int next_len,
+		       unsigned char *types, int types_len)
+{
+  struct nsec_zone *zone;
+  struct nsec_range *r, **new;
+  int i, exact, algo = 0, iterations = 0, salt_len = 0, hash_len = 0;
+
+  if (rdata)
+    {
+      algo = rdata[0];
+      iterations = (rdata[2] << 8) | rdata[3];
+      salt_len = rdata[4];
+      hash_len = next_len;
+    }
+  
+  if (nsec_total >= daemon->nsec_cache_size)
+    nsec_make_room(now);
+  
+  for (zone = nsec_zones; zone; zone = zone->next)
+    if (hostname_isequal(zone->name, zonename))
+      break;
+
+  if (!zone)
+    {
+      if (!(zone = whine_malloc(sizeof(struct nsec_zone) + strlen(zonename) + 1)))
+	return;
+
+      zone->name = (char *)(zone + 1);
+      strcpy(zone->name, zonename);
+      zone->next = nsec_zones;
+      nsec_zones = zone;
+    }
+
+  /* Zone has gone from NSEC to NSEC3 or been re-salted, the old ranges are no use. */
+  if (zone->type != type || zone->algo != algo || zone->iterations != iterations ||
+      zone->hash_len != hash_len || zone->salt_len != salt_len ||
+      (salt_len != 0 && memcmp(zone->salt, &rdata[5], salt_len) != 0))
+    {
+      while (zone->count != 0)
+	nsec_remove(zone, zone->count - 1);
+      
+      zone->type = type;
+      zone->algo = algo;
+      zone->iterations = iterations;
+      zone->hash_len = hash_len;
+      zone->salt_len = salt_len;
+      if (salt_len != 0)
+	memcpy(zone->salt, &rdata[5], salt_len);
+    }
+  
+  if (!(r = whine_malloc(sizeof(struct nsec_range) + owner_len + next_len + types_len)))
+    return;
+
+  r->owner = (unsigned char *)(r + 1);
+  r->next = r->owner + owner_len;
+  r->types = r->next + next_len;
+  memcpy(r->owner, owner, owner_len);
+  memcpy(r->next, next, next_len);
+  memcpy(r->types, types, types_len);
+  r->types_len = types_len;
+  r->optout = rdata && (rdata[1] & 0x01);
+  r->ttd = now + (time_t)ttl;
+
+  i = nsec_find(zone, r->owner, &exact);
+  
+  if (exact)
+    {
+      free(zone->ranges[i]);
+      zone->ranges[i] = r;
+      return;
+    }
+
+  /* nsec_find() wraps round, but a new smallest owner goes first. */
+  if (i == zone->count - 1 && zone->count != 0 && nsec_cmp(zone, r->owner, zone->ranges[0]->owner) < 0)
+    i = -1;
+  
+  if (zone->count == zone->size)
+    {
+      if (!(new = whine_realloc(zone->ranges, (zone->size == 0 ? 8 : zone->size * 2) * sizeof(*new))))
+	{
+	  free(r);
+	  return;
+	}
+
+      zone->ranges = new;
+      zone->size = zone->size == 0 ? 8 : zone->size * 2;
+    }
+
+  i++;
+  memmove(&zone->ranges[i+1], &zone->ranges[i], (zone->count - i) * sizeof(r));
+  zone->ranges[i] = r;
+  zone->count++;
+  nsec_total++;
+}
+
+/* Signer name and labels of the RRSIGs over the type RRset at name in the
+   authority section, which starts at p. Like the labels in
+   prove_non_existence(), they must be the same in every RRSIG. */
+static int nsec_signer(struct dns_header *header, size_t plen, unsigned char *p, char *name, int type,
+		       char *signer, int *labels)
+{
+  int i, rc, type1, class1, rdlen1, covered, found = 0;
+  unsigned char *psave;
+
+  for (i = ntohs(header->nscount); i != 0; i--)
+    {
+      if (!(rc = extract_name(header, plen, &p, name, EXTR_NAME_COMPARE, 10)))
+	return 0;
+      
+      GETSHORT(type1, p);
+      GETSHORT(class1, p);
+      p += 4; /* TTL */
+      GETSHORT(rdlen1, p);
+      psave = p;
+
+      if (!CHECK_LEN(header, p, plen, rdlen1))
+	return 0;
+      
+      if (rc != 2 && type1 == T_RRSIG && class1 == C_IN && rdlen1 >= 18)
+	{
+	  GETSHORT(covered, p);
+
+	  if (covered == type)
+	    {
+	      p++; /* algo */
+	      if (found && *labels != *p)
+		return 0;
+	      *labels = *p;
+	      p += 15; /* labels, orig TTL, sig expiration, sig inception, key tag */
+
+	      if ((rc = extract_name(header, plen, &p, signer, found ? EXTR_NAME_COMPARE : EXTR_NAME_EXTRACT, 0)) == 0 ||
+		  rc == 2)
+		return 0;
+
+	      found = 1;
+	    }
+	}
+
+      p = psave + rdlen1;
+    }
+
+  return found;
+}
+
+/* Keep the NSEC/NSEC3 RRs which dnssec_validate_reply() validated, 
+   ie have non-zero rr_status. NSECs from wildcard expansion are skipped. */
+static void nsec_harvest(struct dns_header *header, size_t plen, char *signer, time_t now)
+{
+  unsigned char *p, *p1, *auth_start, *rdata;
+  unsigned char hash[64];
+  int i, type, class, rdlen, labels = 0, salt_len, hash_len, ancount = ntohs(header->ancount);
+  unsigned long ttl, minimum;
+  long soa_ttl = -1;
+  char *owner = daemon->workspacename, *next = daemon->cname, *parent;
+  
+  if (!(p = skip_questions(header, plen)) || !(p = skip_section(p, ancount, header, plen)))
+    return;
+
+  auth_start = p;
+
+  /* 8198 5.4: no longer than the SOA allows a negative answer to be cached. */
+  for (i = 0; i < ntohs(header->nscount); i++)
+    {
+      if (!(p = skip_name(p, header, plen, 10)))
+	return;
+
+      GETSHORT(type, p);
+      GETSHORT(class, p);
+      GETLONG(ttl, p);
+      GETSHORT(rdlen, p);
+
+      if (!CHECK_LEN(header, p, plen, rdlen))
+	return;
+
+      if (type == T_SOA && class == C_IN && rdlen >= 22)
+	{
+	  p1 = p + rdlen - 4;
+	  GETLONG(minimum, p1);
+	  soa_ttl = ttl < minimum ? ttl : minimum;
+	}
+
+      p += rdlen;
+    }
+
+  for (p = auth_start, i = 0; i < ntohs(header->nscount); i++)
+    {
+      if (!extract_name(header, plen, &p, owner, EXTR_NAME_EXTRACT, 10))
+	return;
+
+      GETSHORT(type, p);
+      GETSHORT(class, p);
+      GETLONG(ttl, p);
+      GETSHORT(rdlen, p);
+      rdata = p;
+      p += rdlen; /* checked above */
+
+      if ((type != T_NSEC && type != T_NSEC3) || class != C_IN || daemon->rr_status[ancount + i] == 0 ||
+	  !nsec_signer(header, plen, auth_start, owner, type, signer, &labels) ||
+	  labels != count_labels(owner) || !nsec_in_zone(owner, signer))
+	continue;
+
+      if (ttl > daemon->rr_status[ancount + i])
+	ttl = daemon->rr_status[ancount + i];
+      if (soa_ttl >= 0 && ttl > (unsigned long)soa_ttl)
+	ttl = soa_ttl;
+      if (daemon->max_cache_ttl != 0 && ttl > daemon->max_cache_ttl)
+	ttl = daemon->max_cache_ttl;
+      if (ttl == 0)
+	continue;
+
+      if (type == T_NSEC)
+	{
+	  p1 = rdata;
+	  if (!extract_name(header, plen, &p1, next, EXTR_NAME_EXTRACT, 0) || !nsec_in_zone(next, signer) ||
+	      rdlen < p1 - rdata)
+	    continue;
+
+	  nsec_store(now, ttl, signer, T_NSEC, NULL, (unsigned char *)owner, strlen(owner) + 1,
+		     (unsigned char *)next, strlen(next) + 1, p1, rdlen - (p1 - rdata));
+	}
+      else
+	{
+	  /* algo, flags, iterations, salt, next hash, type map. Only the
+	     zone's own NSEC3s, with parameters we'd accept in a proof. */
+	  if (rdlen < 6 || rdlen < 6 + (salt_len = rdata[4]) ||
+	      rdlen < 6 + salt_len + (hash_len = rdata[5 + salt_len]) ||
+	      (rdata[1] & ~0x01) != 0 ||
+	      ((rdata[2] << 8) | rdata[3]) > daemon->limit[LIMIT_NSEC3_ITERS] ||
+	      !hash_find(nsec3_digest_name(rdata[0])))
+	    continue;
+
+	  parent = strchr(owner, '.');
+	  parent = parent ? parent + 1 : owner + strlen(owner);
+	  
+	  if (!hostname_isequal(parent, signer) || hash_len == 0 ||
+	      base32_decode(owner, hash) != hash_len)
+	    continue;
+
+	  nsec_store(now, ttl, signer, T_NSEC3, rdata, hash, hash_len, &rdata[6 + salt_len], hash_len,
+		     &rdata[6 + salt_len + hash_len], rdlen - (6 + salt_len + hash_len));
+	}
+    }
+}
+
+/* The closest common ancestor of a and b, as a suffix of a. */
+static char *nsec_common(char *a, char *b)
+{
+  char *p;
+
+  for (p = a; *p; p++)
+    if ((p == a || *(p-1) == '.') && nsec_in_zone(b, p))
+      break;
+
+  return p;
+}
+
+/* Turn the closest encloser ce, a proper suffix of a writable name, into
+   the wildcard below it. */
+static char *nsec_wildcard(char *ce)
+{
+  if (*ce == 0)
+    {
+      *(ce-1) = '*';
+      return ce - 1;
+    }
+
+  *(ce-2) = '*';
+  *(ce-1) = '.';
+  return ce - 2;
+}
+
+static int nsec_answer(struct nsec_zone *zone, char *name, int qtype, time_t now)
+{
+  struct nsec_range *r;
+  char *ce, *ce1, *wild;
+  int i, exact;
+
+  i = nsec_find(zone, (unsigned char *)name, &exact);
+
+  if (!nsec_live(zone, i, now))
+    return 0;
+
+  r = zone->ranges[i];
+
+  if (exact)
+    return nsec_nodata(r, name, qtype);
+
+  if (!nsec_covers(zone, r, (unsigned char *)name) ||
+      (nsec_in_zone(name, (char *)r->owner) && nsec_cut(r)))
+    return 0;
+
+  /* Empty non-terminal: next is below name. */
+  if (nsec_in_zone((char *)r->next, name))
+    return F_NEG;
+
+  /* 4035 5.4: the wildcard at the closest encloser mustn't exist either. */
+  ce = nsec_common(name, (char *)r->owner);
+  if ((ce1 = nsec_common(name, (char *)r->next)) < ce)
+    ce = ce1;
+
+  if (ce == name)
+    return 0;
+  
+  wild = nsec_wildcard(ce);
+  i = nsec_find(zone, (unsigned char *)wild, &exact);
+
+  if (exact || !nsec_live(zone, i, now) || !nsec_covers(zone, zone->ranges[i], (unsigned char *)wild))
+    return 0;
+
+  return F_NEG | F_NXDOMAIN;
+}
+
+static int nsec3_hash(struct nsec_zone *zone, char *name, unsigned char *out)
+{
+  struct nettle_hash const *hash;
+  unsigned char *digest;
+
+  if (!(hash = hash_find(nsec3_digest_name(zone->algo))) ||
+      hash_name(name, &digest, hash, zone->salt, zone->salt_len, zone->iterations) != zone->hash_len)
+    return 0;
+
+  memcpy(out, digest, zone->hash_len);
+  return 1;
+}
+
+static int nsec3_answer(struct nsec_zone *zone, char *name, int qtype, time_t now)
+{
+  unsigned char hash[64];
+  char *ce, *next_closer;
+  int i, exact;
+
+  if (!nsec3_hash(zone, name, hash))
+    return 0;
+
+  i = nsec_find(zone, hash, &exact);
+  
+  if (exact)
+    return nsec_live(zone, i, now) ? nsec_nodata(zone->ranges[i], name, qtype) : 0;
+
+  /* Closest encloser proof, 5155 8.4: an ancestor with an NSEC3, and
+     ranges covering the next closer name, without opt-out, and the
+     wildcard at the closest encloser. */
+  for (next_closer = name; ; next_closer = ce)
+    {
+      if (*next_closer == 0)
+	return 0;
+      
+      ce = strchr(next_closer, '.');
+      ce = ce ? ce + 1 : next_closer + strlen(next_closer);
+
+      if (!nsec_in_zone(ce, zone->name) || !nsec3_hash(zone, ce, hash))
+	return 0;
+
+      i = nsec_find(zone, hash, &exact);
+
+      if (exact)
+	break;
+    }
+
+  if (!nsec_live(zone, i, now) || nsec_cut(zone->ranges[i]) ||
+      !nsec3_hash(zone, next_closer, hash))
+    return 0;
+
+  i = nsec_find(zone, hash, &exact);
+
+  if (exact || !nsec_live(zone, i, now) || zone->ranges[i]->optout ||
+      !nsec_covers(zone, zone->ranges[i], hash) ||
+      !nsec3_hash(zone, nsec_wildcard(ce), hash))
+    return 0;
+
+  i = nsec_find(zone, hash, &exact);
+
+  if (exact || !nsec_live(zone, i, now) || !nsec_covers(zone, zone->ranges[i], hash))
+    return 0;
+  
+  return F_NEG | F_NXDOMAIN;
+}
+
+/* Can the cached NSEC/NSEC3 ranges answer name/qtype? Returns F_NEG | F_NXDOMAIN
+   or F_NEG (NODATA) if so, and the zone, for its SOA, in *zonep. */
+int dnssec_nsec_answer(char *name, int qtype, time_t now, char **zonep)
+{
+  struct nsec_zone *zone, *best = NULL;
+  int ret;
+
+  for (zone = nsec_zones; zone; zone = zone->next)
+    if (zone->count != 0 && nsec_in_zone(name, zone->name) &&
+	(!best || strlen(zone->name) > strlen(best->name)))
+      best = zone;
+
+  if (!best)
+    return 0;
+
+  /* NSEC3 hashing canonicalises names in place, and the wildcard is built there too. */
+  strcpy(daemon->keyname, name);
+  
+  if (best->type == T_NSEC)
+    ret = nsec_answer(best, daemon->keyname, qtype, now);
+  else
+    ret = nsec3_answer(best, daemon->keyname, qtype, now);
+
+  if (ret != 0)
+    {
+      *zonep = best->name;
+      daemon->metrics[METRIC_DNS_NSEC_ANSWERED]++;
+    }
+
+  return ret;
+}
+
+void dnssec_nsec_flush(void)
+{
+  struct nsec_zone *zone;
+
+  while ((zone = nsec_zones))
+    {
+      nsec_zones = zone->next;
+      while (zone->count != 0)
+	nsec_remove(zone, zone->count - 1);
+      free(zone->ranges);
+      free(zone);
+    }
+}
+
 /* Validate all the RRsets in the answer and authority sections of the reply (4035:3.2.3) 
    Return code:
    STAT_SECURE   if it validates.
@@ -2322,6 +2921,9 @@ int dnssec_validate_reply(time_t now, struct dns_header *header, size_t plen, ch
 	    return STAT_BOGUS | rc_nsec; /* signed zone, no NSECs */
 	  }
       }
+
+  if (daemon->nsec_cache_size != 0 && STAT_ISEQUAL(secure, STAT_SECURE))
+    nsec_harvest(header, plen, keyname, now);
   
   return secure;
 }
@@ -97,6 +97,10 @@ void dump_packet_udp(int mask, void *packet, size_t len,
   union mysockaddr fd_addr;
   socklen_t addr_len = sizeof(fd_addr);
 
+#ifdef HAVE_SQLITE
+  db_tap_packet(mask, packet, len, src, dst, 0);
+#endif
+
   if (daemon->dumpfd != -1 && (mask & daemon->dump_mask))
      {
        /* if fd is negative it carries a port number (negated) 
@@ -272,6 +272,11 @@ void edns0_needs_mac(union mysockaddr *addr, time_t now)
 {
   if (option_bool(OPT_MAC_B64) || option_bool(OPT_MAC_HEX) || option_bool(OPT_ADD_MAC))
     find_mac(addr, NULL, 0, now);
+#ifdef HAVE_SQLITE
+  /* sqlite-policy=mac=... looks up the client MAC in answer_request() */
+  else if (db_policy_uses_mac())
+    find_mac(addr, NULL, 0, now);
+#endif
 }
 
 /* OPT_ADD_MAC = MAC is added (if available)
@@ -410,7 +415,7 @@ static size_t calc_subnet_opt(struct subnet_opt *opt, union mysockaddr *source,
    OPT_CLIENT_SUBNET + OPT_STRIP_ECS = client subnet is replaced
    OPT_STRIP_ECS = client subnet is removed */
 static size_t add_source_addr(struct dns_header *header, size_t plen, unsigned char *limit,
-			      union mysockaddr *source, int *cacheable)
+			      union mysockaddr *source, int *cacheable, int *ecs)
 {
   /* http://tools.ietf.org/html/draft-vandergaast-edns-client-subnet-02 */
   
@@ -419,9 +424,19 @@ static size_t add_source_addr(struct dns_header *header, size_t plen, unsigned c
   
   if (option_bool(OPT_CLIENT_SUBNET))
     {
+      unsigned char *pheader;
+      
       if (option_bool(OPT_STRIP_ECS))
 	replace = 1;
       len = calc_subnet_opt(&opt, source, cacheable);
+
+      /* The answer depends on the client's subnet, which we send: it can
+	 be cached for the scope in the reply, unless a subnet option from
+	 the client goes upstream in place of ours. */
+      if (ecs && !*cacheable &&
+	  (replace || !(pheader = find_pseudoheader(header, plen, NULL, NULL, NULL, NULL)) ||
+	   check_source(header, plen, pheader, NULL)))
+	*ecs = 1;
     }
   else if (option_bool(OPT_STRIP_ECS))
     replace = 2;
@@ -442,6 +457,37 @@ static size_t add_source_addr(struct dns_header *header, size_t plen, unsigned c
   return add_pseudoheader(header, plen, (unsigned char *)limit, EDNS0_OPTION_CLIENT_SUBNET, (unsigned char *)&opt, len, 0, replace);
 }
 
+/* Scope prefix length of the client subnet option in a reply, 0 (valid
+   for all clients, RFC 7871 7.3.1) if there is none. */
+int get_ecs_scope(struct dns_header *header, size_t plen)
+{
+  unsigned char *p, *pheader;
+  int code, i, len, rdlen;
+
+  if (!(pheader = find_pseudoheader(header, plen, NULL, NULL, NULL, NULL)) ||
+      !(p = skip_name(pheader, header, plen, 10)))
+    return 0;
+  
+  p += 8; /* skip UDP length and RCODE */
+  
+  GETSHORT(rdlen, p);
+  if (!CHECK_LEN(header, p, plen, rdlen))
+    return 0;
+  
+  for (i = 0; i + 4 < rdlen; i += len + 4)
+    {
+      GETSHORT(code, p);
+      GETSHORT(len, p);
+      if (i + 4 + len > rdlen)
+	return 0; /* bad packet */
+      if (code == EDNS0_OPTION_CLIENT_SUBNET && len >= 4)
+	return ((struct subnet_opt *)p)->scope_netmask;
+      p += len;
+    }
+  
+  return 0;
+}
+
 int check_source(struct dns_header *header, size_t plen, unsigned char *pseudoheader, union mysockaddr *peer)
 {
   /* Section 9.2, Check that subnet option (if any) in reply matches.
@@ -551,11 +597,16 @@ static size_t add_umbrella_opt(struct dns_header *header, size_t plen, unsigned
 
 /* Set *check_subnet if we add a client subnet option, which needs to checked 
    in the reply. Set *cacheable to zero if we add an option which the answer
-   may depend on. */
+   may depend on. Set *ecs (if not NULL) if the only such option is the
+   per-client subnet, so the answer can go into the cache for its scope. */
 size_t add_edns0_config(struct dns_header *header, size_t plen, unsigned char *limit, 
-			union mysockaddr *source, time_t now, int *cacheable)    
+			union mysockaddr *source, time_t now, int *cacheable, int *ecs)    
 {
+  int subnet_cacheable = 1;
+  
   *cacheable = 1;
+  if (ecs)
+    *ecs = 0;
   
   plen  = add_mac(header, plen, limit, source, now, cacheable);
   plen = add_dns_client(header, plen, limit, source, now, cacheable);
@@ -567,8 +618,13 @@ size_t add_edns0_config(struct dns_header *header, size_t plen, unsigned char *l
   if (option_bool(OPT_UMBRELLA))
     plen = add_umbrella_opt(header, plen, limit, source, cacheable);
   
-  plen = add_source_addr(header, plen, limit, source, cacheable);
+  plen = add_source_addr(header, plen, limit, source, &subnet_cacheable, ecs);
 
+  /* No per-scope caching when validating DNSSEC. */
+  if (ecs && (!*cacheable || option_bool(OPT_DNSSEC_VALID)))
+    *ecs = 0;
+  *cacheable = *cacheable && subnet_cacheable;
+  
   return plen;
 }
 
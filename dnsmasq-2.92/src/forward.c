@@ -19,13 +19,13 @@
 #ifdef HAVE_SQLITE
 /* Rewrite IP addresses in DNS response based on block_ips table
  * Scans answer section for A/AAAA records and rewrites matching IPs
- * Returns: number of IPs rewritten
+ * Returns: number of IPs rewritten, -1 if block_ips could not be read
  */
 static int sqlite_rewrite_response_ips(struct dns_header *header, size_t n)
 {
   unsigned char *p, *ansp;
   unsigned char *packet_end = (unsigned char *)header + n;
-  int i, rewritten = 0;
+  int i, rc, rewritten = 0;
   unsigned short type, class, rdlen;
 
   /* Skip past question section */
@@ -81,7 +81,9 @@ static int sqlite_rewrite_response_ips(struct dns_header *header, size_t n)
         /* Use memcpy to avoid alignment/aliasing issues */
         struct in_addr addr;
         memcpy(&addr, ansp, sizeof(addr));
-        if (db_rewrite_ipv4(&addr))
+        if ((rc = db_rewrite_ipv4(&addr)) < 0)
+          return -1;
+        if (rc)
           {
             memcpy(ansp, &addr, sizeof(addr));
             rewritten++;
@@ -90,7 +92,9 @@ static int sqlite_rewrite_response_ips(struct dns_header *header, size_t n)
         /* Use memcpy to avoid alignment/aliasing issues */
         struct in6_addr addr;
         memcpy(&addr, ansp, sizeof(addr));
-        if (db_rewrite_ipv6(&addr))
+        if ((rc = db_rewrite_ipv6(&addr)) < 0)
+          return -1;
+        if (rc)
           {
             memcpy(ansp, &addr, sizeof(addr));
             rewritten++;
@@ -114,8 +118,12 @@ static int tcp_key_recurse(time_t now, int status, struct dns_header *header, si
 #endif
 static unsigned short get_id(void);
 static void free_frec(struct frec *f);
+static void frec_set_sentto(struct frec *f, struct server *server, time_t now);
+static void frec_schedule(struct frec *f, time_t now);
 static void query_full(time_t now, char *domain);
 
+static int frecs_in_use, frecs_alloced, frec_srcs_in_use;
+
 /* Send a UDP packet with its source address set as "source" 
    unless nowild is true, when we just send it with the kernel default */
 int send_from(int fd, int nowild, char *packet, size_t len, 
@@ -391,6 +399,8 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
 	  
 	  src = daemon->free_frec_src;
 	  daemon->free_frec_src = src->next;
+	  if (daemon->metrics[METRIC_FREC_SRC_HWM] < (unsigned int)++frec_srcs_in_use)
+	    daemon->metrics[METRIC_FREC_SRC_HWM] = frec_srcs_in_use;
 	  src->next = forward->frec_src.next;
 	  forward->frec_src.next = src;
 	  src->orig_id = id;
@@ -481,7 +491,10 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
       forward->frec_src.encode_bigmap = NULL;
 
       if (!extract_name(header, plen, NULL, (char *)&forward->frec_src.encode_bitmap, EXTR_NAME_FLIP, 1))
-	goto reply;
+	{
+	  free_frec(forward);
+	  goto reply;
+	}
       
       /* Keep copy of query for retries and move to TCP */
       if (!(forward->stash = blockdata_alloc((char *)header, plen)))
@@ -652,7 +665,7 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
 
 	      srv->queries++;
 	      forwarded = 1;
-	      forward->sentto = srv;
+	      frec_set_sentto(forward, srv, now);
 	      if (!forward->forwardall) 
 		break;
 	      forward->forwardall++;
@@ -667,6 +680,7 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
     {
       daemon->metrics[METRIC_DNS_QUERIES_FORWARDED]++;
       forward->forward_timestamp = dnsmasq_milliseconds();
+      frec_schedule(forward, now);
       return;
     }
   
@@ -711,52 +725,325 @@ static void forward_query(int udpfd, union mysockaddr *udpaddr,
   return;
 }
 
-/* Check if any frecs need to do a retry, and action that if so. 
-   Return time in milliseconds until he next retry will be required,
-   or -1 if none. */
-int fast_retry(time_t now)
+/* Every frec in use has one timer, for whichever comes first of its
+   fast retry, the end of its TIMEOUT in the per-server count used to
+   limit concurrent queries, and garbage collection after 4*TIMEOUT.
+   Timers live in a hierarchical wheel: WHEEL_LEVELS levels of
+   WHEEL_SLOTS slots, a level-0 slot is one WHEEL_TICK ms tick and a slot
+   at level n covers WHEEL_SLOTS^n ticks. Adding and removing a timer is
+   O(1), timers move down a level when their slot comes round. */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK   8
+
+static struct frec *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static unsigned long long wheel_used[WHEEL_LEVELS]; /* bitmap of non-empty slots */
+static unsigned long long wheel_tick;   /* next tick to run */
+static unsigned long long wheel_clock;  /* monotonic ms */
+static u32 wheel_millis;                /* dnsmasq_milliseconds() at wheel_clock */
+static int wheel_count;
+
+static unsigned long long wheel_update(void)
+{
+  u32 millis = dnsmasq_milliseconds();
+  u32 diff = millis - wheel_millis;
+
+  /* Don't follow the wall clock backwards. */
+  if (wheel_clock == 0 || diff > 0x7fffffff)
+    diff = 1;
+
+  wheel_millis = millis;
+  wheel_clock += diff;
+  
+  return wheel_clock;
+}
+
+static void wheel_remove(struct frec *f)
+{
+  if (!f->timer_pprev)
+    return;
+  
+  if ((*f->timer_pprev = f->timer_next))
+    f->timer_next->timer_pprev = f->timer_pprev;
+
+  if (f->timer_slot != -1 && !wheel[f->timer_slot / WHEEL_SLOTS][f->timer_slot % WHEEL_SLOTS])
+    wheel_used[f->timer_slot / WHEEL_SLOTS] &= ~(1ULL << (f->timer_slot % WHEEL_SLOTS));
+  
+  f->timer_pprev = NULL;
+  wheel_count--;
+}
+
+static void wheel_add(struct frec *f)
+{
+  unsigned long long due = f->timer_due < wheel_tick ? wheel_tick : f->timer_due;
+  unsigned long long delta = due - wheel_tick;
+  int level, slot;
+
+  for (level = 0; level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))); level++);
+
+  /* Beyond the top level (days), park in its furthest slot and look again then. */
+  if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
+    due = wheel_tick + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  
+  slot = (due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  f->timer_slot = level * WHEEL_SLOTS + slot;
+  if ((f->timer_next = wheel[level][slot]))
+    f->timer_next->timer_pprev = &f->timer_next;
+  f->timer_pprev = &wheel[level][slot];
+  wheel[level][slot] = f;
+  wheel_used[level] |= 1ULL << slot;
+  wheel_count++;
+}
+
+/* Take a slot's list out of the wheel, its frecs can still be removed. */
+static struct frec *wheel_detach(int level, int slot, struct frec **head)
 {
   struct frec *f;
-  int ret = -1;
   
-  if (daemon->fast_retry_time != 0)
+  if ((*head = wheel[level][slot]))
+    (*head)->timer_pprev = head;
+  wheel[level][slot] = NULL;
+  wheel_used[level] &= ~(1ULL << slot);
+
+  for (f = *head; f; f = f->timer_next)
+    f->timer_slot = -1;
+  
+  return *head;
+}
+
+static int frec_can_retry(struct frec *f, time_t now)
+{
+  if (daemon->fast_retry_time == 0 || !f->sentto || difftime(now, f->time) >= daemon->fast_retry_timeout)
+    return 0;
+#ifdef HAVE_DNSSEC
+  if (f->blocking_query || (f->flags & FREC_GONE_TO_TCP))
+    return 0;
+#endif
+  return 1;
+}
+
+/* (Re)arm the timer of a frec in use. */
+static void frec_schedule(struct frec *f, time_t now)
+{
+  unsigned long long clock = wheel_update();
+  long long wait = -1, age = (long long)difftime(now, f->time) * 1000;
+
+#ifdef HAVE_DNSSEC
+  /* DNSSEC sub-queries are freed with the query waiting for them. */
+  if (!f->dependent)
+#endif
+    wait = 4*TIMEOUT*1000 - age;
+
+  if (f->counted && (wait == -1 || TIMEOUT*1000 - age < wait))
+    wait = TIMEOUT*1000 - age;
+
+  if (frec_can_retry(f, now))
     {
-      u32 millis = dnsmasq_milliseconds();
+      int to_run = f->forward_delay - (int)(wheel_millis - f->forward_timestamp);
       
-      for (f = daemon->frec_list; f; f = f->next)
-	if (f->sentto && difftime(now, f->time) < daemon->fast_retry_timeout)
-	  {
+      if (wait == -1 || to_run < wait)
+	wait = to_run;
+    }
+
+  wheel_remove(f);
+  
+  if (wait == -1)
+    return;
+  
+  if (wait < 0)
+    wait = 0;
+  
+  f->timer_due = (clock + wait + WHEEL_TICK - 1) / WHEEL_TICK;
+  wheel_add(f);
+}
+
+/* Frecs in use but past TIMEOUT, in the order they got there. When the
+   free list is empty get_new_frec() recycles the oldest, rather than
+   leaving it until its 4*TIMEOUT expiry and going to the heap. */
+static struct frec *stale_head, **stale_tail = &stale_head;
+
+static void stale_add(struct frec *f)
+{
+  if (f->stale_pprev)
+    return;
+  f->stale_next = NULL;
+  f->stale_pprev = stale_tail;
+  *stale_tail = f;
+  stale_tail = &f->stale_next;
+}
+
+static void stale_remove(struct frec *f)
+{
+  if (!f->stale_pprev)
+    return;
+  if ((*f->stale_pprev = f->stale_next))
+    f->stale_next->stale_pprev = f->stale_pprev;
+  else
+    stale_tail = f->stale_pprev;
+  f->stale_pprev = NULL;
+}
+
+static void frec_set_sentto(struct frec *f, struct server *server, time_t now)
+{
+  if (f->counted)
+    f->counted->frec_count--;
+  
+  f->sentto = server;
+  f->counted = NULL;
+  
+  if (server && difftime(now, f->time) < TIMEOUT)
+    {
+      f->counted = server;
+      server->frec_count++;
+    }
+
+  if (server && !f->counted)
+    stale_add(f);
+  else
+    stale_remove(f);
+}
+
+/* Number of frecs younger than TIMEOUT sent to master's server-group. */
+static int group_frecs(struct server *master)
+{
+  int i, count = 0;
+
+  for (i = master->arrayposn; i > 0 && server_samegroup(daemon->serverarray[i-1], master); i--);
+
+  for (; i < daemon->serverarraysz && server_samegroup(daemon->serverarray[i], master); i++)
+    if (!(daemon->serverarray[i]->flags & (SERV_USE_RESOLV | SERV_LITERAL_ADDRESS)))
+      count += daemon->serverarray[i]->frec_count;
+  
+  return count;
+}
+
+static void frec_timer(struct frec *f, time_t now)
+{
+  int age = (int)difftime(now, f->time);
+
+  if (f->counted && age >= TIMEOUT)
+    {
+      f->counted->frec_count--;
+      f->counted = NULL;
+      stale_add(f);
+    }
+
 #ifdef HAVE_DNSSEC
-	    if (f->blocking_query || (f->flags & FREC_GONE_TO_TCP))
-	      continue;
+  if (!f->dependent)
 #endif
-	    /* t is milliseconds since last query sent. */ 
-	    int to_run, t = (int)(millis - f->forward_timestamp);
-	    
-	    if (t < f->forward_delay)
-	      to_run = f->forward_delay - t;
-	    else
-	      {
-		struct dns_header *header = (struct dns_header *)daemon->packet;
-		
-		/* packet buffer overwritten */
-		daemon->srv_save = NULL;
-		
-		blockdata_retrieve(f->stash, f->stash_len, (void *)header);
-		
-		daemon->log_display_id = f->frec_src.log_id;
-		daemon->log_source_addr = NULL;
-		
-		forward_query(-1, NULL, NULL, 0, header, f->stash_len, 0, now, f, 0, 1);
-		
-		to_run = f->forward_delay = 2 * f->forward_delay;
-	      }
+    if (age >= 4*TIMEOUT)
+      {
+	daemon->metrics[METRIC_DNS_UNANSWERED_QUERY]++;
+	free_frec(f);
+	return;
+      }
+  
+  if (frec_can_retry(f, now))
+    {
+      /* t is milliseconds since last query sent. */ 
+      int t = (int)(dnsmasq_milliseconds() - f->forward_timestamp);
+      
+      if (t >= f->forward_delay)
+	{
+	  struct dns_header *header = (struct dns_header *)daemon->packet;
+	  
+	  /* packet buffer overwritten */
+	  daemon->srv_save = NULL;
+	  
+	  blockdata_retrieve(f->stash, f->stash_len, (void *)header);
+	  
+	  daemon->log_display_id = f->frec_src.log_id;
+	  daemon->log_source_addr = NULL;
+	  
+	  forward_query(-1, NULL, NULL, 0, header, f->stash_len, 0, now, f, 0, 1);
 
-	    if (ret == -1 || ret > to_run)
-	      ret = to_run;
-	  }
+	  /* Cancelled if it couldn't be sent anywhere. */
+	  if (!f->sentto)
+	    return;
+	  
+	  f->forward_delay = 2 * f->forward_delay;
+	}
     }
-  return ret;
+
+  frec_schedule(f, now);
+}
+
+/* Run the timers which are due: retries, and expiry of frecs.
+   Return time in milliseconds until the wheel next needs attention,
+   or -1 if no timers are set. */
+int fast_retry(time_t now)
+{
+  unsigned long long clock = wheel_update(), tick = clock / WHEEL_TICK, next;
+  struct frec *f, *list;
+  int level, slot;
+  
+  while (wheel_tick <= tick)
+    {
+      if (wheel_count == 0)
+	{
+	  wheel_tick = tick + 1;
+	  break;
+	}
+
+      /* Nothing at level 0, skip to where the next slot of level 1 comes down. */
+      if (!wheel_used[0] && (wheel_tick & (WHEEL_SLOTS - 1)))
+	{
+	  next = (wheel_tick | (WHEEL_SLOTS - 1)) + 1;
+	  wheel_tick = next <= tick ? next : tick + 1;
+	  continue;
+	}
+
+      /* Move the timers of the upper level slots which start now down. */
+      for (level = 1; level < WHEEL_LEVELS && !(wheel_tick & ((1ULL << (WHEEL_BITS * level)) - 1)); level++);
+      while (--level > 0)
+	{
+	  slot = (wheel_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	  for (wheel_detach(level, slot, &list); (f = list); )
+	    {
+	      wheel_remove(f);
+	      wheel_add(f);
+	    }
+	}
+      
+      /* Handlers may free other frecs, so always take the head. */
+      wheel_detach(0, wheel_tick & (WHEEL_SLOTS - 1), &list);
+      wheel_tick++;
+      
+      while ((f = list))
+	{
+	  wheel_remove(f);
+	  if (f->timer_due >= wheel_tick)
+	    wheel_add(f);
+	  else
+	    frec_timer(f, now);
+	}
+    }
+
+  if (wheel_count == 0)
+    return -1;
+  
+  /* Earliest occupied slot at any level. */
+  for (next = 0, level = 0; level < WHEEL_LEVELS; level++)
+    if (wheel_used[level])
+      {
+	int shift = WHEEL_BITS * level;
+	/* first slot boundary not yet run */
+	unsigned long long base = (wheel_tick + (1ULL << shift) - 1) >> shift;
+	unsigned long long used = wheel_used[level];
+	int rot = base & (WHEEL_SLOTS - 1);
+	unsigned long long t;
+	
+	used = (used >> rot) | (rot ? used << (WHEEL_SLOTS - rot) : 0);
+	t = (base + __builtin_ctzll(used)) << shift;
+	if (next == 0 || t < next)
+	  next = t;
+      }
+  
+  if (next * WHEEL_TICK <= clock)
+    return 0;
+  
+  return (int)(next * WHEEL_TICK - clock);
 }
 
 #if defined(HAVE_IPSET) || defined(HAVE_NFTSET)
@@ -939,8 +1226,15 @@ static size_t process_reply(struct dns_header *header, time_t now, struct server
 
 #ifdef HAVE_SQLITE
       /* Rewrite IPs in response based on block_ips table */
-      if (RCODE(header) == NOERROR)
-	sqlite_rewrite_response_ips(header, n);
+      if (RCODE(header) == NOERROR && sqlite_rewrite_response_ips(header, n) < 0)
+	{
+	  /* Don't hand out addresses which may have needed rewriting. */
+	  SET_RCODE(header, SERVFAIL);
+	  header->ancount = htons(0);
+	  header->nscount = htons(0);
+	  header->arcount = htons(0);
+	  ede = EDE_OTHER;
+	}
 #endif
     }
 
@@ -1133,9 +1427,11 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 		  *new = *forward; /* copy everything, then overwrite */
 		  new->next = next;
 		  new->blocking_query = NULL;
+		  new->timer_pprev = NULL;
+		  new->counted = NULL;
 		  
 		  new->frec_src.log_id = daemon->log_display_id = ++daemon->log_id;
-		  new->sentto = server;
+		  frec_set_sentto(new, server, now);
 		  new->rfds = rfds;
 		  new->frec_src.next = NULL;
 		  new->flags &= ~(FREC_DNSKEY_QUERY | FREC_DS_QUERY);
@@ -1160,6 +1456,7 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 		  new->stash_len = nn;
 		  if (daemon->fast_retry_time != 0)
 		    new->forward_timestamp = dnsmasq_milliseconds();
+		  frec_schedule(new, now);
 		  
 		  /* Don't resend this. */
 		  daemon->srv_save = NULL;
@@ -1353,7 +1650,7 @@ void reply_query(int fd, time_t now)
   if (forward->forwardall && (--forward->forwardall > 1) && RCODE(header) == REFUSED)
     return;
 
-  forward->sentto = server;
+  frec_set_sentto(forward, server, now);
 
   /* We have a good answer, and will now validate it or return it. 
      It may be some time before this the validation completes, but we don't need
@@ -1514,14 +1811,22 @@ void return_reply(time_t now, struct frec *forward, struct dns_header *header, s
     header->hb4 &= ~HB4_CD;
 
   /* Never cache answers which are contingent on the source or MAC address EDSN0 option,
-     since the cache is ignorant of such things. */
-  if (forward->flags & FREC_NO_CACHE)
+     since the cache is ignorant of such things. The exception is our own
+     per-client subnet, those answers are cached for the scope the reply gives. */
+  if (forward->flags & FREC_ECS)
+    cache_ecs_set(&forward->frec_src.source, get_ecs_scope(header, n));
+  else if (forward->flags & FREC_NO_CACHE)
     no_cache_dnssec = 1;
   
-  if ((nn = process_reply(header, now, forward->sentto, (size_t)n, check_rebind, no_cache_dnssec, cache_secure, bogusanswer, 
-			  forward->flags & FREC_AD_QUESTION, forward->flags & FREC_DO_QUESTION, 
-			  !(forward->flags & FREC_HAS_PHEADER), &forward->frec_src.source,
-			  ((unsigned char *)header) + daemon->edns_pktsz, ede)))
+  nn = process_reply(header, now, forward->sentto, (size_t)n, check_rebind, no_cache_dnssec, cache_secure, bogusanswer, 
+		     forward->flags & FREC_AD_QUESTION, forward->flags & FREC_DO_QUESTION, 
+		     !(forward->flags & FREC_HAS_PHEADER), &forward->frec_src.source,
+		     ((unsigned char *)header) + daemon->edns_pktsz, ede);
+  
+  if (forward->flags & FREC_ECS)
+    cache_ecs_set(NULL, 0);
+  
+  if (nn)
     {
       struct frec_src *src, *prev;
       int do_trunc;
@@ -1669,7 +1974,7 @@ void receive_query(struct listener *listen, time_t now)
   ssize_t n;
   int if_index = 0, auth_dns = 0, do_bit = 0;
   unsigned int fwd_flags = 0;
-  int stale = 0, filtered = 0, ede = EDE_UNSET, do_forward = 0;
+  int stale = 0, prefetch = 0, filtered = 0, ede = EDE_UNSET, do_forward = 0;
   int metric, fd; 
   struct blockdata *saved_question = NULL;
 #ifdef HAVE_CONNTRACK
@@ -2022,16 +2327,31 @@ void receive_query(struct listener *listen, time_t now)
 #endif
   else
     {
-      int cacheable;
+      int cacheable, ecs;
 
-      n = add_edns0_config(header, n, ((unsigned char *)header) + daemon->edns_pktsz, &source_addr, now, &cacheable);
+      n = add_edns0_config(header, n, ((unsigned char *)header) + daemon->edns_pktsz, &source_addr, now, &cacheable, &ecs);
       saved_question = blockdata_alloc((char *) header, (size_t)n);
 
       if (!cacheable)
 	fwd_flags |= FREC_NO_CACHE;
 
+      /* Answers for our per-client subnet are cached per scope: look for
+	 one which covers this client. */
+      if (ecs)
+	{
+	  fwd_flags |= FREC_ECS;
+	  cache_ecs_set(&source_addr, -1);
+	}
+      
       m = answer_request(header, ((char *) header) + udp_size, (size_t)n, 
-			 dst_addr_4, netmask, now, fwd_flags & FREC_AD_QUESTION, do_bit, !cacheable, &stale, &filtered);
+			 dst_addr_4, netmask, now, fwd_flags & FREC_AD_QUESTION, do_bit, !cacheable && !ecs,
+			 &stale, &prefetch, &filtered);
+
+      if (ecs)
+	{
+	  cache_ecs_set(NULL, 0);
+	  daemon->metrics[m != 0 ? METRIC_DNS_ECS_ANSWERED : METRIC_DNS_ECS_FORWARDED]++;
+	}
       
       metric = stale ? METRIC_DNS_STALE_ANSWERED : METRIC_DNS_LOCAL_ANSWERED;
       
@@ -2080,7 +2400,11 @@ void receive_query(struct listener *listen, time_t now)
 
       daemon->metrics[metric]++;
       
-      if (stale)
+      /* Popular entries near the end of their TTL are refreshed the same way. */
+      if (prefetch && !stale)
+	daemon->metrics[METRIC_DNS_PREFETCHED]++;
+      
+      if (stale || prefetch)
 	{
 	  /* We answered with stale cache data, so forward the query anyway to
 	     refresh that. */
@@ -2556,6 +2880,10 @@ unsigned char *tcp_request(int confd, time_t now,
 	     log_display_id is negative for TCP connections. */
 	  daemon->log_display_id = -(++daemon->log_id);
 	  daemon->log_source_addr = &peer_addr;
+
+#ifdef HAVE_SQLITE
+	  db_tap_packet(DUMP_QUERY, payload, size, &peer_addr, NULL, 1);
+#endif
 	  
 	  if (OPCODE(header) != QUERY)
 	    {
@@ -2584,7 +2912,7 @@ unsigned char *tcp_request(int confd, time_t now,
 		    do_bit = 1; /* do bit */ 
 		}
 
-	      size = add_edns0_config(header, size, ((unsigned char *) header) + 65536, &peer_addr, now, &cacheable);
+	      size = add_edns0_config(header, size, ((unsigned char *) header) + 65536, &peer_addr, now, &cacheable, NULL);
 	      saved_question = blockdata_alloc((char *)header, (size_t)size);
 	      saved_size = size;
 	      
@@ -2649,7 +2977,7 @@ unsigned char *tcp_request(int confd, time_t now,
 #endif
 	      else
 		m = answer_request(header, ((char *) header) + 65536, (size_t)size, 
-				   dst_addr_4, netmask, now, ad_reqd, do_bit, !cacheable, &stale, &filtered);
+				   dst_addr_4, netmask, now, ad_reqd, do_bit, !cacheable, &stale, NULL, &filtered);
 	    }
 	}
       
@@ -2831,6 +3159,10 @@ unsigned char *tcp_request(int confd, time_t now,
 	if (option_bool(OPT_CMARK_ALST_EN) && have_mark && ((u32)mark & daemon->allowlist_mask))
 	  report_addresses(header, m, mark);
 #endif
+
+#ifdef HAVE_SQLITE
+      db_tap_packet(DUMP_REPLY, header, m, NULL, &peer_addr, 1);
+#endif
       
       if (!read_write(confd, packet, m + sizeof(u16), RW_WRITE))
 	break;
@@ -3140,14 +3472,18 @@ static void free_frec(struct frec *f)
   /* add back to freelist if not the record builtin to every frec,
      also free any bigmaps they've been decorated with. */
   for (last = f->frec_src.next; last && last->next; last = last->next)
-    if (last->encode_bigmap)
-      {
-	free(last->encode_bigmap);
-	last->encode_bigmap = NULL;
-      }
+    {
+      frec_srcs_in_use--;
+      if (last->encode_bigmap)
+	{
+	  free(last->encode_bigmap);
+	  last->encode_bigmap = NULL;
+	}
+    }
   
   if (last)
     {
+      frec_srcs_in_use--;
       /* final link in the chain loses bigmap too. */
       if (last->encode_bigmap)
 	{
@@ -3160,9 +3496,18 @@ static void free_frec(struct frec *f)
     
   f->frec_src.next = NULL;    
   free_rfds(&f->rfds);
-  f->sentto = NULL;
+  frec_set_sentto(f, NULL, 0);
+  wheel_remove(f);
   f->flags = 0;
 
+  if (!f->on_free_list)
+    {
+      f->next_free = daemon->free_frec_list;
+      daemon->free_frec_list = f;
+      f->on_free_list = 1;
+      frecs_in_use--;
+    }
+
   if (f->stash)
     {
       blockdata_free(f->stash);
@@ -3198,75 +3543,57 @@ static void free_frec(struct frec *f)
 
 
 
-/* Impose an absolute
-   limit of 4*TIMEOUT before we wipe things (for random sockets).
+/* Records older than 4*TIMEOUT are wiped by their timer (for random
+   sockets), and only those younger than TIMEOUT count towards the
+   limit of concurrent queries, see fast_retry().
    If force is set, always return a result, even if we have
-   to allocate above the limit, and don't free any records.
-   This is set when allocating for DNSSEC to avoid cutting off
-   the branch we are sitting on. */
+   to allocate above the limit. This is set when allocating for DNSSEC
+   to avoid cutting off the branch we are sitting on. */
 static struct frec *get_new_frec(time_t now, struct server *master, int force)
 {
-  struct frec *f, *oldest, *target;
-  int count;
+  struct frec *target;
 #ifdef HAVE_DNSSEC
   static int next_uid = 0;
 #endif
   
-  /* look for free records, garbage collect old records and count number in use by our server-group. */
-  for (f = daemon->frec_list, oldest = NULL, target =  NULL, count = 0; f; f = f->next)
+  if (!force && group_frecs(master) >= daemon->ftabsize)
     {
-      if (!f->sentto)
-	target = f;
-      else
-	{
+      query_full(now, master->domain);
+      return NULL;
+    }
+  
+  /* Pool empty: reuse the oldest record past TIMEOUT, as it would
+     otherwise sit there until its 4*TIMEOUT expiry. */
+  if (!daemon->free_frec_list && !force)
+    for (target = stale_head; target; target = target->stale_next)
 #ifdef HAVE_DNSSEC
-	  /* Don't free DNSSEC sub-queries here, as we may end up with
-	     dangling references to them. They'll go when their "real" query 
-	     is freed. */
-	  if (!f->dependent)
+      /* DNSSEC sub-queries go with the query waiting for them. */
+      if (!target->dependent)
 #endif
-	    if (!force)
-	      {
-		if (difftime(now, f->time) >= 4*TIMEOUT)
-		  {
-		    daemon->metrics[METRIC_DNS_UNANSWERED_QUERY]++;
-		    free_frec(f);
-		    target = f;
-		  }
-		else if (!oldest || difftime(f->time, oldest->time) <= 0)
-		  oldest = f;
-	      }
+	{
+	  daemon->metrics[METRIC_DNS_UNANSWERED_QUERY]++;
+	  free_frec(target);
+	  break;
 	}
-      
-      if (f->sentto && ((int)difftime(now, f->time)) < TIMEOUT && server_samegroup(f->sentto, master))
-	count++;
-    }
   
-  if (!force)
+  /* The pool from frec_init() only runs dry when several server-groups
+     are busy at once, or for DNSSEC; records are never returned to the heap. */
+  if ((target = daemon->free_frec_list))
     {
-      if (count >= daemon->ftabsize)
-	{
-	  query_full(now, master->domain);
-	  return NULL;
-	}
-      
-      if (!target && oldest && ((int)difftime(now, oldest->time)) >= TIMEOUT)
-	{ 
-	  /* can't find empty one, use oldest if there is one and it's older than timeout */
-	  daemon->metrics[METRIC_DNS_UNANSWERED_QUERY]++;
-	  free_frec(oldest);
-	  target = oldest;
-	}      
+      daemon->free_frec_list = target->next_free;
+      target->on_free_list = 0;
     }
-  
-  if (!target && (target = (struct frec *)whine_malloc(sizeof(struct frec))))
+  else if ((target = (struct frec *)whine_malloc(sizeof(struct frec))))
     {
       target->next = daemon->frec_list;
       daemon->frec_list = target;
+      frecs_alloced++;
     }
 
   if (target)
     {
+      if (daemon->metrics[METRIC_FREC_HWM] < (unsigned int)++frecs_in_use)
+	daemon->metrics[METRIC_FREC_HWM] = frecs_in_use;
       target->time = now;
       target->forward_delay = daemon->fast_retry_time;
 #ifdef HAVE_DNSSEC
@@ -3277,6 +3604,218 @@ static struct frec *get_new_frec(time_t now, struct server *master, int force)
   return target;
 }
 
+/* A typical query as stashed for forwarding: header (12), a name of
+   about 40 bytes, type and class (4), and an OPT RR (11) carrying a
+   client subnet or cookie option (up to 28). That is 95 bytes, or
+   three KEYBLOCK_LEN blocks. */
+#define FREC_STASH_TYPICAL (12 + 40 + 4 + 11 + 28)
+
+/* Preallocate --dns-forward-max frecs and extra query sources as one
+   block each, plus blockdata for their stashed queries, so forwarding
+   doesn't go to the heap once running. */
+void frec_init(void)
+{
+  struct frec *frecs = safe_malloc(daemon->ftabsize * sizeof(struct frec));
+  struct frec_src *srcs = safe_malloc(daemon->ftabsize * sizeof(struct frec_src));
+  int i;
+
+  /* safe_malloc returns zero'd memory */
+  for (i = daemon->ftabsize - 1; i >= 0; i--)
+    {
+      frecs[i].next = daemon->frec_list;
+      daemon->frec_list = &frecs[i];
+      frecs[i].next_free = daemon->free_frec_list;
+      daemon->free_frec_list = &frecs[i];
+      frecs[i].on_free_list = 1;
+
+      srcs[i].next = daemon->free_frec_src;
+      daemon->free_frec_src = &srcs[i];
+    }
+
+  frecs_alloced = daemon->frec_src_count = daemon->ftabsize;
+
+  blockdata_reserve(daemon->ftabsize * ((FREC_STASH_TYPICAL + KEYBLOCK_LEN - 1) / KEYBLOCK_LEN));
+}
+
+void frec_report(void)
+{
+  my_syslog(LOG_INFO, _("forwarded queries in progress %d, max %u, allocated %d; extra sources %d, max %u, allocated %d; pool misses %u"),
+	    frecs_in_use, daemon->metrics[METRIC_FREC_HWM], frecs_alloced,
+	    frec_srcs_in_use, daemon->metrics[METRIC_FREC_SRC_HWM], daemon->frec_src_count,
+	    daemon->metrics[METRIC_BLOCKDATA_MISSES]);
+}
+
+/* --cache-warmup: at startup, look up the names of a ranked list
+   upstream, most popular first, so the cache is full before the
+   clients ask. The list has one name per line, or the "<count> <name>"
+   lines of the control socket's top command. Each name is queried as A
+   and AAAA, at most warmup_qps queries a second and with no more than
+   half of --dns-forward-max in flight. Names already in the cache (from
+   --cache-snapshot, say) are skipped, and blocked names are only looked
+   up in the blocklist, not forwarded. */
+static char **warmup_list = NULL;
+static int warmup_count, warmup_next, warmup_qtype, warmup_budget;
+static time_t warmup_second, warmup_started;
+
+/* Called at startup, before privileges are dropped */
+void warmup_init(void)
+{
+  char line[MAXDNAME + 32];
+  int size = 0, bad = 0;
+  FILE *f;
+
+  if (!daemon->warmup_file)
+    return;
+
+  if (!(f = fopen(daemon->warmup_file, "r")))
+    die(_("cannot read %s: %s"), daemon->warmup_file, EC_FILE);
+
+  while (fgets(line, sizeof(line), f))
+    {
+      char *tok = strtok(line, " \t\r\n"), *next, *name;
+      int nomem;
+
+      /* comments, and the "window" and "OK" lines of the top output */
+      if (!tok || *tok == '#' || strcmp(tok, "window") == 0 || strcmp(tok, "OK") == 0)
+	continue;
+
+      if ((next = strtok(NULL, " \t\r\n")) && strspn(tok, "0123456789") == strlen(tok))
+	tok = next;
+
+      if (!(name = canonicalise(tok, &nomem)))
+	{
+	  bad++;
+	  continue;
+	}
+      
+      if (warmup_count == size)
+	{
+	  char **new = whine_realloc(warmup_list, (size = size ? 2 * size : 1024) * sizeof(char *));
+
+	  if (!new)
+	    {
+	      free(name);
+	      break;
+	    }
+	  warmup_list = new;
+	}
+      warmup_list[warmup_count++] = name;
+    }
+  
+  fclose(f);
+
+  if (bad != 0)
+    my_syslog(LOG_WARNING, _("cache warm-up: ignored %d bad names in %s"), bad, daemon->warmup_file);
+
+  daemon->metrics[METRIC_WARMUP_NAMES] = warmup_count;
+  if (warmup_count == 0)
+    {
+      free(warmup_list);
+      warmup_list = NULL;
+    }
+}
+
+/* The main loop wakes every quarter second until the list is done. */
+int warmup_pending(void)
+{
+  return warmup_list != NULL;
+}
+
+/* A query with no client: the reply only goes into the cache. */
+static void warmup_query(char *name, unsigned short qtype, time_t now)
+{
+  struct dns_header *header = (struct dns_header *)daemon->packet;
+  union mysockaddr source;
+  union all_addr dst_addr;
+  unsigned char *p;
+
+  memset(header, 0, sizeof(struct dns_header));
+  header->id = htons(rand16());
+  header->hb3 = HB3_RD;
+  header->qdcount = htons(1);
+  
+  p = do_rfc1035_name((unsigned char *)(header+1), name, NULL);
+  *p++ = 0;
+  PUTSHORT(qtype, p);
+  PUTSHORT(C_IN, p);
+
+  memset(&source, 0, sizeof(source));
+  source.in.sin_family = AF_INET;
+  source.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  memset(&dst_addr, 0, sizeof(dst_addr));
+  daemon->log_source_addr = NULL;
+
+  forward_query(-1, &source, &dst_addr, 0, header, p - (unsigned char *)header,
+		daemon->edns_pktsz, now, NULL, 0, 0);
+  daemon->metrics[METRIC_WARMUP_QUERIES]++;
+}
+
+/* Once the cache is loaded at start, which would discard earlier answers */
+void warmup_start(time_t now)
+{
+  if (!warmup_list || warmup_started != 0)
+    return;
+
+  warmup_started = now;
+  my_syslog(LOG_INFO, _("cache warm-up: %d names from %s, %d queries/s"),
+	    warmup_count, daemon->warmup_file, daemon->warmup_qps);
+}
+
+void warmup_poll(time_t now)
+{
+  static const unsigned short qtypes[] = { T_A, T_AAAA };
+  
+  if (!warmup_list || warmup_started == 0 || !daemon->servers)
+    return;
+
+  if (now != warmup_second)
+    {
+      warmup_second = now;
+      warmup_budget = daemon->warmup_qps;
+    }
+  
+  /* leave half the forward table to clients, but at least one slot so
+     a tiny --dns-forward-max still finishes */
+  while (warmup_budget > 0 && frecs_in_use < (daemon->ftabsize > 1 ? daemon->ftabsize / 2 : 1))
+    {
+      char *name;
+      
+      if (warmup_next == warmup_count)
+	{
+	  my_syslog(LOG_INFO, _("cache warm-up done: %d names, %u queries, %u blocked, %ds"),
+		    warmup_count, daemon->metrics[METRIC_WARMUP_QUERIES],
+		    daemon->metrics[METRIC_WARMUP_BLOCKED], (int)difftime(now, warmup_started));
+	  free(warmup_list);
+	  warmup_list = NULL;
+	  return;
+	}
+
+      name = warmup_list[warmup_next];
+
+#ifdef HAVE_SQLITE
+      if (warmup_qtype == 0 && db_warm_block(name))
+	{
+	  daemon->metrics[METRIC_WARMUP_BLOCKED]++;
+	  warmup_qtype = 1;
+	}
+      else
+#endif
+	if (!cache_find_by_name(NULL, name, now, qtypes[warmup_qtype] == T_A ? F_IPV4 : F_IPV6))
+	  {
+	    warmup_query(name, qtypes[warmup_qtype], now);
+	    warmup_budget--;
+	  }
+      
+      if (++warmup_qtype == 2)
+	{
+	  free(name);
+	  warmup_qtype = 0;
+	  warmup_next++;
+	  daemon->metrics[METRIC_WARMUP_DONE]++;
+	}
+    }
+}
+
 static void query_full(time_t now, char *domain)
 {
   static time_t last_log = 0;
@@ -3342,10 +3881,8 @@ static struct frec *lookup_frec(time_t now, char *target, int class, int rrtype,
 	    continue;
 	  }
 
-	/* frecs older than this will get garbage-collected in
-	   get_new_frec(), so don't return them here, so we have
-	   consistent behaviour from an idle dnsmasq which
-	   is not calling get_new_frec() often. */
+	/* frecs older than this are about to be garbage-collected
+	   by their timer, don't return them here. */
 	if (difftime(now, f->time) >= 4*TIMEOUT)
 	  return NULL;
 	
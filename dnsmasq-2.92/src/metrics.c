@@ -46,7 +46,33 @@ const char * metric_names[] = {
     "dhcp_leasequery",
     "dhcp_lease_unassigned",
     "dhcp_lease_actve",
-    "dhcp_lease_unknown"
+    "dhcp_lease_unknown",
+    "sqlite_blocked_hosts",
+    "sqlite_blocked_wildcard",
+    "sqlite_rewritten",
+    "sqlite_overlay_hits",
+    "sqlite_allowed",
+    "sqlite_errors",
+    "sqlite_qlog_dropped",
+    "sqlite_qlog_lost",
+    "sqlite_tap_dropped",
+    "sqlite_tap_errors",
+    "sqlite_stats_dropped",
+    "sqlite_stats_errors",
+    "dns_max_forwards",
+    "dns_max_forward_sources",
+    "pool_max_blocks",
+    "pool_misses",
+    "dns_prefetch_queries",
+    "warmup_names",
+    "warmup_names_done",
+    "warmup_queries",
+    "warmup_blocked",
+    "dns_ecs_answered",
+    "dns_ecs_forwarded",
+    "dns_nsec_answered",
+    "dnssec_sig_cache_hits",
+    "dnssec_sig_cache_misses"
 };
 
 const char* get_metric_name(int i) {
@@ -46,6 +46,32 @@ enum {
   METRIC_DHCPLEASEUNASSIGNED,
   METRIC_DHCPLEASEACTIVE,
   METRIC_DHCPLEASEUNKNOWN,
+  METRIC_SQLITE_BLOCKED_HOSTS,
+  METRIC_SQLITE_BLOCKED_WILDCARD,
+  METRIC_SQLITE_REWRITTEN,
+  METRIC_SQLITE_OVERLAY_HITS,
+  METRIC_SQLITE_ALLOWED,
+  METRIC_SQLITE_ERRORS,
+  METRIC_SQLITE_QLOG_DROPPED,
+  METRIC_SQLITE_QLOG_LOST,
+  METRIC_SQLITE_TAP_DROPPED,
+  METRIC_SQLITE_TAP_ERRORS,
+  METRIC_SQLITE_STATS_DROPPED,
+  METRIC_SQLITE_STATS_ERRORS,
+  METRIC_FREC_HWM,
+  METRIC_FREC_SRC_HWM,
+  METRIC_BLOCKDATA_HWM,
+  METRIC_BLOCKDATA_MISSES,
+  METRIC_DNS_PREFETCHED,
+  METRIC_WARMUP_NAMES,
+  METRIC_WARMUP_DONE,
+  METRIC_WARMUP_QUERIES,
+  METRIC_WARMUP_BLOCKED,
+  METRIC_DNS_ECS_ANSWERED,
+  METRIC_DNS_ECS_FORWARDED,
+  METRIC_DNS_NSEC_ANSWERED,
+  METRIC_SIG_CACHE_HITS,
+  METRIC_SIG_CACHE_MISSES,
   
   __METRIC_MAX,
 };
@@ -203,6 +203,19 @@ struct myoption {
 #define LOPT_TLD2_FILE     394
 #define LOPT_BLOCK_TXT     395
 #define LOPT_BLOCK_MX      396
+#define LOPT_DELTA_DIR     397
+#define LOPT_DELTA_KEY     398
+#define LOPT_SQLITE_CTL    399
+#define LOPT_SQLITE_POLICY 400
+#define LOPT_SQLITE_QLOG   401
+#define LOPT_SQLITE_TAP    402
+#define LOPT_SQLITE_STATS  403
+#define LOPT_SQLITE_TOP    404
+#define LOPT_CACHE_SNAP    405
+#define LOPT_PREFETCH      406
+#define LOPT_WARMUP        407
+#define LOPT_AGGR_NSEC     408
+#define LOPT_SIG_CACHE     409
 
 #ifdef HAVE_GETOPT_LONG
 static const struct option opts[] =  
@@ -380,6 +393,8 @@ static const struct myoption opts[] =
     { "dnssec-no-timecheck", 0, 0, LOPT_DNSSEC_TIME },
     { "dnssec-timestamp", 1, 0, LOPT_DNSSEC_STAMP },
     { "dnssec-limits", 1, 0, LOPT_DNSSEC_LIMITS },
+    { "dnssec-aggressive-nsec", 2, 0, LOPT_AGGR_NSEC },
+    { "dnssec-sig-cache", 1, 0, LOPT_SIG_CACHE },
     { "dhcp-relay", 1, 0, LOPT_RELAY },
     { "dhcp-split-relay", 1, 0, LOPT_SPLIT_RELAY },
     { "ra-param", 1, 0, LOPT_RA_PARAM },
@@ -404,6 +419,9 @@ static const struct myoption opts[] =
     { "no-ident", 0, 0, LOPT_NO_IDENT },
     { "max-tcp-connections", 1, 0, LOPT_MAX_PROCS },
     { "leasequery", 2, 0, LOPT_LEASEQUERY },
+    { "cache-snapshot", 1, 0, LOPT_CACHE_SNAP },
+    { "cache-prefetch", 1, 0, LOPT_PREFETCH },
+    { "cache-warmup", 1, 0, LOPT_WARMUP },
 #ifdef HAVE_SQLITE
     { "sqlite-database", 1, 0, LOPT_SQLITE_DB },
     { "sqlite-block-ipv4", 1, 0, LOPT_BLOCK_IPV4 },
@@ -411,6 +429,14 @@ static const struct myoption opts[] =
     { "sqlite-block-txt", 1, 0, LOPT_BLOCK_TXT },
     { "sqlite-block-mx", 1, 0, LOPT_BLOCK_MX },
     { "sqlite-tld2-list", 1, 0, LOPT_TLD2_FILE },
+    { "sqlite-delta-dir", 1, 0, LOPT_DELTA_DIR },
+    { "sqlite-delta-key", 1, 0, LOPT_DELTA_KEY },
+    { "sqlite-control", 1, 0, LOPT_SQLITE_CTL },
+    { "sqlite-policy", 1, 0, LOPT_SQLITE_POLICY },
+    { "sqlite-query-log", 1, 0, LOPT_SQLITE_QLOG },
+    { "sqlite-tap", 1, 0, LOPT_SQLITE_TAP },
+    { "sqlite-stats", 1, 0, LOPT_SQLITE_STATS },
+    { "sqlite-top", 1, 0, LOPT_SQLITE_TOP },
 #endif
     { NULL, 0, 0, 0 }
   };
@@ -494,6 +520,9 @@ static struct {
   { LOPT_MAXCTTL, ARG_ONE, "<integer>", gettext_noop("Specify time-to-live ceiling for cache."), NULL },
   { LOPT_MINCTTL, ARG_ONE, "<integer>", gettext_noop("Specify time-to-live floor for cache."), NULL },
   { LOPT_FAST_RETRY, ARG_ONE, "<milliseconds>", gettext_noop("Retry DNS queries after this many milliseconds."), NULL},
+  { LOPT_CACHE_SNAP, ARG_ONE, "<path>[,<seconds>]", gettext_noop("Save the DNS cache to a file on exit (and periodically), restore it on start."), NULL },
+  { LOPT_PREFETCH, ARG_ONE, "<hits>[,<percent>]", gettext_noop("Refresh cache entries answered <hits> times in the last <percent> of their TTL."), NULL },
+  { LOPT_WARMUP, ARG_ONE, "<path>[,<qps>]", gettext_noop("Look up the names listed in a file at start to fill the cache."), NULL },
   { 'u', ARG_ONE, "<username>", gettext_noop("Change to this user after startup. (defaults to %s)."), CHUSER }, 
   { 'U', ARG_DUP, "set:<tag>,<class>", gettext_noop("Map DHCP vendor class to tag."), NULL },
   { 'v', 0, NULL, gettext_noop("Display dnsmasq version and copyright information."), NULL },
@@ -598,6 +627,8 @@ static struct {
   { LOPT_DNSSEC_TIME, OPT_DNSSEC_TIME, NULL, gettext_noop("Don't check DNSSEC signature timestamps until first cache-reload"), NULL },
   { LOPT_DNSSEC_STAMP, ARG_ONE, "<path>", gettext_noop("Timestamp file to verify system clock for DNSSEC"), NULL },
   { LOPT_DNSSEC_LIMITS, ARG_ONE, "<limit>,..", gettext_noop("Set resource limits for DNSSEC validation"), NULL },
+  { LOPT_AGGR_NSEC, ARG_ONE, "[=<ranges>]", gettext_noop("Answer NXDOMAIN/NODATA from cached, validated NSEC/NSEC3 ranges."), NULL },
+  { LOPT_SIG_CACHE, ARG_ONE, "<entries>", gettext_noop("Number of RRSIG verification results to cache, 0 to disable."), NULL },
   { LOPT_RA_PARAM, ARG_DUP, "<iface>,[mtu:<value>|<interface>|off,][<prio>,]<intval>[,<lifetime>]", gettext_noop("Set MTU, priority, resend-interval and router-lifetime"), NULL },
   { LOPT_QUIET_DHCP, OPT_QUIET_DHCP, NULL, gettext_noop("Do not log routine DHCP."), NULL },
   { LOPT_QUIET_DHCP6, OPT_QUIET_DHCP6, NULL, gettext_noop("Do not log routine DHCPv6."), NULL },
@@ -2333,6 +2364,44 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
     case LOPT_BLOCK_MX: /* --sqlite-block-mx */
       db_set_block_mx(opt_string_alloc(arg));
       break;
+
+    case LOPT_DELTA_DIR: /* --sqlite-delta-dir */
+      db_set_delta_dir(opt_string_alloc(arg));
+      break;
+
+    case LOPT_DELTA_KEY: /* --sqlite-delta-key */
+      if (!db_set_delta_key(arg))
+	ret_err(_("cannot read delta key file"));
+      break;
+
+    case LOPT_SQLITE_CTL: /* --sqlite-control */
+      db_set_control(arg);
+      break;
+
+    case LOPT_SQLITE_POLICY: /* --sqlite-policy */
+      if (!db_add_policy(arg))
+	ret_err(_("bad sqlite-policy, use <cidr|mac=..|listen=ip>,<all|none|cat:cat..>[,<ip-set>]"));
+      break;
+
+    case LOPT_SQLITE_QLOG: /* --sqlite-query-log */
+      if (!db_set_query_log(arg))
+	ret_err(_("bad sqlite-query-log, use <file|unix:/path>[,<records>]"));
+      break;
+
+    case LOPT_SQLITE_TAP: /* --sqlite-tap */
+      if (!db_set_tap(arg))
+	ret_err(_("bad sqlite-tap, use <file>[,size=<MB>][,interval=<s>][,buffer=<KB>]"));
+      break;
+
+    case LOPT_SQLITE_STATS: /* --sqlite-stats */
+      if (!db_set_stats(arg))
+	ret_err(_("bad sqlite-stats, use <file>[,<seconds>]"));
+      break;
+
+    case LOPT_SQLITE_TOP: /* --sqlite-top */
+      if (!db_set_top(arg))
+	ret_err(_("bad sqlite-top, use <K 1-1024>[,<seconds>]"));
+      break;
 #endif
 
     case 'r': /* --resolv-file */
@@ -3604,6 +3673,32 @@ static int one_opt(int option, char *arg, char *errstr, char *gen_err, int comma
 	}
       break;
 
+    case LOPT_CACHE_SNAP: /* --cache-snapshot */
+      comma = split(arg);
+      daemon->cache_snapshot = opt_string_alloc(arg);
+      daemon->cache_snapshot_interval = 0;
+      if (comma && (!atoi_check(comma, &daemon->cache_snapshot_interval) || daemon->cache_snapshot_interval < 0))
+	ret_err(gen_err);
+      break;
+
+    case LOPT_PREFETCH: /* --cache-prefetch */
+      comma = split(arg);
+      daemon->prefetch_percent = 10;
+      if (!atoi_check(arg, &daemon->prefetch_hits) ||
+	  daemon->prefetch_hits < 1 || daemon->prefetch_hits > 65534 ||
+	  (comma && (!atoi_check(comma, &daemon->prefetch_percent) ||
+		     daemon->prefetch_percent < 1 || daemon->prefetch_percent > 99)))
+	ret_err(gen_err);
+      break;
+
+    case LOPT_WARMUP: /* --cache-warmup */
+      comma = split(arg);
+      daemon->warmup_file = opt_string_alloc(arg);
+      daemon->warmup_qps = 100;
+      if (comma && (!atoi_check(comma, &daemon->warmup_qps) || daemon->warmup_qps < 1))
+	ret_err(gen_err);
+      break;
+
     case LOPT_CACHE_RR: /* --cache-rr */
     case LOPT_FILTER_RR: /* --filter-rr */
     case LOPT_FILTER_A: /* --filter-A */
@@ -5398,6 +5493,17 @@ err:
 	break;
       }
       
+    case LOPT_AGGR_NSEC: /* --dnssec-aggressive-nsec */
+      daemon->nsec_cache_size = NSEC_CACHE_SIZE;
+      if (arg && (!atoi_check(arg, &daemon->nsec_cache_size) || daemon->nsec_cache_size < 1))
+	ret_err(gen_err);
+      break;
+
+    case LOPT_SIG_CACHE: /* --dnssec-sig-cache */
+      if (!atoi_check(arg, &daemon->sig_cache_size) || daemon->sig_cache_size < 0)
+	ret_err(gen_err);
+      break;
+      
     case LOPT_DNSSEC_STAMP: /* --dnssec-timestamp */
       daemon->timestamp_file = opt_string_alloc(arg); 
       break;
@@ -6026,6 +6132,7 @@ void read_opts(int argc, char **argv, char *compile_opts)
   daemon->limit[LIMIT_CRYPTO] = DNSSEC_LIMIT_CRYPTO;
   daemon->limit[LIMIT_WORK] = DNSSEC_LIMIT_WORK;
   daemon->limit[LIMIT_NSEC3_ITERS] = DNSSEC_LIMIT_NSEC3_ITERS;
+  daemon->sig_cache_size = SIG_CACHE_SIZE;
 #endif
   
   /* See comment above make_servers(). Optimises server-read code. */
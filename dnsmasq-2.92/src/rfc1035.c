@@ -1608,7 +1608,8 @@ static int cache_not_validated(const struct crec *crecp)
 /* return zero if we can't answer from cache, or packet size if we can */
 size_t answer_request(struct dns_header *header, char *limit, size_t qlen,  
 		      struct in_addr local_addr, struct in_addr local_netmask, 
-		      time_t now, int ad_reqd, int do_bit, int no_cache, int *stale, int *filtered) 
+		      time_t now, int ad_reqd, int do_bit, int no_cache, int *stale, int *prefetch,
+		      int *filtered) 
 {
   char *name = daemon->namebuff;
   unsigned char *p, *ansp;
@@ -1618,7 +1619,11 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
   unsigned short flag;
   int ans, anscount = 0, nscount = 0, addncount = 0;
   struct crec *crecp, *soa_lookup = NULL;
-  int nxdomain = 0, notimp = 0, auth = 1, trunc = 0, sec_data = 1;
+  char *soa_name = NULL;
+  int nxdomain = 0, notimp = 0, servfail = 0, auth = 1, trunc = 0, sec_data = 1;
+#ifdef HAVE_DNSSEC
+  int nsec_flags;
+#endif
   struct mx_srv_record *rec;
   size_t len;
   int rd_bit = (header->hb3 & HB3_RD);
@@ -1631,6 +1636,9 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
   if (stale)
     *stale = 0;
 
+  if (prefetch)
+    *prefetch = 0;
+
   if (filtered)
     *filtered = 0;
   
@@ -1670,9 +1678,27 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
   /* SQLite Blocking: Check if domain should be blocked for various record types */
   if (qclass == C_IN)
     {
-      char *block_ipv4 = NULL;
-      char *block_ipv6 = NULL;
-      int is_blocked = db_get_block_ips(name, &block_ipv4, &block_ipv6);
+      struct in_addr *block_ipv4 = NULL;
+      struct in6_addr *block_ipv6 = NULL;
+      int is_blocked = db_policy_block_addrs(name, daemon->log_source_addr, local_addr, now,
+                                             &block_ipv4, &block_ipv6);
+
+      if (is_blocked < 0)
+        {
+          /* Blocklist unreadable: fail closed, the client will retry. */
+          union all_addr a;
+          a.log.rcode = SERVFAIL;
+          a.log.ede = EDE_OTHER;
+          log_query(F_CONFIG | F_RCODE, name, &a, NULL, 0);
+          ans = 1;
+          servfail = 1;
+          auth = 0;
+          goto sqlite_blocked;
+        }
+
+      db_qlog_record(name, qtype, daemon->log_source_addr, is_blocked);
+      db_tap_verdict(name, qtype, daemon->log_source_addr, is_blocked);
+      db_top_record(name, is_blocked, now);
 
       if (is_blocked)
         {
@@ -1684,28 +1710,20 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
             case T_A:
               if (block_ipv4)
                 {
-                  struct in_addr blocked_addr;
-                  if (inet_pton(AF_INET, block_ipv4, &blocked_addr) == 1)
-                    {
-                      log_query(F_CONFIG | F_FORWARD | F_IPV4, name, (union all_addr *)&blocked_addr, NULL, 0);
-                      if (add_resource_record(header, limit, &trunc, nameoffset, &ansp,
-                                              daemon->local_ttl, NULL, T_A, C_IN, "4", &blocked_addr))
-                        anscount++;
-                    }
+                  log_query(F_CONFIG | F_FORWARD | F_IPV4, name, (union all_addr *)block_ipv4, NULL, 0);
+                  if (add_resource_record(header, limit, &trunc, nameoffset, &ansp,
+                                          daemon->local_ttl, NULL, T_A, C_IN, "4", block_ipv4))
+                    anscount++;
                 }
               goto sqlite_blocked;
 
             case T_AAAA:
               if (block_ipv6)
                 {
-                  struct in6_addr blocked_addr6;
-                  if (inet_pton(AF_INET6, block_ipv6, &blocked_addr6) == 1)
-                    {
-                      log_query(F_CONFIG | F_FORWARD | F_IPV6, name, (union all_addr *)&blocked_addr6, NULL, 0);
-                      if (add_resource_record(header, limit, &trunc, nameoffset, &ansp,
-                                              daemon->local_ttl, NULL, T_AAAA, C_IN, "6", &blocked_addr6))
-                        anscount++;
-                    }
+                  log_query(F_CONFIG | F_FORWARD | F_IPV6, name, (union all_addr *)block_ipv6, NULL, 0);
+                  if (add_resource_record(header, limit, &trunc, nameoffset, &ansp,
+                                          daemon->local_ttl, NULL, T_AAAA, C_IN, "6", block_ipv6))
+                    anscount++;
                 }
               goto sqlite_blocked;
 
@@ -1834,6 +1852,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 	    
 	    stale_flag = F_STALE;
 	  }
+	  else if (prefetch && cache_prefetch_hit(crecp, now))
+	    *prefetch = 1;
 	
 	if (crecp->flags & F_NEG)
 	  soa_lookup = crecp;
@@ -2026,6 +2046,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			  
 			  stale_flag = F_STALE;
 			}
+			else if (prefetch && cache_prefetch_hit(crecp, now))
+			  *prefetch = 1;
 		      
 		      /* don't answer wildcard queries with data not from /etc/hosts or dhcp leases */
 		      if (qtype == T_ANY && !(crecp->flags & (F_HOSTS | F_DHCP)))
@@ -2181,6 +2203,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			
 			stale_flag = F_STALE;
 		      }
+		      else if (prefetch && cache_prefetch_hit(crecp, now))
+			*prefetch = 1;
 		    
 		    /* don't answer wildcard queries with data not from /etc/hosts
 		       or DHCP leases */
@@ -2375,6 +2399,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			
 			flags |= F_STALE;
 		      }
+		      else if (prefetch && cache_prefetch_hit(crecp, now))
+			*prefetch = 1;
 		    
 		    if (!(flags & F_DNSSECOK))
 		      sec_data = 0;
@@ -2425,6 +2451,24 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 	  log_query(F_CONFIG | F_NEG, name, NULL, NULL, 0);
 	}
       
+
+#ifdef HAVE_DNSSEC
+      /* RFC 8198: a cached, validated NSEC/NSEC3 range proves that the name, or
+	 the type at the name, doesn't exist. Like cached answers, not used if the
+	 client wants the RRSIGs, nor for domains with their own servers. */
+      if (!ans && rd_bit && !do_bit && daemon->nsec_cache_size != 0 && option_bool(OPT_DNSSEC_VALID) &&
+	  !lookup_domain(name, F_DOMAINSRV, NULL, NULL) &&
+	  (nsec_flags = dnssec_nsec_answer(name, qtype, now, &soa_name)) != 0)
+	{
+	  ans = 1;
+	  auth = 0;
+	  
+	  if (nsec_flags & F_NXDOMAIN)
+	    nxdomain = 1;
+	  
+	  log_query(nsec_flags | F_DNSSECOK, name, NULL, NULL, 0);
+	}
+#endif
       
       if (qtype != T_ANY && !ans && rr_on_list(daemon->filter_rr, qtype) && !do_bit)
 	{
@@ -2458,11 +2502,13 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
      For FORWARD NEG records, the addr.rrdata.datalen field of the othewise
      empty addr is used to held an offset in to the name which yields the SOA
      name.
-     If the F_NO_RR flag is set, there was no SOA record supplied with the RR.  */
+     If the F_NO_RR flag is set, there was no SOA record supplied with the RR.
+     An answer from NSEC/NSEC3 ranges uses the SOA of their zone, if cached. */
   if (soa_lookup && !(soa_lookup->flags & F_NO_RR))
+    soa_name = name + soa_lookup->addr.rrdata.datalen;
+  
+  if (soa_name)
     {
-      char *soa_name = name + soa_lookup->addr.rrdata.datalen;
-      
       crecp = NULL;
       while ((crecp = cache_find_by_name(crecp, soa_name, now, F_RR)))
 	if (crecp->addr.rrblock.rrtype == T_SOA)
@@ -2540,6 +2586,8 @@ sqlite_blocked:
     SET_RCODE(header, NXDOMAIN);
   else if (notimp)
     SET_RCODE(header, NOTIMP);
+  else if (servfail)
+    SET_RCODE(header, SERVFAIL);
   else
     SET_RCODE(header, NOERROR); /* no error */
 
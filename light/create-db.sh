@@ -65,6 +65,14 @@ CREATE TABLE block_ips (
     Source_IP TEXT PRIMARY KEY NOT NULL,
     Target_IP TEXT NOT NULL
 ) WITHOUT ROWID;
+
+CREATE TABLE allow_wildcard (
+    Domain TEXT PRIMARY KEY NOT NULL
+) WITHOUT ROWID;
+
+CREATE TABLE allow_exact (
+    Domain TEXT PRIMARY KEY NOT NULL
+) WITHOUT ROWID;
 SQL
 
 # Import
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Create a signed delta file for a running dnsmasq (--sqlite-delta-dir)
+# Version: 1.0
+#
+# Changes are applied within a second, without rebuilding the database
+# and without restarting dnsmasq. dnsmasq folds them into the database
+# itself once no new deltas arrive for 30 seconds.
+#
+# Usage: ./create-delta.sh <changes-file> [delta-dir] [key-file] [database]
+#        ./create-delta.sh /tmp/changes.txt
+#
+# Input format (changes file): one change per line
+#   +wildcard example.com          block domain and all subdomains
+#   -wildcard example.org          unblock
+#   +hosts ads.example.net         block exact hostname
+#   -hosts ads.example.net
+#   +ips 192.0.2.1 10.0.0.1        rewrite IP (CIDR allowed)
+#   -ips 192.0.2.1
+#   +allow-wildcard example.com    allowlist domain and all subdomains
+#   -allow-wildcard example.com
+#   +allow-exact www.example.com   allowlist exact hostname
+#   -allow-exact www.example.com
+#
+# The next sequence number is one above the highest of the delta files in
+# the directory and delta_seq in the database (db_metadata).
+
+# Configuration
+CHANGES="$1"
+DELTA_DIR="${2:-/usr/local/etc/dnsmasq/delta}"
+KEY_FILE="${3:-/usr/local/etc/dnsmasq/delta.key}"
+DATABASE="${4:-/usr/local/etc/dnsmasq/aviontex.db}"
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+if [ -z "$CHANGES" ] || [ ! -f "$CHANGES" ]; then
+    echo "${RED}Error: changes file not found${NC}"
+    echo ""
+    echo "Usage: $0 <changes-file> [delta-dir] [key-file] [database]"
+    exit 1
+fi
+
+if [ ! -f "$KEY_FILE" ]; then
+    echo "${RED}Error: key file $KEY_FILE not found (dnsmasq only applies signed deltas)${NC}"
+    exit 1
+fi
+
+mkdir -p "$DELTA_DIR"
+
+# Next sequence number
+SEQ=0
+if [ -f "$DATABASE" ]; then
+    SEQ=$(sqlite3 "$DATABASE" "SELECT value FROM db_metadata WHERE key='delta_seq';" 2>/dev/null)
+    SEQ=${SEQ:-0}
+fi
+for f in "$DELTA_DIR"/*.delta; do
+    [ -f "$f" ] || continue
+    N=$(basename "$f" .delta)
+    [ "$N" -gt "$SEQ" ] 2>/dev/null && SEQ=$N
+done
+SEQ=$((SEQ + 1))
+
+PATTERN='^[+-](wildcard|hosts|ips|allow-wildcard|allow-exact)[[:space:]]'
+
+SKIPPED=$(grep -vE "$PATTERN" "$CHANGES" | grep -cvE '^[[:space:]]*(#|$)')
+if [ "$SKIPPED" -gt 0 ]; then
+    echo "${RED}Warning: $SKIPPED unknown lines in $CHANGES ignored${NC}"
+fi
+
+# Write to a temp file first; dnsmasq only applies complete files
+TMP="$DELTA_DIR/.$SEQ.delta.tmp"
+{
+    echo "# created $(date -u '+%Y-%m-%d %H:%M:%S') UTC"
+    echo "seq $SEQ"
+    grep -E "$PATTERN" "$CHANGES" | tr 'A-Z' 'a-z'
+} > "$TMP"
+
+KEY=$(cat "$KEY_FILE")
+MAC=$(openssl dgst -sha256 -hmac "$KEY" < "$TMP" | sed 's/^.* //')
+echo "hmac $MAC" >> "$TMP"
+
+COUNT=$(grep -cE '^[+-]' "$TMP")
+mv "$TMP" "$DELTA_DIR/$SEQ.delta"
+
+echo "${GREEN}Delta $SEQ written: $COUNT changes -> $DELTA_DIR/$SEQ.delta${NC}"
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Import whitelist as exceptions (allow_wildcard / allow_exact)
+# Version: 1.0
+#
+# Im Gegensatz zu remove-whitelist.sh bleiben die Block-Tabellen unverändert:
+# dnsmasq lädt die Ausnahmen beim Start in den RAM, die spezifischste Regel
+# gewinnt (allow_wildcard login.example.com schlägt block_wildcard example.com).
+#
+# Usage: ./import-allowlist.sh [whitelist] [datenbank] [wildcard|exact]
+#        ./import-allowlist.sh /usr/local/etc/whitelist.txt
+#        ./import-allowlist.sh /path/to/exact.wl /path/to/db.db exact
+
+# Konfiguration
+WHITELIST="${1:-/usr/local/etc/whitelist.txt}"
+DATABASE="${2:-/usr/local/etc/dnsmasq/aviontex.db}"
+MODE="${3:-wildcard}"
+DNSMASQ_GROUP="wheel"
+
+case "$MODE" in
+    wildcard) TABLE="allow_wildcard" ;;
+    exact)    TABLE="allow_exact" ;;
+    *)        echo "Fehler: Modus muss wildcard oder exact sein"; exit 1 ;;
+esac
+
+echo ""
+echo "=========================================="
+echo " Allowlist Import ($TABLE)"
+echo "=========================================="
+echo ""
+
+# Prüfe ob Dateien existieren
+if [ ! -f "$WHITELIST" ]; then
+    echo "Fehler: $WHITELIST nicht gefunden"
+    exit 1
+fi
+
+if [ ! -f "$DATABASE" ]; then
+    echo "Fehler: $DATABASE nicht gefunden"
+    exit 1
+fi
+
+echo "Whitelist:   $WHITELIST"
+echo "Datenbank:   $DATABASE"
+echo ""
+
+# Kommentare, Leerzeilen und abschließende Punkte entfernen
+TMPFILE=$(mktemp)
+sed -e 's/#.*//' -e 's/[[:space:]]//g' -e 's/\.$//' "$WHITELIST" \
+    | tr 'A-Z' 'a-z' | grep -v '^$' > "$TMPFILE"
+
+sqlite3 "$DATABASE" << SQL
+CREATE TABLE IF NOT EXISTS $TABLE (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID;
+CREATE TEMP TABLE whitelist (Domain TEXT);
+
+.mode list
+.import $TMPFILE whitelist
+
+INSERT OR IGNORE INTO $TABLE (Domain) SELECT Domain FROM whitelist;
+DROP TABLE whitelist;
+SQL
+
+rm -f "$TMPFILE"
+
+# Berechtigungen setzen
+chown root:${DNSMASQ_GROUP} "$DATABASE" "${DATABASE}-wal" "${DATABASE}-shm" 2>/dev/null
+chmod 644 "$DATABASE" "${DATABASE}-wal" "${DATABASE}-shm" 2>/dev/null
+
+COUNT=$(sqlite3 "$DATABASE" "SELECT COUNT(*) FROM $TABLE;")
+
+echo ""
+echo "=========================================="
+echo " Fertig!"
+echo "=========================================="
+echo ""
+echo "$TABLE: $COUNT Einträge"
+echo "Wirksam nach Neustart von dnsmasq (oder sofort per Control-Socket: allow / allow-wildcard)"
+echo ""
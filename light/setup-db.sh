@@ -24,6 +24,22 @@ CREATE TABLE IF NOT EXISTS block_ips (
     Target_IP TEXT NOT NULL
 ) WITHOUT ROWID;
 
+-- Allowlist: exceptions that override the block tables (most specific wins)
+CREATE TABLE IF NOT EXISTS allow_wildcard (
+    Domain TEXT PRIMARY KEY NOT NULL
+) WITHOUT ROWID;
+
+CREATE TABLE IF NOT EXISTS allow_exact (
+    Domain TEXT PRIMARY KEY NOT NULL
+) WITHOUT ROWID;
+
+-- IP sets: answer addresses for client policies (sqlite-policy)
+CREATE TABLE IF NOT EXISTS ip_sets (
+    ID INTEGER PRIMARY KEY,
+    IPv4 TEXT,
+    IPv6 TEXT
+);
+
 -- Performance settings (optimized for 128GB RAM / 8 Core / 7GB+ DB)
 PRAGMA journal_mode = WAL;
 PRAGMA synchronous = NORMAL;
@@ -33,7 +49,7 @@ PRAGMA temp_store = MEMORY;
 PRAGMA page_size = 4096;
 
 -- Verify
-SELECT 'Tables: block_wildcard, block_hosts, block_ips';
+SELECT 'Tables: block_wildcard, block_hosts, block_ips, allow_wildcard, allow_exact, ip_sets';
 SELECT 'Cache: 20GB | mmap: 20GB | Optimized for HP DL120 (7GB+ DB)';
 EOF
 
@@ -0,0 +1,1273 @@
+/*
+ * Native Bulk Importer for dnsmasq-sqlite
+ *
+ * Replaces the tr/sed + sqlite3 CLI pipelines (light/import-*.sh,
+ * Management_DB/Import/ scripts) for very large inputs. The pipeline is:
+ *
+ *   1. Parse   - every input file is mmap'd and split on line boundaries
+ *                into one chunk per worker thread. Workers trim, strip
+ *                comments, accept plain lists as well as hosts-file lines
+ *                ("0.0.0.0 ads.example.com"), lowercase, drop a trailing
+ *                dot and validate with is_valid_dns_name() from pattern.c.
+ *   2. Sort    - each worker collects keys into an arena bounded by -m;
+ *                a full arena is sorted, deduplicated and spilled to an
+ *                unlinked temp file (a "run"). The last run stays in RAM.
+ *   3. Merge   - a single writer k-way merges all runs with a heap,
+ *                drops duplicates across runs and inserts the keys in
+ *                ascending order inside one transaction, so SQLite only
+ *                ever appends to the right edge of the WITHOUT ROWID B-tree.
+ *   4. Finish  - row counts and import details are written to the
+ *                db_metadata table (same layout as createdb.sh), then
+ *                ANALYZE and journal_mode=WAL.
+ *
+ * Table modes (-t):
+ *   wildcard   block_wildcard(Domain)           a leading "*." is removed
+ *   hosts      block_hosts(Domain)
+ *   ips        block_ips(Source_IP, Target_IP)  "source,target" lines (CSV
+ *              header allowed); source may be a CIDR. A source listed twice
+ *              keeps a single row (the lowest target in byte order), also
+ *              when its rows land in runs of different threads.
+ *
+ * Into an empty or new database the rows are plain INSERTs; with -a the
+ * importer appends to existing tables using INSERT OR IGNORE (still sorted).
+ * Without -a the target table is emptied first, like the shell scripts.
+ *
+ * Watchlist mode (-w DIR) replaces Management_DB/watchlists/import-all-parallel.sh,
+ * whose hundreds of concurrent sqlite3 writers serialize on the database lock.
+ * Every company directory DIR/<name>/ contributes <name>.txt and <name>.exact.txt
+ * (blocked, table domain / domain_exact) and <name>.wl and <name>.exact.wl
+ * (whitelist); the IP-set is read from IPV4="..." / IPV6="..." in
+ * import-<name>.sh. The worker threads take whole files from a shared queue and
+ * tag every key with table, list type and company, e.g. "wads.example.com,b00007".
+ * ',' sorts below every domain character, so all keys of one domain are
+ * adjacent: first the whitelist keys, then the blocked ones, each by company.
+ * The merge gives the result of running the import scripts one after the
+ * other in name order, each one blocklists first and whitelists after:
+ *   - the last company that whitelists the domain deletes it (with -a an
+ *     existing row, like process_whitelist())
+ *   - the first company after that one which blocks it inserts it with its
+ *     IP-set; companies before it are undone by the DELETE
+ *   - without a later blocker the domain stays out
+ * The single writer then fills domain and domain_exact in key order.
+ * With -s it fills block_wildcard / block_hosts instead, the tables dnsmasq
+ * reads, and stores each company's IP-set once in ip_sets: rows only carry
+ * the integer IPSet, and companies with the same addresses share one ID.
+ *
+ * Compile: gcc -O2 -pthread -I../dnsmasq-2.92/src -o bulk-import bulk-import.c -lsqlite3
+ * Usage:   ./bulk-import -d blocklist.db -t wildcard [-j 8] [-m 512] [-a] file...
+ *          ./bulk-import -d blocklist.db -w Management_DB/watchlists [-s] [-j 8] [-a]
+ */
+
+#define HAVE_CONNTRACK
+#include "pattern.c"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sqlite3.h>
+
+#define DEFAULT_MEM_MB     256
+#define MAX_THREADS        64
+#define MAX_KEY_LEN        300
+#define RUN_IO_BUF         (1 << 20)
+#define MAX_COMPANIES      99999
+
+enum { MODE_WILDCARD, MODE_HOSTS, MODE_IPS, MODE_WATCH };
+
+/* one watchlist company: IP-set used for its blocked domains */
+typedef struct {
+  char *name;
+  char ipv4[INET_ADDRSTRLEN];
+  char ipv6[INET6_ADDRSTRLEN];
+  int set_id;          /* ip_sets ID with -s, 0 = no addresses */
+} company_t;
+
+/* one watchlist file; mode selects "*." stripping (wildcard) or not */
+typedef struct {
+  char *path;
+  int mode;
+  char tag[8];         /* appended to every key: ",b00007" */
+  char table;          /* key prefix: 'w' domain, 'e' domain_exact */
+} watch_file_t;
+
+static int verbose = 0;
+static const char *tmpdir = NULL;
+
+/* pattern.c logs through my_syslog(); keep its diagnostics behind -v */
+void my_syslog(int priority, const char *format, ...)
+{
+  va_list ap;
+
+  (void)priority;
+  if (!verbose)
+    return;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fatal(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+/* ============================================================================
+ * Sorted runs
+ * ============================================================================ */
+
+typedef struct {
+  FILE *fp;            /* spilled run, NULL for the in-memory run */
+  char **keys;         /* in-memory run */
+  size_t nkeys, pos;
+  char *arena;         /* owner of in-memory keys */
+  char line[MAX_KEY_LEN + 2];
+  const char *cur;
+} run_t;
+
+typedef struct {
+  int mode;
+  const char *data;
+  size_t len;
+  int last_file;       /* keep the final run in RAM instead of spilling */
+
+  /* arena of NUL-terminated keys plus pointer array */
+  char *arena;
+  size_t arena_used, arena_size;
+  char **keys;
+  size_t nkeys, keys_size;
+
+  run_t *runs;
+  size_t nruns;
+
+  uint64_t lines, accepted, invalid, dups;
+
+  /* watchlist mode: shared file queue */
+  watch_file_t *files;
+  size_t nfiles, *next_file;
+  const watch_file_t *cur_file;
+} worker_t;
+
+static int cmp_key(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Compare only the part before ',' so "ips" rows dedupe on Source_IP */
+static int key_cmp(const char *a, const char *b)
+{
+  for (;; a++, b++)
+    {
+      unsigned char ca = (*a == ',') ? 0 : (unsigned char)*a;
+      unsigned char cb = (*b == ',') ? 0 : (unsigned char)*b;
+      if (ca != cb)
+	return ca < cb ? -1 : 1;
+      if (!ca)
+	return 0;
+    }
+}
+
+/* Sort the current arena and drop duplicates; returns unique count */
+static size_t sort_unique(worker_t *w)
+{
+  size_t i, n = 0;
+
+  if (w->nkeys == 0)
+    return 0;
+
+  /* ',' sorts below every character of an address, so rows with the same
+     Source_IP are adjacent and key_cmp() finds them for the "ips" mode.
+     Watchlist keys of one domain differ only in the tag and all of them
+     count for the merge, so only identical keys are dropped there. */
+  qsort(w->keys, w->nkeys, sizeof(char *), cmp_key);
+  for (i = 0; i < w->nkeys; i++)
+    if (n == 0 || (w->files ? strcmp(w->keys[n - 1], w->keys[i])
+		   : key_cmp(w->keys[n - 1], w->keys[i])) != 0)
+      w->keys[n++] = w->keys[i];
+
+  w->dups += w->nkeys - n;
+  w->nkeys = n;
+  return n;
+}
+
+static void add_run(worker_t *w, run_t *r)
+{
+  w->runs = realloc(w->runs, (w->nruns + 1) * sizeof(run_t));
+  if (!w->runs)
+    fatal("realloc");
+  w->runs[w->nruns++] = *r;
+}
+
+static void spill(worker_t *w)
+{
+  char path[4096];
+  run_t r;
+  size_t i;
+  int fd;
+
+  sort_unique(w);
+
+  snprintf(path, sizeof(path), "%s/bulk-import.XXXXXX", tmpdir);
+  if ((fd = mkstemp(path)) < 0)
+    fatal("mkstemp");
+  unlink(path);
+
+  memset(&r, 0, sizeof(r));
+  if (!(r.fp = fdopen(fd, "w+")))
+    fatal("fdopen");
+  setvbuf(r.fp, NULL, _IOFBF, RUN_IO_BUF);
+
+  for (i = 0; i < w->nkeys; i++)
+    {
+      fputs(w->keys[i], r.fp);
+      fputc('\n', r.fp);
+    }
+  if (fflush(r.fp) != 0 || fseek(r.fp, 0, SEEK_SET) != 0)
+    fatal("spill run");
+
+  add_run(w, &r);
+  w->nkeys = 0;
+  w->arena_used = 0;
+}
+
+static void push_key(worker_t *w, const char *key, size_t len)
+{
+  if (w->arena_used + len + 1 > w->arena_size)
+    spill(w);
+
+  if (w->nkeys == w->keys_size)
+    {
+      w->keys_size = w->keys_size ? w->keys_size * 2 : 65536;
+      if (!(w->keys = realloc(w->keys, w->keys_size * sizeof(char *))))
+	fatal("realloc");
+    }
+
+  memcpy(w->arena + w->arena_used, key, len);
+  w->arena[w->arena_used + len] = 0;
+  w->keys[w->nkeys++] = w->arena + w->arena_used;
+  w->arena_used += len + 1;
+}
+
+/* ============================================================================
+ * Line normalization
+ * ============================================================================ */
+
+static int is_ip(const char *s)
+{
+  unsigned char buf[sizeof(struct in6_addr)];
+  return inet_pton(AF_INET, s, buf) == 1 || inet_pton(AF_INET6, s, buf) == 1;
+}
+
+static int is_ip_or_cidr(char *s)
+{
+  char *slash = strchr(s, '/');
+  char *end;
+  long bits;
+  int ok;
+
+  if (!slash)
+    return is_ip(s);
+
+  *slash = 0;
+  bits = strtol(slash + 1, &end, 10);
+  ok = *end == 0 && slash[1] != 0 && bits >= 0 &&
+       ((strchr(s, ':') && bits <= 128) || (!strchr(s, ':') && bits <= 32)) &&
+       is_ip(s);
+  *slash = '/';
+  return ok;
+}
+
+/* Normalize one domain line in place; returns length or 0 to skip */
+static size_t normalize_domain(int mode, char *s, size_t len, int *bad)
+{
+  char *p = s, *tok, *end;
+  size_t i;
+
+  /* hosts-file form: "<ip> <name> [aliases]" -> <name> */
+  end = s + len;
+  for (tok = p; tok < end && !isspace((unsigned char)*tok); tok++)
+    ;
+  if (tok < end)
+    {
+      *tok = 0;
+      if (!is_ip(p))
+	{
+	  *bad = 1;
+	  return 0;
+	}
+      for (p = tok + 1; p < end && isspace((unsigned char)*p); p++)
+	;
+      for (tok = p; tok < end && !isspace((unsigned char)*tok); tok++)
+	;
+      *tok = 0;
+      len = tok - p;
+    }
+
+  if (mode == MODE_WILDCARD && len > 2 && p[0] == '*' && p[1] == '.')
+    p += 2, len -= 2;
+  if (len > 0 && p[len - 1] == '.')
+    p[--len] = 0;
+
+  for (i = 0; i < len; i++)
+    p[i] = tolower((unsigned char)p[i]);
+
+  if (len == 0 || len > 253 || !is_valid_dns_name(p))
+    {
+      *bad = 1;
+      return 0;
+    }
+
+  memmove(s, p, len + 1);
+  return len;
+}
+
+/* Normalize "source,target"; returns length or 0 to skip */
+static size_t normalize_ips(char *s, size_t len, int *bad)
+{
+  char *comma = memchr(s, ',', len);
+  char *src = s, *dst;
+  size_t i, n;
+
+  if (!comma)
+    {
+      *bad = 1;
+      return 0;
+    }
+  *comma = 0;
+  dst = comma + 1;
+
+  /* CSV header from the shell importers */
+  if (strcasecmp(src, "Source_IP") == 0)
+    return 0;
+
+  while (*src && isspace((unsigned char)*src))
+    src++;
+  for (n = strlen(src); n && isspace((unsigned char)src[n - 1]); )
+    src[--n] = 0;
+  while (*dst && isspace((unsigned char)*dst))
+    dst++;
+  for (n = strlen(dst); n && isspace((unsigned char)dst[n - 1]); )
+    dst[--n] = 0;
+
+  for (i = 0; src[i]; i++)
+    src[i] = tolower((unsigned char)src[i]);
+  for (i = 0; dst[i]; i++)
+    dst[i] = tolower((unsigned char)dst[i]);
+
+  if (!is_ip_or_cidr(src) || !is_ip(dst))
+    {
+      *bad = 1;
+      return 0;
+    }
+
+  n = strlen(src);
+  memmove(s, src, n);
+  s[n] = ',';
+  memmove(s + n + 1, dst, strlen(dst) + 1);
+  return strlen(s);
+}
+
+static void parse_chunk(worker_t *w)
+{
+  const char *p = w->data, *end = w->data + w->len;
+  char line[MAX_KEY_LEN + 16];
+
+  while (p < end)
+    {
+      const char *nl = memchr(p, '\n', end - p);
+      const char *e = nl ? nl : end;
+      const char *b = p;
+      char *c;
+      size_t len;
+      int bad = 0;
+
+      p = nl ? nl + 1 : end;
+      w->lines++;
+
+      while (b < e && isspace((unsigned char)*b))
+	b++;
+      while (e > b && isspace((unsigned char)e[-1]))
+	e--;
+      if (b == e || *b == '#' || *b == ';')
+	continue;
+
+      if ((size_t)(e - b) > MAX_KEY_LEN)
+	{
+	  w->invalid++;
+	  continue;
+	}
+
+      /* strip trailing comments ("ads.example.com # tracker") */
+      len = e - b;
+      memcpy(line, b, len);
+      line[len] = 0;
+      if ((c = strchr(line, '#')))
+	{
+	  len = c - line;
+	  while (len && isspace((unsigned char)line[len - 1]))
+	    len--;
+	  line[len] = 0;
+	}
+
+      if (w->mode == MODE_IPS)
+	len = normalize_ips(line, len, &bad);
+      else
+	len = normalize_domain(w->mode, line, len, &bad);
+
+      if (bad)
+	{
+	  w->invalid++;
+	  if (verbose > 1)
+	    fprintf(stderr, "skip: %.*s\n", (int)(e - b), b);
+	  continue;
+	}
+      if (len == 0)
+	continue;
+
+      if (w->cur_file)
+	{
+	  /* "<table><domain><tag>", e.g. "eads.example.com,a00003" */
+	  memmove(line + 1, line, len);
+	  line[0] = w->cur_file->table;
+	  strcpy(line + 1 + len, w->cur_file->tag);
+	  len += 1 + strlen(w->cur_file->tag);
+	}
+
+      push_key(w, line, len);
+      w->accepted++;
+    }
+}
+
+static void finish_runs(worker_t *w)
+{
+  /* only the run of the last input file stays in memory for the merge,
+     earlier ones are spilled so RAM stays bounded by -m per thread */
+  if (w->nkeys && !w->last_file)
+    spill(w);
+  else if (w->nkeys)
+    {
+      run_t r;
+
+      sort_unique(w);
+      memset(&r, 0, sizeof(r));
+      r.keys = w->keys;
+      r.nkeys = w->nkeys;
+      r.arena = w->arena;
+      add_run(w, &r);
+      w->keys = NULL;
+      w->arena = NULL;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+  worker_t *w = arg;
+
+  parse_chunk(w);
+  finish_runs(w);
+  return NULL;
+}
+
+/* Watchlist mode: files are small and many, so each worker takes whole
+   files from the queue instead of splitting one file */
+static void *watch_main(void *arg)
+{
+  worker_t *w = arg;
+  size_t i;
+
+  while ((i = __atomic_fetch_add(w->next_file, 1, __ATOMIC_RELAXED)) < w->nfiles)
+    {
+      const watch_file_t *f = &w->files[i];
+      struct stat sb;
+      const char *map;
+      int fd;
+
+      if ((fd = open(f->path, O_RDONLY)) < 0 || fstat(fd, &sb) < 0)
+	fatal(f->path);
+      if (sb.st_size > 0)
+	{
+	  if ((map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	    fatal("mmap");
+	  w->cur_file = f;
+	  w->mode = f->mode;
+	  w->data = map;
+	  w->len = sb.st_size;
+	  parse_chunk(w);
+	  munmap((void *)map, sb.st_size);
+	}
+      close(fd);
+    }
+
+  w->cur_file = NULL;
+  w->last_file = 1;
+  finish_runs(w);
+  return NULL;
+}
+
+/* ============================================================================
+ * K-way merge
+ * ============================================================================ */
+
+static int run_next(run_t *r)
+{
+  if (!r->fp)
+    {
+      if (r->pos >= r->nkeys)
+	return 0;
+      r->cur = r->keys[r->pos++];
+      return 1;
+    }
+
+  if (!fgets(r->line, sizeof(r->line), r->fp))
+    return 0;
+  r->line[strcspn(r->line, "\n")] = 0;
+  r->cur = r->line;
+  return 1;
+}
+
+static void run_free(run_t *r)
+{
+  if (r->fp)
+    fclose(r->fp);
+  free(r->keys);
+  free(r->arena);
+}
+
+/* The heap orders on the whole key so that, among keys key_cmp() treats
+   as equal, the smallest one comes out first in every run and overall */
+static void heap_down(run_t **h, size_t n, size_t i)
+{
+  for (;;)
+    {
+      size_t l = 2 * i + 1, s = i;
+      run_t *t;
+
+      if (l < n && strcmp(h[l]->cur, h[s]->cur) < 0)
+	s = l;
+      if (l + 1 < n && strcmp(h[l + 1]->cur, h[s]->cur) < 0)
+	s = l + 1;
+      if (s == i)
+	return;
+      t = h[i], h[i] = h[s], h[s] = t;
+      i = s;
+    }
+}
+
+/* ============================================================================
+ * Watchlists
+ * ============================================================================ */
+
+static int cmp_name(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* IPV4="..." / IPV6="..." from import-<name>.sh (written by add-company.sh) */
+static int read_ipset(const char *script, company_t *c)
+{
+  char line[512];
+  FILE *fp = fopen(script, "r");
+
+  if (!fp)
+    return 0;
+
+  while (fgets(line, sizeof(line), fp))
+    {
+      char *p = line, *q, *dst = NULL;
+      size_t size = 0;
+
+      while (isspace((unsigned char)*p))
+	p++;
+      if (strncmp(p, "IPV4=\"", 6) == 0)
+	dst = c->ipv4, size = sizeof(c->ipv4);
+      else if (strncmp(p, "IPV6=\"", 6) == 0)
+	dst = c->ipv6, size = sizeof(c->ipv6);
+      if (!dst || !(q = strchr(p + 6, '"')))
+	continue;
+      *q = 0;
+      if (*(p + 6) && !is_ip(p + 6))
+	{
+	  fprintf(stderr, "%s: invalid address '%s'\n", script, p + 6);
+	  fclose(fp);
+	  return 0;
+	}
+      snprintf(dst, size, "%s", p + 6);
+    }
+
+  fclose(fp);
+  return c->ipv4[0] || c->ipv6[0];
+}
+
+/* Collect companies (sorted by name) and their list files */
+static size_t load_watchlists(const char *dir, company_t **companies,
+			      watch_file_t **files, size_t *nfiles)
+{
+  static const struct {
+    const char *suffix;
+    char table, type;
+    int mode;
+  } lists[] = {
+    { ".txt",       'w', 'b', MODE_WILDCARD },
+    { ".exact.txt", 'e', 'b', MODE_HOSTS },
+    { ".wl",        'w', 'a', MODE_WILDCARD },
+    { ".exact.wl",  'e', 'a', MODE_HOSTS },
+  };
+  char **names = NULL, path[4096];
+  size_t nnames = 0, n = 0, i, l;
+  struct dirent *de;
+  DIR *d;
+
+  if (!(d = opendir(dir)))
+    fatal(dir);
+  while ((de = readdir(d)))
+    {
+      if (de->d_name[0] == '.' || strcmp(de->d_name, "TEMPLATE") == 0)
+	continue;
+      snprintf(path, sizeof(path), "%s/%s/import-%s.sh", dir, de->d_name, de->d_name);
+      if (access(path, R_OK) != 0)
+	continue;
+      if (!(names = realloc(names, (nnames + 1) * sizeof(char *))) ||
+	  !(names[nnames++] = strdup(de->d_name)))
+	fatal("realloc");
+    }
+  closedir(d);
+
+  if (nnames > MAX_COMPANIES)
+    {
+      fprintf(stderr, "%s: more than %d companies\n", dir, MAX_COMPANIES);
+      exit(1);
+    }
+  qsort(names, nnames, sizeof(char *), cmp_name);
+
+  *companies = calloc(nnames ? nnames : 1, sizeof(company_t));
+  *files = calloc(nnames ? nnames * 4 : 1, sizeof(watch_file_t));
+  if (!*companies || !*files)
+    fatal("calloc");
+  *nfiles = 0;
+
+  for (i = 0; i < nnames; i++)
+    {
+      company_t *c = &(*companies)[n];
+
+      c->name = names[i];
+      snprintf(path, sizeof(path), "%s/%s/import-%s.sh", dir, c->name, c->name);
+      if (!read_ipset(path, c))
+	{
+	  fprintf(stderr, "%s: no IP-set found, skipping %s\n", path, c->name);
+	  free(names[i]);
+	  continue;
+	}
+
+      for (l = 0; l < sizeof(lists) / sizeof(lists[0]); l++)
+	{
+	  watch_file_t *f = &(*files)[*nfiles];
+
+	  snprintf(path, sizeof(path), "%s/%s/%s%s", dir, c->name, c->name, lists[l].suffix);
+	  if (access(path, R_OK) != 0)
+	    continue;
+	  if (!(f->path = strdup(path)))
+	    fatal("strdup");
+	  f->mode = lists[l].mode;
+	  f->table = lists[l].table;
+	  snprintf(f->tag, sizeof(f->tag), ",%c%05zu", lists[l].type, n);
+	  (*nfiles)++;
+	}
+      n++;
+    }
+
+  free(names);
+  return n;
+}
+
+/* ============================================================================
+ * SQLite
+ * ============================================================================ */
+
+static const char *schema_sql =
+  "CREATE TABLE IF NOT EXISTS block_wildcard (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS block_hosts (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS block_ips (Source_IP TEXT PRIMARY KEY NOT NULL, Target_IP TEXT NOT NULL) WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS db_metadata (key TEXT PRIMARY KEY, value TEXT) WITHOUT ROWID;";
+
+/* watchlist tables, as in createdb-regex.sh */
+static const char *watch_schema_sql =
+  "CREATE TABLE IF NOT EXISTS domain (Domain TEXT PRIMARY KEY, IPv4 TEXT, IPv6 TEXT) WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS domain_exact (Domain TEXT PRIMARY KEY, IPv4 TEXT, IPv6 TEXT) WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS db_metadata (key TEXT PRIMARY KEY, value TEXT) WITHOUT ROWID;";
+
+/* -w -s: dnsmasq block tables referencing ip_sets by ID */
+static const char *ipset_schema_sql =
+  "CREATE TABLE IF NOT EXISTS block_wildcard (Domain TEXT PRIMARY KEY NOT NULL, IPSet INTEGER) WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS block_hosts (Domain TEXT PRIMARY KEY NOT NULL, IPSet INTEGER) WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS ip_sets (ID INTEGER PRIMARY KEY, IPv4 TEXT, IPv6 TEXT);"
+  "CREATE TABLE IF NOT EXISTS db_metadata (key TEXT PRIMARY KEY, value TEXT) WITHOUT ROWID;";
+
+static void exec_sql(sqlite3 *db, const char *sql)
+{
+  char *err = NULL;
+
+  if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK)
+    {
+      fprintf(stderr, "SQL error: %s\n  in: %.120s\n", err, sql);
+      sqlite3_free(err);
+      exit(1);
+    }
+}
+
+static void set_meta(sqlite3 *db, const char *key, const char *value)
+{
+  sqlite3_stmt *st;
+
+  if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO db_metadata (key, value) VALUES (?, ?)",
+			 -1, &st, NULL) != SQLITE_OK)
+    return;
+  sqlite3_bind_text(st, 1, key, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(st, 2, value, -1, SQLITE_TRANSIENT);
+  sqlite3_step(st);
+  sqlite3_finalize(st);
+}
+
+static void count_into_meta(sqlite3 *db, const char *table)
+{
+  char sql[128], key[64], val[32];
+  sqlite3_stmt *st;
+
+  snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM %s", table);
+  if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK)
+    return;
+  if (sqlite3_step(st) == SQLITE_ROW)
+    {
+      snprintf(key, sizeof(key), "rows_%s", table);
+      snprintf(val, sizeof(val), "%lld", (long long)sqlite3_column_int64(st, 0));
+      set_meta(db, key, val);
+    }
+  sqlite3_finalize(st);
+}
+
+/* Block tables created by setup-db.sh have no IPSet column yet */
+static void add_ipset_column(sqlite3 *db, const char *table)
+{
+  char sql[128];
+  sqlite3_stmt *st;
+
+  snprintf(sql, sizeof(sql), "SELECT IPSet FROM %s LIMIT 0", table);
+  if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) == SQLITE_OK)
+    {
+      sqlite3_finalize(st);
+      return;
+    }
+  snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN IPSet INTEGER", table);
+  exec_sql(db, sql);
+}
+
+/* One ip_sets row per distinct address pair, reused across runs */
+static void assign_ip_sets(sqlite3 *db, company_t *companies, size_t n)
+{
+  sqlite3_stmt *sel, *ins;
+  size_t i;
+
+  if (sqlite3_prepare_v2(db, "SELECT ID FROM ip_sets WHERE IPv4 IS ? AND IPv6 IS ?",
+			 -1, &sel, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "INSERT INTO ip_sets (IPv4, IPv6) VALUES (?, ?)",
+			 -1, &ins, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "prepare: %s\n", sqlite3_errmsg(db));
+      exit(1);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      company_t *c = &companies[i];
+
+      if (!c->ipv4[0] && !c->ipv6[0])
+	continue;
+      sqlite3_bind_text(sel, 1, c->ipv4[0] ? c->ipv4 : NULL, -1, SQLITE_STATIC);
+      sqlite3_bind_text(sel, 2, c->ipv6[0] ? c->ipv6 : NULL, -1, SQLITE_STATIC);
+      if (sqlite3_step(sel) == SQLITE_ROW)
+	c->set_id = sqlite3_column_int(sel, 0);
+      else
+	{
+	  sqlite3_bind_text(ins, 1, c->ipv4[0] ? c->ipv4 : NULL, -1, SQLITE_STATIC);
+	  sqlite3_bind_text(ins, 2, c->ipv6[0] ? c->ipv6 : NULL, -1, SQLITE_STATIC);
+	  if (sqlite3_step(ins) != SQLITE_DONE)
+	    {
+	      fprintf(stderr, "ip_sets: %s\n", sqlite3_errmsg(db));
+	      exit(1);
+	    }
+	  c->set_id = (int)sqlite3_last_insert_rowid(db);
+	  sqlite3_reset(ins);
+	}
+      sqlite3_reset(sel);
+    }
+
+  sqlite3_finalize(sel);
+  sqlite3_finalize(ins);
+}
+
+static void watch_step(sqlite3 *db, sqlite3_stmt *q, const char *key, const char *comma)
+{
+  sqlite3_bind_text(q, 1, key + 1, comma - key - 1, SQLITE_STATIC);
+  if (sqlite3_step(q) != SQLITE_DONE)
+    {
+      fprintf(stderr, "write '%.*s': %s\n", (int)(comma - key - 1), key + 1,
+	      sqlite3_errmsg(db));
+      exit(1);
+    }
+}
+
+/* Write phase of -w: replay the import scripts in name order (see top) */
+static void merge_watch(sqlite3 *db, run_t **heap, size_t nheap,
+			const company_t *companies, int append, int ipsets,
+			uint64_t *inserted, uint64_t *whitelisted, uint64_t *dups)
+{
+  static const char *sql_addr[] = {
+    "INSERT INTO domain (Domain, IPv4, IPv6) VALUES (?, ?, ?)",
+    "INSERT INTO domain_exact (Domain, IPv4, IPv6) VALUES (?, ?, ?)",
+    "INSERT OR IGNORE INTO domain (Domain, IPv4, IPv6) VALUES (?, ?, ?)",
+    "INSERT OR IGNORE INTO domain_exact (Domain, IPv4, IPv6) VALUES (?, ?, ?)",
+    "DELETE FROM domain WHERE Domain = ?",
+    "DELETE FROM domain_exact WHERE Domain = ?",
+  };
+  static const char *sql_set[] = {
+    "INSERT INTO block_wildcard (Domain, IPSet) VALUES (?, ?)",
+    "INSERT INTO block_hosts (Domain, IPSet) VALUES (?, ?)",
+    "INSERT OR IGNORE INTO block_wildcard (Domain, IPSet) VALUES (?, ?)",
+    "INSERT OR IGNORE INTO block_hosts (Domain, IPSet) VALUES (?, ?)",
+    "DELETE FROM block_wildcard WHERE Domain = ?",
+    "DELETE FROM block_hosts WHERE Domain = ?",
+  };
+  const char **sql = ipsets ? sql_set : sql_addr;
+  sqlite3_stmt *st[6];
+  char prev[MAX_KEY_LEN + 16] = "";
+  int have_prev = 0, wl = -1, done = 0;
+  size_t i;
+
+  for (i = 0; i < 6; i++)
+    if (sqlite3_prepare_v2(db, sql[i], -1, &st[i], NULL) != SQLITE_OK)
+      {
+	fprintf(stderr, "prepare: %s\n", sqlite3_errmsg(db));
+	exit(1);
+      }
+
+  while (nheap)
+    {
+      run_t *r = heap[0];
+      const char *key = r->cur, *comma = strchr(key, ',');
+      int exact = key[0] == 'e', company = atoi(comma + 2);
+
+      /* next domain: the previous one is settled */
+      if (!have_prev || key_cmp(prev, key) != 0)
+	{
+	  if (have_prev && wl >= 0 && !done)
+	    (*whitelisted)++;
+	  snprintf(prev, sizeof(prev), "%s", key);
+	  have_prev = 1;
+	  wl = -1;
+	  done = 0;
+	}
+
+      if (comma[1] == 'a')
+	{
+	  /* whitelist keys come by company, so the last one is the latest */
+	  if (wl < 0 && append)
+	    {
+	      watch_step(db, st[4 + exact], key, comma);
+	      sqlite3_reset(st[4 + exact]);
+	    }
+	  wl = company;
+	}
+      else if (done || company <= wl)
+	/* already inserted, or deleted again by a later (or its own) whitelist */
+	(*dups)++;
+      else
+	{
+	  const company_t *c = &companies[company];
+	  sqlite3_stmt *q = st[(append ? 2 : 0) + exact];
+
+	  if (!ipsets)
+	    {
+	      sqlite3_bind_text(q, 2, c->ipv4[0] ? c->ipv4 : NULL, -1, SQLITE_STATIC);
+	      sqlite3_bind_text(q, 3, c->ipv6[0] ? c->ipv6 : NULL, -1, SQLITE_STATIC);
+	    }
+	  else if (c->set_id)
+	    sqlite3_bind_int(q, 2, c->set_id);
+	  else
+	    sqlite3_bind_null(q, 2);
+
+	  watch_step(db, q, key, comma);
+	  if (sqlite3_changes(db) > 0)
+	    (*inserted)++;
+	  sqlite3_reset(q);
+	  done = 1;
+	}
+
+      if (!run_next(r))
+	heap[0] = heap[--nheap];
+      heap_down(heap, nheap, 0);
+    }
+  if (have_prev && wl >= 0 && !done)
+    (*whitelisted)++;
+
+  for (i = 0; i < 6; i++)
+    sqlite3_finalize(st[i]);
+}
+
+/* ============================================================================
+ * Main
+ * ============================================================================ */
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+	  "Usage: %s -d DB -t wildcard|hosts|ips [options] file...\n"
+	  "       %s -d DB -w DIR [-s] [options]\n"
+	  "  -d DB      target database (created with the v7.2 schema if missing)\n"
+	  "  -t MODE    wildcard (block_wildcard), hosts (block_hosts), ips (block_ips)\n"
+	  "  -w DIR     watchlist directory: all companies into domain / domain_exact\n"
+	  "  -s         with -w: into block_wildcard / block_hosts, IP-sets by ID in ip_sets\n"
+	  "  -a         append: keep existing rows (INSERT OR IGNORE)\n"
+	  "  -j N       parser threads (default: online CPUs, max %d)\n"
+	  "  -m MB      sort memory per thread before spilling (default %d)\n"
+	  "  -T DIR     directory for spilled runs (default $TMPDIR or /tmp)\n"
+	  "  -v         verbose (-vv lists rejected lines)\n",
+	  prog, prog, MAX_THREADS, DEFAULT_MEM_MB);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  const char *dbpath = NULL, *table = NULL, *watchdir = NULL;
+  int mode = -1, append = 0, ipsets = 0, opt, f;
+  company_t *companies = NULL;
+  watch_file_t *files = NULL;
+  size_t ncompanies = 0, nfiles = 0, next_file = 0;
+  uint64_t whitelisted = 0;
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t mem_mb = DEFAULT_MEM_MB;
+  worker_t *workers;
+  run_t **heap;
+  size_t nheap = 0, nruns = 0, k;
+  uint64_t lines = 0, accepted = 0, invalid = 0, inserted = 0, dups = 0;
+  double t0, t_parse = 0, t1;
+  sqlite3 *db;
+  sqlite3_stmt *ins;
+  char prev[MAX_KEY_LEN + 2] = "";
+  int have_prev = 0;
+  char val[64];
+
+  while ((opt = getopt(argc, argv, "d:t:w:saj:m:T:vh")) != -1)
+    switch (opt)
+      {
+      case 'd': dbpath = optarg; break;
+      case 't':
+	if (strcmp(optarg, "wildcard") == 0)
+	  mode = MODE_WILDCARD, table = "block_wildcard";
+	else if (strcmp(optarg, "hosts") == 0)
+	  mode = MODE_HOSTS, table = "block_hosts";
+	else if (strcmp(optarg, "ips") == 0)
+	  mode = MODE_IPS, table = "block_ips";
+	else
+	  usage(argv[0]);
+	break;
+      case 'w': mode = MODE_WATCH, table = "domain,domain_exact", watchdir = optarg; break;
+      case 's': ipsets = 1; break;
+      case 'a': append = 1; break;
+      case 'j': nthreads = atol(optarg); break;
+      case 'm': mem_mb = strtoul(optarg, NULL, 10); break;
+      case 'T': tmpdir = optarg; break;
+      case 'v': verbose++; break;
+      default: usage(argv[0]);
+      }
+
+  if (!dbpath || mode < 0 || (mode == MODE_WATCH) != (optind >= argc) ||
+      (ipsets && mode != MODE_WATCH))
+    usage(argv[0]);
+  if (ipsets)
+    table = "block_wildcard,block_hosts";
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > MAX_THREADS)
+    nthreads = MAX_THREADS;
+  if (mem_mb < 1)
+    mem_mb = 1;
+  if (!tmpdir && !(tmpdir = getenv("TMPDIR")))
+    tmpdir = "/tmp";
+
+  if (!(workers = calloc(nthreads, sizeof(worker_t))))
+    fatal("calloc");
+  for (k = 0; k < (size_t)nthreads; k++)
+    {
+      workers[k].mode = mode;
+      workers[k].arena_size = mem_mb << 20;
+      if (!(workers[k].arena = malloc(workers[k].arena_size)))
+	fatal("malloc arena");
+    }
+
+  /* ---- Phase 1+2: parse, normalize, sort, spill ---- */
+  t0 = now_sec();
+  if (mode == MODE_WATCH)
+    {
+      pthread_t tid[MAX_THREADS];
+
+      ncompanies = load_watchlists(watchdir, &companies, &files, &nfiles);
+      if (verbose)
+	fprintf(stderr, "%zu companies, %zu list files\n", ncompanies, nfiles);
+
+      for (k = 0; k < (size_t)nthreads; k++)
+	{
+	  workers[k].files = files;
+	  workers[k].nfiles = nfiles;
+	  workers[k].next_file = &next_file;
+	  if (pthread_create(&tid[k], NULL, watch_main, &workers[k]) != 0)
+	    fatal("pthread_create");
+	}
+      for (k = 0; k < (size_t)nthreads; k++)
+	pthread_join(tid[k], NULL);
+    }
+
+  for (f = optind; f < argc; f++)
+    {
+      pthread_t tid[MAX_THREADS];
+      struct stat sb;
+      const char *map;
+      size_t off = 0;
+      int fd;
+
+      if ((fd = open(argv[f], O_RDONLY)) < 0 || fstat(fd, &sb) < 0)
+	fatal(argv[f]);
+      if (sb.st_size == 0)
+	{
+	  close(fd);
+	  continue;
+	}
+      map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+	fatal("mmap");
+      madvise((void *)map, sb.st_size, MADV_SEQUENTIAL);
+
+      /* split on newline boundaries, one chunk per worker */
+      for (k = 0; k < (size_t)nthreads; k++)
+	{
+	  size_t end = (k + 1 == (size_t)nthreads) ? (size_t)sb.st_size
+	    : (size_t)sb.st_size / nthreads * (k + 1);
+	  const char *nl;
+
+	  if (end < off)
+	    end = off;
+	  if (end < (size_t)sb.st_size &&
+	      (nl = memchr(map + end, '\n', sb.st_size - end)))
+	    end = nl - map + 1;
+	  else
+	    end = sb.st_size;
+
+	  workers[k].last_file = (f + 1 == argc);
+	  workers[k].data = map + off;
+	  workers[k].len = end - off;
+	  off = end;
+	  if (pthread_create(&tid[k], NULL, worker_main, &workers[k]) != 0)
+	    fatal("pthread_create");
+	}
+      for (k = 0; k < (size_t)nthreads; k++)
+	pthread_join(tid[k], NULL);
+
+      munmap((void *)map, sb.st_size);
+      close(fd);
+    }
+
+  for (k = 0; k < (size_t)nthreads; k++)
+    {
+      lines += workers[k].lines;
+      accepted += workers[k].accepted;
+      invalid += workers[k].invalid;
+      dups += workers[k].dups;
+      nruns += workers[k].nruns;
+      free(workers[k].arena);
+      free(workers[k].keys);
+      workers[k].arena = NULL;
+      workers[k].keys = NULL;
+    }
+  t_parse = now_sec() - t0;
+
+  if (verbose)
+    fprintf(stderr, "parsed %llu lines (%llu valid, %llu invalid) into %zu runs in %.2fs\n",
+	    (unsigned long long)lines, (unsigned long long)accepted,
+	    (unsigned long long)invalid, nruns, t_parse);
+
+  /* ---- Phase 3: single-writer merge into SQLite ---- */
+  if (sqlite3_open(dbpath, &db) != SQLITE_OK)
+    {
+      fprintf(stderr, "cannot open %s: %s\n", dbpath, sqlite3_errmsg(db));
+      return 1;
+    }
+
+  /* same import pragmas as create-db.sh; page_size only affects new files */
+  exec_sql(db, "PRAGMA page_size = 8192;"
+	       "PRAGMA journal_mode = OFF;"
+	       "PRAGMA synchronous = OFF;"
+	       "PRAGMA cache_size = -1048576;"
+	       "PRAGMA temp_store = MEMORY;"
+	       "PRAGMA locking_mode = EXCLUSIVE;");
+  exec_sql(db, ipsets ? ipset_schema_sql : mode == MODE_WATCH ? watch_schema_sql : schema_sql);
+  if (ipsets)
+    {
+      add_ipset_column(db, "block_wildcard");
+      add_ipset_column(db, "block_hosts");
+    }
+
+  exec_sql(db, "BEGIN");
+  if (ipsets)
+    {
+      if (!append)
+	exec_sql(db, "DELETE FROM block_wildcard; DELETE FROM block_hosts;");
+      assign_ip_sets(db, companies, ncompanies);
+    }
+  else if (!append && mode == MODE_WATCH)
+    exec_sql(db, "DELETE FROM domain; DELETE FROM domain_exact;");
+  else if (!append)
+    {
+      char sql[64];
+      snprintf(sql, sizeof(sql), "DELETE FROM %s", table);
+      exec_sql(db, sql);
+    }
+
+  if (!(heap = malloc((nruns ? nruns : 1) * sizeof(run_t *))))
+    fatal("malloc");
+  for (k = 0; k < (size_t)nthreads; k++)
+    {
+      size_t r;
+      for (r = 0; r < workers[k].nruns; r++)
+	if (run_next(&workers[k].runs[r]))
+	  heap[nheap++] = &workers[k].runs[r];
+    }
+  for (k = nheap / 2; k-- > 0; )
+    heap_down(heap, nheap, k);
+
+  t1 = now_sec();
+  if (mode == MODE_WATCH)
+    {
+      merge_watch(db, heap, nheap, companies, append, ipsets, &inserted, &whitelisted, &dups);
+      nheap = 0;
+      count_into_meta(db, ipsets ? "block_wildcard" : "domain");
+      count_into_meta(db, ipsets ? "block_hosts" : "domain_exact");
+    }
+  else if (sqlite3_prepare_v2(db,
+			 mode == MODE_IPS
+			 ? (append ? "INSERT OR IGNORE INTO block_ips (Source_IP, Target_IP) VALUES (?, ?)"
+			    : "INSERT INTO block_ips (Source_IP, Target_IP) VALUES (?, ?)")
+			 : mode == MODE_HOSTS
+			 ? (append ? "INSERT OR IGNORE INTO block_hosts (Domain) VALUES (?)"
+			    : "INSERT INTO block_hosts (Domain) VALUES (?)")
+			 : (append ? "INSERT OR IGNORE INTO block_wildcard (Domain) VALUES (?)"
+			    : "INSERT INTO block_wildcard (Domain) VALUES (?)"),
+			 -1, &ins, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "prepare: %s\n", sqlite3_errmsg(db));
+      return 1;
+    }
+
+  while (nheap)
+    {
+      run_t *r = heap[0];
+      const char *key = r->cur;
+
+      /* whole keys come out in order, so the first row of a Source_IP
+	 carries its lowest target and the later ones are dropped here */
+      if (have_prev && key_cmp(prev, key) == 0)
+	dups++;
+      else
+	{
+	  size_t len = strlen(key);
+
+	  memcpy(prev, key, len + 1);
+	  have_prev = 1;
+
+	  if (mode == MODE_IPS)
+	    {
+	      char *comma = strchr(prev, ',');
+	      sqlite3_bind_text(ins, 1, prev, comma - prev, SQLITE_STATIC);
+	      sqlite3_bind_text(ins, 2, comma + 1, -1, SQLITE_STATIC);
+	    }
+	  else
+	    sqlite3_bind_text(ins, 1, prev, len, SQLITE_STATIC);
+
+	  if (sqlite3_step(ins) != SQLITE_DONE)
+	    {
+	      fprintf(stderr, "insert '%s': %s\n", prev, sqlite3_errmsg(db));
+	      return 1;
+	    }
+	  if (sqlite3_changes(db) > 0)
+	    inserted++;
+	  else
+	    dups++;
+	  sqlite3_reset(ins);
+	}
+
+      if (run_next(r))
+	heap_down(heap, nheap, 0);
+      else
+	{
+	  heap[0] = heap[--nheap];
+	  heap_down(heap, nheap, 0);
+	}
+    }
+  if (mode != MODE_WATCH)
+    {
+      sqlite3_finalize(ins);
+      count_into_meta(db, "block_wildcard");
+      count_into_meta(db, "block_hosts");
+      count_into_meta(db, "block_ips");
+    }
+
+  /* ---- Phase 4: metadata ---- */
+  snprintf(val, sizeof(val), "%ld", (long)time(NULL));
+  set_meta(db, "last_import", val);
+  set_meta(db, "last_import_table", table);
+  snprintf(val, sizeof(val), "%llu", (unsigned long long)inserted);
+  set_meta(db, "last_import_rows", val);
+  exec_sql(db, "COMMIT");
+  t1 = now_sec() - t1;
+
+  if (verbose)
+    fprintf(stderr, "merged and inserted in %.2fs, running ANALYZE...\n", t1);
+
+  exec_sql(db, "ANALYZE;"
+	       "PRAGMA locking_mode = NORMAL;"
+	       "PRAGMA journal_mode = WAL;");
+  sqlite3_close(db);
+
+  for (k = 0; k < (size_t)nthreads; k++)
+    {
+      size_t r;
+      for (r = 0; r < workers[k].nruns; r++)
+	run_free(&workers[k].runs[r]);
+      free(workers[k].runs);
+    }
+  free(workers);
+  free(heap);
+  for (k = 0; k < nfiles; k++)
+    free(files[k].path);
+  for (k = 0; k < ncompanies; k++)
+    free(companies[k].name);
+  free(files);
+  free(companies);
+
+  if (mode == MODE_WATCH)
+    printf("watchlists: %zu companies, %llu domains whitelisted\n",
+	   ncompanies, (unsigned long long)whitelisted);
+
+  printf("%s: %llu lines, %llu invalid, %llu duplicates, %llu rows inserted\n",
+	 table, (unsigned long long)lines, (unsigned long long)invalid,
+	 (unsigned long long)dups, (unsigned long long)inserted);
+  printf("parse+sort %.2fs (%.0f lines/s), merge+insert %.2fs (%.0f rows/s), total %.2fs\n",
+	 t_parse, t_parse > 0 ? lines / t_parse : 0.0,
+	 t1, t1 > 0 ? inserted / t1 : 0.0, now_sec() - t0);
+
+  return 0;
+}
@@ -0,0 +1,610 @@
+/*
+ * Lookup Engine Microbenchmark for dnsmasq-sqlite
+ *
+ * Unlike performance-benchmark.c (raw SQL against the old schema), this tool
+ * compiles db.c into the binary and calls the real lookup code paths:
+ *   db_check_block, get_base_domain, db_rewrite_ipv4, db_rewrite_ipv6,
+ *   cidr_find_match
+ *
+ * The fixture database (v7.2 schema: block_hosts, block_wildcard, block_ips
+ * incl. CIDR rows) is generated deterministically from (rows, seed), so two
+ * runs against two versions of db.c measure exactly the same workload.
+ *
+ * Reported per function: ns/op (un-instrumented pass), latency percentiles
+ * (per-call samples, timer overhead subtracted) and, on Linux, hardware
+ * cache misses per op via perf_event_open (needs perf_event_paranoid <= 2).
+ *
+ * Compile: gcc -O2 -I../dnsmasq-2.92/src -o db-lookup-bench db-lookup-bench.c -lsqlite3
+ * Usage:   ./db-lookup-bench [-n rows] [-q ops] [-s seed] [-c cidr] [-t tld2.txt] [-r] <fixture.db>
+ */
+
+#include "db.c"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
+
+#define DEFAULT_ROWS    1000000
+#define DEFAULT_OPS     1000000
+#define DEFAULT_SEED    42
+#define DEFAULT_CIDR    64
+#define MAX_NAME_LEN    256
+#define MAX_BASE_LEN    192
+#define MAX_SUFFIXES    16384
+
+/* my_syslog() lives in log.c which we do not link; db.c only needs a sink.
+ * db.c also bumps daemon->metrics[], so give it a zeroed daemon struct. */
+static int verbose = 0;
+static struct daemon bench_daemon;
+struct daemon *dnsmasq_daemon = &bench_daemon;
+
+void my_syslog(int priority, const char *format, ...)
+{
+    va_list ap;
+    (void)priority;
+    if (!verbose) return;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+/* db-stats.c is not linked either; measure with --sqlite-stats off */
+void db_stats_hit(int table, const char *key)
+{
+    (void)table;
+    (void)key;
+}
+
+/* ============================================================================
+ * Deterministic name / address generation
+ * ============================================================================ */
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static const char *default_tlds[] = {
+    "com", "com", "com", "com", "net", "org", "de", "io", "info", "ru", "uk", "nl"
+};
+#define N_DEFAULT_TLDS (sizeof(default_tlds) / sizeof(default_tlds[0]))
+
+/* Two-label suffixes taken from the TLD2 list (e.g. co.uk), if one is given */
+static char *suffixes[MAX_SUFFIXES];
+static int n_suffixes = 0;
+
+static void load_suffixes(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[MAX_NAME_LEN];
+
+    if (!f) {
+        fprintf(stderr, "Cannot open TLD2 list: %s\n", path);
+        exit(1);
+    }
+    while (n_suffixes < MAX_SUFFIXES && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        char *dot = strchr(line, '.');
+        if (!dot || strchr(dot + 1, '.')) continue;
+        suffixes[n_suffixes] = strdup(line);
+        str_tolower(suffixes[n_suffixes]);
+        n_suffixes++;
+    }
+    fclose(f);
+}
+
+static void make_label(uint64_t h, char *out)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    int len = 4 + (int)(h % 11);
+    for (int i = 0; i < len; i++) {
+        h = mix64(h + i);
+        out[i] = alphabet[h % (i == 0 ? 26 : 36)];
+    }
+    out[len] = '\0';
+}
+
+/* Registrable domain number i of the fixture (~20% under a 2-label suffix) */
+static void base_name(uint64_t seed, uint64_t i, char *out)
+{
+    char label[32];
+    uint64_t h = mix64(seed ^ (i * 0x9e3779b97f4a7c15ULL));
+    make_label(h, label);
+    if (n_suffixes > 0 && (h >> 40) % 5 == 0)
+        snprintf(out, MAX_BASE_LEN, "%s%llu.%s", label, (unsigned long long)i,
+                 suffixes[(h >> 20) % n_suffixes]);
+    else
+        snprintf(out, MAX_BASE_LEN, "%s%llu.%s", label, (unsigned long long)i,
+                 default_tlds[(h >> 20) % N_DEFAULT_TLDS]);
+}
+
+static void host_name(uint64_t seed, uint64_t i, char *out)
+{
+    static const char *prefixes[] = { "www", "cdn", "ads", "api", "static", "track" };
+    char base[MAX_BASE_LEN];
+    base_name(seed ^ 0x5bd1e995ULL, i, base);
+    snprintf(out, MAX_NAME_LEN, "%s.%s", prefixes[mix64(i) % 6], base);
+}
+
+static void wildcard_name(uint64_t seed, uint64_t i, char *out)
+{
+    base_name(seed ^ 0xa5a5a5a5ULL, i, out);
+}
+
+static void miss_name(uint64_t seed, uint64_t i, char *out)
+{
+    char base[MAX_BASE_LEN];
+    base_name(seed ^ 0x1234567ULL, i, base);
+    snprintf(out, MAX_NAME_LEN, "m.%s", base);
+}
+
+/* Exact IPv4 rows live in 10/8, CIDR rows in 172.16/12 (one /24 each) */
+static void exact_ip4(uint64_t i, struct in_addr *a)
+{
+    a->s_addr = htonl(0x0a000000U | (uint32_t)(i & 0xffffff));
+}
+
+static void cidr_ip4(uint64_t i, struct in_addr *a)
+{
+    a->s_addr = htonl(0xac100000U | ((uint32_t)(i & 0xfff) << 8));
+}
+
+static void exact_ip6(uint64_t i, struct in6_addr *a)
+{
+    memset(a, 0, sizeof(*a));
+    a->s6_addr[0] = 0x20; a->s6_addr[1] = 0x01; a->s6_addr[2] = 0x0d; a->s6_addr[3] = 0xb8;
+    for (int b = 0; b < 8; b++) a->s6_addr[15 - b] = (unsigned char)(i >> (8 * b));
+}
+
+static void cidr_ip6(uint64_t i, struct in6_addr *a)
+{
+    memset(a, 0, sizeof(*a));
+    a->s6_addr[0] = 0xfd; a->s6_addr[1] = 0x00;
+    a->s6_addr[2] = (unsigned char)(i >> 8); a->s6_addr[3] = (unsigned char)i;
+}
+
+/* ============================================================================
+ * Fixture
+ * ============================================================================ */
+
+static void exec_or_die(sqlite3 *h, const char *sql)
+{
+    char *err = NULL;
+    if (sqlite3_exec(h, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n  in: %s\n", err, sql);
+        exit(1);
+    }
+}
+
+static void insert_text(sqlite3_stmt *s, const char *a, const char *b)
+{
+    sqlite3_reset(s);
+    sqlite3_bind_text(s, 1, a, -1, SQLITE_TRANSIENT);
+    if (b) sqlite3_bind_text(s, 2, b, -1, SQLITE_TRANSIENT);
+    sqlite3_step(s);
+}
+
+static void make_fixture(const char *path, uint64_t rows, uint64_t seed, int cidrs)
+{
+    sqlite3 *h;
+    sqlite3_stmt *hosts, *wild, *ips;
+    char name[MAX_NAME_LEN], src[INET6_ADDRSTRLEN + 4], dst[INET6_ADDRSTRLEN];
+    uint64_t ip_rows = rows / 10 ? rows / 10 : 1;
+
+    unlink(path);
+    if (sqlite3_open(path, &h) != SQLITE_OK) {
+        fprintf(stderr, "Cannot create fixture: %s\n", sqlite3_errmsg(h));
+        exit(1);
+    }
+
+    printf("Generating fixture %s (%llu rows per table, seed %llu)...\n",
+           path, (unsigned long long)rows, (unsigned long long)seed);
+
+    exec_or_die(h, "PRAGMA page_size = 8192; PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF;");
+    exec_or_die(h, "CREATE TABLE block_wildcard (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID;"
+                   "CREATE TABLE block_hosts (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID;"
+                   "CREATE TABLE block_ips (Source_IP TEXT PRIMARY KEY NOT NULL, Target_IP TEXT NOT NULL) WITHOUT ROWID;"
+                   "CREATE TABLE bench_fixture (Key TEXT PRIMARY KEY, Value INTEGER) WITHOUT ROWID;");
+    exec_or_die(h, "BEGIN");
+
+    sqlite3_prepare_v2(h, "INSERT OR IGNORE INTO block_hosts VALUES (?)", -1, &hosts, NULL);
+    sqlite3_prepare_v2(h, "INSERT OR IGNORE INTO block_wildcard VALUES (?)", -1, &wild, NULL);
+    sqlite3_prepare_v2(h, "INSERT OR IGNORE INTO block_ips VALUES (?, ?)", -1, &ips, NULL);
+
+    for (uint64_t i = 0; i < rows; i++) {
+        host_name(seed, i, name);
+        insert_text(hosts, name, NULL);
+        wildcard_name(seed, i, name);
+        insert_text(wild, name, NULL);
+    }
+
+    for (uint64_t i = 0; i < ip_rows; i++) {
+        struct in_addr a4;
+        struct in6_addr a6;
+        exact_ip4(i, &a4);
+        inet_ntop(AF_INET, &a4, src, sizeof(src));
+        snprintf(dst, sizeof(dst), "192.0.2.%u", (unsigned)(i % 254) + 1);
+        insert_text(ips, src, dst);
+        exact_ip6(i, &a6);
+        inet_ntop(AF_INET6, &a6, src, sizeof(src));
+        snprintf(dst, sizeof(dst), "2001:db8:ffff::%x", (unsigned)(i % 0xffff) + 1);
+        insert_text(ips, src, dst);
+    }
+
+    for (int i = 0; i < cidrs; i++) {
+        struct in_addr a4;
+        struct in6_addr a6;
+        char net[INET6_ADDRSTRLEN];
+        cidr_ip4(i, &a4);
+        inet_ntop(AF_INET, &a4, net, sizeof(net));
+        snprintf(src, sizeof(src), "%s/24", net);
+        insert_text(ips, src, "198.51.100.1");
+        cidr_ip6(i, &a6);
+        inet_ntop(AF_INET6, &a6, net, sizeof(net));
+        snprintf(src, sizeof(src), "%s/32", net);
+        insert_text(ips, src, "2001:db8:eeee::1");
+    }
+
+    sqlite3_finalize(hosts);
+    sqlite3_finalize(wild);
+    sqlite3_finalize(ips);
+
+    snprintf(name, sizeof(name),
+             "INSERT INTO bench_fixture VALUES ('rows', %llu), ('seed', %llu), ('cidr', %d)",
+             (unsigned long long)rows, (unsigned long long)seed, cidrs);
+    exec_or_die(h, name);
+    exec_or_die(h, "COMMIT");
+    exec_or_die(h, "ANALYZE");
+    sqlite3_close(h);
+}
+
+/* Returns 1 and fills rows/seed/cidrs if path is a fixture made by this tool */
+static int read_fixture_params(const char *path, uint64_t *rows, uint64_t *seed, int *cidrs)
+{
+    sqlite3 *h;
+    sqlite3_stmt *s;
+    int found = 0;
+
+    if (access(path, R_OK) != 0) return 0;
+    if (sqlite3_open_v2(path, &h, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        sqlite3_close(h);
+        return 0;
+    }
+    if (sqlite3_prepare_v2(h, "SELECT Key, Value FROM bench_fixture", -1, &s, NULL) == SQLITE_OK) {
+        while (sqlite3_step(s) == SQLITE_ROW) {
+            const char *k = (const char *)sqlite3_column_text(s, 0);
+            sqlite3_int64 v = sqlite3_column_int64(s, 1);
+            if (!k) continue;
+            if (strcmp(k, "rows") == 0) { *rows = (uint64_t)v; found++; }
+            else if (strcmp(k, "seed") == 0) { *seed = (uint64_t)v; found++; }
+            else if (strcmp(k, "cidr") == 0) { *cidrs = (int)v; found++; }
+        }
+        sqlite3_finalize(s);
+    }
+    sqlite3_close(h);
+    return found == 3;
+}
+
+/* ============================================================================
+ * Workloads (50% exact hits, 25% wildcard/CIDR hits, 25% misses)
+ * ============================================================================ */
+
+typedef struct {
+    char (*names)[MAX_NAME_LEN];
+    struct in_addr *ip4;
+    struct in6_addr *ip6;
+    int count;
+} workload_t;
+
+static void build_workload(workload_t *w, int ops, uint64_t rows, uint64_t seed, int cidrs)
+{
+    uint64_t ip_rows = rows / 10 ? rows / 10 : 1;
+
+    w->count = ops;
+    w->names = malloc((size_t)ops * MAX_NAME_LEN);
+    w->ip4 = malloc((size_t)ops * sizeof(struct in_addr));
+    w->ip6 = malloc((size_t)ops * sizeof(struct in6_addr));
+    if (!w->names || !w->ip4 || !w->ip6) {
+        fprintf(stderr, "Out of memory building workload\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < ops; i++) {
+        uint64_t h = mix64(seed + 0x77 + (uint64_t)i);
+        uint64_t pick = h >> 32;
+        switch (h & 3) {
+        case 0:
+        case 1:
+            host_name(seed, pick % rows, w->names[i]);
+            exact_ip4(pick % ip_rows, &w->ip4[i]);
+            exact_ip6(pick % ip_rows, &w->ip6[i]);
+            break;
+        case 2: {
+            char base[MAX_BASE_LEN];
+            wildcard_name(seed, pick % rows, base);
+            snprintf(w->names[i], MAX_NAME_LEN, "s%u.%s", (unsigned)(pick % 97), base);
+            cidr_ip4(pick % (cidrs ? cidrs : 1), &w->ip4[i]);
+            w->ip4[i].s_addr |= htonl((uint32_t)(pick % 254) + 1);
+            cidr_ip6(pick % (cidrs ? cidrs : 1), &w->ip6[i]);
+            w->ip6[i].s6_addr[15] = (unsigned char)(pick % 254) + 1;
+            break;
+        }
+        default:
+            miss_name(seed, pick, w->names[i]);
+            w->ip4[i].s_addr = htonl(0xc6336400U | (uint32_t)(pick & 0xff)); /* 198.51.100/24 */
+            inet_pton(AF_INET6, "2001:db8:abcd::1", &w->ip6[i]);
+            w->ip6[i].s6_addr[15] = (unsigned char)pick;
+            break;
+        }
+    }
+}
+
+/* ============================================================================
+ * Measurement
+ * ============================================================================ */
+
+static volatile uintptr_t sink;
+
+typedef void (*bench_fn)(const workload_t *w, int i);
+
+static void op_check_block(const workload_t *w, int i)
+{
+    sink += (uintptr_t)db_check_block(w->names[i]);
+}
+
+static void op_base_domain(const workload_t *w, int i)
+{
+    sink += (uintptr_t)get_base_domain(w->names[i]);
+}
+
+static void op_rewrite_ipv4(const workload_t *w, int i)
+{
+    struct in_addr a = w->ip4[i];
+    sink += (uintptr_t)db_rewrite_ipv4(&a);
+}
+
+static void op_rewrite_ipv6(const workload_t *w, int i)
+{
+    struct in6_addr a = w->ip6[i];
+    sink += (uintptr_t)db_rewrite_ipv6(&a);
+}
+
+static void op_cidr_v4(const workload_t *w, int i)
+{
+    sink += (uintptr_t)cidr_find_match(&w->ip4[i], NULL, 0);
+}
+
+static void op_cidr_v6(const workload_t *w, int i)
+{
+    sink += (uintptr_t)cidr_find_match(NULL, &w->ip6[i], 1);
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Median cost of one back-to-back now_ns() pair, subtracted from samples */
+static uint32_t timer_overhead(void)
+{
+    uint32_t s[1001];
+    for (int i = 0; i < 1001; i++) {
+        uint64_t t0 = now_ns();
+        s[i] = (uint32_t)(now_ns() - t0);
+    }
+    qsort(s, 1001, sizeof(uint32_t), compare_u32);
+    return s[500];
+}
+
+#ifdef __linux__
+static int perf_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = type;
+    pe.size = sizeof(pe);
+    pe.config = config;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+#endif
+
+typedef struct {
+    int fd_llc;
+    int fd_l1d;
+} counters_t;
+
+static void counters_open(counters_t *c)
+{
+    c->fd_llc = c->fd_l1d = -1;
+#ifdef __linux__
+    c->fd_llc = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    c->fd_l1d = perf_open(PERF_TYPE_HW_CACHE,
+                          PERF_COUNT_HW_CACHE_L1D |
+                          (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+}
+
+static void counters_start(counters_t *c)
+{
+#ifdef __linux__
+    if (c->fd_llc >= 0) { ioctl(c->fd_llc, PERF_EVENT_IOC_RESET, 0); ioctl(c->fd_llc, PERF_EVENT_IOC_ENABLE, 0); }
+    if (c->fd_l1d >= 0) { ioctl(c->fd_l1d, PERF_EVENT_IOC_RESET, 0); ioctl(c->fd_l1d, PERF_EVENT_IOC_ENABLE, 0); }
+#else
+    (void)c;
+#endif
+}
+
+static long long counter_stop(int fd)
+{
+    long long v = -1;
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &v, sizeof(v)) != sizeof(v)) v = -1;
+    }
+#else
+    (void)fd;
+#endif
+    return v;
+}
+
+static void print_counter(long long v, int ops)
+{
+    if (v < 0) printf(" %10s", "n/a");
+    else printf(" %10.2f", (double)v / ops);
+}
+
+static void run_bench(const char *label, bench_fn fn, const workload_t *w,
+                      counters_t *c, uint32_t overhead, uint32_t *samples)
+{
+    int n = w->count;
+    int warm = n < 10000 ? n : 10000;
+
+    for (int i = 0; i < warm; i++) fn(w, i);
+
+    /* Pass 1: throughput and cache misses, no per-call timing */
+    counters_start(c);
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < n; i++) fn(w, i);
+    uint64_t elapsed = now_ns() - t0;
+    long long llc = counter_stop(c->fd_llc);
+    long long l1d = counter_stop(c->fd_l1d);
+
+    /* Pass 2: per-call latency distribution */
+    for (int i = 0; i < n; i++) {
+        uint64_t s = now_ns();
+        fn(w, i);
+        uint64_t d = now_ns() - s;
+        samples[i] = d > overhead ? (uint32_t)(d - overhead) : 0;
+    }
+    qsort(samples, n, sizeof(uint32_t), compare_u32);
+
+    printf("%-18s %10.1f %8u %8u %8u %8u %10u",
+           label, (double)elapsed / n,
+           samples[n / 2], samples[(int)(n * 0.90)], samples[(int)(n * 0.99)],
+           samples[(int)(n * 0.999)], samples[n - 1]);
+    print_counter(llc, n);
+    print_counter(l1d, n);
+    printf("\n");
+}
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [options] <fixture.db>\n\n", prog);
+    printf("Options:\n");
+    printf("  -n rows   Rows per table when generating the fixture (default %d)\n", DEFAULT_ROWS);
+    printf("  -q ops    Operations per function (default %d)\n", DEFAULT_OPS);
+    printf("  -s seed   Fixture/workload seed (default %d)\n", DEFAULT_SEED);
+    printf("  -c count  CIDR rules per address family (default %d)\n", DEFAULT_CIDR);
+    printf("  -t file   TLD2 list (2ndlevel.txt) for fixture names and base-domain detection\n");
+    printf("  -r        Regenerate the fixture even if it exists\n");
+    printf("  -v        Show db.c log output\n\n");
+    printf("An existing fixture is reused with the parameters it was built with.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t rows = DEFAULT_ROWS, seed = DEFAULT_SEED;
+    int ops = DEFAULT_OPS, cidrs = DEFAULT_CIDR, regen = 0, opt;
+    const char *tld2 = NULL;
+
+    while ((opt = getopt(argc, argv, "n:q:s:c:t:rvh")) != -1) {
+        switch (opt) {
+        case 'n': rows = strtoull(optarg, NULL, 10); regen = 1; break;
+        case 'q': ops = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 10); regen = 1; break;
+        case 'c': cidrs = atoi(optarg); regen = 1; break;
+        case 't': tld2 = optarg; break;
+        case 'r': regen = 1; break;
+        case 'v': verbose = 1; break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1 || rows == 0 || ops <= 0 || cidrs < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char *fixture = argv[optind];
+
+    if (tld2) load_suffixes(tld2);
+
+    uint64_t f_rows, f_seed;
+    int f_cidrs;
+    if (read_fixture_params(fixture, &f_rows, &f_seed, &f_cidrs) &&
+        (!regen || (f_rows == rows && f_seed == seed && f_cidrs == cidrs))) {
+        rows = f_rows; seed = f_seed; cidrs = f_cidrs;
+        printf("Reusing fixture %s (%llu rows per table, seed %llu)\n",
+               fixture, (unsigned long long)rows, (unsigned long long)seed);
+    } else {
+        make_fixture(fixture, rows, seed, cidrs);
+    }
+
+    workload_t w;
+    build_workload(&w, ops, rows, seed, cidrs);
+
+    db_set_file((char *)fixture);
+    if (tld2) db_set_tld2_file((char *)tld2);
+    db_init();
+    if (!db) {
+        fprintf(stderr, "db_init() failed for %s (run with -v)\n", fixture);
+        return 1;
+    }
+
+    uint32_t *samples = malloc((size_t)ops * sizeof(uint32_t));
+    if (!samples) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    counters_t c;
+    counters_open(&c);
+    uint32_t overhead = timer_overhead();
+
+    printf("Ops per function: %d, timer overhead: %u ns, cidr rules: %d, tld2: %s\n\n",
+           ops, overhead, cidr_count, psl_loaded ? "yes" : "no");
+    printf("%-18s %10s %8s %8s %8s %8s %10s %10s %10s\n",
+           "function", "ns/op", "p50", "p90", "p99", "p99.9", "max", "llc-miss", "l1d-miss");
+
+    run_bench("db_check_block", op_check_block, &w, &c, overhead, samples);
+    run_bench("get_base_domain", op_base_domain, &w, &c, overhead, samples);
+    run_bench("db_rewrite_ipv4", op_rewrite_ipv4, &w, &c, overhead, samples);
+    run_bench("db_rewrite_ipv6", op_rewrite_ipv6, &w, &c, overhead, samples);
+    run_bench("cidr_find_match/4", op_cidr_v4, &w, &c, overhead, samples);
+    run_bench("cidr_find_match/6", op_cidr_v6, &w, &c, overhead, samples);
+
+    printf("\nPercentiles in ns; miss columns are per op (n/a without perf counters).\n");
+
+    free(samples);
+    free(w.names);
+    free(w.ip4);
+    free(w.ip6);
+    db_cleanup();
+    return 0;
+}
@@ -0,0 +1,743 @@
+/*
+ * DNS Load Generator for dnsmasq-sqlite
+ *
+ * Replays a query workload against a running instance (normally 127.0.0.1)
+ * over UDP and/or TCP and reports QPS, the latency distribution and the
+ * answer RCODE mix.
+ *
+ * Workload sources:
+ *   -f file.pcap   pcap capture, e.g. one written by --dumpfile (dump.c,
+ *                  DLT_RAW) or tcpdump (Ethernet, Linux SLL, BSD loopback).
+ *                  Only DNS queries (QR=0) over UDP or TCP are replayed.
+ *   -f file.txt    plain list, one "name [qtype]" per line (qtype defaults
+ *                  to A; names or numbers, e.g. "example.com AAAA", "x.org 65").
+ *
+ * The workload is replayed in order and looped until -n queries or -d seconds
+ * have been sent. All sockets are non-blocking and driven from one poll()
+ * loop, so the generator itself stays cheap compared to the server.
+ *
+ * Compile: gcc -O2 -o dns-loadgen dns-loadgen.c
+ * Usage:   ./dns-loadgen -f queries.txt [-s 127.0.0.1] [-p 53] [-c 100] [-r qps] [-d secs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_CONCURRENCY 100
+#define DEFAULT_SOCKETS     16
+#define DEFAULT_TIMEOUT_MS  2000
+#define MAX_PACKET          65535
+#define PENDING_RING        (1 << 20)
+
+/* ============================================================================
+ * Workload
+ * ============================================================================ */
+
+typedef struct {
+    unsigned char *data;
+    uint16_t len;
+} query_t;
+
+static query_t *queries = NULL;
+static size_t n_queries = 0, cap_queries = 0;
+
+static void add_query(const unsigned char *pkt, size_t len)
+{
+    if (len < 12 || len > MAX_PACKET) return;
+    if (n_queries == cap_queries) {
+        cap_queries = cap_queries ? cap_queries * 2 : 4096;
+        queries = realloc(queries, cap_queries * sizeof(query_t));
+        if (!queries) { perror("realloc"); exit(1); }
+    }
+    queries[n_queries].data = malloc(len);
+    if (!queries[n_queries].data) { perror("malloc"); exit(1); }
+    memcpy(queries[n_queries].data, pkt, len);
+    queries[n_queries].len = (uint16_t)len;
+    n_queries++;
+}
+
+static const struct { const char *name; int type; } qtypes[] = {
+    { "A", 1 }, { "NS", 2 }, { "CNAME", 5 }, { "SOA", 6 }, { "PTR", 12 },
+    { "MX", 15 }, { "TXT", 16 }, { "AAAA", 28 }, { "SRV", 33 }, { "NAPTR", 35 },
+    { "DS", 43 }, { "SSHFP", 44 }, { "RRSIG", 46 }, { "DNSKEY", 48 },
+    { "SMIMEA", 53 }, { "SVCB", 64 }, { "HTTPS", 65 }, { "CAA", 257 }, { "ANY", 255 }
+};
+
+static int parse_qtype(const char *s)
+{
+    if (isdigit((unsigned char)*s)) return atoi(s);
+    if (strncasecmp(s, "TYPE", 4) == 0 && isdigit((unsigned char)s[4])) return atoi(s + 4);
+    for (size_t i = 0; i < sizeof(qtypes) / sizeof(qtypes[0]); i++)
+        if (strcasecmp(s, qtypes[i].name) == 0) return qtypes[i].type;
+    return -1;
+}
+
+/* Build a wire-format query with RD set; returns length or 0 on bad name */
+static size_t build_query(const char *name, int qtype, unsigned char *out)
+{
+    unsigned char *p = out + 12;
+    const char *label = name;
+
+    memset(out, 0, 12);
+    out[2] = 0x01;              /* RD */
+    out[5] = 1;                 /* QDCOUNT */
+
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t l = dot ? (size_t)(dot - label) : strlen(label);
+        if (l == 0 || l > 63 || (p - out) + l + 1 > 255 + 12) return 0;
+        *p++ = (unsigned char)l;
+        memcpy(p, label, l);
+        p += l;
+        if (!dot) break;
+        label = dot + 1;
+    }
+    *p++ = 0;
+    *p++ = (unsigned char)(qtype >> 8); *p++ = (unsigned char)qtype;
+    *p++ = 0; *p++ = 1;         /* IN */
+    return (size_t)(p - out);
+}
+
+static void load_list(FILE *f)
+{
+    char line[1024], name[512], type[32];
+    unsigned char pkt[512];
+    int skipped = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        int n = sscanf(line, "%511s %31s", name, type);
+        if (n < 1 || name[0] == '#') continue;
+        int qt = n == 2 ? parse_qtype(type) : 1;
+        size_t nl = strlen(name);
+        if (nl > 1 && name[nl - 1] == '.') name[nl - 1] = '\0';
+        size_t len = qt >= 0 ? build_query(name, qt, pkt) : 0;
+        if (len) add_query(pkt, len);
+        else skipped++;
+    }
+    if (skipped)
+        fprintf(stderr, "Skipped %d unparseable lines\n", skipped);
+}
+
+/* pcap: link types handled are the ones DNS captures come in */
+#define LT_NULL   0
+#define LT_EN10MB 1
+#define LT_RAW    101
+#define LT_RAW12  12
+#define LT_LOOP   108
+#define LT_SLL    113
+
+static uint32_t swap32(uint32_t v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+static int dst_port_filter = -1;
+
+/* Feed one DNS payload found in a capture; only queries are kept */
+static void pcap_payload(const unsigned char *dns, size_t len, int dport, int tcp)
+{
+    if (dst_port_filter >= 0 && dport != dst_port_filter) return;
+
+    /* A TCP segment may carry one or more length-prefixed messages */
+    while (tcp && len >= 2) {
+        size_t mlen = ((size_t)dns[0] << 8) | dns[1];
+        if (mlen + 2 > len) return;
+        if (mlen >= 12 && !(dns[2] & 0x80)) add_query(dns + 2, mlen);
+        dns += mlen + 2;
+        len -= mlen + 2;
+    }
+    if (!tcp && len >= 12 && !(dns[2] & 0x80))
+        add_query(dns, len);
+}
+
+static void pcap_ip(const unsigned char *p, size_t len)
+{
+    int proto;
+    size_t hl;
+
+    if (len < 1) return;
+    if ((p[0] >> 4) == 4) {
+        if (len < 20) return;
+        hl = (size_t)(p[0] & 0x0f) * 4;
+        if ((((p[6] & 0x1f) << 8) | p[7]) != 0 || (p[6] & 0x20)) return;  /* fragment */
+        proto = p[9];
+    } else if ((p[0] >> 4) == 6) {
+        if (len < 40) return;
+        hl = 40;
+        proto = p[6];           /* extension headers are not followed */
+    } else
+        return;
+
+    if (hl > len) return;
+    p += hl;
+    len -= hl;
+
+    if (proto == IPPROTO_UDP && len >= 8)
+        pcap_payload(p + 8, len - 8, (p[2] << 8) | p[3], 0);
+    else if (proto == IPPROTO_TCP && len >= 20) {
+        size_t th = (size_t)(p[12] >> 4) * 4;
+        if (th <= len && len > th)
+            pcap_payload(p + th, len - th, (p[2] << 8) | p[3], 1);
+    }
+}
+
+static int load_pcap(FILE *f)
+{
+    unsigned char gh[24], rh[16];
+    unsigned char *pkt = malloc(MAX_PACKET + 256);
+    int swapped;
+    uint32_t linktype;
+
+    if (!pkt) { perror("malloc"); exit(1); }
+    if (fread(gh, 1, sizeof(gh), f) != sizeof(gh)) { free(pkt); return 0; }
+
+    uint32_t magic;
+    memcpy(&magic, gh, 4);
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) swapped = 0;
+    else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) swapped = 1;
+    else { free(pkt); return 0; }
+
+    memcpy(&linktype, gh + 20, 4);
+    if (swapped) linktype = swap32(linktype);
+    linktype &= 0x0fffffff;
+
+    while (fread(rh, 1, sizeof(rh), f) == sizeof(rh)) {
+        uint32_t incl;
+        memcpy(&incl, rh + 8, 4);
+        if (swapped) incl = swap32(incl);
+        if (incl > MAX_PACKET + 256) {
+            fprintf(stderr, "Corrupt pcap record (%u bytes), stopping\n", incl);
+            break;
+        }
+        if (fread(pkt, 1, incl, f) != incl) break;
+
+        const unsigned char *p = pkt;
+        size_t len = incl;
+        switch (linktype) {
+        case LT_RAW:
+        case LT_RAW12:
+            break;
+        case LT_NULL:
+        case LT_LOOP:
+            if (len < 4) continue;
+            p += 4; len -= 4;
+            break;
+        case LT_EN10MB: {
+            if (len < 14) continue;
+            size_t off = 12;
+            uint16_t et = (uint16_t)((p[off] << 8) | p[off + 1]);
+            while ((et == 0x8100 || et == 0x88a8) && len >= off + 6) {
+                off += 4;
+                et = (uint16_t)((p[off] << 8) | p[off + 1]);
+            }
+            if (et != 0x0800 && et != 0x86dd) continue;
+            p += off + 2; len -= off + 2;
+            break;
+        }
+        case LT_SLL:
+            if (len < 16) continue;
+            p += 16; len -= 16;
+            break;
+        default:
+            fprintf(stderr, "Unsupported pcap link type %u\n", linktype);
+            free(pkt);
+            exit(1);
+        }
+        pcap_ip(p, len);
+    }
+    free(pkt);
+    return 1;
+}
+
+static void load_workload(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) { perror(path); exit(1); }
+    if (!load_pcap(f)) {
+        rewind(f);
+        load_list(f);
+    }
+    fclose(f);
+    if (n_queries == 0) {
+        fprintf(stderr, "No queries found in %s\n", path);
+        exit(1);
+    }
+}
+
+/* ============================================================================
+ * Statistics
+ * ============================================================================ */
+
+static uint64_t sent = 0, received = 0, timeouts = 0, truncated = 0, errors = 0;
+static uint64_t sent_udp = 0, sent_tcp = 0;
+static uint64_t rcodes[16];
+static uint32_t *lat_us = NULL;
+static size_t n_lat = 0, cap_lat = 0;
+
+static void record_answer(const unsigned char *pkt, size_t len, uint64_t rtt_ns)
+{
+    received++;
+    if (len >= 4) {
+        rcodes[pkt[3] & 0x0f]++;
+        if (pkt[2] & 0x02) truncated++;
+    }
+    if (n_lat == cap_lat) {
+        cap_lat = cap_lat ? cap_lat * 2 : 1 << 20;
+        lat_us = realloc(lat_us, cap_lat * sizeof(uint32_t));
+        if (!lat_us) { perror("realloc"); exit(1); }
+    }
+    lat_us[n_lat++] = (uint32_t)(rtt_ns / 1000);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static const char *rcode_names[16] = {
+    "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+    "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE", "RCODE11",
+    "RCODE12", "RCODE13", "RCODE14", "RCODE15"
+};
+
+static void print_summary(double secs)
+{
+    printf("\n=== Load Generator Results ===\n");
+    printf("Duration:         %.2f s\n", secs);
+    printf("Queries sent:     %llu (udp %llu, tcp %llu)\n",
+           (unsigned long long)sent, (unsigned long long)sent_udp, (unsigned long long)sent_tcp);
+    printf("Answers:          %llu\n", (unsigned long long)received);
+    printf("Timeouts:         %llu\n", (unsigned long long)timeouts);
+    if (errors)
+        printf("Socket errors:    %llu\n", (unsigned long long)errors);
+    printf("Throughput:       %.0f answers/sec\n", secs > 0 ? received / secs : 0.0);
+
+    if (n_lat) {
+        qsort(lat_us, n_lat, sizeof(uint32_t), compare_u32);
+        double sum = 0;
+        for (size_t i = 0; i < n_lat; i++) sum += lat_us[i];
+        printf("\nLatency (us):\n");
+        printf("  Average:        %.1f\n", sum / n_lat);
+        printf("  Min:            %u\n", lat_us[0]);
+        printf("  50th:           %u\n", lat_us[n_lat / 2]);
+        printf("  90th:           %u\n", lat_us[(size_t)(n_lat * 0.90)]);
+        printf("  99th:           %u\n", lat_us[(size_t)(n_lat * 0.99)]);
+        printf("  99.9th:         %u\n", lat_us[(size_t)(n_lat * 0.999)]);
+        printf("  Max:            %u\n", lat_us[n_lat - 1]);
+    }
+
+    printf("\nRCODE mix:\n");
+    for (int i = 0; i < 16; i++)
+        if (rcodes[i])
+            printf("  %-15s %llu (%.2f%%)\n", rcode_names[i], (unsigned long long)rcodes[i],
+                   100.0 * rcodes[i] / (received ? received : 1));
+    if (truncated)
+        printf("  %-15s %llu\n", "TC set", (unsigned long long)truncated);
+    printf("==============================\n");
+}
+
+/* ============================================================================
+ * Transport
+ * ============================================================================ */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+typedef union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} sockaddr_any_t;
+
+static sockaddr_any_t server, source;
+static socklen_t server_len;
+static int have_source = 0;
+
+static void set_nonblock(int fd)
+{
+    int fl = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+typedef struct {
+    int fd;
+    uint16_t next_id;
+    uint64_t *sent_at;          /* per DNS ID, 0 = free */
+} udp_sock_t;
+
+/* In-flight UDP queries in send order; the uniform timeout means the oldest
+   entry is always the next to expire. */
+typedef struct {
+    uint32_t sock;
+    uint16_t id;
+    uint64_t sent_at;
+} pending_t;
+
+static pending_t *ring;
+static size_t ring_head = 0, ring_tail = 0;
+
+typedef struct {
+    int fd;
+    int busy;
+    uint64_t sent_at;
+    size_t have;
+    unsigned char *buf;
+} tcp_conn_t;
+
+static int udp_open(int port)
+{
+    int fd = socket(server.sa.sa_family, SOCK_DGRAM, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    if (have_source || port) {
+        sockaddr_any_t b = source;
+        if (!have_source) {
+            memset(&b, 0, sizeof(b));
+            b.sa.sa_family = server.sa.sa_family;
+        }
+        if (b.sa.sa_family == AF_INET) b.in.sin_port = htons(port);
+        else b.in6.sin6_port = htons(port);
+        if (bind(fd, &b.sa, b.sa.sa_family == AF_INET ? sizeof(b.in) : sizeof(b.in6)) < 0) {
+            fprintf(stderr, "bind to source port %d: %s\n", port, strerror(errno));
+            exit(1);
+        }
+    }
+    if (connect(fd, &server.sa, server_len) < 0) { perror("connect"); exit(1); }
+    int sz = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+    set_nonblock(fd);
+    return fd;
+}
+
+static int tcp_open(void)
+{
+    int fd = socket(server.sa.sa_family, SOCK_STREAM, 0);
+    int one = 1;
+    if (fd < 0) { perror("socket"); exit(1); }
+    if (have_source) {
+        sockaddr_any_t b = source;
+        if (b.sa.sa_family == AF_INET) b.in.sin_port = 0;
+        else b.in6.sin6_port = 0;
+        bind(fd, &b.sa, b.sa.sa_family == AF_INET ? sizeof(b.in) : sizeof(b.in6));
+    }
+    /* Connects to a local server complete immediately; keep it simple */
+    if (connect(fd, &server.sa, server_len) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    set_nonblock(fd);
+    return fd;
+}
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s -f <workload> [options]\n\n", prog);
+    printf("Workload:\n");
+    printf("  -f file    pcap capture (e.g. --dumpfile output) or \"name [qtype]\" list\n");
+    printf("  -P port    only replay captured queries sent to this destination port\n\n");
+    printf("Target:\n");
+    printf("  -s addr    server address (default 127.0.0.1)\n");
+    printf("  -p port    server port (default 53)\n");
+    printf("  -B addr    source address to bind\n");
+    printf("  -b port    first UDP source port; sockets use port..port+N-1 (default: ephemeral)\n\n");
+    printf("Load:\n");
+    printf("  -c num     maximum queries in flight (default %d)\n", DEFAULT_CONCURRENCY);
+    printf("  -u num     UDP sockets (default %d)\n", DEFAULT_SOCKETS);
+    printf("  -t pct     percentage of queries sent over TCP (default 0)\n");
+    printf("  -r qps     target send rate (default: unlimited, bounded by -c)\n");
+    printf("  -n num     stop after this many queries (default: one pass over the workload)\n");
+    printf("  -d secs    stop after this many seconds (overrides the one-pass default)\n");
+    printf("  -w ms      answer timeout (default %d)\n", DEFAULT_TIMEOUT_MS);
+    printf("  -q         no per-second progress lines\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *workload = NULL, *server_addr = "127.0.0.1", *source_addr = NULL;
+    int port = 53, concurrency = DEFAULT_CONCURRENCY, n_udp = DEFAULT_SOCKETS;
+    int tcp_pct = 0, src_port = 0, timeout_ms = DEFAULT_TIMEOUT_MS, quiet = 0, opt;
+    double rate = 0, duration = 0;
+    uint64_t limit = 0;
+
+    while ((opt = getopt(argc, argv, "f:P:s:p:B:b:c:u:t:r:n:d:w:qh")) != -1) {
+        switch (opt) {
+        case 'f': workload = optarg; break;
+        case 'P': dst_port_filter = atoi(optarg); break;
+        case 's': server_addr = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'B': source_addr = optarg; break;
+        case 'b': src_port = atoi(optarg); break;
+        case 'c': concurrency = atoi(optarg); break;
+        case 'u': n_udp = atoi(optarg); break;
+        case 't': tcp_pct = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'n': limit = strtoull(optarg, NULL, 10); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': timeout_ms = atoi(optarg); break;
+        case 'q': quiet = 1; break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!workload || concurrency <= 0 || n_udp <= 0 || tcp_pct < 0 || tcp_pct > 100 ||
+        timeout_ms <= 0 || (src_port && src_port + n_udp > 65536)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    memset(&server, 0, sizeof(server));
+    if (inet_pton(AF_INET, server_addr, &server.in.sin_addr) == 1) {
+        server.in.sin_family = AF_INET;
+        server.in.sin_port = htons(port);
+        server_len = sizeof(server.in);
+    } else if (inet_pton(AF_INET6, server_addr, &server.in6.sin6_addr) == 1) {
+        server.in6.sin6_family = AF_INET6;
+        server.in6.sin6_port = htons(port);
+        server_len = sizeof(server.in6);
+    } else {
+        fprintf(stderr, "Bad server address: %s\n", server_addr);
+        return 1;
+    }
+    if (source_addr) {
+        memset(&source, 0, sizeof(source));
+        if (server.sa.sa_family == AF_INET && inet_pton(AF_INET, source_addr, &source.in.sin_addr) == 1)
+            source.in.sin_family = AF_INET;
+        else if (server.sa.sa_family == AF_INET6 && inet_pton(AF_INET6, source_addr, &source.in6.sin6_addr) == 1)
+            source.in6.sin6_family = AF_INET6;
+        else {
+            fprintf(stderr, "Bad source address (family must match server): %s\n", source_addr);
+            return 1;
+        }
+        have_source = 1;
+    }
+
+    load_workload(workload);
+    if (!limit && duration <= 0) limit = n_queries;
+    printf("Loaded %zu queries from %s\n", n_queries, workload);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* UDP sockets */
+    udp_sock_t *udp = calloc((size_t)n_udp, sizeof(udp_sock_t));
+    ring = malloc(PENDING_RING * sizeof(pending_t));
+    if (!udp || !ring) { perror("malloc"); return 1; }
+    for (int i = 0; i < n_udp; i++) {
+        udp[i].fd = udp_open(src_port ? src_port + i : 0);
+        udp[i].next_id = (uint16_t)(i * 7919);
+        udp[i].sent_at = calloc(65536, sizeof(uint64_t));
+        if (!udp[i].sent_at) { perror("calloc"); return 1; }
+    }
+
+    /* TCP connections: one query in flight per connection */
+    int n_tcp = tcp_pct ? concurrency : 0;
+    tcp_conn_t *tcp = calloc((size_t)(n_tcp ? n_tcp : 1), sizeof(tcp_conn_t));
+    if (!tcp) { perror("calloc"); return 1; }
+    for (int i = 0; i < n_tcp; i++) {
+        tcp[i].fd = -1;
+        tcp[i].buf = malloc(MAX_PACKET + 2);
+        if (!tcp[i].buf) { perror("malloc"); return 1; }
+    }
+
+    struct pollfd *pfds = calloc((size_t)(n_udp + n_tcp), sizeof(struct pollfd));
+    unsigned char *out = malloc(MAX_PACKET + 2), *in = malloc(MAX_PACKET);
+    if (!pfds || !out || !in) { perror("malloc"); return 1; }
+
+    uint64_t timeout_ns = (uint64_t)timeout_ms * 1000000ULL;
+    uint64_t interval_ns = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t start = now_ns(), next_send = start, next_report = start + 1000000000ULL;
+    uint64_t end = duration > 0 ? start + (uint64_t)(duration * 1e9) : UINT64_MAX;
+    uint64_t last_recv = 0, inflight = 0, tcp_credit = 0;
+    size_t qi = 0;
+    int cur_udp = 0;
+
+    while (!stop) {
+        uint64_t now = now_ns();
+        int sending = now < end && (!limit || sent < limit);
+
+        if (!sending && inflight == 0) break;
+
+        /* Send as many queries as rate and concurrency allow */
+        while (sending && inflight < (uint64_t)concurrency && (!interval_ns || next_send <= now)) {
+            const query_t *q = &queries[qi];
+            int use_tcp = 0;
+
+            tcp_credit += (uint64_t)tcp_pct;
+            if (tcp_credit >= 100) { tcp_credit -= 100; use_tcp = 1; }
+
+            if (use_tcp) {
+                int c;
+                for (c = 0; c < n_tcp && tcp[c].busy; c++);
+                if (c == n_tcp) { tcp_credit += 100; break; }
+                if (tcp[c].fd < 0 && (tcp[c].fd = tcp_open()) < 0) {
+                    errors++;
+                    tcp_credit += 100;
+                    break;
+                }
+                out[0] = (unsigned char)(q->len >> 8);
+                out[1] = (unsigned char)q->len;
+                memcpy(out + 2, q->data, q->len);
+                out[2] = (unsigned char)(sent >> 8); out[3] = (unsigned char)sent;
+                if (send(tcp[c].fd, out, (size_t)q->len + 2, 0) != (ssize_t)q->len + 2) {
+                    close(tcp[c].fd);
+                    tcp[c].fd = -1;
+                    errors++;
+                    break;
+                }
+                tcp[c].busy = 1;
+                tcp[c].have = 0;
+                tcp[c].sent_at = now;
+                sent_tcp++;
+            } else {
+                udp_sock_t *s = &udp[cur_udp];
+                uint16_t id = s->next_id;
+                int tries = 0;
+                while (s->sent_at[id] && ++tries < 65536) id++;
+                if (tries == 65536 || ((ring_tail + 1) & (PENDING_RING - 1)) == ring_head) break;
+                s->next_id = (uint16_t)(id + 1);
+
+                memcpy(out, q->data, q->len);
+                out[0] = (unsigned char)(id >> 8); out[1] = (unsigned char)id;
+                if (send(s->fd, out, q->len, 0) != q->len) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) errors++;
+                    break;
+                }
+                s->sent_at[id] = now;
+                ring[ring_tail].sock = (uint32_t)cur_udp;
+                ring[ring_tail].id = id;
+                ring[ring_tail].sent_at = now;
+                ring_tail = (ring_tail + 1) & (PENDING_RING - 1);
+                cur_udp = (cur_udp + 1) % n_udp;
+                sent_udp++;
+            }
+
+            sent++;
+            inflight++;
+            qi = (qi + 1) % n_queries;
+            next_send += interval_ns;
+            if (!sending || (limit && sent >= limit)) break;
+        }
+        /* Do not build up a burst backlog when the target rate cannot be met */
+        if (interval_ns && next_send + 100 * interval_ns < now) next_send = now;
+
+        /* Expire UDP queries; answered entries are skipped lazily */
+        while (ring_head != ring_tail) {
+            pending_t *p = &ring[ring_head];
+            uint64_t *slot = &udp[p->sock].sent_at[p->id];
+            if (*slot == p->sent_at) {
+                if (now - p->sent_at < timeout_ns) break;
+                *slot = 0;
+                timeouts++;
+                inflight--;
+            }
+            ring_head = (ring_head + 1) & (PENDING_RING - 1);
+        }
+        for (int c = 0; c < n_tcp; c++)
+            if (tcp[c].busy && now - tcp[c].sent_at >= timeout_ns) {
+                close(tcp[c].fd);
+                tcp[c].fd = -1;
+                tcp[c].busy = 0;
+                timeouts++;
+                inflight--;
+            }
+
+        /* Wait for answers (or the next send slot) */
+        int nfds = 0;
+        for (int i = 0; i < n_udp; i++) {
+            pfds[nfds].fd = udp[i].fd;
+            pfds[nfds].events = POLLIN;
+            nfds++;
+        }
+        for (int c = 0; c < n_tcp; c++) {
+            pfds[nfds].fd = tcp[c].busy ? tcp[c].fd : -1;
+            pfds[nfds].events = POLLIN;
+            nfds++;
+        }
+        int wait_ms = 10;
+        if (sending && inflight < (uint64_t)concurrency)
+            wait_ms = (!interval_ns || next_send <= now) ? 0 : (int)((next_send - now) / 1000000);
+        if (poll(pfds, (nfds_t)nfds, wait_ms) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        now = now_ns();
+        for (int i = 0; i < n_udp; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            ssize_t r;
+            while ((r = recv(udp[i].fd, in, MAX_PACKET, 0)) >= 12) {
+                uint16_t id = (uint16_t)((in[0] << 8) | in[1]);
+                if (!udp[i].sent_at[id]) continue;      /* late or duplicate */
+                record_answer(in, (size_t)r, now - udp[i].sent_at[id]);
+                udp[i].sent_at[id] = 0;
+                inflight--;
+            }
+        }
+        for (int c = 0; c < n_tcp; c++) {
+            if (!(pfds[n_udp + c].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            tcp_conn_t *t = &tcp[c];
+            ssize_t r = recv(t->fd, t->buf + t->have, MAX_PACKET + 2 - t->have, 0);
+            if (r <= 0) {
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+                close(t->fd);
+                t->fd = -1;
+                t->busy = 0;
+                errors++;
+                inflight--;
+                continue;
+            }
+            t->have += (size_t)r;
+            if (t->have >= 2) {
+                size_t mlen = ((size_t)t->buf[0] << 8) | t->buf[1];
+                if (t->have >= mlen + 2) {
+                    record_answer(t->buf + 2, mlen, now - t->sent_at);
+                    t->busy = 0;
+                    inflight--;
+                }
+            }
+        }
+
+        if (!quiet && now >= next_report) {
+            printf("  %6.1fs  sent %llu  answered %llu  (%llu/s)  in flight %llu  timeouts %llu\n",
+                   (now - start) / 1e9, (unsigned long long)sent, (unsigned long long)received,
+                   (unsigned long long)(received - last_recv), (unsigned long long)inflight,
+                   (unsigned long long)timeouts);
+            fflush(stdout);
+            last_recv = received;
+            next_report += 1000000000ULL;
+        }
+    }
+
+    print_summary((now_ns() - start) / 1e9);
+    return 0;
+}
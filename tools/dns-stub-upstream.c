@@ -0,0 +1,643 @@
+/*
+ * Stub Upstream Server for dnsmasq-sqlite benchmarks
+ *
+ * A small authoritative-style server that answers any name with synthetic
+ * data, so the forwarding path (forward_query, reply_query, fast_retry) and
+ * the IP rewriting in forward.c can be benchmarked offline with fixed,
+ * reproducible upstream behaviour.
+ *
+ * Behaviour is configured per name pattern (fnmatch(3) globs, first match
+ * wins, names compared in lower case). Rule file format, one rule per line:
+ *
+ *   # pattern         options
+ *   *.slow.test       delay=200 jitter=50
+ *   *.lossy.test      loss=30
+ *   *.chain.test      cname=3 ttl=60
+ *   *.tc.test         tc=100
+ *   nx.*              rcode=nxdomain
+ *   *.rewrite.test    a=178.223.16.21 aaaa=2001:db8::21
+ *   *                 ttl=300
+ *
+ * Options:
+ *   delay=MS     answer delay in milliseconds          (default 0)
+ *   jitter=MS    uniform extra delay 0..MS              (default 0)
+ *   loss=PCT     percentage of queries silently dropped (default 0)
+ *   tc=PCT       percentage of UDP answers sent truncated (TC=1, no RRs)
+ *   ttl=SEC      TTL of all records                     (default 300)
+ *   cname=N      length of the CNAME chain before the final records (default 0)
+ *   count=N      number of A/AAAA records               (default 1)
+ *   rcode=NAME   noerror|nxdomain|servfail|refused      (default noerror)
+ *   a=IP         fixed IPv4 answer (default: derived from a hash of the name)
+ *   aaaa=IP      fixed IPv6 answer (default: derived from a hash of the name)
+ *
+ * Loss, truncation and jitter use a seeded PRNG (-S) so runs are repeatable.
+ * SIGUSR1 prints counters; SIGINT/SIGTERM print them and exit.
+ *
+ * Compile: gcc -O2 -o dns-stub-upstream dns-stub-upstream.c
+ * Usage:   ./dns-stub-upstream [-l 127.0.0.2] [-p 53] [-f rules.conf] [-S seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_RULES      256
+#define MAX_PACKET     65535
+#define MAX_TCP        64
+#define MAX_CHAIN      16
+#define MAX_COUNT      32
+#define UDP_LIMIT      512
+
+#define T_A     1
+#define T_CNAME 5
+#define T_SOA   6
+#define T_AAAA  28
+
+/* ============================================================================
+ * Rules
+ * ============================================================================ */
+
+typedef struct {
+    char pattern[256];
+    int delay_ms;
+    int jitter_ms;
+    int loss_pct;
+    int tc_pct;
+    uint32_t ttl;
+    int cname;
+    int count;
+    int rcode;
+    int have_a, have_aaaa;
+    struct in_addr a;
+    struct in6_addr aaaa;
+} rule_t;
+
+static rule_t rules[MAX_RULES];
+static int n_rules = 0;
+static rule_t default_rule;
+
+static void rule_defaults(rule_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    strcpy(r->pattern, "*");
+    r->ttl = 300;
+    r->count = 1;
+}
+
+static int parse_rcode(const char *s)
+{
+    if (strcasecmp(s, "noerror") == 0) return 0;
+    if (strcasecmp(s, "servfail") == 0) return 2;
+    if (strcasecmp(s, "nxdomain") == 0) return 3;
+    if (strcasecmp(s, "refused") == 0) return 5;
+    return isdigit((unsigned char)*s) ? atoi(s) & 0x0f : -1;
+}
+
+static int parse_option(rule_t *r, char *opt)
+{
+    char *eq = strchr(opt, '=');
+    if (!eq) return 0;
+    *eq++ = '\0';
+
+    if (strcmp(opt, "delay") == 0) r->delay_ms = atoi(eq);
+    else if (strcmp(opt, "jitter") == 0) r->jitter_ms = atoi(eq);
+    else if (strcmp(opt, "loss") == 0) r->loss_pct = atoi(eq);
+    else if (strcmp(opt, "tc") == 0) r->tc_pct = atoi(eq);
+    else if (strcmp(opt, "ttl") == 0) r->ttl = (uint32_t)strtoul(eq, NULL, 10);
+    else if (strcmp(opt, "cname") == 0) r->cname = atoi(eq);
+    else if (strcmp(opt, "count") == 0) r->count = atoi(eq);
+    else if (strcmp(opt, "rcode") == 0) { if ((r->rcode = parse_rcode(eq)) < 0) return 0; }
+    else if (strcmp(opt, "a") == 0) { if (inet_pton(AF_INET, eq, &r->a) != 1) return 0; r->have_a = 1; }
+    else if (strcmp(opt, "aaaa") == 0) { if (inet_pton(AF_INET6, eq, &r->aaaa) != 1) return 0; r->have_aaaa = 1; }
+    else return 0;
+
+    if (r->cname < 0 || r->cname > MAX_CHAIN) return 0;
+    if (r->count < 0 || r->count > MAX_COUNT) return 0;
+    return 1;
+}
+
+static void load_rules(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    int lineno = 0;
+
+    if (!f) { perror(path); exit(1); }
+    while (fgets(line, sizeof(line), f)) {
+        char *tok, *save;
+        lineno++;
+        if (!(tok = strtok_r(line, " \t\r\n", &save)) || tok[0] == '#') continue;
+        if (n_rules == MAX_RULES) {
+            fprintf(stderr, "%s:%d: too many rules (max %d)\n", path, lineno, MAX_RULES);
+            exit(1);
+        }
+        rule_t *r = &rules[n_rules];
+        rule_defaults(r);
+        snprintf(r->pattern, sizeof(r->pattern), "%s", tok);
+        for (char *p = r->pattern; *p; p++) *p = (char)tolower((unsigned char)*p);
+        while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+            if (!parse_option(r, tok)) {
+                fprintf(stderr, "%s:%d: bad option '%s'\n", path, lineno, tok);
+                exit(1);
+            }
+        }
+        n_rules++;
+    }
+    fclose(f);
+}
+
+static const rule_t *match_rule(const char *name)
+{
+    for (int i = 0; i < n_rules; i++)
+        if (fnmatch(rules[i].pattern, name, 0) == 0)
+            return &rules[i];
+    return &default_rule;
+}
+
+/* ============================================================================
+ * Deterministic randomness
+ * ============================================================================ */
+
+static uint64_t rng_state = 42;
+
+static uint32_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 16);
+}
+
+static uint32_t hash_name(const char *s)
+{
+    uint32_t h = 2166136261U;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619U; }
+    return h;
+}
+
+/* ============================================================================
+ * Packet construction
+ * ============================================================================ */
+
+static unsigned char *put16(unsigned char *p, unsigned v)
+{
+    *p++ = (unsigned char)(v >> 8); *p++ = (unsigned char)v;
+    return p;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+    *p++ = (unsigned char)(v >> 24); *p++ = (unsigned char)(v >> 16);
+    *p++ = (unsigned char)(v >> 8); *p++ = (unsigned char)v;
+    return p;
+}
+
+/* Extract the question name (lower case, dotted) and return the end of the
+   question section, or NULL for anything we will not answer. */
+static const unsigned char *parse_question(const unsigned char *pkt, size_t len,
+                                           char *name, int *qtype)
+{
+    const unsigned char *p = pkt + 12, *end = pkt + len;
+    char *n = name;
+
+    if (len < 17 || (pkt[2] & 0x80) || pkt[4] != 0 || pkt[5] != 1) return NULL;
+    while (p < end && *p) {
+        unsigned l = *p++;
+        if (l > 63 || p + l >= end || (n - name) + l + 2 > 255) return NULL;
+        for (unsigned i = 0; i < l; i++) *n++ = (char)tolower(p[i]);
+        *n++ = '.';
+        p += l;
+    }
+    if (n > name) n--;
+    *n = '\0';
+    if (p + 5 > end) return NULL;
+    p++;
+    *qtype = (p[0] << 8) | p[1];
+    return p + 4;
+}
+
+/* Name of the i-th CNAME target for a query, wire format */
+static unsigned char *put_chain_name(unsigned char *p, uint32_t h, int i)
+{
+    char label[16];
+    int l = snprintf(label, sizeof(label), "c%d-%08x", i, h);
+    *p++ = (unsigned char)l;
+    memcpy(p, label, (size_t)l);
+    p += l;
+    memcpy(p, "\005chain\004stub\000", 12);
+    return p + 12;
+}
+
+static size_t build_answer(const unsigned char *q, size_t qlen, unsigned char *out,
+                           size_t limit, const rule_t *r, int truncate)
+{
+    char name[256];
+    int qtype;
+    const unsigned char *qend = parse_question(q, qlen, name, &qtype);
+    unsigned char *p, *owner_end;
+    unsigned owner_ptr = 12, ancount = 0, nscount = 0;
+    uint32_t h;
+
+    if (!qend) return 0;
+    size_t qsec = (size_t)(qend - q);
+    if (qsec + 64 > limit) return 0;
+
+    memcpy(out, q, qsec);
+    out[2] = (unsigned char)((q[2] & 0x01) | 0x84);     /* QR, AA, keep RD */
+    out[3] = (unsigned char)(0x80 | (r->rcode & 0x0f)); /* RA */
+    memset(out + 6, 0, 6);
+    p = out + qsec;
+
+    if (truncate) {
+        out[2] |= 0x02;
+        return qsec;
+    }
+
+    h = hash_name(name);
+    if (r->rcode == 0) {
+        /* CNAME chain: qname -> c1 -> ... -> cN, final records at cN */
+        for (int i = 1; i <= r->cname; i++) {
+            if ((size_t)(p - out) + 64 > limit) break;
+            unsigned char *rdlen, *target = p + 12;
+            p = put16(p, 0xc000 | owner_ptr);
+            p = put16(p, T_CNAME);
+            p = put16(p, 1);
+            p = put32(p, r->ttl);
+            rdlen = p;
+            p += 2;
+            owner_end = put_chain_name(p, h, i);
+            put16(rdlen, (unsigned)(owner_end - p));
+            p = owner_end;
+            owner_ptr = (unsigned)(target - out);
+            ancount++;
+            if (qtype == T_CNAME) break;
+        }
+
+        if (qtype == T_A || qtype == T_AAAA) {
+            int v6 = qtype == T_AAAA;
+            for (int i = 0; i < r->count && (size_t)(p - out) + 28 <= limit; i++) {
+                p = put16(p, 0xc000 | owner_ptr);
+                p = put16(p, (unsigned)qtype);
+                p = put16(p, 1);
+                p = put32(p, r->ttl);
+                if (!v6) {
+                    p = put16(p, 4);
+                    if (r->have_a) memcpy(p, &r->a, 4);
+                    else { uint32_t a = htonl(0x0a000000U | ((h + (uint32_t)i) & 0xffffff)); memcpy(p, &a, 4); }
+                    p += 4;
+                } else {
+                    p = put16(p, 16);
+                    if (r->have_aaaa) memcpy(p, &r->aaaa, 16);
+                    else {
+                        memset(p, 0, 16);
+                        p[0] = 0xfd; p[1] = 0x00;
+                        put32(p + 12, h + (uint32_t)i);
+                    }
+                    p += 16;
+                }
+                ancount++;
+            }
+        }
+    }
+
+    /* SOA in authority for NXDOMAIN/NODATA so negative answers get cached */
+    if (ancount == 0 && (r->rcode == 0 || r->rcode == 3) && (size_t)(p - out) + 64 <= limit) {
+        static const unsigned char soa_names[] = "\002ns\004stub\000\012hostmaster\004stub\000";
+        *p++ = 0;               /* owner: root */
+        p = put16(p, T_SOA);
+        p = put16(p, 1);
+        p = put32(p, r->ttl);
+        p = put16(p, (unsigned)(sizeof(soa_names) - 1 + 20));
+        memcpy(p, soa_names, sizeof(soa_names) - 1);
+        p += sizeof(soa_names) - 1;
+        p = put32(p, 1);        /* serial */
+        p = put32(p, 3600);
+        p = put32(p, 600);
+        p = put32(p, 86400);
+        p = put32(p, r->ttl);   /* minimum = negative TTL */
+        nscount++;
+    }
+
+    put16(out + 6, ancount);
+    put16(out + 8, nscount);
+    return (size_t)(p - out);
+}
+
+/* ============================================================================
+ * Delayed answers (binary heap ordered by release time)
+ * ============================================================================ */
+
+typedef struct {
+    uint64_t due;
+    int fd;                     /* UDP socket or TCP connection */
+    int tcp;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    uint16_t len;
+    unsigned char *data;
+} delayed_t;
+
+static delayed_t *heap = NULL;
+static size_t heap_n = 0, heap_cap = 0;
+
+static void heap_push(delayed_t d)
+{
+    if (heap_n == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        heap = realloc(heap, heap_cap * sizeof(delayed_t));
+        if (!heap) { perror("realloc"); exit(1); }
+    }
+    size_t i = heap_n++;
+    while (i > 0 && heap[(i - 1) / 2].due > d.due) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = d;
+}
+
+static delayed_t heap_pop(void)
+{
+    delayed_t top = heap[0], last = heap[--heap_n];
+    size_t i = 0;
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= heap_n) break;
+        if (c + 1 < heap_n && heap[c + 1].due < heap[c].due) c++;
+        if (last.due <= heap[c].due) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (heap_n) heap[i] = last;
+    return top;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+/* ============================================================================
+ * Server
+ * ============================================================================ */
+
+static uint64_t c_queries = 0, c_answers = 0, c_dropped = 0, c_truncated = 0, c_bad = 0;
+static uint64_t c_tcp = 0;
+static volatile sig_atomic_t want_stats = 0, stop = 0;
+
+static void on_signal(int sig)
+{
+    if (sig == SIGUSR1) want_stats = 1;
+    else stop = 1;
+}
+
+static void print_stats(void)
+{
+    fprintf(stderr, "queries %llu (tcp %llu)  answered %llu  dropped %llu  truncated %llu  bad %llu  pending %zu\n",
+            (unsigned long long)c_queries, (unsigned long long)c_tcp, (unsigned long long)c_answers,
+            (unsigned long long)c_dropped, (unsigned long long)c_truncated, (unsigned long long)c_bad,
+            heap_n);
+}
+
+typedef struct {
+    int fd;
+    size_t have;
+    unsigned char buf[MAX_PACKET + 2];
+} tcp_client_t;
+
+static tcp_client_t *clients[MAX_TCP];
+
+static void send_answer(const delayed_t *d)
+{
+    if (d->tcp) {
+        unsigned char hdr[2];
+        hdr[0] = (unsigned char)(d->len >> 8); hdr[1] = (unsigned char)d->len;
+        /* A closed connection just fails the write; nothing else to do */
+        if (write(d->fd, hdr, 2) == 2 && write(d->fd, d->data, d->len) == d->len)
+            c_answers++;
+    } else if (sendto(d->fd, d->data, d->len, 0, (const struct sockaddr *)&d->peer, d->peer_len) == d->len)
+        c_answers++;
+}
+
+/* Handle one query; answers immediately or queues it for later */
+static void handle_query(int fd, int tcp, const unsigned char *q, size_t qlen,
+                         const struct sockaddr_storage *peer, socklen_t peer_len)
+{
+    static unsigned char out[MAX_PACKET];
+    char name[256];
+    int qtype;
+
+    c_queries++;
+    if (tcp) c_tcp++;
+    if (!parse_question(q, qlen, name, &qtype)) {
+        c_bad++;
+        return;
+    }
+
+    const rule_t *r = match_rule(name);
+    if (r->loss_pct && (int)(rng_next() % 100) < r->loss_pct) {
+        c_dropped++;
+        return;
+    }
+    int truncate = !tcp && r->tc_pct && (int)(rng_next() % 100) < r->tc_pct;
+    size_t len = build_answer(q, qlen, out, tcp ? MAX_PACKET : UDP_LIMIT, r, truncate);
+    if (!len) {
+        c_bad++;
+        return;
+    }
+    if (truncate) c_truncated++;
+
+    delayed_t d;
+    memset(&d, 0, sizeof(d));
+    d.fd = fd;
+    d.tcp = tcp;
+    if (peer) memcpy(&d.peer, peer, peer_len);
+    d.peer_len = peer_len;
+    d.len = (uint16_t)len;
+    d.data = out;
+
+    int delay = r->delay_ms + (r->jitter_ms ? (int)(rng_next() % (uint32_t)(r->jitter_ms + 1)) : 0);
+    if (delay <= 0) {
+        send_answer(&d);
+        return;
+    }
+    d.due = now_ms() + (uint64_t)delay;
+    d.data = malloc(len);
+    if (!d.data) { perror("malloc"); exit(1); }
+    memcpy(d.data, out, len);
+    heap_push(d);
+}
+
+static int open_listener(int family, int type, const char *addr, int port)
+{
+    struct sockaddr_storage ss;
+    socklen_t sl;
+    int one = 1;
+    int fd = socket(family, type, 0);
+
+    memset(&ss, 0, sizeof(ss));
+    if (family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&ss;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        inet_pton(AF_INET, addr, &in->sin_addr);
+        sl = sizeof(*in);
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ss;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        inet_pton(AF_INET6, addr, &in6->sin6_addr);
+        sl = sizeof(*in6);
+    }
+    if (fd < 0) { perror("socket"); exit(1); }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&ss, sl) < 0) {
+        fprintf(stderr, "bind %s#%d: %s\n", addr, port, strerror(errno));
+        exit(1);
+    }
+    if (type == SOCK_STREAM && listen(fd, 64) < 0) { perror("listen"); exit(1); }
+    if (type == SOCK_DGRAM) {
+        int sz = 4 * 1024 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static void close_client(int i)
+{
+    /* Drop queued answers for this connection before the fd can be reused */
+    for (size_t k = 0; k < heap_n; k++)
+        if (heap[k].tcp && heap[k].fd == clients[i]->fd)
+            heap[k].fd = -1;
+    close(clients[i]->fd);
+    free(clients[i]);
+    clients[i] = NULL;
+}
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [options]\n\n", prog);
+    printf("  -l addr   listen address (default 127.0.0.2)\n");
+    printf("  -p port   listen port, UDP and TCP (default 53)\n");
+    printf("  -f file   per-pattern rule file (see header of dns-stub-upstream.c)\n");
+    printf("  -S seed   PRNG seed for loss/truncation/jitter (default 42)\n");
+    printf("  -d MS     default delay for names matching no rule\n");
+    printf("  -t SEC    default TTL for names matching no rule\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *addr = "127.0.0.2", *rules_file = NULL;
+    int port = 53, opt;
+
+    rule_defaults(&default_rule);
+    while ((opt = getopt(argc, argv, "l:p:f:S:d:t:h")) != -1) {
+        switch (opt) {
+        case 'l': addr = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'f': rules_file = optarg; break;
+        case 'S': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+        case 'd': default_rule.delay_ms = atoi(optarg); break;
+        case 't': default_rule.ttl = (uint32_t)strtoul(optarg, NULL, 10); break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (rules_file) load_rules(rules_file);
+
+    int family = strchr(addr, ':') ? AF_INET6 : AF_INET;
+    int udp = open_listener(family, SOCK_DGRAM, addr, port);
+    int tcp = open_listener(family, SOCK_STREAM, addr, port);
+
+    signal(SIGUSR1, on_signal);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Stub upstream on %s#%d, %d rules\n", addr, port, n_rules);
+
+    unsigned char *buf = malloc(MAX_PACKET);
+    if (!buf) { perror("malloc"); return 1; }
+
+    while (!stop) {
+        struct pollfd pfd[2 + MAX_TCP];
+        int map[2 + MAX_TCP], n = 0;
+
+        pfd[n].fd = udp; pfd[n].events = POLLIN; map[n++] = -1;
+        pfd[n].fd = tcp; pfd[n].events = POLLIN; map[n++] = -2;
+        for (int i = 0; i < MAX_TCP; i++)
+            if (clients[i]) { pfd[n].fd = clients[i]->fd; pfd[n].events = POLLIN; map[n++] = i; }
+
+        int wait = -1;
+        if (heap_n) {
+            uint64_t now = now_ms();
+            wait = heap[0].due <= now ? 0 : (int)(heap[0].due - now);
+        }
+        if (poll(pfd, (nfds_t)n, wait) < 0 && errno != EINTR) { perror("poll"); break; }
+
+        if (want_stats) { want_stats = 0; print_stats(); }
+
+        for (int k = 0; k < n; k++) {
+            if (!pfd[k].revents) continue;
+            if (map[k] == -1) {
+                for (int burst = 0; burst < 256; burst++) {
+                    struct sockaddr_storage peer;
+                    socklen_t pl = sizeof(peer);
+                    ssize_t r = recvfrom(udp, buf, MAX_PACKET, 0, (struct sockaddr *)&peer, &pl);
+                    if (r < 0) break;
+                    handle_query(udp, 0, buf, (size_t)r, &peer, pl);
+                }
+            } else if (map[k] == -2) {
+                int cfd = accept(tcp, NULL, NULL);
+                int slot;
+                if (cfd < 0) continue;
+                for (slot = 0; slot < MAX_TCP && clients[slot]; slot++);
+                if (slot == MAX_TCP || !(clients[slot] = malloc(sizeof(tcp_client_t)))) {
+                    close(cfd);
+                    continue;
+                }
+                clients[slot]->fd = cfd;
+                clients[slot]->have = 0;
+            } else {
+                tcp_client_t *c = clients[map[k]];
+                ssize_t r = read(c->fd, c->buf + c->have, sizeof(c->buf) - c->have);
+                if (r <= 0) { close_client(map[k]); continue; }
+                c->have += (size_t)r;
+                while (c->have >= 2) {
+                    size_t mlen = ((size_t)c->buf[0] << 8) | c->buf[1];
+                    if (c->have < mlen + 2) break;
+                    handle_query(c->fd, 1, c->buf + 2, mlen, NULL, 0);
+                    memmove(c->buf, c->buf + mlen + 2, c->have - mlen - 2);
+                    c->have -= mlen + 2;
+                }
+            }
+        }
+
+        uint64_t now = now_ms();
+        while (heap_n && heap[0].due <= now) {
+            delayed_t d = heap_pop();
+            if (d.fd >= 0) send_answer(&d);
+            free(d.data);
+        }
+    }
+
+    print_stats();
+    return 0;
+}
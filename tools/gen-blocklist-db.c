@@ -0,0 +1,570 @@
+/*
+ * Synthetic Blocklist Generator for dnsmasq-sqlite
+ *
+ * Produces a database in the exact v7.2 schema read by db.c
+ *   block_wildcard (Domain)              base domains, block all subdomains
+ *   block_hosts    (Domain)              exact hostnames
+ *   block_ips      (Source_IP, Target_IP) exact IPv4/IPv6 rows and CIDR rows
+ * plus optional Zipfian query-name lists, so benchmark numbers can be
+ * reproduced without access to production data.
+ *
+ * Name model:
+ *   - Label lengths follow a fixed histogram shaped like registered domains
+ *     (peak at 7-10 characters, long tail to 30).
+ *   - TLDs: weighted gTLD/ccTLD table; a share of names (-x, default 15%)
+ *     sits under a 2-label public suffix drawn from 2ndlevel.txt (co.uk, ...).
+ *   - Every base domain ends in a fixed-width base36 code of a permuted
+ *     index, so names are unique by construction and no dedupe state is
+ *     needed at any scale.
+ *
+ * Rows are produced in batches that are sorted in RAM before insertion,
+ * which keeps B-tree page writes local; memory is bounded by -B regardless
+ * of the total row count (1M to billions).
+ *
+ * Query lists (-q) contain "name qtype" lines usable by dns-loadgen. Names
+ * are drawn by Zipf rank from a universe mixing blocked hosts, subdomains
+ * of blocked wildcards and never-blocked names (-b sets the blocked share).
+ *
+ * Compile: gcc -O2 -o gen-blocklist-db gen-blocklist-db.c -lsqlite3 -lm
+ * Usage:   ./gen-blocklist-db -o out.db -w 10000000 -H 5000000 -t ../2ndlevel.txt [-q queries.txt]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#define DEFAULT_WILDCARD   1000000ULL
+#define DEFAULT_HOSTS      1000000ULL
+#define DEFAULT_IPS        10000ULL
+#define DEFAULT_CIDR       256ULL
+#define DEFAULT_BATCH      (1ULL << 20)
+#define DEFAULT_QUERIES    1000000ULL
+#define DEFAULT_UNIVERSE   1000000ULL
+#define MAX_NAME_LEN       256
+#define MAX_BASE_LEN       192
+#define MAX_SUFFIXES       16384
+
+static uint64_t seed = 42;
+
+/* ============================================================================
+ * Distributions
+ * ============================================================================ */
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Second-level label lengths 1..30 (relative weights) */
+static const unsigned label_len_weights[31] = {
+    0, 1, 6, 30, 55, 75, 90, 100, 100, 95, 85, 72, 60, 48, 38, 30,
+    23, 18, 14, 11, 8, 6, 5, 4, 3, 2, 2, 1, 1, 1, 1
+};
+
+static const struct { const char *tld; unsigned weight; } tld_weights[] = {
+    { "com", 460 }, { "net", 55 }, { "org", 45 }, { "de", 40 }, { "ru", 30 },
+    { "uk", 12 }, { "info", 18 }, { "nl", 15 }, { "io", 14 }, { "fr", 13 },
+    { "br", 12 }, { "xyz", 12 }, { "it", 11 }, { "pl", 10 }, { "top", 10 },
+    { "cn", 10 }, { "au", 8 }, { "in", 8 }, { "es", 7 }, { "ch", 6 },
+    { "jp", 6 }, { "eu", 6 }, { "co", 6 }, { "site", 6 }, { "online", 6 },
+    { "ca", 5 }, { "be", 5 }, { "at", 5 }, { "se", 5 }, { "me", 5 },
+    { "biz", 4 }, { "us", 4 }, { "tv", 3 }, { "cc", 3 }, { "club", 3 }
+};
+#define N_TLDS (sizeof(tld_weights) / sizeof(tld_weights[0]))
+
+/* English-ish letter frequencies for the readable part of labels */
+static const char letters[] =
+    "eeeeeeeeeeeeaaaaaaaaarrrrrrrrriiiiiiiiiooooooootttttttnnnnnnnnsssssss"
+    "llllllcccccuuuuddddpppmmmhhhgggbbbfffyywkvxzjq";
+
+static unsigned label_len_cdf[31];
+static unsigned tld_cdf[N_TLDS];
+static char *suffixes[MAX_SUFFIXES];
+static int n_suffixes = 0;
+static unsigned suffix_pct = 15;
+
+static void init_tables(void)
+{
+    unsigned acc = 0;
+    for (int i = 0; i < 31; i++) { acc += label_len_weights[i]; label_len_cdf[i] = acc; }
+    acc = 0;
+    for (size_t i = 0; i < N_TLDS; i++) { acc += tld_weights[i].weight; tld_cdf[i] = acc; }
+}
+
+static unsigned pick_label_len(uint64_t h)
+{
+    unsigned r = (unsigned)(h % label_len_cdf[30]);
+    for (unsigned i = 1; i < 31; i++)
+        if (r < label_len_cdf[i]) return i;
+    return 30;
+}
+
+static const char *pick_tld(uint64_t h)
+{
+    if (n_suffixes && (h % 100) < suffix_pct)
+        return suffixes[(h >> 8) % (uint64_t)n_suffixes];
+    unsigned r = (unsigned)((h >> 16) % tld_cdf[N_TLDS - 1]);
+    for (size_t i = 0; i < N_TLDS; i++)
+        if (r < tld_cdf[i]) return tld_weights[i].tld;
+    return "com";
+}
+
+static void load_suffixes(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[MAX_NAME_LEN];
+
+    if (!f) { perror(path); exit(1); }
+    while (n_suffixes < MAX_SUFFIXES && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        /* db.c only recognises two-label suffixes */
+        char *dot = strchr(line, '.');
+        if (!dot || strchr(dot + 1, '.')) continue;
+        for (char *p = line; *p; p++) *p = (char)tolower((unsigned char)*p);
+        if (!(suffixes[n_suffixes] = strdup(line))) { perror("strdup"); exit(1); }
+        n_suffixes++;
+    }
+    fclose(f);
+}
+
+/* ============================================================================
+ * Unique base domains
+ *
+ * Index space [0, M) with M = 36^width is permuted by an affine map
+ * (a*i + b) mod M, gcd(a, M) = 1. The permuted value is written as `width`
+ * base36 digits at the end of the label, which makes names unique and
+ * makes them look unordered.
+ * ============================================================================ */
+
+static uint64_t space_m = 1, perm_a = 1, perm_b = 0;
+static unsigned code_width = 1;
+
+static void init_space(uint64_t needed)
+{
+    code_width = 1;
+    space_m = 36;
+    while (space_m < needed) { space_m *= 36; code_width++; }
+    perm_a = (mix64(seed ^ 0x51) % space_m) | 1;
+    while (perm_a % 3 == 0 || perm_a < 2) perm_a += 2;
+    perm_b = mix64(seed ^ 0x52) % space_m;
+}
+
+static uint64_t permute(uint64_t i)
+{
+    return (uint64_t)(((unsigned __int128)perm_a * i + perm_b) % space_m);
+}
+
+/* Base domain number `i` of the whole index space */
+static size_t base_domain(uint64_t i, char *out)
+{
+    static const char b36[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    uint64_t h = mix64(seed ^ (i * 0x9e3779b97f4a7c15ULL));
+    unsigned len = pick_label_len(h);
+    unsigned plain = len > code_width ? len - code_width : 0;
+    uint64_t code = permute(i);
+    char *p = out;
+
+    for (unsigned k = 0; k < plain; k++) {
+        h = mix64(h + k + 1);
+        *p++ = letters[h % (sizeof(letters) - 1)];
+    }
+    for (unsigned k = code_width; k > 0; k--) {
+        p[k - 1] = b36[code % 36];
+        code /= 36;
+    }
+    p += code_width;
+    *p++ = '.';
+    const char *tld = pick_tld(mix64(h ^ 0x7f));
+    size_t tl = strlen(tld);
+    memcpy(p, tld, tl + 1);
+    return (size_t)(p - out) + tl;
+}
+
+static const char *host_prefixes[] = {
+    "www", "ads", "ad", "track", "tracking", "pixel", "cdn", "static", "api",
+    "m", "stats", "metrics", "analytics", "log", "t", "img", "tag", "s",
+    "click", "collect", "events", "beacon", "sync", "data", "telemetry"
+};
+#define N_HOST_PREFIXES (sizeof(host_prefixes) / sizeof(host_prefixes[0]))
+
+/* Blocked host number `i`: one or two prefix labels in front of a base domain */
+static size_t host_name(uint64_t base_index, uint64_t i, char *out)
+{
+    char base[MAX_BASE_LEN];
+    uint64_t h = mix64(seed ^ (i + 0xabcdef));
+    base_domain(base_index, base);
+    if (h % 5 == 0)
+        return (size_t)snprintf(out, MAX_NAME_LEN, "%s.%s.%s",
+                                host_prefixes[(h >> 8) % N_HOST_PREFIXES],
+                                host_prefixes[(h >> 16) % N_HOST_PREFIXES], base);
+    return (size_t)snprintf(out, MAX_NAME_LEN, "%s.%s",
+                            host_prefixes[(h >> 8) % N_HOST_PREFIXES], base);
+}
+
+/* ============================================================================
+ * Batched, sorted inserts
+ * ============================================================================ */
+
+typedef struct {
+    char *arena;
+    size_t arena_used, arena_cap;
+    size_t *offs;
+    size_t n, cap;
+} batch_t;
+
+static void batch_init(batch_t *b, size_t cap)
+{
+    b->cap = cap;
+    b->n = 0;
+    b->arena_cap = cap * 48;
+    b->arena_used = 0;
+    b->arena = malloc(b->arena_cap);
+    b->offs = malloc(cap * sizeof(size_t));
+    if (!b->arena || !b->offs) { perror("malloc"); exit(1); }
+}
+
+static void batch_add(batch_t *b, const char *s, size_t len)
+{
+    if (b->arena_used + len + 1 > b->arena_cap) {
+        b->arena_cap *= 2;
+        if (!(b->arena = realloc(b->arena, b->arena_cap))) { perror("realloc"); exit(1); }
+    }
+    memcpy(b->arena + b->arena_used, s, len + 1);
+    b->offs[b->n++] = b->arena_used;
+    b->arena_used += len + 1;
+}
+
+static const char *sort_arena;
+
+static int compare_offs(const void *a, const void *b)
+{
+    return strcmp(sort_arena + *(const size_t *)a, sort_arena + *(const size_t *)b);
+}
+
+static sqlite3 *db;
+
+static void exec_or_die(const char *sql)
+{
+    char *err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n  in: %s\n", err, sql);
+        exit(1);
+    }
+}
+
+static void batch_flush(batch_t *b, sqlite3_stmt *stmt)
+{
+    sort_arena = b->arena;
+    qsort(b->offs, b->n, sizeof(size_t), compare_offs);
+    exec_or_die("BEGIN");
+    for (size_t i = 0; i < b->n; i++) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, b->arena + b->offs[i], -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db));
+            exit(1);
+        }
+    }
+    exec_or_die("COMMIT");
+    b->n = 0;
+    b->arena_used = 0;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void progress(const char *table, uint64_t done, uint64_t total, double start)
+{
+    double el = now_sec() - start;
+    fprintf(stderr, "\r  %-15s %llu/%llu (%.1f%%, %.0f rows/s)   ", table,
+            (unsigned long long)done, (unsigned long long)total,
+            100.0 * done / (total ? total : 1), el > 0 ? done / el : 0.0);
+}
+
+static void fill_domains(const char *table, uint64_t count, uint64_t first_base,
+                         int hosts, size_t batch_size)
+{
+    char sql[128], name[MAX_NAME_LEN];
+    sqlite3_stmt *stmt;
+    batch_t b;
+    double start = now_sec();
+
+    snprintf(sql, sizeof(sql), "INSERT OR IGNORE INTO %s (Domain) VALUES (?)", table);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Prepare failed: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+    batch_init(&b, batch_size);
+
+    for (uint64_t i = 0; i < count; i++) {
+        size_t len = hosts ? host_name(first_base + i, i, name) : base_domain(first_base + i, name);
+        batch_add(&b, name, len);
+        if (b.n == b.cap) {
+            batch_flush(&b, stmt);
+            progress(table, i + 1, count, start);
+        }
+    }
+    if (b.n) batch_flush(&b, stmt);
+    progress(table, count, count, start);
+    fprintf(stderr, "\n");
+
+    sqlite3_finalize(stmt);
+    free(b.arena);
+    free(b.offs);
+}
+
+static void fill_ips(uint64_t count, uint64_t cidrs)
+{
+    sqlite3_stmt *stmt;
+    char src[64], dst[64];
+
+    if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO block_ips (Source_IP, Target_IP) VALUES (?, ?)",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Prepare failed: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+
+    exec_or_die("BEGIN");
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t h = mix64(seed ^ (i + 0x1111));
+        if (h % 4 == 0)
+            snprintf(src, sizeof(src), "2001:db8:%x:%x::%x", (unsigned)((h >> 8) & 0xffff),
+                     (unsigned)((h >> 24) & 0xffff), (unsigned)(i & 0xffff) + 1);
+        else
+            snprintf(src, sizeof(src), "%u.%u.%u.%u", 1 + (unsigned)((h >> 8) % 223),
+                     (unsigned)((h >> 16) & 0xff), (unsigned)((h >> 24) & 0xff),
+                     (unsigned)((h >> 32) & 0xff));
+        if (h % 4 == 0)
+            snprintf(dst, sizeof(dst), "2001:db8:ffff::%x", (unsigned)(i % 0xfffe) + 1);
+        else
+            snprintf(dst, sizeof(dst), "10.%u.%u.%u", (unsigned)((i >> 16) & 0xff),
+                     (unsigned)((i >> 8) & 0xff), (unsigned)(i & 0xff));
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, src, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, dst, -1, SQLITE_STATIC);
+        sqlite3_step(stmt);
+    }
+
+    /* CIDR rows: mostly /16-/28 IPv4, some /32-/64 IPv6 */
+    for (uint64_t i = 0; i < cidrs; i++) {
+        uint64_t h = mix64(seed ^ (i + 0x2222));
+        if (h % 5 == 0) {
+            unsigned prefix = 32 + (unsigned)((h >> 8) % 3) * 16;
+            snprintf(src, sizeof(src), "2001:db8:%x::/%u", (unsigned)(i & 0xffff), prefix);
+            snprintf(dst, sizeof(dst), "2001:db8:eeee::%x", (unsigned)(i & 0xffff) + 1);
+        } else {
+            unsigned prefix = 16 + (unsigned)((h >> 8) % 13);
+            uint32_t net = ((1 + (uint32_t)((h >> 32) % 223)) << 24 | (uint32_t)(h >> 40)) &
+                           (~0U << (32 - prefix));
+            snprintf(src, sizeof(src), "%u.%u.%u.%u/%u", net >> 24, (net >> 16) & 0xff,
+                     (net >> 8) & 0xff, net & 0xff, prefix);
+            snprintf(dst, sizeof(dst), "10.255.%u.%u", (unsigned)((i >> 8) & 0xff), (unsigned)(i & 0xff));
+        }
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, src, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, dst, -1, SQLITE_STATIC);
+        sqlite3_step(stmt);
+    }
+    exec_or_die("COMMIT");
+    sqlite3_finalize(stmt);
+}
+
+/* ============================================================================
+ * Zipfian query lists
+ * ============================================================================ */
+
+/* Inverse-CDF sample of a continuous Zipf(s) approximation on [1, n] */
+static uint64_t zipf_rank(double u, uint64_t n, double s)
+{
+    double r;
+    if (fabs(s - 1.0) < 1e-9)
+        r = exp(u * log((double)n + 1.0));
+    else {
+        double t = pow((double)n + 1.0, 1.0 - s);
+        r = pow(1.0 + u * (t - 1.0), 1.0 / (1.0 - s));
+    }
+    uint64_t k = (uint64_t)r;
+    if (k < 1) k = 1;
+    if (k > n) k = n;
+    return k;
+}
+
+static void write_queries(const char *path, uint64_t count, uint64_t universe, double s,
+                          unsigned blocked_pct, uint64_t n_wild, uint64_t n_hosts,
+                          uint64_t unblocked_base)
+{
+    FILE *f = fopen(path, "w");
+    char name[MAX_NAME_LEN], base[MAX_BASE_LEN];
+
+    if (!f) { perror(path); exit(1); }
+    for (uint64_t q = 0; q < count; q++) {
+        uint64_t h = mix64(seed ^ (q * 0x2545f4914f6cdd1dULL) ^ 0x9999);
+        double u = (double)(h >> 11) / 9007199254740992.0;
+        uint64_t rank = zipf_rank(u, universe, s);
+        /* Scatter ranks over the item kinds; the same rank is always the same name */
+        uint64_t item = mix64(rank ^ seed);
+        unsigned kind = (unsigned)(item % 100);
+
+        if (kind < blocked_pct && (n_hosts || n_wild)) {
+            if ((item >> 8) % 2 && n_hosts)
+                host_name(n_wild + (item >> 16) % n_hosts, (item >> 16) % n_hosts, name);
+            else if (n_wild) {
+                base_domain((item >> 16) % n_wild, base);
+                snprintf(name, sizeof(name), "%s.%s",
+                         host_prefixes[(item >> 40) % N_HOST_PREFIXES], base);
+            } else
+                host_name(n_wild + (item >> 16) % n_hosts, (item >> 16) % n_hosts, name);
+        } else {
+            base_domain(unblocked_base + (item >> 16) % universe, base);
+            if ((item >> 12) % 2)
+                snprintf(name, sizeof(name), "www.%s", base);
+            else
+                snprintf(name, sizeof(name), "%s", base);
+        }
+
+        unsigned t = (unsigned)((h >> 3) % 100);
+        fprintf(f, "%s %s\n", name, t < 70 ? "A" : t < 95 ? "AAAA" : "HTTPS");
+    }
+    fclose(f);
+}
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s -o <out.db> [options]\n\n", prog);
+    printf("Database:\n");
+    printf("  -w num    block_wildcard rows (default %llu)\n", DEFAULT_WILDCARD);
+    printf("  -H num    block_hosts rows (default %llu)\n", DEFAULT_HOSTS);
+    printf("  -i num    block_ips exact rows (default %llu)\n", DEFAULT_IPS);
+    printf("  -c num    block_ips CIDR rows (default %llu)\n", DEFAULT_CIDR);
+    printf("  -t file   2ndlevel.txt for two-label public suffixes\n");
+    printf("  -x pct    share of names under a 2ndlevel.txt suffix (default 15)\n");
+    printf("  -B num    rows sorted per insert batch (default %llu)\n", DEFAULT_BATCH);
+    printf("  -s seed   generator seed (default 42)\n");
+    printf("  -f        overwrite an existing output file\n\n");
+    printf("Query list (optional):\n");
+    printf("  -q file   write \"name qtype\" lines for dns-loadgen\n");
+    printf("  -n num    number of queries (default %llu)\n", DEFAULT_QUERIES);
+    printf("  -u num    distinct names in the query universe (default %llu)\n", DEFAULT_UNIVERSE);
+    printf("  -z s      Zipf exponent (default 1.0)\n");
+    printf("  -b pct    share of the universe that is blocked (default 30)\n");
+    printf("  -Q        only write the query list, do not build the database\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out = NULL, *tld2 = NULL, *qfile = NULL;
+    uint64_t n_wild = DEFAULT_WILDCARD, n_hosts = DEFAULT_HOSTS, n_ips = DEFAULT_IPS;
+    uint64_t n_cidr = DEFAULT_CIDR, batch = DEFAULT_BATCH, n_queries = DEFAULT_QUERIES;
+    uint64_t universe = DEFAULT_UNIVERSE;
+    double zipf_s = 1.0;
+    unsigned blocked_pct = 30;
+    int force = 0, queries_only = 0, opt;
+
+    while ((opt = getopt(argc, argv, "o:w:H:i:c:t:x:B:s:fq:n:u:z:b:Qh")) != -1) {
+        switch (opt) {
+        case 'o': out = optarg; break;
+        case 'w': n_wild = strtoull(optarg, NULL, 10); break;
+        case 'H': n_hosts = strtoull(optarg, NULL, 10); break;
+        case 'i': n_ips = strtoull(optarg, NULL, 10); break;
+        case 'c': n_cidr = strtoull(optarg, NULL, 10); break;
+        case 't': tld2 = optarg; break;
+        case 'x': suffix_pct = (unsigned)atoi(optarg); break;
+        case 'B': batch = strtoull(optarg, NULL, 10); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'f': force = 1; break;
+        case 'q': qfile = optarg; break;
+        case 'n': n_queries = strtoull(optarg, NULL, 10); break;
+        case 'u': universe = strtoull(optarg, NULL, 10); break;
+        case 'z': zipf_s = atof(optarg); break;
+        case 'b': blocked_pct = (unsigned)atoi(optarg); break;
+        case 'Q': queries_only = 1; break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if ((!out && !queries_only) || (queries_only && !qfile) || batch == 0 ||
+        universe == 0 || zipf_s <= 0 || blocked_pct > 100 || suffix_pct > 100) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    init_tables();
+    if (tld2) load_suffixes(tld2);
+    /* Index space: wildcard bases, host bases, then never-blocked names */
+    init_space(n_wild + n_hosts + universe);
+
+    if (!queries_only) {
+        if (access(out, F_OK) == 0) {
+            if (!force) {
+                fprintf(stderr, "%s exists (use -f to overwrite)\n", out);
+                return 1;
+            }
+            char side[1024];
+            unlink(out);
+            snprintf(side, sizeof(side), "%s-wal", out); unlink(side);
+            snprintf(side, sizeof(side), "%s-shm", out); unlink(side);
+        }
+        if (sqlite3_open(out, &db) != SQLITE_OK) {
+            fprintf(stderr, "Cannot create %s: %s\n", out, sqlite3_errmsg(db));
+            return 1;
+        }
+
+        printf("Generating %s: wildcard=%llu hosts=%llu ips=%llu cidr=%llu seed=%llu\n", out,
+               (unsigned long long)n_wild, (unsigned long long)n_hosts,
+               (unsigned long long)n_ips, (unsigned long long)n_cidr, (unsigned long long)seed);
+        double start = now_sec();
+
+        /* Same import settings and schema as light/create-db.sh */
+        exec_or_die("PRAGMA page_size = 8192");
+        exec_or_die("PRAGMA journal_mode = OFF");
+        exec_or_die("PRAGMA synchronous = OFF");
+        exec_or_die("PRAGMA cache_size = -1048576");
+        exec_or_die("PRAGMA temp_store = MEMORY");
+        exec_or_die("PRAGMA locking_mode = EXCLUSIVE");
+        exec_or_die("CREATE TABLE block_wildcard (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID");
+        exec_or_die("CREATE TABLE block_hosts (Domain TEXT PRIMARY KEY NOT NULL) WITHOUT ROWID");
+        exec_or_die("CREATE TABLE block_ips (Source_IP TEXT PRIMARY KEY NOT NULL, "
+                    "Target_IP TEXT NOT NULL) WITHOUT ROWID");
+
+        fill_domains("block_wildcard", n_wild, 0, 0, (size_t)batch);
+        fill_domains("block_hosts", n_hosts, n_wild, 1, (size_t)batch);
+        fill_ips(n_ips, n_cidr);
+
+        fprintf(stderr, "  Optimizing...\n");
+        exec_or_die("PRAGMA locking_mode = NORMAL");
+        exec_or_die("PRAGMA journal_mode = WAL");
+        exec_or_die("PRAGMA synchronous = NORMAL");
+        exec_or_die("ANALYZE");
+        sqlite3_close(db);
+
+        double el = now_sec() - start;
+        printf("Done in %.1f s (%.0f rows/s)\n", el,
+               (double)(n_wild + n_hosts + n_ips + n_cidr) / (el > 0 ? el : 1));
+    }
+
+    if (qfile) {
+        write_queries(qfile, n_queries, universe, zipf_s, blocked_pct, n_wild, n_hosts,
+                      n_wild + n_hosts);
+        printf("Wrote %llu queries (universe %llu, zipf s=%.2f, %u%% blocked) to %s\n",
+               (unsigned long long)n_queries, (unsigned long long)universe, zipf_s,
+               blocked_pct, qfile);
+    }
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Binary Log Decoder for dnsmasq-sqlite
+ *
+ * Prints the frames written by --sqlite-tap (layout documented in
+ * dnsmasq-2.92/src/db-tap.c), one line per frame:
+ *
+ *   1760000000.123456 CQ udp 192.168.1.10#40512 id=4711 ads.example.com A
+ *   1760000000.123460 BV udp 192.168.1.10#40512 ads.example.com A wildcard
+ *   1760000000.123470 CR udp 192.168.1.10#40512 id=4711 ads.example.com A NOERROR an=1
+ *   1760000000.130001 UQ udp 9.9.9.9#53 id=28115 www.example.org AAAA
+ *   1760000000.151200 UR udp 9.9.9.9#53 id=28115 www.example.org AAAA NOERROR an=2
+ *
+ * Types: CQ/CR client query/response, UQ/UR upstream query/response,
+ * BV block verdict (table block_hosts or block_wildcard). Several files
+ * (e.g. the rotated ones in order) are read one after the other; without a
+ * file argument the log is read from stdin, so a live file can be followed
+ * with "tail -c +1 -f dns.tap | tap-decode".
+ *
+ * Compile: gcc -O2 -o tap-decode tap-decode.c
+ * Usage:   ./tap-decode [-t CQ,CR,UQ,UR,BV] [-c name] [-x] [file...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define FILE_HDR    16
+#define FRAME_HDR   36
+#define MAX_PAYLOAD 65535
+
+static const char *type_names[] = { "??", "CQ", "CR", "UQ", "UR", "BV" };
+static unsigned int type_filter = 0;    /* bit per type, 0 = all */
+static const char *name_filter = NULL;
+static int hexdump = 0;
+
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static const char *qtype_name(unsigned int t, char *buf)
+{
+    switch (t) {
+    case 1: return "A";
+    case 2: return "NS";
+    case 5: return "CNAME";
+    case 6: return "SOA";
+    case 12: return "PTR";
+    case 15: return "MX";
+    case 16: return "TXT";
+    case 28: return "AAAA";
+    case 33: return "SRV";
+    case 35: return "NAPTR";
+    case 43: return "DS";
+    case 48: return "DNSKEY";
+    case 64: return "SVCB";
+    case 65: return "HTTPS";
+    case 257: return "CAA";
+    case 255: return "ANY";
+    }
+    sprintf(buf, "TYPE%u", t);
+    return buf;
+}
+
+static const char *rcode_name(unsigned int r, char *buf)
+{
+    static const char *names[] = { "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED" };
+
+    if (r < sizeof(names) / sizeof(names[0]))
+        return names[r];
+    sprintf(buf, "RCODE%u", r);
+    return buf;
+}
+
+/* First question name; returns the offset after it or 0 */
+static size_t read_qname(const unsigned char *msg, size_t len, char *out, size_t outlen)
+{
+    size_t p = 12, n = 0;
+
+    while (p < len) {
+        unsigned int l = msg[p++];
+        if (l == 0) {
+            if (n == 0)
+                strcpy(out, ".");
+            else
+                out[n - 1] = '\0';
+            return p;
+        }
+        /* the question is never compressed; anything else is garbage */
+        if (l > 63 || p + l > len || n + l + 1 >= outlen)
+            return 0;
+        for (unsigned int i = 0; i < l; i++) {
+            unsigned char c = msg[p + i];
+            out[n++] = (c > 32 && c < 127) ? c : '?';
+        }
+        out[n++] = '.';
+        p += l;
+    }
+    return 0;
+}
+
+static void print_frame(const unsigned char *h, const unsigned char *payload, size_t len)
+{
+    unsigned int type = h[4], family = h[5];
+    char addr[INET6_ADDRSTRLEN], name[1024], tb[16], rb[16];
+    unsigned int qtype = 0;
+
+    if (type >= sizeof(type_names) / sizeof(type_names[0]))
+        type = 0;
+    if (type_filter && !(type_filter & (1u << type)))
+        return;
+
+    if (family == 4)
+        inet_ntop(AF_INET, h + 20, addr, sizeof(addr));
+    else if (family == 6)
+        inet_ntop(AF_INET6, h + 20, addr, sizeof(addr));
+    else
+        strcpy(addr, "-");
+
+    if (type == 5) {
+        size_t n = len < sizeof(name) - 1 ? len : sizeof(name) - 1;
+        memcpy(name, payload, n);
+        name[n] = '\0';
+        qtype = get16(h + 18);
+    } else {
+        size_t q = len >= 12 && get16(payload + 4) ? read_qname(payload, len, name, sizeof(name)) : 0;
+        if (q == 0)
+            strcpy(name, "-");
+        else if (q + 2 <= len)
+            qtype = get16(payload + q);
+    }
+    if (name_filter && strcasecmp(name, name_filter) != 0)
+        return;
+
+    printf("%u.%06u %s %s %s#%u", get32(h + 8), get32(h + 12), type_names[type],
+           h[6] == 6 ? "tcp" : "udp", addr, get16(h + 16));
+
+    if (type == 5)
+        printf(" %s %s %s\n", name, qtype_name(qtype, tb),
+               h[7] == 1 ? "hosts" : h[7] == 2 ? "wildcard" : "-");
+    else if (len < 12)
+        printf(" short message (%zu bytes)\n", len);
+    else {
+        printf(" id=%u %s %s", get16(payload), name, qtype_name(qtype, tb));
+        if (payload[2] & 0x80)
+            printf(" %s an=%u", rcode_name(payload[3] & 0x0f, rb), get16(payload + 6));
+        if (payload[2] & 0x02)
+            printf(" TC");
+        printf("\n");
+    }
+
+    if (hexdump)
+        for (size_t i = 0; i < len; i += 16) {
+            printf("    %04zx ", i);
+            for (size_t j = i; j < i + 16 && j < len; j++)
+                printf(" %02x", payload[j]);
+            printf("\n");
+        }
+}
+
+static int decode(FILE *f, const char *fname)
+{
+    static unsigned char payload[MAX_PAYLOAD];
+    unsigned char hdr[FRAME_HDR];
+    unsigned long frames = 0;
+
+    if (fread(hdr, 1, FILE_HDR, f) != FILE_HDR || memcmp(hdr, "DSQLTAP1", 8) != 0) {
+        fprintf(stderr, "%s: not a dnsmasq-sqlite binary log\n", fname);
+        return 1;
+    }
+    if (get32(hdr + 8) != 1) {
+        fprintf(stderr, "%s: unsupported version %u\n", fname, get32(hdr + 8));
+        return 1;
+    }
+
+    for (;;) {
+        size_t got = fread(hdr, 1, FRAME_HDR, f);
+        uint32_t flen;
+
+        if (got == 0)
+            break;
+        flen = get32(hdr);
+        if (got != FRAME_HDR || flen < FRAME_HDR - 4 || flen - (FRAME_HDR - 4) > MAX_PAYLOAD) {
+            fprintf(stderr, "%s: corrupt frame after %lu frames\n", fname, frames);
+            return 1;
+        }
+        flen -= FRAME_HDR - 4;
+        if (fread(payload, 1, flen, f) != flen) {
+            /* the writer may be in the middle of this frame */
+            fprintf(stderr, "%s: truncated frame after %lu frames\n", fname, frames);
+            return 1;
+        }
+        print_frame(hdr, payload, flen);
+        frames++;
+    }
+    return 0;
+}
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [options] [file...]\n\n", prog);
+    printf("  -t types   only these frame types, comma separated (CQ,CR,UQ,UR,BV)\n");
+    printf("  -c name    only frames for this query name\n");
+    printf("  -x         hex dump of the DNS message after each line\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "t:c:xh")) != -1) {
+        switch (opt) {
+        case 't':
+            for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+                unsigned int i;
+                for (i = 1; i < sizeof(type_names) / sizeof(type_names[0]); i++)
+                    if (strcasecmp(tok, type_names[i]) == 0)
+                        break;
+                if (i == sizeof(type_names) / sizeof(type_names[0])) {
+                    fprintf(stderr, "Unknown frame type: %s\n", tok);
+                    return 1;
+                }
+                type_filter |= 1u << i;
+            }
+            break;
+        case 'c': name_filter = optarg; break;
+        case 'x': hexdump = 1; break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind == argc)
+        return decode(stdin, "stdin");
+
+    for (int i = optind; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            ret = 1;
+            continue;
+        }
+        ret |= decode(f, argv[i]);
+        fclose(f);
+    }
+    return ret;
+}